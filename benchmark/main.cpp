@@ -1,7 +1,13 @@
 #include <cubez/cubez.h>
+#include <cubez/network.h>
+#include <cubez/socket.h>
 #include <cubez/utils.h>
 
 #include <omp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <unordered_map>
 #include <vector>
 #include <iostream>
@@ -24,10 +30,23 @@ struct ComflabulationComponent {
   std::string stringy;
 };
 
+struct ReplicatedPositionComponent {
+  glm::vec3 p;
+};
+
+struct ReplicatedVelocityComponent {
+  glm::vec3 v;
+};
+
 qbComponent position_component;
 qbComponent direction_component;
 qbComponent comflabulation_component;
 
+// Indexed by whether the component is quantized with fields: position at 3x20
+// bits and velocity at 3x12 bits.
+qbComponent replicated_position_component[2];
+qbComponent replicated_velocity_component[2];
+
 void move(qbInstance* insts, qbFrame* f) {
   PositionComponent* p;
   DirectionComponent* d;
@@ -119,12 +138,84 @@ double iterate_unpack_one_component_benchmark(uint64_t count, uint64_t iteration
   return elapsed;
 }
 
+long minor_page_faults() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt;
+}
+
+// Measures iteration throughput over a component with "count" instances and
+// the page faults taken while filling and iterating it. Build the engine with
+// make BLOCK_ALLOCATOR=heap to compare the huge page arena against allocating
+// every block on its own.
+double iterate_large_component_benchmark(uint64_t count, uint64_t iterations) {
+  qbTimer timer;
+  qb_timer_create(&timer, 0);
+
+  long faults = minor_page_faults();
+  {
+    qbEntityAttr attr;
+    qb_entityattr_create(&attr);
+    DirectionComponent d;
+    d.dir = { 1.0f, 0.0f };
+    qb_entityattr_addcomponent(attr, direction_component, &d);
+
+    for (uint64_t i = 0; i < count; ++i) {
+      qbEntity entity;
+      qb_entity_create(&entity, attr);
+    }
+
+    qb_entityattr_destroy(&attr);
+  }
+  qb_loop(0, 0);
+  std::cout << "Page faults while creating: " << minor_page_faults() - faults << std::endl;
+
+  {
+    qbSystemAttr attr;
+    qb_systemattr_create(&attr);
+    qb_systemattr_addconst(attr, direction_component);
+    qb_systemattr_setfunction(attr,
+      [](qbInstance* instance, qbFrame*) {
+        DirectionComponent* d;
+        qb_instance_getconst(*instance, &d);
+        *Count() += (int64_t)d->dir.x;
+      });
+
+    qbSystem system;
+    qb_system_create(&system, attr);
+    qb_systemattr_destroy(&attr);
+  }
+  qb_loop(0, 0);
+
+  *Count() = 0;
+  faults = minor_page_faults();
+  qb_timer_start(timer);
+  for (uint64_t i = 0; i < iterations; ++i) {
+    qb_loop(0, 0);
+  }
+  qb_timer_stop(timer);
+  std::cout << "Page faults while iterating: " << minor_page_faults() - faults << std::endl;
+
+  double elapsed = qb_timer_elapsed(timer);
+  std::cout << "Count = " << *Count() << std::endl;
+  std::cout << "Instances per second: " << (count * iterations) / (elapsed / 1e9) << std::endl;
+
+  qb_timer_destroy(&timer);
+  return elapsed;
+}
+
+// Measures the cost of switching between "count" coroutines that each yield
+// once per frame. Build the engine with -DQB_CORO_STACK_SWITCHING
+// (make CORO_BACKEND=switch) to compare the stack-switching backend against
+// the default stack-copying one.
 double coroutine_overhead_benchmark(uint64_t count, uint64_t iterations) {
+  std::cout << "Coroutine backend: " << qb_coro_backend() << "\n";
+
   qbTimer timer;
   qb_timer_create(&timer, 0);
 
   *Count() = 0;
-  for (auto i = 0; i < count; ++i) {
+  for (uint64_t i = 0; i < count; ++i) {
     qb_coro_sync([](qbVar) {
       for (;;) {
         *Count() += 1;
@@ -134,20 +225,328 @@ double coroutine_overhead_benchmark(uint64_t count, uint64_t iterations) {
     }, qbNone);
   }
 
-  qb_timer_start(timer);
+  // Schedule the coroutines before timing.
   qb_loop(0, 0);
+
+  *Count() = 0;
+  qb_timer_start(timer);
   for (uint64_t i = 0; i < iterations; ++i) {
     qb_loop(0, 0);
   }
   qb_timer_stop(timer);
 
+  double elapsed = qb_timer_elapsed(timer);
   std::cout << "Count = " << *Count() << std::endl;
+  if (*Count() > 0) {
+    std::cout << "Elapsed per switch: " << elapsed / *Count() << "ns\n";
+  }
+
+  qb_timer_destroy(&timer);
+  return elapsed;
+}
+
+// Measures loopback UDP throughput by sending "count" datagrams in bursts
+// and receiving each burst before the next. Compares one system call per
+// datagram against qb_socket_sendbatch and qb_socket_recvbatch.
+template<bool kBatched>
+double udp_loopback_benchmark(uint64_t count, uint64_t iterations) {
+  const size_t kBurst = 64;
+  const size_t kPacketSize = 1200;
+
+  qbSocketAttr_ attr = {};
+  attr.np = QB_UDP;
+  attr.af = QB_IPV4;
+  qbSocket sender, receiver;
+  qb_socket_create(&sender, &attr);
+  qb_socket_create(&receiver, &attr);
+
+  int rcvbuf = 8 << 20;
+  qb_socket_setopt(receiver, SOL_SOCKET, SO_RCVBUF, (const char*)&rcvbuf, sizeof(rcvbuf));
+
+  qbEndpoint_ endpoint;
+  qb_endpoint(&endpoint, "127.0.0.1", 45123);
+  qb_socket_bind(receiver, &endpoint);
+
+  std::vector<char> payload(kPacketSize, 'x');
+  std::vector<char> buffers(kBurst * 2048);
+  std::vector<qbPacket_> out(kBurst);
+  std::vector<qbPacket_> in(kBurst);
+  for (size_t i = 0; i < kBurst; ++i) {
+    out[i].buf = payload.data();
+    out[i].len = payload.size();
+    out[i].endpoint = endpoint;
+    in[i].buf = buffers.data() + i * 2048;
+    in[i].cap = 2048;
+  }
+
+  qbTimer timer;
+  qb_timer_create(&timer, 0);
+
+  uint64_t received = 0;
+  qb_timer_start(timer);
+  for (uint64_t i = 0; i < iterations; ++i) {
+    for (uint64_t sent = 0; sent < count; sent += kBurst) {
+      int32_t burst = 0;
+      if (kBatched) {
+        burst = qb_socket_sendbatch(sender, out.data(), kBurst, 0);
+        for (int32_t left = burst; left > 0;) {
+          int32_t res = qb_socket_recvbatch(receiver, in.data(), left, 0);
+          if (res <= 0) {
+            break;
+          }
+          left -= res;
+          received += res;
+        }
+      } else {
+        for (size_t j = 0; j < kBurst; ++j) {
+          burst += qb_socket_sendto(sender, payload.data(), payload.size(), 0, &endpoint) > 0;
+        }
+        for (int32_t j = 0; j < burst; ++j) {
+          received += qb_socket_recvfrom(receiver, in[0].buf, in[0].cap, 0, nullptr) > 0;
+        }
+      }
+    }
+  }
+  qb_timer_stop(timer);
 
   double elapsed = qb_timer_elapsed(timer);
+  std::cout << "Packets received: " << received << std::endl;
+  std::cout << "Packets per second: " << received / (elapsed / 1e9) << std::endl;
+
   qb_timer_destroy(&timer);
+  qb_socket_close(sender);
+  qb_socket_close(receiver);
   return elapsed;
 }
 
+// One client of the replication benchmark. The server and the client each
+// have a connection over the client's own qbLink, server on side 0.
+struct ReplicationClient {
+  uint32_t id;
+  qbLink link;
+  qbConnection server;
+  qbConnection client;
+  qbReplica replica;
+  qbScene scene;
+};
+
+struct ReplicationBenchmark {
+  qbReplicator replicator;
+  std::vector<ReplicationClient> clients;
+
+  // Number of fixed updates seen, the first one has no tick to write yet.
+  uint64_t updates;
+  uint64_t ticks;
+  double time;
+
+  uint64_t message_bytes;
+  uint64_t datagram_bytes;
+
+  // Server time spent writing and acking, and capturing and moving the
+  // entities between updates.
+  int64_t server_ns;
+  int64_t clock_start;
+} replication;
+
+int32_t replication_serversend(const uint8_t* packet, size_t size, void* state) {
+  ReplicationClient* client = (ReplicationClient*)state;
+  replication.datagram_bytes += size;
+  qb_link_send(client->link, 0, packet, size, replication.time);
+  return (int32_t)size;
+}
+
+int32_t replication_clientsend(const uint8_t* packet, size_t size, void* state) {
+  ReplicationClient* client = (ReplicationClient*)state;
+  qb_link_send(client->link, 1, packet, size, replication.time);
+  return (int32_t)size;
+}
+
+void replication_drain(qbLink link, int side, qbConnection connection) {
+  uint8_t buf[2048];
+  int32_t size;
+  while ((size = qb_link_recv(link, side, buf, sizeof(buf), replication.time)) >= 0) {
+    qb_connection_receive(connection, buf, (size_t)size);
+  }
+}
+
+void replication_stopclock() {
+  if (replication.clock_start) {
+    replication.server_ns += qb_timer_query() - replication.clock_start;
+    replication.clock_start = 0;
+  }
+}
+
+// Runs before the systems of every fixed update, so the tick captured by the
+// previous update is the latest one.
+void replication_update(uint64_t, qbVar) {
+  ReplicationBenchmark& r = replication;
+  replication_stopclock();
+  if (r.updates++ == 0 || r.ticks == 0) {
+    r.clock_start = r.ticks ? qb_timer_query() : 0;
+    return;
+  }
+  --r.ticks;
+  r.time += 1.0 / 60.0;
+
+  int64_t start = qb_timer_query();
+  for (ReplicationClient& c : r.clients) {
+    replication_drain(c.link, 0, c.server);
+    qbMessage_ message;
+    while (qb_connection_recv(c.server, &message)) {
+      uint32_t tick;
+      memcpy(&tick, message.data, sizeof(tick));
+      qb_replicator_ack(r.replicator, c.id, tick);
+    }
+
+    const uint8_t* data;
+    size_t size;
+    qb_replicator_write(r.replicator, c.id, &data, &size);
+    qb_connection_send(c.server, 0, data, size);
+    qb_connection_update(c.server, r.time);
+    r.message_bytes += size;
+  }
+  r.server_ns += qb_timer_query() - start;
+
+  for (ReplicationClient& c : r.clients) {
+    replication_drain(c.link, 1, c.client);
+    qbMessage_ message;
+    while (qb_connection_recv(c.client, &message)) {
+      uint32_t tick;
+      if (qb_replica_apply(c.replica, c.scene, message.data, message.size, &tick) == QB_OK) {
+        qb_connection_send(c.client, 0, (const uint8_t*)&tick, sizeof(tick));
+      }
+    }
+    qb_connection_update(c.client, r.time);
+  }
+
+  r.clock_start = r.ticks ? qb_timer_query() : 0;
+}
+
+void replication_prerender(qbRenderEvent_*, qbVar) {
+  replication_stopclock();
+}
+
+// Replicates "count" entities, 3 in 4 of them moving, to 64 clients with
+// interest management for "iterations" ticks. Each client gets its messages
+// over a qbLink with latency and loss, applies them to its own scene and acks
+// them, so a run gives the same bytes every time. Only the server side is
+// timed: capturing the tick and moving the entities, writing the messages and
+// taking the acks.
+template<bool kQuantized>
+double replication_benchmark(uint64_t count, uint64_t iterations) {
+  const size_t kClients = 64;
+  qbComponent position = replicated_position_component[kQuantized];
+  qbComponent velocity = replicated_velocity_component[kQuantized];
+
+  srand(1);
+  auto random = [](float min, float max) {
+    return min + (max - min) * (rand() / (float)RAND_MAX);
+  };
+  {
+    qbEntityAttr attr;
+    for (uint64_t i = 0; i < count; ++i) {
+      qb_entityattr_create(&attr);
+      ReplicatedPositionComponent p;
+      p.p = { random(0.0f, 1000.0f), 0.0f, random(0.0f, 1000.0f) };
+      qb_entityattr_addcomponent(attr, position, &p);
+      if (i % 4) {
+        ReplicatedVelocityComponent v;
+        v.v = { random(-0.5f, 0.5f), 0.0f, random(-0.5f, 0.5f) };
+        qb_entityattr_addcomponent(attr, velocity, &v);
+      }
+
+      qbEntity entity;
+      qb_entity_create(&entity, attr);
+      qb_entityattr_destroy(&attr);
+    }
+  }
+  {
+    qbSystemAttr attr;
+    qb_systemattr_create(&attr);
+    qb_systemattr_addmutable(attr, position);
+    qb_systemattr_addconst(attr, velocity);
+    qb_systemattr_setfunction(attr,
+      [](qbInstance* insts, qbFrame*) {
+        ReplicatedPositionComponent* p;
+        ReplicatedVelocityComponent* v;
+        qb_instance_getmutable(insts[0], &p);
+        qb_instance_getconst(insts[1], &v);
+        p->p += v->v;
+      });
+
+    qbSystem system;
+    qb_system_create(&system, attr);
+    qb_systemattr_destroy(&attr);
+  }
+
+  ReplicationBenchmark& r = replication;
+  r = ReplicationBenchmark{};
+  r.ticks = iterations;
+  {
+    qbReplicatorAttr_ attr = {};
+    attr.interest = true;
+    attr.position = position;
+    attr.radius = 150.0f;
+    qb_replicator_create(&r.replicator, &attr);
+  }
+
+  const qbChannelType channels[] = { QB_CHANNEL_UNRELIABLE };
+  r.clients.resize(kClients);
+  for (size_t i = 0; i < kClients; ++i) {
+    ReplicationClient& c = r.clients[i];
+    qb_replicator_addclient(r.replicator, &c.id);
+    qb_replicator_setviewpoint(r.replicator, c.id,
+                               random(0.0f, 1000.0f), 0.0f, random(0.0f, 1000.0f));
+
+    qbLinkAttr_ link_attr = {};
+    link_attr.latency = 0.05;
+    link_attr.jitter = 0.01;
+    link_attr.loss = 0.02;
+    link_attr.seed = i + 1;
+    qb_link_create(&c.link, &link_attr);
+
+    qbConnectionAttr_ attr = {};
+    attr.channels = channels;
+    attr.channel_count = 1;
+    attr.state = &c;
+    attr.send = replication_serversend;
+    qb_connection_create(&c.server, &attr);
+    attr.send = replication_clientsend;
+    qb_connection_create(&c.client, &attr);
+
+    qb_replica_create(&c.replica);
+    qb_scene_create(&c.scene, "");
+  }
+
+  qbLoopCallbacks_ callbacks = {};
+  callbacks.on_update = replication_update;
+  callbacks.on_prerender = replication_prerender;
+  qbLoopArgs_ args = {};
+  while (r.ticks > 0) {
+    qb_loop(&callbacks, &args);
+  }
+  replication_stopclock();
+
+  std::cout << "Quantized: " << (kQuantized ? "yes" : "no") << std::endl;
+  std::cout << "Bytes per client per tick: "
+            << (double)r.message_bytes / kClients / iterations << std::endl;
+  std::cout << "Datagram bytes per client per tick: "
+            << (double)r.datagram_bytes / kClients / iterations << std::endl;
+  std::cout << "Server CPU per tick: " << r.server_ns / iterations / 1000 << "us\n";
+
+  for (ReplicationClient& c : r.clients) {
+    qb_scene_destroy(&c.scene);
+    qb_replica_destroy(&c.replica);
+    qb_connection_destroy(&c.server);
+    qb_connection_destroy(&c.client);
+    qb_link_destroy(&c.link);
+  }
+  r.clients.clear();
+  qb_replicator_destroy(&r.replicator);
+
+  return (double)r.server_ns;
+}
+
 template<class F>
 void do_benchmark(const char* name, F f, uint64_t count, uint64_t iterations, uint64_t test_iterations) {
   std::cout << "Running benchmark: " << name << "\n";
@@ -205,6 +604,34 @@ int main() {
     qb_component_create(&comflabulation_component, attr);
     qb_componentattr_destroy(&attr);
   }
+  for (int quantized = 0; quantized < 2; ++quantized) {
+    auto add_fields = [quantized](qbComponentAttr attr, float range, uint32_t bits) {
+      for (size_t i = 0; quantized && i < 3; ++i) {
+        qbFieldAttr_ field = {};
+        field.type = QB_FIELD_FLOAT;
+        field.offset = i * sizeof(float);
+        field.min = -range;
+        field.max = range;
+        field.bits = bits;
+        qb_componentattr_addfield(attr, &field);
+      }
+    };
+
+    qbComponentAttr attr;
+    qb_componentattr_create(&attr);
+    qb_componentattr_setdatatype(attr, ReplicatedPositionComponent);
+    qb_componentattr_setreplicated(attr);
+    add_fields(attr, 2048.0f, 20);
+    qb_component_create(&replicated_position_component[quantized], attr);
+    qb_componentattr_destroy(&attr);
+
+    qb_componentattr_create(&attr);
+    qb_componentattr_setdatatype(attr, ReplicatedVelocityComponent);
+    qb_componentattr_setreplicated(attr);
+    add_fields(attr, 1.0f, 12);
+    qb_component_create(&replicated_velocity_component[quantized], attr);
+    qb_componentattr_destroy(&attr);
+  }
 
   uint64_t count = 1'000'000;
   uint64_t iterations = 500;
@@ -214,8 +641,18 @@ int main() {
                create_entities_benchmark, count, iterations, 1);*/
   do_benchmark("Unpack one component benchmark",
     iterate_unpack_one_component_benchmark, count, iterations, test_iterations);
-  /*do_benchmark("coroutine_overhead_benchmark",
-               coroutine_overhead_benchmark, 1, 1000000, 1);*/
+  do_benchmark("Iterate large component benchmark",
+    iterate_large_component_benchmark, 4'000'000, 100, test_iterations);
+  do_benchmark("coroutine_overhead_benchmark",
+               coroutine_overhead_benchmark, 10'000, 1000, 1);
+  do_benchmark("UDP loopback benchmark (sendto/recvfrom)",
+               udp_loopback_benchmark<false>, 64'000, 20, 1);
+  do_benchmark("UDP loopback benchmark (sendbatch/recvbatch)",
+               udp_loopback_benchmark<true>, 64'000, 20, 1);
+  do_benchmark("Replication benchmark (raw components)",
+               replication_benchmark<false>, 1'000, 300, 1);
+  do_benchmark("Replication benchmark (quantized fields)",
+               replication_benchmark<true>, 1'000, 300, 1);
   qb_stop();
   while (1);
 }
@@ -161,6 +161,8 @@ enum qbResult {
   QB_ERROR_COLLECTIONATTR_REMOVE_BY_HANDLE_IS_NOT_SET = -514,
 
   QB_ERROR_SOCKET = -600,
+
+  QB_ERROR_FILE = -700,
 };
 
 #endif  // CUBEZ_COMMON__H
@@ -127,10 +127,13 @@ typedef struct {
 } qbTiming_, *qbTiming;
 QB_API qbResult qb_timing(qbUniverse universe, qbTiming timing);
 
-// Unimplemented.
+// Saves all entities and component instances of the current scene to the
+// file. See qb_scene_save.
 QB_API qbResult qb_save(const char* file);
 
-// Unimplemented.
+// Replaces all entities and component instances of the current scene with the
+// ones saved to the file. Must be called in between frames. No create or
+// destroy events are sent.
 QB_API qbResult qb_load(const char* file);
 
 // ======== qbProgram ========
@@ -172,8 +175,82 @@ typedef struct qbBarrier_* qbBarrier;
 typedef struct qbBarrierOrder_* qbBarrierOrder;
 typedef struct qbScene_* qbScene;
 typedef struct qbCoro_* qbCoro;
-typedef struct qbAsync_* qbAsync;
+typedef struct qbCoro_* qbAsync;
 typedef struct qbAlarm_* qbAlarm;
+typedef struct qbChannel_* qbChannel;
+typedef struct qbRecorder_* qbRecorder;
+typedef struct qbReplay_* qbReplay;
+
+///////////////////////////////////////////////////////////
+///////////////////////  Bit Streams  /////////////////////
+///////////////////////////////////////////////////////////
+
+// ======== qbBitWriter ========
+// Writes values of any number of bits back to back into a byte buffer. Bits
+// are gathered in a 64-bit word that is stored little-endian 32 bits at a
+// time. Writing past the capacity sets overflow and drops the rest.
+
+typedef struct {
+  uint8_t* data;
+  size_t capacity;
+  size_t size;
+  uint64_t scratch;
+  uint32_t scratch_bits;
+  bool overflow;
+} qbBitWriter_, *qbBitWriter;
+
+QB_API void          qb_bitwriter_init(qbBitWriter writer, void* data,
+                                       size_t capacity);
+
+// Writes the low "bits" bits of value, 0 < bits <= 32.
+QB_API void          qb_bitwriter_bits(qbBitWriter writer, uint32_t value,
+                                       uint32_t bits);
+
+// Writes 7 bits of value at a time until the rest is zero, each preceded by a
+// bit that says whether more follow.
+QB_API void          qb_bitwriter_varint(qbBitWriter writer, uint64_t value);
+
+// Clamps value to [min, max] and writes it rounded to the closest of 2^bits
+// evenly spaced steps.
+QB_API void          qb_bitwriter_float(qbBitWriter writer, float value,
+                                        float min, float max, uint32_t bits);
+
+// Writes a unit quaternion (x, y, z, w) as the index of its largest component
+// in 2 bits and the other three with "bits" bits each. The three are in
+// [-1/sqrt(2), 1/sqrt(2)] and the largest is restored from them on read.
+QB_API void          qb_bitwriter_quat(qbBitWriter writer, const float q[4],
+                                       uint32_t bits);
+
+// Stores the bits left in the scratch word, padding to a whole byte, and sets
+// size to the number of bytes written. Returns QB_ERROR_MEMORY_OUT_OF_BOUNDS
+// if the writer overflowed.
+QB_API qbResult      qb_bitwriter_flush(qbBitWriter writer, size_t* size);
+
+// ======== qbBitReader ========
+// Reads values written by a qbBitWriter. Reading past the end sets overflow
+// and returns zeros.
+
+typedef struct {
+  const uint8_t* data;
+  size_t size;
+  size_t offset;
+  uint64_t scratch;
+  uint32_t scratch_bits;
+  bool overflow;
+} qbBitReader_, *qbBitReader;
+
+QB_API void          qb_bitreader_init(qbBitReader reader, const void* data,
+                                       size_t size);
+
+QB_API uint32_t      qb_bitreader_bits(qbBitReader reader, uint32_t bits);
+
+QB_API uint64_t      qb_bitreader_varint(qbBitReader reader);
+
+QB_API float         qb_bitreader_float(qbBitReader reader, float min,
+                                        float max, uint32_t bits);
+
+QB_API void          qb_bitreader_quat(qbBitReader reader, float q[4],
+                                       uint32_t bits);
 
 ///////////////////////////////////////////////////////////
 ///////////////////////  Components  //////////////////////
@@ -185,7 +262,8 @@ typedef enum {
   QB_COMPONENT_TYPE_RAW = 0,
 
   // A pointer to a piece of memory. Will be freed when instance is destroyed.
-  // Pointer must not be allocated with new or new[] operators.
+  // Pointer must either be allocated with "qb_component_alloc" or with malloc,
+  // not with the new or new[] operators.
   QB_COMPONENT_TYPE_POINTER,
 
   // A struct only comprised of "qbEntity"s as its members. Will destroy all
@@ -211,12 +289,70 @@ QB_API qbResult      qb_componentattr_settype(qbComponentAttr attr,
 // Sets the component to be shared across programs with a reader/writer lock.
 QB_API qbResult      qb_componentattr_setshared(qbComponentAttr attr);
 
+// Marks the component to be sent to clients by a qbReplicator, see
+// <cubez/network.h>. Only RAW components are replicated.
+QB_API qbResult      qb_componentattr_setreplicated(qbComponentAttr attr);
 
-// Unimplemented.
+// ======== qbField ========
+// Describes how a member of a RAW component is packed into a bit stream when
+// it is replicated or recorded to a replay. Once a component has a field,
+// only its fields are packed and the bytes outside of them read back as zero.
+
+#define QB_COMPONENT_MAX_FIELDS 16
+
+typedef enum {
+  // A float quantized to "bits" bits over [min, max].
+  QB_FIELD_FLOAT,
+
+  // A unit quaternion of four floats (x, y, z, w) packed as the smallest
+  // three with "bits" bits each.
+  QB_FIELD_QUAT,
+
+  // An unsigned integer of "size" bytes written as a varint.
+  QB_FIELD_UINT,
+
+  // A signed integer of "size" bytes zigzag encoded and written as a varint.
+  QB_FIELD_INT,
+
+  // "size" bytes written as they are.
+  QB_FIELD_BYTES,
+} qbFieldType;
+
+typedef struct {
+  qbFieldType type;
+
+  // Byte offset of the member in the component.
+  size_t offset;
+
+  // Size in bytes of a UINT, INT or BYTES member. UINT and INT members are
+  // 1, 2, 4 or 8 bytes.
+  size_t size;
+
+  // Range and precision of a FLOAT, and the precision of a QUAT.
+  float min;
+  float max;
+  uint32_t bits;
+} qbFieldAttr_, *qbFieldAttr;
+
+// Adds a field to the component. Returns QB_ERROR_MEMORY_OUT_OF_BOUNDS if the
+// component has QB_COMPONENT_MAX_FIELDS fields already or the field does not
+// fit in the data size, which must be set first. Returns
+// QB_ERROR_INCOMPATIBLE_DATA_TYPES if the size, bits or range of the field are
+// not valid for its type.
+QB_API qbResult      qb_componentattr_addfield(qbComponentAttr attr,
+                                               qbFieldAttr field);
+
+// Sets the function to save an instance of a POINTER or COMPOSITE component.
+// The function is called with write == nullptr to return the number of bytes
+// it needs, then again to write them. POINTER components without one are not
+// saved. RAW components are always saved as-is.
 QB_API qbResult      qb_componentattr_onserialize(qbComponentAttr attr,
                                                   size_t(*fn)(void* read, uint8_t* write));
 
-// Unimplemented.
+// Sets the function to load an instance written by the onserialize function.
+// It writes the instance to "write" and returns the number of bytes read. A
+// POINTER payload is allocated like any other, with malloc or with
+// qb_component_alloc, which allocates it in the scene being loaded.
 QB_API qbResult      qb_componentattr_ondeserialize(qbComponentAttr attr,
                                                     size_t(*fn)(uint8_t* read, uint8_t* write));
 
@@ -236,6 +372,35 @@ QB_API qbResult      qb_component_destroy(qbComponent* component);
 // Returns the number of specified components.
 QB_API size_t        qb_component_getcount(qbComponent component);
 
+// Allocates the payload of a QB_COMPONENT_TYPE_POINTER instance from size
+// class pools owned by the component in the current scene. The payload is
+// returned to the pool when its instance is destroyed, and the pools are
+// released all at once when the scene is destroyed. The same component may
+// also hold payloads from malloc, which are freed. Returns null if the
+// component is not a pointer component.
+QB_API void*         qb_component_alloc(qbComponent component, size_t size);
+
+// Immediately frees the storage the component in the current scene no longer
+// needs. Storage is otherwise released a few blocks per frame.
+QB_API qbResult      qb_component_shrink(qbComponent component);
+
+// Packs count instances laid end to end in "instances" with the fields of the
+// component. Instances are packed field by field, the first field of every
+// instance and then the next, so that each field is quantized in a single
+// pass over the array. A component without fields is packed as raw bytes.
+QB_API qbResult      qb_component_pack(qbComponent component,
+                                       const void* instances, size_t count,
+                                       qbBitWriter writer);
+
+// Unpacks count instances packed by qb_component_pack.
+QB_API qbResult      qb_component_unpack(qbComponent component,
+                                         qbBitReader reader, void* instances,
+                                         size_t count);
+
+// Returns the most bytes that qb_component_pack can write for count instances.
+QB_API size_t        qb_component_packbound(qbComponent component,
+                                            size_t count);
+
 ///////////////////////////////////////////////////////////
 ////////////////////////  Instances  //////////////////////
 ///////////////////////////////////////////////////////////
@@ -435,6 +600,22 @@ QB_API qbResult      qb_systemattr_addbarrier(qbSystemAttr attr,
 QB_API qbResult      qb_systemattr_setuserstate(qbSystemAttr attr,
                                              void* state);
 
+// Limits the time the system may spend running its transform to the given
+// number of microseconds per frame. When the budget runs out, the system stops
+// and picks up where it left off on the next frame, so a single sweep over
+// all of its instances may be spread across many frames. The callback only
+// runs once a sweep is complete. A budget of zero, the default, runs the
+// transform over every instance every frame.
+//
+// The sweep resumes at the same position in the component, not at the same
+// instance. Removing an instance between frames moves the last instance into
+// its place, so a sweep that spans frames may skip an instance or visit one
+// twice. If the component shrinks below the position, the sweep restarts.
+//
+// Budgets are not supported with QB_JOIN_CROSS, which always runs in full.
+QB_API qbResult      qb_systemattr_setbudget(qbSystemAttr attr,
+                                          uint32_t budget_us);
+
 // ======== qbSystem ========
 // A qbSystem is the atomic unit of synchronous execution. Systems are run when
 // either: qb_loop() is called, a program is detached and runs continuously, or
@@ -458,6 +639,26 @@ QB_API qbResult      qb_system_disable(qbSystem system);
 // Unimplemented.
 QB_API qbResult      qb_system_run(qbSystem system);
 
+typedef struct {
+  // Fraction of the instances visited so far in the current sweep, from 0 to
+  // 1. Equal to 1 if the last run completed a sweep.
+  double progress;
+
+  // Seconds from the start to the end of the last complete sweep.
+  double sweep_latency;
+
+  // Number of frames the last complete sweep was spread across.
+  uint64_t sweep_frames;
+
+  // Number of complete sweeps since the system was created.
+  uint64_t sweeps;
+} qbSystemBudgetStats_, *qbSystemBudgetStats;
+
+// Fills stats with the progress of a system created with a budget. For a
+// system without a budget, every sweep completes in a single frame.
+QB_API qbResult      qb_system_budgetstats(qbSystem system,
+                                        qbSystemBudgetStats stats);
+
 ///////////////////////////////////////////////////////////
 //////////////////  Events and Messaging  /////////////////
 ///////////////////////////////////////////////////////////
@@ -512,6 +713,35 @@ QB_API qbResult      qb_event_send(qbEvent event,
 QB_API qbResult      qb_event_sendsync(qbEvent event,
                                        void* message);
 
+///////////////////////////////////////////////////////////
+/////////////////////////  Alarms  ////////////////////////
+///////////////////////////////////////////////////////////
+
+// ======== qbAlarm ========
+// A qbAlarm sends a message on an event after a delay in seconds of game time.
+// Alarms are kept in a timer wheel that is advanced once per fixed update
+// (or once per qb_loop() if the game loop feature is disabled), so creating,
+// cancelling, and firing an alarm is O(1) regardless of how many are pending.
+// Alarms are not thread-safe.
+
+// Creates an alarm that sends a copy of message on the event after delay
+// seconds. If repeat is true, the alarm is resent every delay seconds until
+// it is cancelled. A non-repeating alarm is freed after it fires, after which
+// the handle is no longer valid.
+QB_API qbAlarm       qb_alarm_create(qbEvent event,
+                                     void* message,
+                                     double delay,
+                                     bool repeat);
+
+// Cancels and frees a pending alarm.
+QB_API qbResult      qb_alarm_cancel(qbAlarm* alarm);
+
+// Returns the number of seconds until the alarm is next fired.
+QB_API double        qb_alarm_remaining(qbAlarm alarm);
+
+// Returns the number of pending alarms.
+QB_API size_t        qb_alarm_count();
+
 
 ///////////////////////////////////////////////////////////
 /////////////////////////  Scenes  ////////////////////////
@@ -522,11 +752,15 @@ QB_API qbResult      qb_event_sendsync(qbEvent event,
 QB_API qbResult      qb_scene_create(qbScene* scene,
                                   const char* name);
 
-// Unimplemented.
+// Saves all entities and component instances of the scene to the file. The
+// instances of RAW components are written in their in-memory layout, so that
+// loading them maps the file instead of reading it.
 QB_API qbResult      qb_scene_save(qbScene* scene,
                                 const char* file);
 
-// Unimplemented.
+// Creates a scene with the given name that holds the entities and instances
+// of the file. Components must be created in the same order, with the same
+// sizes and types, as when the file was saved.
 QB_API qbResult      qb_scene_load(qbScene* scene,
                                 const char* name,
                                 const char* file);
@@ -597,6 +831,183 @@ QB_API qbResult      qb_scene_ondeactivate(qbScene scene,
                                                      const char* keys[],
                                                      void* values[]));
 
+///////////////////////////////////////////////////////////
+////////////////////////  Replays  ////////////////////////
+///////////////////////////////////////////////////////////
+
+// ======== qbRecorder ========
+// A recorder appends a frame of the current scene to a file at the start of
+// every loop, once the previous frame's entity destroys and component removals
+// have been applied. Most frames only hold the entities and the bytes of
+// component instances that changed since the frame before. Every
+// keyframe_interval frames holds the whole world so that a replay can seek
+// without playing back from the start. Instances of POINTER components are not
+// recorded. Changed instances of components with fields are recorded whole
+// and packed with them, so a replay must be played back with the same fields.
+
+typedef struct {
+  // Number of frames from one keyframe to the next. Defaults to 300 if zero.
+  uint32_t keyframe_interval;
+} qbRecorderAttr_, *qbRecorderAttr;
+
+// Starts recording to the file, overwriting it. The attr may be null.
+QB_API qbResult      qb_recorder_create(qbRecorder* recorder,
+                                        const char* file,
+                                        qbRecorderAttr attr);
+
+// Stops recording and closes the file.
+QB_API qbResult      qb_recorder_destroy(qbRecorder* recorder);
+
+// Returns the number of frames recorded.
+QB_API uint64_t      qb_recorder_framecount(qbRecorder recorder);
+
+// ======== qbReplay ========
+// Plays back a file written by a qbRecorder. A file that is still being
+// recorded, or was cut short by a crash, can be opened and holds the frames
+// that were completely written at the time.
+
+QB_API qbResult      qb_replay_open(qbReplay* replay, const char* file);
+
+QB_API qbResult      qb_replay_close(qbReplay* replay);
+
+QB_API uint64_t      qb_replay_framecount(qbReplay replay);
+
+// Replaces the entities and component instances of the scene with the ones at
+// the given frame. No create or destroy events are sent. Seeking forward from
+// the last frame plays back the frames in between, seeking elsewhere starts
+// from the closest keyframe.
+QB_API qbResult      qb_replay_seek(qbReplay replay, uint64_t frame,
+                                    qbScene scene);
+
+///////////////////////////////////////////////////////////
+////////////////////////  Rollback  ///////////////////////
+///////////////////////////////////////////////////////////
+
+// Lets a predicting client rewind the active scene to an earlier fixed update,
+// correct it with inputs that arrived late, and run the fixed updates back up
+// to the present within a single call to qb_loop(). Frames are numbered by the
+// caller, e.g. with a count of fixed updates. Saving a frame takes a
+// copy-on-write snapshot of the scene, so it costs little more than the blocks
+// of instances written until the frame is dropped. The last
+// QB_ROLLBACK_MAX_FRAMES saved frames are kept.
+//
+// These must be called outside of systems, e.g. from the on_update callback of
+// qb_loop(), which runs before the systems of each fixed update.
+
+#define QB_ROLLBACK_MAX_FRAMES 64
+
+typedef struct {
+  // Called before each resimulated frame to apply its inputs, e.g. by writing
+  // them to the components the systems read input from. May be null.
+  void(*on_frame)(uint64_t frame, qbVar arg);
+  qbVar arg;
+} qbRollbackInputs_, *qbRollbackInputs;
+
+// Saves the active scene as the frame, replacing a frame saved with the same
+// number. Entity destroys and component removals from the last systems run are
+// applied first.
+QB_API qbResult      qb_rollback_save(uint64_t frame);
+
+// Rewinds the active scene to the frame without sending create or destroy
+// events. The frames saved after it are dropped. Returns QB_ERROR_NOT_FOUND if
+// the frame is not saved.
+QB_API qbResult      qb_rollback_restore(uint64_t frame);
+
+// Rewinds the active scene to "from" and runs the systems once for each frame
+// up to "to", saving every frame it reaches, so that the scene is left at
+// "to". Replays and replicators do not capture the resimulated frames,
+// coroutines and alarms do not run, nothing is rendered, and calls that play or
+// change sounds are ignored. The inputs may be null.
+QB_API qbResult      qb_resimulate(uint64_t from, uint64_t to,
+                                   qbRollbackInputs inputs);
+
+// Returns true while qb_resimulate runs systems. Systems can check it to skip
+// effects that must only happen once, e.g. spawning particles.
+QB_API bool          qb_resimulating();
+
+///////////////////////////////////////////////////////////
+//////////////////////  Frame Memory  /////////////////////
+///////////////////////////////////////////////////////////
+
+// Allocates size bytes aligned to align, which must be a power of two, or zero
+// for the maximum fundamental alignment. The memory is valid until the end of
+// the current call to qb_loop() and must not be freed. Allocation is a pointer
+// bump in an arena that is private to the calling thread, which makes this
+// the cheapest way to get scratch memory that does not outlive a frame.
+QB_API void*         qb_frame_alloc(size_t size, size_t align);
+
+typedef struct {
+  // Bytes allocated during the last frame by all threads.
+  size_t bytes;
+
+  // The most bytes allocated during any single frame.
+  size_t high_water;
+
+  // Bytes currently reserved by the arenas of all threads.
+  size_t capacity;
+} qbFrameAllocStats_, *qbFrameAllocStats;
+
+// Fills stats with the frame allocator usage as of the last completed frame.
+QB_API qbResult      qb_frame_allocstats(qbFrameAllocStats stats);
+
+///////////////////////////////////////////////////////////
+///////////////////  Memory Accounting  ///////////////////
+///////////////////////////////////////////////////////////
+
+// ======== qbMemoryTag ========
+// The subsystems that memory is accounted to.
+typedef enum {
+  // Instance storage and the sparse index of every component in every scene.
+  QB_MEMORY_TAG_COMPONENT = 0,
+
+  // Buffered messages of every event.
+  QB_MEMORY_TAG_EVENT,
+
+  // Coroutine stacks, including the ones cached for reuse.
+  QB_MEMORY_TAG_CORO_STACK,
+
+  // Systems owned by every program.
+  QB_MEMORY_TAG_PROGRAM,
+
+  // GPU buffers, by the size they were created with.
+  QB_MEMORY_TAG_RENDER,
+
+  QB_MEMORY_TAG_COUNT,
+} qbMemoryTag;
+
+typedef struct {
+  // Bytes allocated from the system.
+  size_t reserved;
+
+  // Bytes holding live data. Never more than reserved.
+  size_t used;
+} qbMemoryUsage_;
+
+typedef struct {
+  qbMemoryUsage_ total;
+  qbMemoryUsage_ tags[QB_MEMORY_TAG_COUNT];
+} qbMemoryStats_, *qbMemoryStats;
+
+// Fills stats with the memory currently held by each subsystem. Cheap enough
+// to call every frame.
+QB_API qbResult      qb_memory_stats(qbMemoryStats stats);
+
+// Calls fn with the memory held by every individual component, event and
+// program. The id is the qbComponent, the qbEvent id or the program id. A
+// component is listed once for every scene it has instances in.
+QB_API qbResult      qb_memory_foreach(void(*fn)(qbMemoryTag tag, qbId id,
+                                                 qbMemoryUsage_ usage,
+                                                 void* arg),
+                                       void* arg);
+
+// Starts writing the totals of qb_memory_stats to the given file every
+// interval seconds, as comma-separated values with a header row. The file is
+// overwritten. Replaces any running sampler.
+QB_API qbResult      qb_memory_startsampling(const char* file,
+                                             double interval);
+
+// Stops sampling and flushes the file.
+QB_API qbResult      qb_memory_stopsampling();
 
 ///////////////////////////////////////////////////////////
 ///////////////////////  Coroutines  //////////////////////
@@ -662,4 +1073,84 @@ qb_coro_done(
   qbCoro coro
 );
 
+typedef struct {
+  // Number of allocations served from a free list.
+  uint64_t hits;
+
+  // Number of allocations that had to go to the system allocator.
+  uint64_t misses;
+} qbPoolStats_;
+
+typedef struct {
+  qbPoolStats_ handles;
+  qbPoolStats_ contexts;
+  qbPoolStats_ stacks;
+} qbCoroPoolStats_, *qbCoroPoolStats;
+
+// Fills stats with the hit and miss counts of the coroutine memory pools since
+// startup. The hit rate of a pool is hits / (hits + misses).
+QB_API qbResult qb_coro_poolstats(qbCoroPoolStats stats);
+
+// Returns the name of the coroutine backend the engine was built with, either
+// "stack copying" or "stack switching".
+QB_API const char* qb_coro_backend();
+
+///////////////////////////////////////////////////////////
+///////////////////////  Channels  ////////////////////////
+///////////////////////////////////////////////////////////
+
+// ======== qbChannel ========
+// A channel is a bounded, thread-safe FIFO of qbVars that coroutines use to
+// pass values to each other. Any number of sync or async coroutines may send
+// and receive on the same channel. A sender that finds the channel full, or a
+// receiver that finds it empty, is suspended and only woken up once its
+// send or receive has completed.
+//
+// Outside of a scheduled coroutine, qb_channel_send and qb_channel_receive
+// yield (or spin on a plain thread) until they can complete.
+
+// Creates a channel that holds at least capacity values.
+QB_API qbChannel   qb_channel_create(size_t capacity);
+
+// Destroys the channel. No coroutine may be waiting on it.
+QB_API qbResult    qb_channel_destroy(qbChannel* channel);
+
+// Sends the var, waiting while the channel is full.
+QB_API void        qb_channel_send(qbChannel channel, qbVar var);
+
+// Receives the oldest var, waiting while the channel is empty.
+QB_API qbVar       qb_channel_receive(qbChannel channel);
+
+// Sends the var if the channel is not full. Returns true if it was sent.
+QB_API bool        qb_channel_trysend(qbChannel channel, qbVar var);
+
+// Receives the oldest var if the channel is not empty. Returns true if a var
+// was received.
+QB_API bool        qb_channel_tryreceive(qbChannel channel, qbVar* var);
+
+///////////////////////////////////////////////////////////
+////////////////////  Asynchronous I/O  ///////////////////
+///////////////////////////////////////////////////////////
+
+// A qbAsync is an operation that runs in the background. It behaves like a
+// scheduled coroutine: wait for it with qb_coro_await, poll it with
+// qb_coro_peek or qb_coro_done and destroy it with qb_coro_destroy once it is
+// done.
+
+typedef struct {
+  // The contents of the file followed by a null terminator.
+  uint8_t* data;
+
+  // Size of the file in bytes, not including the null terminator.
+  size_t size;
+} qbFileBuffer_, *qbFileBuffer;
+
+// Reads the whole file in the background. When done, the qbAsync's value is a
+// qbVoid holding a qbFileBuffer, or a null pointer if the file could not be
+// read. Uses io_uring where the kernel supports it and a thread pool
+// otherwise.
+QB_API qbAsync     qb_file_readasync(const char* path);
+
+QB_API qbResult    qb_filebuffer_destroy(qbFileBuffer* buffer);
+
 #endif  // #ifndef CUBEZ__H
@@ -1,6 +1,356 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
 #ifndef CUBEZ_NETWORK__H
 #define CUBEZ_NETWORK__H
 
+#include <cubez/cubez.h>
+#include <cubez/socket.h>
+
+///////////////////////////////////////////////////////////
+/////////////////////  Socket Reactor  ////////////////////
+///////////////////////////////////////////////////////////
+
+// The reactor polls every watched socket without blocking once per fixed
+// update, right before systems run, and sends what it found as one batch per
+// qbEvent. A single thread can then serve thousands of sockets. Watching a
+// socket makes it non-blocking. The reactor is not thread-safe.
+
+// Readiness flags of a qbSocketEvent.
+#define QB_SOCKET_READABLE 0x1
+#define QB_SOCKET_WRITABLE 0x2
+
+// The peer hung up or the socket has a pending error.
+#define QB_SOCKET_CLOSED 0x4
+
+typedef struct {
+  // Any of QB_SOCKET_READABLE and QB_SOCKET_WRITABLE.
+  int interest;
+
+  // If true, the reactor receives the datagrams of the socket when it is
+  // readable and sends one qbSocketEvent per datagram instead of the
+  // readiness. For UDP sockets. Datagrams longer than
+  // QB_PACKET_BUFFER_CAPACITY are truncated.
+  bool recv_datagrams;
+
+  // The event to send batches on. Create it with
+  // qb_eventattr_setmessagetype(attr, qbSocketEventBatch_).
+  qbEvent event;
+
+  // Passed back in every qbSocketEvent of the socket.
+  void* user;
+} qbSocketWatchAttr_, *qbSocketWatchAttr;
+
+typedef struct {
+  qbSocket socket;
+
+  // The QB_SOCKET_* readiness flags.
+  int events;
+
+  void* user;
+
+  // A datagram if the socket is watched with recv_datagrams, otherwise null.
+  // The reactor keeps the buffer for the frame it was received in and the
+  // next. Take a reference with qb_packetbuffer_ref to keep it longer, or to
+  // send it on with qb_socket_sendbuffers.
+  qbPacketBuffer buffer;
+  const uint8_t* data;
+  size_t size;
+  qbEndpoint_ from;
+} qbSocketEvent_, *qbSocketEvent;
+
+// The message sent on a qbSocketWatchAttr_::event. The events are in frame
+// memory, see qb_frame_alloc.
+typedef struct {
+  size_t count;
+  qbSocketEvent_* events;
+} qbSocketEventBatch_, *qbSocketEventBatch;
+
+// Starts watching the socket, or changes how it is watched if it already is.
+QB_API qbResult qb_socket_watch(qbSocket socket, qbSocketWatchAttr attr);
+
+// Stops watching the socket. Must be called before the socket is closed.
+QB_API qbResult qb_socket_unwatch(qbSocket socket);
+
+///////////////////////////////////////////////////////////
+///////////////////////  Connections  /////////////////////
+///////////////////////////////////////////////////////////
+
+// A connection carries messages between two peers over unreliable datagrams.
+// Every packet has a sequence number and acks the last 33 packets received
+// from the peer. A connection that receives 32 packets without sending one
+// sends an ack right away, so that a burst longer than that is not resent.
+// Reliable messages are resent until a packet carrying them is
+// acked. Messages longer than a packet are split into fragments and
+// reassembled. Each channel has its own ordering, so a lost message only holds
+// back later messages on the same reliable-ordered channel.
+//
+// A connection does no I/O of its own apart from sending packets. Received
+// datagrams are handed to it with qb_connection_receive, and
+// qb_connection_update sends what is due.
+
+typedef struct qbConnection_* qbConnection;
+
+typedef enum {
+  // Sent once. May be lost, duplicated messages are dropped.
+  QB_CHANNEL_UNRELIABLE,
+
+  // Delivered exactly once, in the order received.
+  QB_CHANNEL_RELIABLE_UNORDERED,
+
+  // Delivered exactly once, in the order sent.
+  QB_CHANNEL_RELIABLE_ORDERED,
+} qbChannelType;
+
+#define QB_CONNECTION_MAX_CHANNELS 32
+
+typedef struct {
+  // The type of each channel. Messages are sent and received on a channel
+  // index. Both peers must use the same channels.
+  const qbChannelType* channels;
+  size_t channel_count;
+
+  // Largest packet to send, at most 65553 bytes. Defaults to 1200 bytes if
+  // zero.
+  size_t mtu;
+
+  // Sends a packet to the peer. If null, packets are sent with
+  // qb_socket_sendto to "endpoint" from "socket".
+  int32_t(*send)(const uint8_t* packet, size_t size, void* state);
+  void* state;
+
+  qbSocket socket;
+  qbEndpoint_ endpoint;
+} qbConnectionAttr_, *qbConnectionAttr;
+
+typedef struct {
+  uint8_t channel;
+
+  // Valid until the next qb_connection_recv.
+  const uint8_t* data;
+  size_t size;
+} qbMessage_, *qbMessage;
+
+typedef struct {
+  // Smoothed round trip time in seconds.
+  double rtt;
+
+  uint64_t packets_sent;
+  uint64_t packets_received;
+  uint64_t packets_acked;
+
+  // Packets that were never acked.
+  uint64_t packets_lost;
+
+  // Fragments of reliable messages that were sent again.
+  uint64_t fragments_resent;
+} qbConnectionStats_, *qbConnectionStats;
+
+QB_API qbResult qb_connection_create(qbConnection* connection, qbConnectionAttr attr);
+QB_API qbResult qb_connection_destroy(qbConnection* connection);
+
+// Queues a message on the channel. It is sent on the next update.
+QB_API qbResult qb_connection_send(qbConnection connection, uint8_t channel,
+                                   const void* data, size_t size);
+
+// Processes a packet received from the peer. May send an ack.
+QB_API qbResult qb_connection_receive(qbConnection connection,
+                                      const uint8_t* packet, size_t size);
+
+// Sends the queued messages, the reliable messages that are due to be resent
+// and any acks owed. "time" is in seconds and must not go backwards.
+QB_API qbResult qb_connection_update(qbConnection connection, double time);
+
+// Pops the next delivered message. Returns false if there are none.
+QB_API bool qb_connection_recv(qbConnection connection, qbMessage message);
+
+QB_API void qb_connection_stats(qbConnection connection, qbConnectionStats stats);
+
+///////////////////////////////////////////////////////////
+///////////////////////  Replication  /////////////////////
+///////////////////////////////////////////////////////////
+
+// A qbReplicator runs on the server. It captures the world once per loop as a
+// tick and encodes, per client, the replicated components of the
+// entities around the client's viewpoint. Each message is a delta against the
+// last tick the client acked, or the full state if there is none. Unchanged
+// instances are found with the copy-on-write blocks of the captured worlds,
+// so the cost follows what changed.
+//
+// A qbReplica runs on the client and applies the messages to a scene,
+// creating, updating and destroying local entities. It keeps the ticks it
+// applied so that a delta against any of them can be applied. Component ids
+// and fields must be the same on both sides, i.e. the components are created
+// in the same order with the same qb_componentattr_addfield calls. Instances
+// are packed with qb_component_pack.
+//
+// Messages can be larger than a packet, send them on a qbConnection channel.
+
+typedef struct qbReplicator_* qbReplicator;
+typedef struct qbReplica_* qbReplica;
+
+typedef struct {
+  // If true, clients only receive entities within "radius" of their viewpoint
+  // and entities without a "position" component.
+  bool interest;
+
+  // The component holding each entity's position as three floats at
+  // "position_offset". If they do not fit in the component,
+  // qb_replicator_write fails with QB_ERROR_MEMORY_OUT_OF_BOUNDS.
+  qbComponent position;
+  size_t position_offset;
+
+  float radius;
+
+  // Side of a cell of the grid that finds the entities around a viewpoint.
+  // Defaults to "radius" if zero.
+  float cell_size;
+
+  // Number of ticks kept to delta against. A client whose ack is older gets
+  // the full state. Defaults to 32 if zero.
+  uint32_t history;
+} qbReplicatorAttr_, *qbReplicatorAttr;
+
+QB_API qbResult qb_replicator_create(qbReplicator* replicator, qbReplicatorAttr attr);
+QB_API qbResult qb_replicator_destroy(qbReplicator* replicator);
+
+QB_API qbResult qb_replicator_addclient(qbReplicator replicator, uint32_t* client);
+QB_API qbResult qb_replicator_removeclient(qbReplicator replicator, uint32_t client);
+
+// Sets the point the client receives entities around.
+QB_API qbResult qb_replicator_setviewpoint(qbReplicator replicator, uint32_t client,
+                                           float x, float y, float z);
+
+// Records that the client applied the tick. Later messages are encoded
+// against it.
+QB_API qbResult qb_replicator_ack(qbReplicator replicator, uint32_t client, uint32_t tick);
+
+// Encodes the latest tick for the client. The message is valid until the next
+// call for the same client.
+QB_API qbResult qb_replicator_write(qbReplicator replicator, uint32_t client,
+                                    const uint8_t** data, size_t* size);
+
+QB_API qbResult qb_replica_create(qbReplica* replica);
+QB_API qbResult qb_replica_destroy(qbReplica* replica);
+
+// Applies a message from qb_replicator_write to the scene and returns its tick,
+// which the client should send back to be acked. Messages older than the last
+// one applied are kept as baselines but not applied. Returns
+// QB_ERROR_NOT_FOUND if the message is a delta against a tick the replica no
+// longer has.
+QB_API qbResult qb_replica_apply(qbReplica replica, qbScene scene,
+                                 const uint8_t* data, size_t size, uint32_t* tick);
+
+///////////////////////////////////////////////////////////
+/////////////////////  Link Simulator  ////////////////////
+///////////////////////////////////////////////////////////
+
+// An in-process network that delays, drops, duplicates and reorders datagrams
+// and limits their rate, so that the networking stack can be measured without
+// a real network. Every random draw comes from a generator seeded by the
+// attribute, so a run with the same calls gives the same results on every
+// platform. Time is in seconds and supplied by the caller.
+//
+// A link connects two sides, 0 and 1. It can also carry datagrams between any
+// number of endpoints, like UDP sockets on one network. Each direction between
+// two ends has its own bandwidth queue.
+
+typedef struct qbLink_* qbLink;
+
+typedef struct {
+  // One-way delay in seconds.
+  double latency;
+
+  // Probability in [0, 1] that a datagram is dropped.
+  double loss;
+
+  // Extra delay in seconds drawn uniformly from [0, jitter) for every
+  // datagram. Datagrams sent closer together than this can arrive out of
+  // order.
+  double jitter;
+
+  // Probability in [0, 1] that a datagram arrives twice. Each copy has its own
+  // jitter.
+  double duplicate;
+
+  // Probability in [0, 1] that a datagram is held back by reorder_delay
+  // seconds, letting the ones sent after it arrive first.
+  double reorder;
+  double reorder_delay;
+
+  // Bytes per second each direction carries, or 0 for no limit. Datagrams
+  // wait for the ones ahead of them to go out. Once queue_size bytes are
+  // waiting, more datagrams are dropped. A queue_size of 0 never drops.
+  double bandwidth;
+  size_t queue_size;
+
+  uint64_t seed;
+} qbLinkAttr_, *qbLinkAttr;
+
+typedef struct {
+  uint64_t sent;
+
+  // Dropped by "loss", or sent to an endpoint that is not bound.
+  uint64_t lost;
+
+  // Dropped because the bandwidth queue was full.
+  uint64_t overflowed;
+
+  uint64_t duplicated;
+  uint64_t reordered;
+
+  // Received, counting both copies of a duplicate.
+  uint64_t delivered;
+} qbLinkStats_, *qbLinkStats;
+
+QB_API qbResult qb_link_create(qbLink* link, qbLinkAttr attr);
+QB_API qbResult qb_link_destroy(qbLink* link);
+
+// Sends a datagram from "side" to the other side.
+QB_API qbResult qb_link_send(qbLink link, int side, const uint8_t* data,
+                             size_t size, double time);
+
+// Receives the next datagram that has arrived at "side" by "time". Returns its
+// size, or -1 if none has arrived. Longer datagrams are truncated to "size".
+QB_API int32_t qb_link_recv(qbLink link, int side, uint8_t* data, size_t size,
+                            double time);
+
+// Lets the endpoint receive datagrams. Datagrams sent to an endpoint that is
+// not bound are dropped.
+QB_API qbResult qb_link_bind(qbLink link, qbEndpoint endpoint);
+
+// The qb_socket_sendto and qb_socket_recvfrom of the link. Any endpoint can
+// send. recvfrom writes the sender to "from" if it is not null and returns -1
+// if no datagram has arrived at "at" by "time".
+QB_API int32_t qb_link_sendto(qbLink link, qbEndpoint from, const char* buf,
+                              size_t len, qbEndpoint to, double time);
+QB_API int32_t qb_link_recvfrom(qbLink link, qbEndpoint at, char* buf,
+                                size_t len, qbEndpoint from, double time);
+
+// The qb_socket_sendbatch and qb_socket_recvbatch of the link. Returns the
+// number of packets sent, or the number of packets filled, which is 0 if none
+// has arrived.
+QB_API int32_t qb_link_sendbatch(qbLink link, qbEndpoint from, qbPacket packets,
+                                 size_t count, double time);
+QB_API int32_t qb_link_recvbatch(qbLink link, qbEndpoint at, qbPacket packets,
+                                 size_t count, double time);
 
+QB_API void qb_link_stats(qbLink link, qbLinkStats stats);
 
-#endif  // CUBEZ_NETWORK__H
\ No newline at end of file
+#endif  // CUBEZ_NETWORK__H
@@ -32,6 +32,7 @@ typedef struct qbImageSampler_* qbImageSampler;
 typedef struct qbPixelMap_* qbPixelMap;
 typedef struct qbImage_* qbImage;
 typedef struct qbGpuBuffer_* qbGpuBuffer;
+typedef struct qbGpuHeap_* qbGpuHeap;
 typedef struct qbMeshBuffer_* qbMeshBuffer;
 typedef struct qbRenderEvent_* qbRenderEvent;
 typedef struct qbRenderGroup_* qbRenderGroup;
@@ -167,6 +168,19 @@ typedef struct {
   qbRenderExt ext;
 } qbGpuBufferAttr_, *qbGpuBufferAttr;
 
+typedef struct {
+  const char* name;
+
+  // Size of the buffers that allocations are carved from. Allocations that
+  // do not fit get a buffer of their own.
+  size_t page_size;
+
+  // Power of two that every allocation is aligned to. Defaults to 256.
+  size_t alignment;
+
+  qbGpuBufferType buffer_type;
+} qbGpuHeapAttr_, *qbGpuHeapAttr;
+
 typedef struct {
   uint32_t binding;
   uint32_t stride;
@@ -415,6 +429,25 @@ QB_API void qb_gpubuffer_update(qbGpuBuffer buffer, intptr_t offset, size_t size
 QB_API void qb_gpubuffer_copy(qbGpuBuffer dst, qbGpuBuffer src, intptr_t dst_offset, intptr_t src_offset, size_t size);
 QB_API void qb_gpubuffer_swap(qbGpuBuffer a, qbGpuBuffer b);
 
+// A GPU heap hands out ranges of a few large buffers instead of a buffer per
+// allocation. Allocations are identified by ids; the buffer and offset of an
+// allocation may change after qb_gpuheap_defragment.
+QB_API void qb_gpuheap_create(qbGpuHeap* heap, qbGpuHeapAttr attr);
+QB_API void qb_gpuheap_destroy(qbGpuHeap* heap);
+
+// Returns -1 if size is 0. Data may be null.
+QB_API qbId qb_gpuheap_alloc(qbGpuHeap heap, size_t size, void* data);
+QB_API void qb_gpuheap_free(qbGpuHeap heap, qbId allocation);
+
+// Updating an allocation that is -1 or was freed does nothing, and its buffer
+// is null.
+QB_API void qb_gpuheap_update(qbGpuHeap heap, qbId allocation, intptr_t offset, size_t size, void* data);
+QB_API qbGpuBuffer qb_gpuheap_buffer(qbGpuHeap heap, qbId allocation, intptr_t* offset);
+
+// Releases empty buffers and moves at most max_bytes of allocations out of the
+// least used buffer. Returns the number of bytes moved.
+QB_API size_t qb_gpuheap_defragment(qbGpuHeap heap, size_t max_bytes);
+
 QB_API void qb_meshbuffer_create(qbMeshBuffer* buffer, qbMeshBufferAttr attr);
 QB_API void qb_meshbuffer_destroy(qbMeshBuffer* buffer);
 QB_API const char* qb_meshbuffer_name(qbMeshBuffer buffer);
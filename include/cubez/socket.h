@@ -58,6 +58,21 @@ typedef struct qbEndpoint_ {
   };
 } qbEndpoint_, *qbEndpoint;
 
+// A datagram for qb_socket_sendbatch and qb_socket_recvbatch.
+typedef struct qbPacket_ {
+  // Payload to send, or the buffer to receive into.
+  char* buf;
+
+  // Size of "buf". Only read when receiving.
+  size_t cap;
+
+  // Length of the payload. Written when receiving.
+  size_t len;
+
+  // Destination when sending, source when receiving.
+  qbEndpoint_ endpoint;
+} qbPacket_, *qbPacket;
+
 // https://docs.microsoft.com/en-us/windows/win32/api/winsock2/nf-winsock2-send
 // https://man7.org/linux/man-pages/man7/tcp.7.html
 // https://man7.org/linux/man-pages/man7/ip.7.html
@@ -124,6 +139,56 @@ QB_API int32_t qb_socket_sendto(qbSocket socket, const char* buf, size_t len, in
 QB_API int32_t qb_socket_recv(qbSocket socket, char* buf, size_t len, int flags);
 QB_API int32_t qb_socket_recvfrom(qbSocket socket, char* buf, size_t len, int flags, qbEndpoint endpoint);
 
+// Sends "count" datagrams to their endpoints. Uses sendmmsg on Linux, and
+// consecutive packets of the same size to the same endpoint are coalesced
+// with UDP GSO when the kernel supports it. Returns the number of packets
+// sent, which is less than "count" if the socket buffer filled, or -1 if none
+// were sent.
+QB_API int32_t qb_socket_sendbatch(qbSocket socket, qbPacket packets, size_t count, int flags);
+
+// Receives up to "count" datagrams into the given packets. Uses recvmmsg on
+// Linux. Blocks on a blocking socket until the first datagram arrives and then
+// only takes what is already queued. Returns the number of packets filled or
+// -1 on error.
+QB_API int32_t qb_socket_recvbatch(qbSocket socket, qbPacket packets, size_t count, int flags);
+
+// Packet buffers are fixed-size, cache-line aligned and reference counted.
+// They come from a pool that grows in slabs and never shrinks, so a steady
+// stream of packets makes no allocations. A buffer can be shared, e.g. the
+// same snapshot sent to many peers, by taking a reference per use. Buffers
+// are thread-safe to reference and release.
+#define QB_PACKET_BUFFER_CAPACITY 1984
+
+typedef struct qbPacketBuffer_ {
+  uint8_t* data;
+
+  // Bytes used of "data".
+  size_t size;
+
+  // Always QB_PACKET_BUFFER_CAPACITY.
+  size_t capacity;
+} qbPacketBuffer_, *qbPacketBuffer;
+
+// Takes a buffer from the pool with a single reference and a size of zero.
+QB_API qbPacketBuffer qb_packetbuffer_alloc();
+
+QB_API void qb_packetbuffer_ref(qbPacketBuffer buffer);
+
+// Returns the buffer to the pool once the last reference is released.
+QB_API void qb_packetbuffer_release(qbPacketBuffer buffer);
+
+// Sends each buffer to the endpoint with the same index, see
+// qb_socket_sendbatch. Takes over one reference of every buffer, whether it
+// was sent or not. To send a buffer to several endpoints, list it once per
+// endpoint with a reference each.
+QB_API int32_t qb_socket_sendbuffers(qbSocket socket, const qbPacketBuffer* buffers,
+                                     const qbEndpoint_* endpoints, size_t count, int flags);
+
+// Receives up to "count" datagrams into buffers from the pool, see
+// qb_socket_recvbatch. The caller owns a reference to each buffer received.
+QB_API int32_t qb_socket_recvbuffers(qbSocket socket, qbPacketBuffer* buffers,
+                                     qbEndpoint_* endpoints, size_t count, int flags);
+
 // See OS specific socket documentation for what options are available.
 QB_API qbResult qb_socket_setopt(qbSocket socket, int level, int name, const char* val, int len);
 QB_API qbResult qb_socket_getopt(qbSocket socket, int level, int name, char* val, int* len);
@@ -0,0 +1,136 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "alarm_internal.h"
+#include "defs.h"
+#include "event.h"
+#include "memory_pool.h"
+#include "timer_wheel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Messages up to this size are stored inside of the alarm itself.
+const size_t kInlineMessageSize = 32;
+
+struct qbAlarm_ {
+  // Must be the first member so that a TimerWheel::Timer* can be cast back to
+  // its qbAlarm.
+  TimerWheel::Timer timer;
+
+  qbEvent event;
+
+  // Number of ticks between repeats. Zero if the alarm fires only once.
+  uint64_t period;
+
+  void* message;
+  uint8_t inline_message[kInlineMessageSize];
+};
+
+double tick_seconds_;
+TimerWheel* wheel_;
+MemoryPool<qbAlarm_>* alarms_;
+
+void alarm_initialize(double tick_seconds) {
+  tick_seconds_ = tick_seconds;
+  wheel_ = new TimerWheel();
+  alarms_ = new MemoryPool<qbAlarm_>();
+}
+
+void alarm_free(qbAlarm alarm) {
+  if (alarm->message != alarm->inline_message) {
+    free(alarm->message);
+  }
+  alarms_->deleteElement(alarm);
+}
+
+void alarm_shutdown() {
+  // Every live alarm is on the wheel: one-shot alarms are freed when they
+  // fire and repeating ones are scheduled again.
+  wheel_->Clear([](TimerWheel::Timer* timer) {
+    alarm_free((qbAlarm)timer);
+  });
+  delete wheel_;
+  delete alarms_;
+  wheel_ = nullptr;
+  alarms_ = nullptr;
+}
+
+void alarm_tick() {
+  wheel_->Advance(1, [](TimerWheel::Timer* timer) {
+    qbAlarm alarm = (qbAlarm)timer;
+    qb_event_send(alarm->event, alarm->message);
+
+    if (alarm->period) {
+      wheel_->Schedule(&alarm->timer, alarm->period);
+    } else {
+      alarm_free(alarm);
+    }
+  });
+}
+
+uint64_t alarm_ticks(double seconds) {
+  if (seconds <= 0.0) {
+    return 0;
+  }
+  return (uint64_t)std::ceil(seconds / tick_seconds_);
+}
+
+qbAlarm qb_alarm_create(qbEvent event, void* message, double delay, bool repeat) {
+  qbAlarm alarm = alarms_->newElement();
+  alarm->event = event;
+
+  size_t size = ((Event*)event->event)->MessageSize();
+  alarm->message = size <= kInlineMessageSize ? alarm->inline_message : malloc(size);
+  if (message) {
+    memcpy(alarm->message, message, size);
+  } else {
+    memset(alarm->message, 0, size);
+  }
+
+  uint64_t ticks = alarm_ticks(delay);
+  alarm->period = repeat ? std::max(ticks, (uint64_t)1) : 0;
+  wheel_->Schedule(&alarm->timer, ticks);
+
+  return alarm;
+}
+
+qbResult qb_alarm_cancel(qbAlarm* alarm) {
+  if (!*alarm) {
+    return QB_ERROR_NULL_POINTER;
+  }
+
+  // The alarm was already freed by alarm_shutdown.
+  if (!alarms_) {
+    *alarm = nullptr;
+    return QB_OK;
+  }
+  wheel_->Cancel(&(*alarm)->timer);
+  alarm_free(*alarm);
+  *alarm = nullptr;
+  return QB_OK;
+}
+
+double qb_alarm_remaining(qbAlarm alarm) {
+  return wheel_->Remaining(&alarm->timer) * tick_seconds_;
+}
+
+size_t qb_alarm_count() {
+  return wheel_->Size();
+}
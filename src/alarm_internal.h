@@ -0,0 +1,33 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef ALARM_INTERNAL__H
+#define ALARM_INTERNAL__H
+
+#include <cubez/common.h>
+
+// Initializes the alarm wheel. Every call to alarm_tick() advances game time
+// by tick_seconds.
+void alarm_initialize(double tick_seconds);
+void alarm_shutdown();
+
+// Advances the alarm wheel by one tick and sends the messages of all alarms
+// that are due.
+void alarm_tick();
+
+#endif  // ALARM_INTERNAL__H
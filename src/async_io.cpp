@@ -0,0 +1,432 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "async_io_internal.h"
+#include "coro_scheduler.h"
+#include "defs.h"
+#include "thread_pool.h"
+
+#include <cubez/cubez.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#ifdef __COMPILE_AS_LINUX__
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define QB_HAS_IO_URING
+#endif
+
+extern CoroScheduler* coro_scheduler;
+
+namespace {
+
+qbFileBuffer filebuffer_create(size_t size) {
+  qbFileBuffer buffer = new qbFileBuffer_;
+  buffer->size = size;
+  buffer->data = (uint8_t*)malloc(size + 1);
+  buffer->data[size] = '\0';
+  return buffer;
+}
+
+// Blocking read used by the thread pool.
+qbFileBuffer read_file(const std::string& path) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file.is_open()) {
+    return nullptr;
+  }
+
+  std::streamsize size = file.tellg();
+  if (size < 0) {
+    return nullptr;
+  }
+  file.seekg(0, std::ios::beg);
+
+  qbFileBuffer buffer = filebuffer_create((size_t)size);
+  if (!file.read((char*)buffer->data, size)) {
+    qb_filebuffer_destroy(&buffer);
+  }
+  return buffer;
+}
+
+#ifdef QB_HAS_IO_URING
+
+// A minimal io_uring driver on top of the raw system calls. Any thread may
+// submit reads; a single completion thread blocks on the completion queue,
+// resubmits short reads and completes the qbAsync once the whole file is read.
+// Reads that the kernel refuses with EAGAIN, because it is out of resources,
+// are finished with blocking reads on a thread pool instead of being retried.
+class Uring {
+public:
+  struct Request {
+    qbAsync async;
+    qbFileBuffer buffer;
+    int fd;
+    size_t offset;
+    struct iovec iov;
+  };
+
+  ~Uring() {
+    if (completion_thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> l(mu_);
+        stop_ = true;
+      }
+
+      // Gives the completion thread a chance to free up the rings if the
+      // kernel refuses the wake up.
+      std::chrono::microseconds backoff(50);
+      for (;;) {
+        {
+          std::lock_guard<std::mutex> l(mu_);
+          if (SubmitNop()) {
+            break;
+          }
+        }
+        std::this_thread::sleep_for(backoff);
+        backoff = std::min(backoff * 2, std::chrono::microseconds(10000));
+      }
+      completion_thread_.join();
+    }
+    fallback_.reset();
+
+    if (sqes_) munmap(sqes_, sqes_size_);
+    if (cq_ptr_ && cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_size_);
+    if (sq_ptr_) munmap(sq_ptr_, sq_size_);
+    if (fd_ >= 0) close(fd_);
+  }
+
+  // Returns false if io_uring is not supported or not permitted.
+  bool Initialize(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd_ = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd_ < 0) {
+      return false;
+    }
+
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    }
+
+    sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED) {
+      sq_ptr_ = nullptr;
+      return false;
+    }
+    cq_ptr_ = single_mmap ? sq_ptr_ : mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    if (cq_ptr_ == MAP_FAILED) {
+      cq_ptr_ = nullptr;
+      return false;
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe*)mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+      sqes_ = nullptr;
+      return false;
+    }
+
+    char* sq = (char*)sq_ptr_;
+    sq_head_ = (unsigned*)(sq + params.sq_off.head);
+    sq_tail_ = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask_ = *(unsigned*)(sq + params.sq_off.ring_mask);
+    sq_array_ = (unsigned*)(sq + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+
+    char* cq = (char*)cq_ptr_;
+    cq_head_ = (unsigned*)(cq + params.cq_off.head);
+    cq_tail_ = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask_ = *(unsigned*)(cq + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    completion_thread_ = std::thread([this] { Complete(); });
+    return true;
+  }
+
+  // Opens the file and starts reading it. Returns false if the file could not
+  // be opened.
+  bool Read(const char* path, qbAsync async) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      return false;
+    }
+
+    Request* read = new Request;
+    read->async = async;
+    read->buffer = filebuffer_create((size_t)st.st_size);
+    read->fd = fd;
+    read->offset = 0;
+
+    std::lock_guard<std::mutex> l(mu_);
+    if (read->buffer->size == 0) {
+      Finish(read, true);
+    } else if (in_flight_ < sq_entries_) {
+      if (!Submit(read)) {
+        Fallback(read);
+      }
+    } else {
+      backlog_.push_back(read);
+    }
+    return true;
+  }
+
+private:
+  // Must be called with mu_ held.
+  io_uring_sqe* NextSqe() {
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    return sqe;
+  }
+
+  // Submits the entry from NextSqe. Returns false, and takes the entry back
+  // out of the ring, if the kernel refused it. Must be called with mu_ held.
+  bool Enter() {
+    unsigned tail = *sq_tail_;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    for (;;) {
+      if (syscall(__NR_io_uring_enter, fd_, 1, 0, 0, nullptr, 0) >= 0) {
+        return true;
+      }
+      if (errno != EINTR) {
+        // The kernel did not consume the entry, and only this thread
+        // produces entries while mu_ is held.
+        __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+        return false;
+      }
+    }
+  }
+
+  // Returns false if the kernel refused the read. Must be called with mu_
+  // held.
+  bool Submit(Request* read) {
+    read->iov.iov_base = read->buffer->data + read->offset;
+    read->iov.iov_len = read->buffer->size - read->offset;
+
+    io_uring_sqe* sqe = NextSqe();
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = read->fd;
+    sqe->addr = (uint64_t)&read->iov;
+    sqe->len = 1;
+    sqe->off = read->offset;
+    sqe->user_data = (uint64_t)read;
+    if (!Enter()) {
+      return false;
+    }
+    ++in_flight_;
+    return true;
+  }
+
+  // Wakes up the completion thread. Must be called with mu_ held.
+  bool SubmitNop() {
+    io_uring_sqe* sqe = NextSqe();
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = 0;
+    return Enter();
+  }
+
+  // Reads the rest of the file with blocking reads on the thread pool. Must be
+  // called with mu_ held.
+  void Fallback(Request* read) {
+    if (!fallback_) {
+      fallback_.reset(new ThreadPool(1));
+    }
+    fallback_->enqueue([this](Request* read) {
+      while (read->offset < read->buffer->size) {
+        ssize_t res = pread(read->fd, read->buffer->data + read->offset,
+                            read->buffer->size - read->offset, (off_t)read->offset);
+        if (res < 0 && errno == EINTR) {
+          continue;
+        }
+        if (res <= 0) {
+          Finish(read, false);
+          return;
+        }
+        read->offset += (size_t)res;
+      }
+      Finish(read, true);
+    }, read);
+  }
+
+  void Finish(Request* read, bool success) {
+    close(read->fd);
+    if (!success) {
+      qb_filebuffer_destroy(&read->buffer);
+    }
+    coro_scheduler->complete(read->async, qbVoid(read->buffer));
+    delete read;
+  }
+
+  void Complete() {
+    for (;;) {
+      syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+
+      std::lock_guard<std::mutex> l(mu_);
+      unsigned head = *cq_head_;
+      unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      for (; head != tail; ++head) {
+        io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+        Request* read = (Request*)cqe->user_data;
+        if (!read) {
+          continue;
+        }
+        --in_flight_;
+
+        int res = cqe->res;
+        if (res == -EINTR) {
+          backlog_.push_front(read);
+        } else if (res == -EAGAIN) {
+          Fallback(read);
+        } else if (res <= 0) {
+          Finish(read, false);
+        } else {
+          read->offset += (size_t)res;
+          if (read->offset == read->buffer->size) {
+            Finish(read, true);
+          } else {
+            backlog_.push_front(read);
+          }
+        }
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+      while (!backlog_.empty() && in_flight_ < sq_entries_) {
+        Request* read = backlog_.front();
+        backlog_.pop_front();
+        if (!Submit(read)) {
+          Fallback(read);
+        }
+      }
+
+      if (stop_) {
+        return;
+      }
+    }
+  }
+
+  int fd_ = -1;
+
+  void* sq_ptr_ = nullptr;
+  void* cq_ptr_ = nullptr;
+  size_t sq_size_ = 0;
+  size_t cq_size_ = 0;
+  size_t sqes_size_ = 0;
+
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned* sq_array_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  io_uring_sqe* sqes_ = nullptr;
+
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+
+  // Guards the submission queue and everything below.
+  std::mutex mu_;
+  unsigned in_flight_ = 0;
+  std::deque<Request*> backlog_;
+  bool stop_ = false;
+
+  // Created on the first read the kernel refuses.
+  std::unique_ptr<ThreadPool> fallback_;
+
+  std::thread completion_thread_;
+};
+
+std::unique_ptr<Uring> uring_;
+
+#endif  // QB_HAS_IO_URING
+
+std::unique_ptr<ThreadPool> fallback_pool_;
+
+}  // namespace
+
+void async_io_initialize(size_t fallback_threads) {
+#ifdef QB_HAS_IO_URING
+  uring_.reset(new Uring);
+  if (uring_->Initialize(256)) {
+    return;
+  }
+  uring_.reset();
+#endif
+  fallback_pool_.reset(new ThreadPool(fallback_threads));
+}
+
+void async_io_shutdown() {
+#ifdef QB_HAS_IO_URING
+  uring_.reset();
+#endif
+  fallback_pool_.reset();
+}
+
+qbAsync qb_file_readasync(const char* path) {
+  qbAsync async = coro_scheduler->create_pending();
+
+#ifdef QB_HAS_IO_URING
+  if (uring_) {
+    if (!uring_->Read(path, async)) {
+      coro_scheduler->complete(async, qbVoid(nullptr));
+    }
+    return async;
+  }
+#endif
+
+  fallback_pool_->enqueue([async](std::string path) {
+    coro_scheduler->complete(async, qbVoid(read_file(path)));
+  }, std::string(path));
+  return async;
+}
+
+qbResult qb_filebuffer_destroy(qbFileBuffer* buffer) {
+  if (!*buffer) {
+    return QB_ERROR_NULL_POINTER;
+  }
+  free((*buffer)->data);
+  delete *buffer;
+  *buffer = nullptr;
+  return QB_OK;
+}
@@ -0,0 +1,29 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef ASYNC_IO_INTERNAL__H
+#define ASYNC_IO_INTERNAL__H
+
+#include <cubez/common.h>
+
+// Starts the background I/O. Tries to set up an io_uring first and falls back
+// to a pool of fallback_threads blocking readers.
+void async_io_initialize(size_t fallback_threads);
+void async_io_shutdown();
+
+#endif  // ASYNC_IO_INTERNAL__H
@@ -20,6 +20,7 @@
 
 #include "audio_internal.h"
 #include "cute_sound.h"
+#include "rollback.h"
 
 #include "sparse_map.h"
 #include "block_vector.h"
@@ -83,13 +84,21 @@ int qb_audio_size(qbAudioBuffer loaded) {
   return cs_sound_size(&loaded->loaded);
 }
 
+// Sounds are not changed by resimulated frames, which were already heard the
+// first time they ran.
 void qb_audio_play(qbAudioPlaying playing) {
+  if (rollback_resimulating()) {
+    return;
+  }
   if (!cs_is_active(&playing->playing)) {
     cs_insert_sound(ctx, &playing->playing);
   }
 }
 
 void qb_audio_stop(qbAudioPlaying playing) {
+  if (rollback_resimulating()) {
+    return;
+  }
   cs_stop_sound(&playing->playing);
 }
 
@@ -98,29 +107,44 @@ int qb_audio_isplaying(qbAudioPlaying playing) {
 }
 
 void qb_audio_loop(qbAudioPlaying playing, qbAudoLoop enable_loop) {
+  if (rollback_resimulating()) {
+    return;
+  }
   if (cs_is_active(&playing->playing)) {
     cs_loop_sound(&playing->playing, (int)enable_loop);
   }
 }
 
 void qb_audio_pause(qbAudioPlaying playing) {
+  if (rollback_resimulating()) {
+    return;
+  }
   if (cs_is_active(&playing->playing)) {
     cs_pause_sound(&playing->playing, playing->paused);
   }
 }
 
 void qb_audio_pan(qbAudioPlaying playing, float pan) {
+  if (rollback_resimulating()) {
+    return;
+  }
   if (cs_is_active(&playing->playing)) {
     cs_set_pan(&playing->playing, pan);
   }
 }
 
 void qb_audio_volume(qbAudioPlaying playing, float left, float right) {
+  if (rollback_resimulating()) {
+    return;
+  }
   if (cs_is_active(&playing->playing)) {
     cs_set_volume(&playing->playing, left, right);
   }
 }
 
 void qb_audio_stopall() {
+  if (rollback_resimulating()) {
+    return;
+  }
   cs_stop_all_sounds(ctx);
 }
\ No newline at end of file
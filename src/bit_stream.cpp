@@ -0,0 +1,536 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "bit_stream.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+#include <vector>
+
+namespace {
+
+// The three smallest components of a unit quaternion are within this.
+const float kQuatMax = 0.707106781f;
+
+uint32_t mask_of(uint32_t bits) {
+  return bits >= 32 ? 0xFFFFFFFFu : (1u << bits) - 1;
+}
+
+// Holds the state of a qbBitWriter in locals while packing, since the
+// compiler must otherwise assume that every byte stored may change it.
+class Packer {
+public:
+  explicit Packer(qbBitWriter writer)
+    : writer_(writer), data_(writer->data), capacity_(writer->capacity),
+      size_(writer->size), scratch_(writer->scratch),
+      scratch_bits_(writer->scratch_bits), overflow_(writer->overflow) {}
+
+  ~Packer() {
+    writer_->size = size_;
+    writer_->scratch = scratch_;
+    writer_->scratch_bits = scratch_bits_;
+    writer_->overflow = overflow_;
+  }
+
+  void Bits(uint32_t value, uint32_t bits) {
+    scratch_ |= (uint64_t)(value & mask_of(bits)) << scratch_bits_;
+    scratch_bits_ += bits;
+    if (scratch_bits_ >= 32) {
+      Store(4);
+    }
+  }
+
+  void Varint(uint64_t value) {
+    while (value >= 0x80) {
+      Bits((uint32_t)(value & 0x7F) | 0x80, 8);
+      value >>= 7;
+    }
+    Bits((uint32_t)value, 8);
+  }
+
+  void Bytes(const uint8_t* bytes, size_t size) {
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+      uint32_t word = (uint32_t)bytes[i] | (uint32_t)bytes[i + 1] << 8 |
+                      (uint32_t)bytes[i + 2] << 16 | (uint32_t)bytes[i + 3] << 24;
+      Bits(word, 32);
+    }
+    for (; i < size; ++i) {
+      Bits(bytes[i], 8);
+    }
+  }
+
+  void Flush() {
+    if (scratch_bits_ > 0) {
+      Store((scratch_bits_ + 7) / 8);
+    }
+  }
+
+private:
+  void Store(uint32_t bytes) {
+    if (capacity_ - size_ < bytes) {
+      overflow_ = true;
+    } else {
+      uint8_t word[4];
+      for (uint32_t i = 0; i < 4; ++i) {
+        word[i] = (uint8_t)(scratch_ >> (8 * i));
+      }
+      memcpy(data_ + size_, word, bytes);
+      size_ += bytes;
+    }
+    scratch_ >>= 8 * bytes;
+    scratch_bits_ -= std::min(scratch_bits_, 8 * bytes);
+  }
+
+  qbBitWriter writer_;
+  uint8_t* data_;
+  size_t capacity_;
+  size_t size_;
+  uint64_t scratch_;
+  uint32_t scratch_bits_;
+  bool overflow_;
+};
+
+class Unpacker {
+public:
+  explicit Unpacker(qbBitReader reader)
+    : reader_(reader), data_(reader->data), size_(reader->size),
+      offset_(reader->offset), scratch_(reader->scratch),
+      scratch_bits_(reader->scratch_bits), overflow_(reader->overflow) {}
+
+  ~Unpacker() {
+    reader_->offset = offset_;
+    reader_->scratch = scratch_;
+    reader_->scratch_bits = scratch_bits_;
+    reader_->overflow = overflow_;
+  }
+
+  uint32_t Bits(uint32_t bits) {
+    if (scratch_bits_ < bits) {
+      Refill();
+      if (scratch_bits_ < bits) {
+        overflow_ = true;
+        scratch_ = 0;
+        scratch_bits_ = 0;
+        return 0;
+      }
+    }
+    uint32_t value = (uint32_t)scratch_ & mask_of(bits);
+    scratch_ >>= bits;
+    scratch_bits_ -= bits;
+    return value;
+  }
+
+  uint64_t Varint() {
+    uint64_t value = 0;
+    for (uint32_t shift = 0; shift < 64; shift += 7) {
+      uint32_t byte = Bits(8);
+      value |= (uint64_t)(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) {
+        return value;
+      }
+    }
+    overflow_ = true;
+    return 0;
+  }
+
+  void Bytes(uint8_t* bytes, size_t size) {
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+      uint32_t word = Bits(32);
+      for (int k = 0; k < 4; ++k) {
+        bytes[i + k] = (uint8_t)(word >> (8 * k));
+      }
+    }
+    for (; i < size; ++i) {
+      bytes[i] = (uint8_t)Bits(8);
+    }
+  }
+
+private:
+  void Refill() {
+    if (scratch_bits_ <= 32 && size_ - offset_ >= 4) {
+      uint8_t word[4];
+      memcpy(word, data_ + offset_, 4);
+      for (uint32_t i = 0; i < 4; ++i) {
+        scratch_ |= (uint64_t)word[i] << (scratch_bits_ + 8 * i);
+      }
+      scratch_bits_ += 32;
+      offset_ += 4;
+    }
+    while (scratch_bits_ <= 56 && offset_ < size_) {
+      scratch_ |= (uint64_t)data_[offset_++] << scratch_bits_;
+      scratch_bits_ += 8;
+    }
+  }
+
+  qbBitReader reader_;
+  const uint8_t* data_;
+  size_t size_;
+  size_t offset_;
+  uint64_t scratch_;
+  uint32_t scratch_bits_;
+  bool overflow_;
+};
+
+// Single precision is exact enough for up to 24 bits of steps. Every instance
+// goes through the same branch-free arithmetic so that the loops over arrays
+// of instances vectorize.
+template<class Real_>
+void quantize(const uint8_t* values, size_t stride, size_t count,
+              float min, float max, uint32_t bits, uint32_t* out) {
+  Real_ steps = (Real_)mask_of(bits);
+  Real_ scale = steps / ((Real_)max - (Real_)min);
+  for (size_t i = 0; i < count; ++i) {
+    float v;
+    memcpy(&v, values + i * stride, sizeof(float));
+    // NaNs fail the comparison and become min.
+    v = v >= min ? v : min;
+    v = v <= max ? v : max;
+    Real_ q = ((Real_)v - (Real_)min) * scale + (Real_)0.5;
+    out[i] = (uint32_t)(q < steps ? q : steps);
+  }
+}
+
+template<class Real_>
+void dequantize(const uint32_t* in, size_t count, float min, float max,
+                uint32_t bits, uint8_t* values, size_t stride) {
+  Real_ step = ((Real_)max - (Real_)min) / (Real_)mask_of(bits);
+  for (size_t i = 0; i < count; ++i) {
+    float v = (float)((Real_)min + (Real_)in[i] * step);
+    memcpy(values + i * stride, &v, sizeof(float));
+  }
+}
+
+uint32_t quantize_one(float value, float min, float max, uint32_t bits) {
+  uint32_t quantized;
+  if (bits <= 24) {
+    quantize<float>((const uint8_t*)&value, 0, 1, min, max, bits, &quantized);
+  } else {
+    quantize<double>((const uint8_t*)&value, 0, 1, min, max, bits, &quantized);
+  }
+  return quantized;
+}
+
+float dequantize_one(uint32_t quantized, float min, float max, uint32_t bits) {
+  float value;
+  if (bits <= 24) {
+    dequantize<float>(&quantized, 1, min, max, bits, (uint8_t*)&value, 0);
+  } else {
+    dequantize<double>(&quantized, 1, min, max, bits, (uint8_t*)&value, 0);
+  }
+  return value;
+}
+
+void write_quat(Packer* packer, const float q[4], uint32_t bits) {
+  uint32_t largest = 0;
+  for (uint32_t i = 1; i < 4; ++i) {
+    if (std::fabs(q[i]) > std::fabs(q[largest])) {
+      largest = i;
+    }
+  }
+
+  // q and -q are the same rotation, so the largest is made positive and
+  // only its index is written.
+  float sign = q[largest] < 0.0f ? -1.0f : 1.0f;
+  float rest[3];
+  for (uint32_t i = 0, j = 0; i < 4; ++i) {
+    if (i != largest) {
+      rest[j++] = sign * q[i];
+    }
+  }
+  uint32_t quantized[3];
+  if (bits <= 24) {
+    quantize<float>((const uint8_t*)rest, sizeof(float), 3, -kQuatMax, kQuatMax, bits, quantized);
+  } else {
+    quantize<double>((const uint8_t*)rest, sizeof(float), 3, -kQuatMax, kQuatMax, bits, quantized);
+  }
+  packer->Bits(largest, 2);
+  for (uint32_t i = 0; i < 3; ++i) {
+    packer->Bits(quantized[i], bits);
+  }
+}
+
+void read_quat(Unpacker* unpacker, float q[4], uint32_t bits) {
+  uint32_t largest = unpacker->Bits(2);
+  uint32_t quantized[3];
+  for (uint32_t i = 0; i < 3; ++i) {
+    quantized[i] = unpacker->Bits(bits);
+  }
+  float rest[3];
+  if (bits <= 24) {
+    dequantize<float>(quantized, 3, -kQuatMax, kQuatMax, bits, (uint8_t*)rest, sizeof(float));
+  } else {
+    dequantize<double>(quantized, 3, -kQuatMax, kQuatMax, bits, (uint8_t*)rest, sizeof(float));
+  }
+  float sum = 0.0f;
+  for (uint32_t i = 0, j = 0; i < 4; ++i) {
+    if (i != largest) {
+      q[i] = rest[j++];
+      sum += q[i] * q[i];
+    }
+  }
+  q[largest] = std::sqrt(std::max(0.0f, 1.0f - sum));
+}
+
+uint64_t load_uint(const uint8_t* p, size_t size) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; ++i) {
+    value |= (uint64_t)p[i] << (8 * i);
+  }
+  return value;
+}
+
+void store_uint(uint8_t* p, size_t size, uint64_t value) {
+  for (size_t i = 0; i < size; ++i) {
+    p[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+// Returns the most bits a field takes for one instance.
+size_t field_bits(const qbFieldAttr_& field) {
+  switch (field.type) {
+    case QB_FIELD_FLOAT: return field.bits;
+    case QB_FIELD_QUAT: return 2 + 3 * field.bits;
+    case QB_FIELD_UINT:
+    case QB_FIELD_INT: return 8 * ((8 * field.size + 6) / 7);
+    case QB_FIELD_BYTES: return 8 * field.size;
+  }
+  return 0;
+}
+
+}  // namespace
+
+void qb_bitwriter_init(qbBitWriter writer, void* data, size_t capacity) {
+  writer->data = (uint8_t*)data;
+  writer->capacity = capacity;
+  writer->size = 0;
+  writer->scratch = 0;
+  writer->scratch_bits = 0;
+  writer->overflow = false;
+}
+
+void qb_bitwriter_bits(qbBitWriter writer, uint32_t value, uint32_t bits) {
+  Packer(writer).Bits(value, bits);
+}
+
+void qb_bitwriter_varint(qbBitWriter writer, uint64_t value) {
+  Packer(writer).Varint(value);
+}
+
+void qb_bitwriter_float(qbBitWriter writer, float value, float min, float max,
+                        uint32_t bits) {
+  Packer(writer).Bits(quantize_one(value, min, max, bits), bits);
+}
+
+void qb_bitwriter_quat(qbBitWriter writer, const float q[4], uint32_t bits) {
+  Packer packer(writer);
+  write_quat(&packer, q, bits);
+}
+
+qbResult qb_bitwriter_flush(qbBitWriter writer, size_t* size) {
+  Packer(writer).Flush();
+  *size = writer->size;
+  return writer->overflow ? QB_ERROR_MEMORY_OUT_OF_BOUNDS : QB_OK;
+}
+
+void qb_bitreader_init(qbBitReader reader, const void* data, size_t size) {
+  reader->data = (const uint8_t*)data;
+  reader->size = size;
+  reader->offset = 0;
+  reader->scratch = 0;
+  reader->scratch_bits = 0;
+  reader->overflow = false;
+}
+
+uint32_t qb_bitreader_bits(qbBitReader reader, uint32_t bits) {
+  return Unpacker(reader).Bits(bits);
+}
+
+uint64_t qb_bitreader_varint(qbBitReader reader) {
+  return Unpacker(reader).Varint();
+}
+
+float qb_bitreader_float(qbBitReader reader, float min, float max,
+                         uint32_t bits) {
+  return dequantize_one(Unpacker(reader).Bits(bits), min, max, bits);
+}
+
+void qb_bitreader_quat(qbBitReader reader, float q[4], uint32_t bits) {
+  Unpacker unpacker(reader);
+  read_quat(&unpacker, q, bits);
+}
+
+qbResult component_addfield(qbComponentAttr_* attr, const qbFieldAttr_& field) {
+  size_t size = 0;
+  switch (field.type) {
+    case QB_FIELD_FLOAT:
+      if (field.bits == 0 || field.bits > 32 || !(field.min < field.max)) {
+        return QB_ERROR_INCOMPATIBLE_DATA_TYPES;
+      }
+      size = sizeof(float);
+      break;
+    case QB_FIELD_QUAT:
+      if (field.bits == 0 || field.bits > 32) {
+        return QB_ERROR_INCOMPATIBLE_DATA_TYPES;
+      }
+      size = 4 * sizeof(float);
+      break;
+    case QB_FIELD_UINT:
+    case QB_FIELD_INT:
+      if (field.size != 1 && field.size != 2 && field.size != 4 && field.size != 8) {
+        return QB_ERROR_INCOMPATIBLE_DATA_TYPES;
+      }
+      size = field.size;
+      break;
+    case QB_FIELD_BYTES:
+      if (field.size == 0) {
+        return QB_ERROR_INCOMPATIBLE_DATA_TYPES;
+      }
+      size = field.size;
+      break;
+    default:
+      return QB_ERROR_INCOMPATIBLE_DATA_TYPES;
+  }
+  if (attr->field_count == QB_COMPONENT_MAX_FIELDS ||
+      field.offset > attr->data_size || size > attr->data_size - field.offset) {
+    return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+  }
+  attr->fields[attr->field_count++] = field;
+  return QB_OK;
+}
+
+void component_pack(const qbComponentAttr_& attr, const uint8_t* instances,
+                    size_t count, qbBitWriter writer) {
+  Packer packer(writer);
+  size_t stride = attr.data_size;
+  if (attr.field_count == 0) {
+    packer.Bytes(instances, count * stride);
+    return;
+  }
+
+  thread_local std::vector<uint32_t> quantized;
+  for (uint32_t f = 0; f < attr.field_count; ++f) {
+    const qbFieldAttr_& field = attr.fields[f];
+    const uint8_t* values = instances + field.offset;
+    switch (field.type) {
+      case QB_FIELD_FLOAT:
+        quantized.resize(count);
+        if (field.bits <= 24) {
+          quantize<float>(values, stride, count, field.min, field.max, field.bits, quantized.data());
+        } else {
+          quantize<double>(values, stride, count, field.min, field.max, field.bits, quantized.data());
+        }
+        for (size_t i = 0; i < count; ++i) {
+          packer.Bits(quantized[i], field.bits);
+        }
+        break;
+      case QB_FIELD_QUAT:
+        for (size_t i = 0; i < count; ++i) {
+          float q[4];
+          memcpy(q, values + i * stride, sizeof(q));
+          write_quat(&packer, q, field.bits);
+        }
+        break;
+      case QB_FIELD_UINT:
+        for (size_t i = 0; i < count; ++i) {
+          packer.Varint(load_uint(values + i * stride, field.size));
+        }
+        break;
+      case QB_FIELD_INT:
+        for (size_t i = 0; i < count; ++i) {
+          // Sign extends and zigzags so that small negatives stay small.
+          uint32_t shift = 64 - 8 * (uint32_t)field.size;
+          int64_t value = (int64_t)(load_uint(values + i * stride, field.size) << shift) >> shift;
+          packer.Varint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+        }
+        break;
+      case QB_FIELD_BYTES:
+        for (size_t i = 0; i < count; ++i) {
+          packer.Bytes(values + i * stride, field.size);
+        }
+        break;
+    }
+  }
+}
+
+void component_unpack(const qbComponentAttr_& attr, qbBitReader reader,
+                      uint8_t* instances, size_t count) {
+  Unpacker unpacker(reader);
+  size_t stride = attr.data_size;
+  if (attr.field_count == 0) {
+    unpacker.Bytes(instances, count * stride);
+    return;
+  }
+
+  memset(instances, 0, count * stride);
+  thread_local std::vector<uint32_t> quantized;
+  for (uint32_t f = 0; f < attr.field_count; ++f) {
+    const qbFieldAttr_& field = attr.fields[f];
+    uint8_t* values = instances + field.offset;
+    switch (field.type) {
+      case QB_FIELD_FLOAT:
+        quantized.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+          quantized[i] = unpacker.Bits(field.bits);
+        }
+        if (field.bits <= 24) {
+          dequantize<float>(quantized.data(), count, field.min, field.max, field.bits, values, stride);
+        } else {
+          dequantize<double>(quantized.data(), count, field.min, field.max, field.bits, values, stride);
+        }
+        break;
+      case QB_FIELD_QUAT:
+        for (size_t i = 0; i < count; ++i) {
+          float q[4];
+          read_quat(&unpacker, q, field.bits);
+          memcpy(values + i * stride, q, sizeof(q));
+        }
+        break;
+      case QB_FIELD_UINT:
+        for (size_t i = 0; i < count; ++i) {
+          store_uint(values + i * stride, field.size, unpacker.Varint());
+        }
+        break;
+      case QB_FIELD_INT:
+        for (size_t i = 0; i < count; ++i) {
+          uint64_t zigzag = unpacker.Varint();
+          store_uint(values + i * stride, field.size, (zigzag >> 1) ^ (0 - (zigzag & 1)));
+        }
+        break;
+      case QB_FIELD_BYTES:
+        for (size_t i = 0; i < count; ++i) {
+          unpacker.Bytes(values + i * stride, field.size);
+        }
+        break;
+    }
+  }
+}
+
+size_t component_packbound(const qbComponentAttr_& attr, size_t count) {
+  if (attr.field_count == 0) {
+    return count * attr.data_size;
+  }
+  size_t bits = 0;
+  for (uint32_t f = 0; f < attr.field_count; ++f) {
+    bits += field_bits(attr.fields[f]);
+  }
+  return (bits * count + 7) / 8;
+}
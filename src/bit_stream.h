@@ -0,0 +1,41 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef BIT_STREAM__H
+#define BIT_STREAM__H
+
+#include <cubez/cubez.h>
+
+#include "defs.h"
+
+// Validates the field and adds it to the attributes.
+qbResult component_addfield(qbComponentAttr_* attr, const qbFieldAttr_& field);
+
+// Packs count instances of the component laid end to end, field by field. A
+// component without fields is packed as raw bytes.
+void component_pack(const qbComponentAttr_& attr, const uint8_t* instances,
+                    size_t count, qbBitWriter writer);
+
+void component_unpack(const qbComponentAttr_& attr, qbBitReader reader,
+                      uint8_t* instances, size_t count);
+
+// Returns the most bytes component_pack writes for count instances.
+size_t component_packbound(const qbComponentAttr_& attr, size_t count);
+
+#endif  // BIT_STREAM__H
@@ -0,0 +1,163 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "block_arena.h"
+#include "defs.h"
+
+#include <algorithm>
+
+#ifdef __COMPILE_AS_LINUX__
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+const size_t kCacheLineSize = 64;
+
+}  // namespace
+
+BlockArena::BlockArena(size_t block_size)
+  : block_size_((block_size + kCacheLineSize - 1) & ~(kCacheLineSize - 1)),
+    blocks_per_region_(kRegionSize / block_size_),
+    bump_region_(nullptr),
+    live_(0) {
+  if (blocks_per_region_ == 0) {
+    FATAL("Block of " << block_size << " bytes does not fit in an arena region.");
+  }
+}
+
+BlockArena::~BlockArena() {
+  for (Region& region : regions_) {
+    UnmapRegion(region.base);
+  }
+}
+
+void* BlockArena::Alloc() {
+  std::lock_guard<std::mutex> l(mu_);
+  void* block;
+  if (!free_.empty()) {
+    block = free_.back();
+    free_.pop_back();
+    ++Find(block)->live;
+  } else {
+    auto region = bump_region_ ? Find(bump_region_) : regions_.end();
+    if (region == regions_.end() || region->bumped == blocks_per_region_) {
+      Region r;
+      r.base = MapRegion();
+      r.bumped = 0;
+      r.live = 0;
+      region = regions_.insert(
+        std::upper_bound(regions_.begin(), regions_.end(), r.base,
+                         [](const char* base, const Region& r) { return base < r.base; }),
+        r);
+      bump_region_ = r.base;
+    }
+    block = region->base + region->bumped * block_size_;
+    ++region->bumped;
+    ++region->live;
+  }
+  ++live_;
+  return block;
+}
+
+void BlockArena::Free(void* block) {
+  std::lock_guard<std::mutex> l(mu_);
+  auto region = Find(block);
+  --live_;
+  if (--region->live > 0) {
+    free_.push_back(block);
+    return;
+  }
+
+  // The whole region is free: forget about its recycled blocks and unmap it.
+  char* begin = region->base;
+  char* end = begin + kRegionSize;
+  free_.erase(std::remove_if(free_.begin(), free_.end(), [begin, end](void* b) {
+                return (char*)b >= begin && (char*)b < end;
+              }), free_.end());
+  if (bump_region_ == begin) {
+    bump_region_ = nullptr;
+  }
+  UnmapRegion(begin);
+  regions_.erase(region);
+}
+
+bool BlockArena::Owns(const void* block) const {
+  std::lock_guard<std::mutex> l(mu_);
+  return Find(block) != regions_.end();
+}
+
+std::vector<BlockArena::Region>::iterator BlockArena::Find(const void* block) {
+  auto it = std::upper_bound(regions_.begin(), regions_.end(), (const char*)block,
+                             [](const char* p, const Region& r) { return p < r.base; });
+  if (it == regions_.begin()) {
+    return regions_.end();
+  }
+  --it;
+  return (const char*)block < it->base + kRegionSize ? it : regions_.end();
+}
+
+std::vector<BlockArena::Region>::const_iterator BlockArena::Find(const void* block) const {
+  return const_cast<BlockArena*>(this)->Find(block);
+}
+
+#ifdef __COMPILE_AS_LINUX__
+
+char* BlockArena::MapRegion() {
+  // Over-allocate and trim so that the region is 2MB aligned. Otherwise the
+  // kernel cannot back it with a single huge page.
+  size_t size = 2 * kRegionSize;
+  char* p = (char*)mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    FATAL("Could not map a " << kRegionSize << " byte block arena region.");
+  }
+
+  char* base = (char*)(((uintptr_t)p + kRegionSize - 1) & ~(uintptr_t)(kRegionSize - 1));
+  if (base > p) {
+    munmap(p, base - p);
+  }
+  if (base + kRegionSize < p + size) {
+    munmap(base + kRegionSize, (p + size) - (base + kRegionSize));
+  }
+
+#ifdef MADV_HUGEPAGE
+  madvise(base, kRegionSize, MADV_HUGEPAGE);
+#endif
+  return base;
+}
+
+void BlockArena::UnmapRegion(char* base) {
+  munmap(base, kRegionSize);
+}
+
+#else
+
+char* BlockArena::MapRegion() {
+  char* base = (char*)ALIGNED_ALLOC(kRegionSize, kRegionSize);
+  if (!base) {
+    FATAL("Could not allocate a " << kRegionSize << " byte block arena region.");
+  }
+  return base;
+}
+
+void BlockArena::UnmapRegion(char* base) {
+  ALIGNED_FREE(base);
+}
+
+#endif
@@ -0,0 +1,88 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef BLOCK_ARENA__H
+#define BLOCK_ARENA__H
+
+#include <mutex>
+#include <stddef.h>
+#include <vector>
+
+// Carves fixed-size blocks out of 2MB regions. On Linux, regions are mmap'd
+// and advised to be backed by transparent huge pages, so that iterating over a
+// large BlockVector needs a handful of TLB entries instead of one per 4KB
+// page. Blocks are cache-line aligned. Freed blocks are recycled, and a region
+// is returned to the system once all of its blocks are free.
+//
+// Thread-safe: the copies a BlockVector makes with share() allocate from and
+// free to the same arena, and snapshots may be released on other threads.
+class BlockArena {
+public:
+  static const size_t kRegionSize = 2 * 1024 * 1024;
+
+  BlockArena(size_t block_size);
+  ~BlockArena();
+
+  void* Alloc();
+  void Free(void* block);
+
+  bool Owns(const void* block) const;
+
+  // Bytes taken by each block.
+  size_t block_size() const {
+    return block_size_;
+  }
+
+  // Number of blocks handed out.
+  size_t blocks() const {
+    std::lock_guard<std::mutex> l(mu_);
+    return live_;
+  }
+
+  size_t reserved_bytes() const {
+    std::lock_guard<std::mutex> l(mu_);
+    return regions_.size() * kRegionSize;
+  }
+
+private:
+  struct Region {
+    char* base;
+    size_t bumped;
+    size_t live;
+  };
+
+  // Returns the region holding the block or regions_.end().
+  std::vector<Region>::iterator Find(const void* block);
+  std::vector<Region>::const_iterator Find(const void* block) const;
+
+  char* MapRegion();
+  void UnmapRegion(char* base);
+
+  const size_t block_size_;
+  const size_t blocks_per_region_;
+
+  // Sorted by base address.
+  std::vector<Region> regions_;
+  std::vector<void*> free_;
+  char* bump_region_;
+  size_t live_;
+
+  mutable std::mutex mu_;
+};
+
+#endif  // BLOCK_ARENA__H
@@ -20,10 +20,14 @@
 #define BLOCK_VECTOR__H
 
 #include "apex_memmove.h"
+#include "block_arena.h"
 #include <cubez/cubez.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <memory>
+#include <new>
 #include <vector>
 
 #ifdef __COMPILE_AS_WINDOWS__
@@ -63,10 +67,10 @@ public:
   typedef const iterator const_iterator;
   typedef uint64_t Index;
 
-  BlockVector() : count_(0), capacity_(0), elem_size_(0) {}
+  BlockVector() : count_(0), capacity_(0), shared_(false), elem_size_(0) {}
 
   BlockVector(size_t element_size) :
-    count_(0), capacity_(0), elem_size_(element_size) {
+    count_(0), capacity_(0), shared_(false), elem_size_(element_size) {
     elems_.push_back(alloc_block());
     capacity_ = elem_size_ == 0 ? 0 : page_size_ / elem_size_;
     size_t initial_capacity = 8;
@@ -84,9 +88,7 @@ public:
   }
 
   ~BlockVector() {
-    for (void* e : elems_) {
-      ALIGNED_FREE(e);
-    }
+    release();
   }
 
   BlockVector& operator=(const BlockVector& other) {
@@ -103,9 +105,14 @@ public:
     return *this;
   }
 
+  // Mutable access. Duplicates the element's block first if it is shared
+  // with a copy made by share().
   void* operator[](Index index) {
     size_t block = (index * elem_size_) / (page_size_ - elem_size_);
     size_t block_index = (index * elem_size_) % (page_size_ - elem_size_);
+    if (shared_) {
+      unshare(block);
+    }
     return (uint8_t*)(elems_[block]) + block_index;
   }
 
@@ -125,7 +132,7 @@ public:
 
   // Returns the addres to the first element.
   void* front() {
-    return elems_[0];
+    return (*this)[0];
   }
 
   // Returns the address to the last element.
@@ -189,6 +196,116 @@ public:
     return capacity_;
   }
 
+  // Bytes allocated for blocks. Blocks carved from the arena are counted at
+  // their own size rather than by region, because the arena may be shared
+  // with copies made by share().
+  size_t reserved_bytes() const {
+    if (!arena_) {
+      return elems_.size() * block_size();
+    }
+    return (elems_.size() - arena_blocks_) * block_size() +
+           arena_blocks_ * arena_->block_size();
+  }
+
+  // Makes this vector a copy of other that shares its blocks. A shared block
+  // is only duplicated when either vector first mutates it, so this costs a
+  // reference count increment per block.
+  void share(BlockVector& other) {
+    if (this == &other) {
+      return;
+    }
+    // The counts are found with other's layout, which this vector may not
+    // have yet.
+    for (void* e : other.elems_) {
+      other.refs(e).fetch_add(1, std::memory_order_relaxed);
+    }
+    release();
+    count_ = other.count_;
+    capacity_ = other.capacity_;
+    *(size_t*)(&elem_size_) = other.elem_size_;
+    elems_ = other.elems_;
+    arena_ = other.arena_;
+    arena_blocks_ = other.arena_blocks_;
+    backing_ = other.backing_;
+    shared_ = other.shared_ = true;
+  }
+
+  // Number of blocks allocated.
+  size_t blocks() const {
+    return elems_.size();
+  }
+
+  // Number of blocks needed to hold size() elements.
+  size_t blocks_needed() const {
+    if (elem_size_ == 0) {
+      return elems_.size();
+    }
+    return (std::max(count_, size_t(8)) * elem_size_) / (page_size_ - elem_size_) + 1;
+  }
+
+  // Frees at most max_blocks trailing blocks that are not needed to hold
+  // size() elements. Returns the number of blocks freed.
+  size_t shrink(size_t max_blocks) {
+    size_t needed = blocks_needed();
+    size_t freed = 0;
+    while (elems_.size() > needed && freed < max_blocks) {
+      free_block(elems_.back());
+      elems_.pop_back();
+      capacity_ -= page_size_ / elem_size_;
+      ++freed;
+    }
+    if (elems_.size() == needed) {
+      elems_.shrink_to_fit();
+    }
+    return freed;
+  }
+
+  const void* block(size_t i) const {
+    return elems_[i];
+  }
+
+  // Returns the block holding the index-th element.
+  size_t block_of(Index index) const {
+    return (index * elem_size_) / (page_size_ - elem_size_);
+  }
+
+  // Returns the index of the first element past the given block.
+  Index block_end(size_t block) const {
+    return ((block + 1) * (page_size_ - elem_size_) + elem_size_ - 1) / elem_size_;
+  }
+
+  // Bytes between consecutive blocks written by export_block().
+  size_t block_stride() const {
+    return (block_size() + 63) & ~(size_t)63;
+  }
+
+  // Copies the i-th block to dst, which must hold block_stride() bytes. The
+  // copy is pinned: a vector that adopts it never frees it and duplicates it
+  // on the first write.
+  void export_block(size_t i, void* dst) const {
+    memset(dst, 0, block_stride());
+    memcpy(dst, elems_[i], page_size_ + elem_size_);
+    new ((uint8_t*)dst + refs_offset()) std::atomic<uint32_t>(kPinnedRefs);
+  }
+
+  // Replaces the contents with count elements held by blocks written by
+  // export_block(). The blocks are owned by backing, which is kept alive for
+  // as long as any vector may refer to them.
+  void adopt(const std::vector<void*>& blocks, size_t count,
+             std::shared_ptr<void> backing) {
+    release();
+    count_ = count;
+    if (elem_size_ == 0) {
+      elems_.push_back(alloc_block());
+      capacity_ = 0;
+      return;
+    }
+    elems_ = blocks;
+    capacity_ = blocks.size() * (page_size_ / elem_size_);
+    backing_ = std::move(backing);
+    shared_ = true;
+  }
+
   void push_back(void* data) {
     ++count_;
     resize_capacity(count_ + 1);
@@ -236,37 +353,131 @@ private:
     }*/
   }
 
+  // Once a vector holds this many blocks, the rest are carved from a
+  // BlockArena. Build with QB_BLOCK_ARENA_DISABLED to always use the heap.
+  static const size_t kArenaThreshold = 64;
+
+  // Reference count of exported blocks, high enough that releasing them
+  // never drops it to zero.
+  static const uint32_t kPinnedRefs = 0x80000000;
+
+  // Blocks hold page_size_ + elem_size_ bytes of elements followed by a
+  // reference count.
+  size_t refs_offset() const {
+    return (page_size_ + elem_size_ + 7) & ~(size_t)7;
+  }
+
+  size_t block_size() const {
+    return refs_offset() + sizeof(std::atomic<uint32_t>);
+  }
+
+  std::atomic<uint32_t>& refs(void* block) const {
+    return *(std::atomic<uint32_t>*)((uint8_t*)block + refs_offset());
+  }
+
   void* alloc_block() {
-    return ALIGNED_ALLOC(page_size_ + elem_size_, page_size_);
+#ifndef QB_BLOCK_ARENA_DISABLED
+    if (!arena_ && elems_.size() >= kArenaThreshold &&
+        block_size() * 8 <= BlockArena::kRegionSize) {
+      arena_.reset(new BlockArena(block_size()));
+    }
+#endif
+    void* block;
+    if (arena_) {
+      block = arena_->Alloc();
+      ++arena_blocks_;
+    } else {
+      block = ALIGNED_ALLOC(block_size(), page_size_);
+    }
+    new (&refs(block)) std::atomic<uint32_t>(1);
+    return block;
+  }
+
+  void unshare(size_t block) {
+    void* shared = elems_[block];
+    if (refs(shared).load(std::memory_order_acquire) == 1) {
+      return;
+    }
+    void* copy = alloc_block();
+    apex::memcpy(copy, shared, page_size_ + elem_size_);
+    free_block(shared);
+    elems_[block] = copy;
+  }
+
+  // Drops this vector's reference to the block.
+  void free_block(void* block) {
+    bool in_arena = arena_ && arena_->Owns(block);
+    if (in_arena) {
+      --arena_blocks_;
+    }
+    if (refs(block).fetch_sub(1, std::memory_order_acq_rel) != 1) {
+      return;
+    }
+    if (in_arena) {
+      arena_->Free(block);
+    } else {
+      ALIGNED_FREE(block);
+    }
+  }
+
+  void release() {
+    for (void* e : elems_) {
+      free_block(e);
+    }
+    elems_.clear();
+    arena_.reset();
+    arena_blocks_ = 0;
+    backing_.reset();
   }
 
   void copy(const BlockVector& other) {
+    release();
     count_ = other.count_;
     capacity_ = other.capacity_;
+    shared_ = false;
     reserve(count_);
     *(size_t*)(&elem_size_) = other.elem_size_;
     *(size_t*)(&page_size_) = other.page_size_;
     for (void* e : other.elems_) {
       void* copy = alloc_block();
-      apex::memmove(copy, e, page_size_);
+      apex::memmove(copy, e, page_size_ + elem_size_);
       elems_.push_back(copy);
     }
   }
 
   void move(BlockVector&& other) {
+    release();
     count_ = other.count_;
     capacity_ = other.capacity_;
+    shared_ = other.shared_;
     elems_ = other.elems_;
+    arena_ = std::move(other.arena_);
+    arena_blocks_ = other.arena_blocks_;
+    backing_ = std::move(other.backing_);
     *(size_t*)(&elem_size_) = other.elem_size_;
 
+    other.arena_blocks_ = 0;
     other.count_ = 0;
     other.capacity_ = 0;
     other.elems_.clear();
   }
 
   std::vector<void*> elems_;
+
+  // Shared with the copies made by share(), which may hold its blocks.
+  std::shared_ptr<BlockArena> arena_;
+
+  // Number of elems_ carved from arena_.
+  size_t arena_blocks_ = 0;
+
+  // Holds the memory of blocks given to adopt().
+  std::shared_ptr<void> backing_;
   size_t count_;
   size_t capacity_;
+
+  // Set once blocks may be shared, so that vectors which never were skip the
+  // reference count check on mutable access.
+  bool shared_;
   const size_t elem_size_;
   const size_t page_size_ = 4096;
 };
@@ -19,172 +19,213 @@
 #ifndef BUDDY_SYSTEM_ALLOCATOR__H
 #define BUDDY_SYSTEM_ALLOCATOR__H
 
-#include "common.h"
+#include <cubez/common.h>
 #include "fast_math.h"
 
-template<class Ty_>
-class BuddySystemAllocator {
-private:
-  struct Block {
-    uint64_t order;
-    // Null implies that the child is free memory.
-    struct Block* next = nullptr;
-  };
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+// Hands out power-of-two ranges of units in [0, capacity). Does not own any
+// memory, so it can manage ranges of anything, e.g. a GPU buffer.
+//
+// Every order has a bitmap with a bit per block that is set when the block is
+// free, and an intrusive doubly-linked free list. Releasing a block looks up
+// its buddy in the bitmap and unlinks it in constant time, so a release costs
+// O(order) instead of a walk over the free list.
+class BuddySystem {
+public:
+  static const uint64_t kInvalid = ~(uint64_t)0;
 
-  uint8_t* mem_;
-  Block** free_blocks_;
+  BuddySystem(uint64_t count) {
+    order_ = order_of(count == 0 ? 1 : count);
+    capacity_ = (uint64_t)1 << order_;
 
-  uint64_t capacity_;
-  uint64_t tot_size_;
-  uint64_t order_;
-  uint64_t size_;
+    bitmap_offsets_.resize(order_ + 1);
+    uint64_t words = 0;
+    for (uint64_t order = 0; order <= order_; ++order) {
+      bitmap_offsets_[order] = words;
+      words += ((capacity_ >> order) + 63) / 64;
+    }
+    bitmap_.resize(words);
+    heads_.resize(order_ + 1);
+    next_.resize(capacity_);
+    prev_.resize(capacity_);
+    orders_.resize(capacity_);
+    clear();
+  }
+
+  // Returns the offset of a free range of at least count units, or kInvalid.
+  uint64_t alloc(uint64_t count) {
+    if (count == 0 || count > capacity_) {
+      return kInvalid;
+    }
+
+    uint64_t order = order_of(count);
+    uint64_t from = order;
+    while (from <= order_ && heads_[from] == kNil) {
+      ++from;
+    }
+    if (from > order_) {
+      return kInvalid;
+    }
 
-  inline bool in_range(Ty_* mem) {
-    return (uint8_t*)mem >= mem_ && (uint8_t*)mem < mem_ + tot_size_;
+    uint64_t offset = heads_[from];
+    remove_free(offset, from);
+
+    // Split down to the requested order, freeing the upper halves.
+    while (from > order) {
+      --from;
+      push_free(offset + ((uint64_t)1 << from), from);
+    }
+
+    orders_[offset] = (uint8_t)order;
+    used_ += (uint64_t)1 << order;
+    return offset;
   }
 
-  inline Ty_* block_to_ptr(Block* b) {
-    return (Ty_*)((uint8_t*)b + sizeof(Block));
+  // Releases a range returned by alloc().
+  void release(uint64_t offset) {
+    if (offset >= capacity_ || orders_[offset] == kNotAllocated) {
+      return;
+    }
+
+    uint64_t order = orders_[offset];
+    orders_[offset] = kNotAllocated;
+    used_ -= (uint64_t)1 << order;
+
+    while (order < order_) {
+      uint64_t buddy = offset ^ ((uint64_t)1 << order);
+      if (!is_free(buddy, order)) {
+        break;
+      }
+      remove_free(buddy, order);
+      offset &= ~((uint64_t)1 << order);
+      ++order;
+    }
+    push_free(offset, order);
   }
 
-  inline Block* ptr_to_block(Ty_* mem) {
-    return (Block*)((uint8_t*)mem - sizeof(Block));
+  void clear() {
+    std::fill(bitmap_.begin(), bitmap_.end(), 0);
+    std::fill(heads_.begin(), heads_.end(), (uint32_t)kNil);
+    std::fill(orders_.begin(), orders_.end(), (uint8_t)kNotAllocated);
+    used_ = 0;
+    push_free(0, order_);
   }
 
-  Block* merge(Block* head, Block* tail, Block** other) {
-    if (head < tail && tail == buddy_of(head)) {
-      ++head->order;
-      head->next = nullptr;
-      *other = tail;
-      return head;
-    } else if (head > tail && head == buddy_of(tail)) {
-      ++tail->order;
-      tail->next = nullptr;
-      *other = head;
-      return tail;
+  // Number of units in the range allocated at offset.
+  uint64_t size_of(uint64_t offset) const {
+    if (offset >= capacity_ || orders_[offset] == kNotAllocated) {
+      return 0;
     }
-    return nullptr;
+    return (uint64_t)1 << orders_[offset];
   }
 
-  inline Block* buddy_of(Block* block) {
-    return (Block*)((uint8_t*)block + size_ * ((uint64_t)1 << block->order));
+  uint64_t capacity() const {
+    return capacity_;
   }
 
-  void release(Block* block) {
-    uint64_t order = block->order;
+  // Number of units handed out, including what was lost to rounding.
+  uint64_t used() const {
+    return used_;
+  }
 
-    Block* node = free_blocks_[order];
-    Block* prev = node;
-    if (!node->next) {
-      node->next = block;
+  // Smallest order such that (1 << order) >= count.
+  static uint64_t order_of(uint64_t count) {
+    return log_2(count) + (count_bits(count) == 1 ? 0 : 1);
+  }
+
+private:
+  static const uint32_t kNil = 0xFFFFFFFF;
+  static const uint8_t kNotAllocated = 0xFF;
+
+  bool is_free(uint64_t offset, uint64_t order) const {
+    uint64_t bit = offset >> order;
+    return (bitmap_[bitmap_offsets_[order] + bit / 64] >> (bit % 64)) & 1;
+  }
+
+  void set_free(uint64_t offset, uint64_t order, bool free) {
+    uint64_t bit = offset >> order;
+    uint64_t& word = bitmap_[bitmap_offsets_[order] + bit / 64];
+    if (free) {
+      word |= (uint64_t)1 << (bit % 64);
     } else {
-      while (node->next) {
-        prev = node;
-        node = node->next;
-
-        Block* other = nullptr;
-        Block* merged = merge(block, node, &other);
-        if (merged) {
-          prev->next = prev->next->next;
-          other->order = 0;
-          other->next = nullptr;
-          release(merged);
-          return;
-        }
-      }
+      word &= ~((uint64_t)1 << (bit % 64));
     }
   }
 
-  Block* split(Block* head) {
-    --head->order;
-    Block* tail = buddy_of(head);
-    tail->order = head->order;
-    return tail;
-  }
-
-  Block* alloc_block(uint64_t order) {
-    if (order <= order_) {
-      // Get the block of memory to allocate from
-      Block* sentinel = free_blocks_[order];
-      Block* mem = sentinel->next;
-
-      // If there are no free blocks, we need to allocate some.
-      if (mem) {
-        // Otherwise, we can get some memory right away!
-        sentinel->next = mem->next;
-        return mem;
-      } else {
-        // Recurse up to split the block.
-        Block* head = alloc_block(order + 1);
-
-        // If we get a nullptr, that means we have run out of memory.
-        if (head) {
-          // Split the block and push it onto the working memory.
-          Block* tail = split(head);
-          head->next = sentinel->next;
-          sentinel->next = head;
-          return tail;
-        }
-      }
+  void push_free(uint64_t offset, uint64_t order) {
+    set_free(offset, order, true);
+    prev_[offset] = kNil;
+    next_[offset] = heads_[order];
+    if (heads_[order] != kNil) {
+      prev_[heads_[order]] = (uint32_t)offset;
     }
-    return nullptr;
+    heads_[order] = (uint32_t)offset;
   }
 
-public:
-  BuddySystemAllocator(const uint64_t count) {
-    size_ = sizeof(Block) + sizeof(Ty_);
-    order_ = log_2(count) + (count_bits(count) == 1 ? 0 : 1);
-    capacity_ = (uint64_t)1 << order_;
-    tot_size_ = size_ * capacity_;
-    mem_ = (uint8_t*)std::calloc(1, tot_size_);
-    ((Block*)(mem_))->order = order_;
-    ((Block*)(mem_))->next = nullptr;
-
-    free_blocks_ = (Block**)std::calloc(order_ + 1, sizeof(Block*));
-    for (uint64_t i = 0; i < order_ + 1; ++i) {
-      free_blocks_[i] = (Block*)std::calloc(1, sizeof(Block));
-      free_blocks_[i]->order = 0;
-      free_blocks_[i]->next = nullptr;
+  void remove_free(uint64_t offset, uint64_t order) {
+    set_free(offset, order, false);
+    if (prev_[offset] != kNil) {
+      next_[prev_[offset]] = next_[offset];
+    } else {
+      heads_[order] = next_[offset];
+    }
+    if (next_[offset] != kNil) {
+      prev_[next_[offset]] = prev_[offset];
     }
-    free_blocks_[order_]->next = (Block*)mem_;
+  }
+
+  uint64_t order_;
+  uint64_t capacity_;
+  uint64_t used_;
+
+  std::vector<uint64_t> bitmap_;
+  std::vector<uint64_t> bitmap_offsets_;
+
+  // Free lists threaded through the first unit of every free block.
+  std::vector<uint32_t> heads_;
+  std::vector<uint32_t> next_;
+  std::vector<uint32_t> prev_;
+
+  // Order of the allocated block starting at each unit.
+  std::vector<uint8_t> orders_;
+};
+
+template<class Ty_>
+class BuddySystemAllocator {
+public:
+  BuddySystemAllocator(const uint64_t count) : buddies_(count) {
+    mem_ = (Ty_*)std::calloc(buddies_.capacity(), sizeof(Ty_));
   }
 
   ~BuddySystemAllocator() {
-    for (uint64_t i = 0; i < order_ + 1; ++i) {
-      std::free(free_blocks_[i]);
-    }
-    std::free(free_blocks_);
     std::free(mem_);
   }
 
   Ty_* alloc(uint64_t count) {
-    if (count == 0 || count > capacity_) {
-      return nullptr;
-    }
-    uint64_t order = log_2(count) + (count_bits(count) == 1 ? 0 : 1);
-    Block* b = alloc_block(order);
-    return b ? block_to_ptr(b) : nullptr;
+    uint64_t offset = buddies_.alloc(count);
+    return offset == BuddySystem::kInvalid ? nullptr : mem_ + offset;
   }
 
   void release(Ty_* mem) {
-    if (in_range(mem)) {
-      Block* block = ptr_to_block(mem);
-      release(block);
+    if (mem >= mem_ && mem < mem_ + buddies_.capacity()) {
+      buddies_.release(mem - mem_);
     }
   }
 
   void clear() {
-    for (uint64_t i = 0; i < order_ + 1; ++i) {
-      free_blocks_[i]->next = nullptr;
-    }
-    free_blocks_[order_]->next = (Block*)mem_;
-    ((Block*)mem_)->order = order_;
-    ((Block*)mem_)->next = nullptr;
+    buddies_.clear();
   }
 
   uint64_t capacity() {
-    return capacity_;
+    return buddies_.capacity();
   }
+
+private:
+  BuddySystem buddies_;
+  Ty_* mem_;
 };
 
-#endif /*BUDDY_SYSTEM_ALLOCATOR__H*/
\ No newline at end of file
+#endif /*BUDDY_SYSTEM_ALLOCATOR__H*/
@@ -0,0 +1,265 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <cubez/cubez.h>
+#include "coro_scheduler.h"
+#include "defs.h"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+extern CoroScheduler* coro_scheduler;
+
+// The buffer is Dmitry Vyukov's bounded MPMC queue: every cell carries a
+// sequence number that tells producers and consumers whether it is free or
+// full for their lap around the ring, so the hot path is a single CAS.
+//
+// Coroutines that cannot make progress are parked on the waiter lists under
+// mu. "waiting" counts the parked coroutines so that the hot path only takes
+// the lock when somebody actually needs to be woken up.
+struct qbChannel_ {
+  struct Cell {
+    std::atomic<size_t> sequence;
+    qbVar value;
+  };
+
+  Cell* buffer;
+  size_t mask;
+
+  alignas(64) std::atomic<size_t> enqueue_pos;
+  alignas(64) std::atomic<size_t> dequeue_pos;
+
+  alignas(64) std::atomic<size_t> waiting;
+  std::mutex mu;
+
+  // Senders carry the value they are sending in qbCoro_::transfer. Receivers
+  // get the received value in the same field.
+  std::deque<qbCoro> senders;
+  std::deque<qbCoro> receivers;
+};
+
+namespace {
+
+bool channel_push(qbChannel channel, qbVar var) {
+  qbChannel_::Cell* cell;
+  size_t pos = channel->enqueue_pos.load(std::memory_order_relaxed);
+  for (;;) {
+    cell = &channel->buffer[pos & channel->mask];
+    size_t seq = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (channel->enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                                     std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = channel->enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+  cell->value = var;
+  cell->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool channel_pop(qbChannel channel, qbVar* var) {
+  qbChannel_::Cell* cell;
+  size_t pos = channel->dequeue_pos.load(std::memory_order_relaxed);
+  for (;;) {
+    cell = &channel->buffer[pos & channel->mask];
+    size_t seq = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (channel->dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                                     std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = channel->dequeue_pos.load(std::memory_order_relaxed);
+    }
+  }
+  *var = cell->value;
+  cell->sequence.store(pos + channel->mask + 1, std::memory_order_release);
+  return true;
+}
+
+// Completes as many parked sends and receives as the buffer allows and wakes
+// up their coroutines. Must be called with mu held.
+void channel_pump(qbChannel channel) {
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    if (!channel->senders.empty() &&
+        channel_push(channel, channel->senders.front()->transfer)) {
+      qbCoro sender = channel->senders.front();
+      channel->senders.pop_front();
+      --channel->waiting;
+      coro_scheduler->wake(sender);
+      progress = true;
+    }
+    if (!channel->receivers.empty() &&
+        channel_pop(channel, &channel->receivers.front()->transfer)) {
+      qbCoro receiver = channel->receivers.front();
+      channel->receivers.pop_front();
+      --channel->waiting;
+      coro_scheduler->wake(receiver);
+      progress = true;
+    }
+  }
+}
+
+// Called after a successful push or pop on the hot path. The fence pairs with
+// the one in the park functions: either the parking coroutine sees the new
+// state of the buffer or this sees the parked coroutine.
+void channel_notify(qbChannel channel) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (channel->waiting.load(std::memory_order_relaxed) == 0) {
+    return;
+  }
+  std::lock_guard<decltype(channel->mu)> l(channel->mu);
+  channel_pump(channel);
+}
+
+bool park_send(qbCoro coro, void* arg) {
+  qbChannel channel = (qbChannel)arg;
+  std::lock_guard<decltype(channel->mu)> l(channel->mu);
+  ++channel->waiting;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  if (channel_push(channel, coro->transfer)) {
+    --channel->waiting;
+    channel_pump(channel);
+    return false;
+  }
+  channel->senders.push_back(coro);
+  channel_pump(channel);
+  return true;
+}
+
+bool park_receive(qbCoro coro, void* arg) {
+  qbChannel channel = (qbChannel)arg;
+  std::lock_guard<decltype(channel->mu)> l(channel->mu);
+  ++channel->waiting;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  if (channel_pop(channel, &coro->transfer)) {
+    --channel->waiting;
+    channel_pump(channel);
+    return false;
+  }
+  channel->receivers.push_back(coro);
+  channel_pump(channel);
+  return true;
+}
+
+// Used when the caller cannot be suspended.
+void channel_backoff() {
+  if (coro_this()) {
+    qb_coro_yield(qbFuture);
+  } else {
+    std::this_thread::yield();
+  }
+}
+
+}  // namespace
+
+qbChannel qb_channel_create(size_t capacity) {
+  size_t size = 2;
+  while (size < capacity) {
+    size <<= 1;
+  }
+
+  qbChannel channel = new qbChannel_();
+  channel->buffer = new qbChannel_::Cell[size];
+  channel->mask = size - 1;
+  for (size_t i = 0; i < size; ++i) {
+    channel->buffer[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  channel->enqueue_pos = 0;
+  channel->dequeue_pos = 0;
+  channel->waiting = 0;
+  return channel;
+}
+
+qbResult qb_channel_destroy(qbChannel* channel) {
+  if (!*channel) {
+    return QB_ERROR_NULL_POINTER;
+  }
+  delete[] (*channel)->buffer;
+  delete *channel;
+  *channel = nullptr;
+  return QB_OK;
+}
+
+bool qb_channel_trysend(qbChannel channel, qbVar var) {
+  if (!channel_push(channel, var)) {
+    return false;
+  }
+  channel_notify(channel);
+  return true;
+}
+
+bool qb_channel_tryreceive(qbChannel channel, qbVar* var) {
+  if (!channel_pop(channel, var)) {
+    return false;
+  }
+  channel_notify(channel);
+  return true;
+}
+
+void qb_channel_send(qbChannel channel, qbVar var) {
+  if (qb_channel_trysend(channel, var)) {
+    return;
+  }
+
+  // The value is pushed by whoever wakes this coroutine up.
+  qbCoro self = coro_scheduler->running();
+  if (self) {
+    self->transfer = var;
+    if (coro_scheduler->suspend(park_send, channel)) {
+      return;
+    }
+  }
+
+  while (!qb_channel_trysend(channel, var)) {
+    channel_backoff();
+  }
+}
+
+qbVar qb_channel_receive(qbChannel channel) {
+  qbVar ret;
+  if (qb_channel_tryreceive(channel, &ret)) {
+    return ret;
+  }
+
+  // The value is popped by whoever wakes this coroutine up.
+  qbCoro self = coro_scheduler->running();
+  if (self && coro_scheduler->suspend(park_receive, channel)) {
+    return self->transfer;
+  }
+
+  while (!qb_channel_tryreceive(channel, &ret)) {
+    channel_backoff();
+  }
+  return ret;
+}
@@ -22,12 +22,27 @@
 
 #include <omp.h>
 
+namespace {
+
+thread_local Component* deserializing_ = nullptr;
+
+}  // namespace
+
 Component::Component(qbId id, size_t instance_size, bool is_shared, qbComponentType type)
-    : id_(id), instances_(instance_size), is_shared_(is_shared), type_(type) {}
+    : id_(id), instances_(instance_size),
+      memory_(QB_MEMORY_TAG_COMPONENT, id),
+      is_shared_(is_shared), type_(type) {
+  if (type_ == qbComponentType::QB_COMPONENT_TYPE_POINTER) {
+    pool_.reset(new PointerPool);
+  }
+  UpdateMemory();
+}
 
 Component* Component::Clone() {
   Component* ret = new Component(id_, instances_.element_size(), is_shared_, type_);
-  ret->instances_ = instances_;
+  ret->instances_.share(instances_);
+  ret->pool_ = pool_;
+  ret->UpdateMemory();
   return ret;
 }
 
@@ -44,6 +59,7 @@ void Component::Merge(const Component& other) {
 
 qbResult Component::Create(qbId entity, void* value) {
   instances_.insert(entity, value);
+  UpdateMemory();
   return QB_OK;
 }
 
@@ -55,13 +71,29 @@ qbResult Component::Destroy(qbId entity) {
         qb_entity_destroy(entities[i]);
       }
     } else if (type_ == qbComponentType::QB_COMPONENT_TYPE_POINTER) {
-      free(*(void**)instances_[entity]);
+      PointerPool::Release(*(void**)instances_[entity]);
     }
     instances_.erase(entity);
+    UpdateMemory();
   }
   return QB_OK;
 }
 
+void* Component::Alloc(size_t size) {
+  if (!pool_) {
+    return nullptr;
+  }
+  return pool_->Alloc(size);
+}
+
+Component* Component::Deserializing() {
+  return deserializing_;
+}
+
+void Component::SetDeserializing(Component* component) {
+  deserializing_ = component;
+}
+
 void* Component::operator[](qbId entity) {
   return instances_[entity];
 }
@@ -91,7 +123,24 @@ size_t Component::ElementSize() const {
 }
 
 void Component::Reserve(size_t count) {
-  return instances_.reserve(count);
+  instances_.reserve(count);
+  UpdateMemory();
+}
+
+size_t Component::Shrink(size_t max_blocks) {
+  Lock(true);
+  size_t freed = instances_.shrink(max_blocks);
+  Unlock(true);
+  UpdateMemory();
+  return freed;
+}
+
+bool Component::ShouldShrink() const {
+  return instances_.should_shrink();
+}
+
+void Component::UpdateMemory() {
+  memory_.Set(instances_.reserved_bytes(), instances_.used_bytes());
 }
 
 qbId Component::Id() const {
@@ -20,9 +20,12 @@
 #define COMPONENT__H
 
 #include <cubez/cubez.h>
+#include "memory_stats.h"
+#include "pointer_pool.h"
 #include "sparse_map.h"
 #include "sparse_set.h"
 
+#include <memory>
 #include <shared_mutex>
 
 // Not thread-safe. 
@@ -34,12 +37,24 @@ class Component {
 
   Component(qbId id, size_t instance_size, bool is_shared, qbComponentType type);
 
+  // Returns a copy that shares blocks of instances with this component until
+  // either one mutates them.
   Component* Clone();
   void Merge(const Component& other);
 
   qbResult Create(qbId entity, void* value);
   qbResult Destroy(qbId entity);
 
+  // Allocates a payload for a pointer component. Destroying the instance
+  // returns it to the pool, while payloads from malloc are freed.
+  void* Alloc(size_t size);
+
+  // The component whose instances this thread is deserializing, or null.
+  // qb_component_alloc allocates from it so that loaded payloads belong to the
+  // scene being loaded.
+  static Component* Deserializing();
+  static void SetDeserializing(Component* component);
+
   void* operator[](qbId entity);
   const void* operator[](qbId entity) const;
   const void* at(qbId entity) const;
@@ -50,6 +65,11 @@ class Component {
   size_t Size() const;
   void Reserve(size_t count);
 
+  // Frees at most max_blocks blocks of storage left over after instances were
+  // destroyed. Returns the number of blocks freed.
+  size_t Shrink(size_t max_blocks);
+  bool ShouldShrink() const;
+
   size_t ElementSize() const;
   qbId Id() const;
 
@@ -63,12 +83,22 @@ class Component {
   const_iterator end() const;
 
  private:
+  void UpdateMemory();
+
   qbId id_;
   InstanceMap instances_;
+  MemoryAccount memory_;
 
   std::shared_mutex mu_;
   const bool is_shared_;
   qbComponentType type_;
+
+  // Shared with clones, which hold the same payloads.
+  std::shared_ptr<PointerPool> pool_;
+
+  friend class SaveFile;
+  friend class StateDelta;
+  friend struct qbReplicator_;
 };
 
 #endif
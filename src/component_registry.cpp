@@ -66,6 +66,13 @@ Component* ComponentRegistry::Create(qbComponent component) const {
   return new Component(component, attr.data_size, attr.is_shared, attr.type);
 }
 
+const qbComponentAttr_* ComponentRegistry::Find(qbComponent component) {
+  if (component < 0 || !components_defs_.has(component)) {
+    return nullptr;
+  }
+  return &components_defs_[component];
+}
+
 qbResult ComponentRegistry::SubcsribeToOnCreate(qbSystem system,
                                                 qbComponent component) {
   Create(component);
@@ -36,6 +36,10 @@ public:
   qbResult Create(qbComponent* component, qbComponentAttr attr);
   Component* Create(qbComponent component) const;
 
+  // Returns the attributes the component was created with or nullptr if it
+  // does not exist.
+  const qbComponentAttr_* Find(qbComponent component);
+
   qbResult SubcsribeToOnCreate(qbSystem system, qbComponent component);
   qbResult SubcsribeToOnDestroy(qbSystem system, qbComponent component);
 
@@ -0,0 +1,518 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "connection.h"
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+namespace {
+
+const size_t kDefaultMtu = 1200;
+const size_t kPacketHeaderSize = 9;
+const size_t kFragmentHeaderSize = 9;
+
+// The largest MTU whose fragment sizes fit in the u16 size field.
+const size_t kMaxMtu = 0xFFFF + kPacketHeaderSize + kFragmentHeaderSize;
+
+// The packet acks the peer's packets.
+const uint8_t kHasAck = 0x1;
+
+const double kMinRto = 0.05;
+const double kMaxRto = 1.0;
+
+bool sequence_greater(uint16_t a, uint16_t b) {
+  return ((a > b) && (a - b <= 32768)) || ((a < b) && (b - a > 32768));
+}
+
+void write_u8(std::vector<uint8_t>* out, uint8_t v) {
+  out->push_back(v);
+}
+
+void write_u16(std::vector<uint8_t>* out, uint16_t v) {
+  out->push_back((uint8_t)v);
+  out->push_back((uint8_t)(v >> 8));
+}
+
+void write_u32(std::vector<uint8_t>* out, uint32_t v) {
+  write_u16(out, (uint16_t)v);
+  write_u16(out, (uint16_t)(v >> 16));
+}
+
+uint16_t read_u16(const uint8_t* in) {
+  return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+uint32_t read_u32(const uint8_t* in) {
+  return (uint32_t)read_u16(in) | ((uint32_t)read_u16(in + 2) << 16);
+}
+
+}  // namespace
+
+Connection::Connection(qbConnectionAttr attr) : attr_(*attr) {
+  if (attr_.mtu == 0) {
+    attr_.mtu = kDefaultMtu;
+  }
+
+  channels_.resize(attr_.channel_count);
+  for (size_t i = 0; i < attr_.channel_count; ++i) {
+    Channel& channel = channels_[i];
+    channel.type = attr_.channels[i];
+    if (channel.type == QB_CHANNEL_UNRELIABLE) {
+      channel.received.resize(kUnreliableWindow);
+    } else {
+      channel.in_flight.resize(kMessageWindow);
+      channel.received.resize(kMessageWindow);
+    }
+  }
+  attr_.channels = nullptr;
+
+  sent_.resize(kPacketWindow);
+  received_.resize(kPacketWindow);
+  stats_ = {};
+  stats_.rtt = 0.0;
+}
+
+size_t Connection::FragmentSize() const {
+  return attr_.mtu - kPacketHeaderSize - kFragmentHeaderSize;
+}
+
+void Connection::InitMessage(OutMessage* message, uint16_t id,
+                             std::vector<uint8_t> data) {
+  size_t fragment_size = FragmentSize();
+  message->valid = true;
+  message->id = id;
+  message->fragment_count =
+    (uint16_t)std::max<size_t>(1, (data.size() + fragment_size - 1) / fragment_size);
+  message->acked_count = 0;
+  message->acked.assign(message->fragment_count, false);
+  message->sent.assign(message->fragment_count, -1.0);
+  message->data = std::move(data);
+}
+
+qbResult Connection::Send(uint8_t channel_id, const void* data, size_t size) {
+  if (channel_id >= channels_.size()) {
+    return QB_ERROR_NOT_FOUND;
+  }
+  if (size > kMaxFragments * FragmentSize()) {
+    return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+  }
+
+  Channel& channel = channels_[channel_id];
+  std::vector<uint8_t> bytes((const uint8_t*)data, (const uint8_t*)data + size);
+  if (channel.type == QB_CHANNEL_UNRELIABLE) {
+    channel.queued.emplace_back();
+    InitMessage(&channel.queued.back(), channel.next_send_id++, std::move(bytes));
+  } else {
+    channel.backlog.push_back(std::move(bytes));
+  }
+  return QB_OK;
+}
+
+void Connection::OnAck(uint16_t sequence) {
+  SentPacket& packet = sent_[sequence % kPacketWindow];
+  if (!packet.valid || packet.sequence != sequence || packet.acked) {
+    return;
+  }
+  packet.acked = true;
+  ++stats_.packets_acked;
+
+  double sample = time_ - packet.time;
+  if (!has_rtt_) {
+    stats_.rtt = sample;
+    rttvar_ = sample / 2.0;
+    has_rtt_ = true;
+  } else {
+    rttvar_ = 0.75 * rttvar_ + 0.25 * fabs(stats_.rtt - sample);
+    stats_.rtt = 0.875 * stats_.rtt + 0.125 * sample;
+  }
+  rto_ = std::min(kMaxRto, std::max(kMinRto, stats_.rtt + 4.0 * rttvar_));
+
+  for (const FragmentRef& ref : packet.fragments) {
+    Channel& channel = channels_[ref.channel];
+    OutMessage& message = channel.in_flight[ref.id % kMessageWindow];
+    if (!message.valid || message.id != ref.id || message.acked[ref.fragment]) {
+      continue;
+    }
+    message.acked[ref.fragment] = true;
+    if (++message.acked_count == message.fragment_count) {
+      message.valid = false;
+      message.data.clear();
+      message.data.shrink_to_fit();
+    }
+  }
+  packet.fragments.clear();
+
+  for (Channel& channel : channels_) {
+    if (channel.type == QB_CHANNEL_UNRELIABLE) {
+      continue;
+    }
+    while (channel.oldest_unacked != channel.next_send_id &&
+           !channel.in_flight[channel.oldest_unacked % kMessageWindow].valid) {
+      ++channel.oldest_unacked;
+    }
+  }
+}
+
+void Connection::Deliver(uint8_t channel, InMessage* message) {
+  Delivered delivered;
+  delivered.channel = channel;
+  for (const auto& fragment : message->fragments) {
+    delivered.data.insert(delivered.data.end(), fragment.begin(), fragment.end());
+  }
+  inbox_.push_back(std::move(delivered));
+
+  message->delivered = true;
+  message->fragments.clear();
+}
+
+void Connection::OnFragment(uint8_t channel_id, uint16_t id, uint16_t fragment,
+                            uint16_t fragment_count, const uint8_t* data,
+                            size_t size) {
+  Channel& channel = channels_[channel_id];
+  bool reliable = channel.type != QB_CHANNEL_UNRELIABLE;
+  uint16_t window = reliable ? kMessageWindow : kUnreliableWindow;
+
+  // Reliable messages before the window were delivered already, ones past it
+  // cannot have been sent yet.
+  if (reliable && (uint16_t)(id - channel.next_receive_id) >= window) {
+    return;
+  }
+
+  InMessage& message = channel.received[id % window];
+  if (!message.valid || message.id != id) {
+    if (!reliable && message.valid && sequence_greater(message.id, id)) {
+      return;
+    }
+    message.valid = true;
+    message.complete = false;
+    message.delivered = false;
+    message.id = id;
+    message.fragment_count = fragment_count;
+    message.received_count = 0;
+    message.fragments.assign(fragment_count, {});
+  }
+  if (message.complete || message.fragment_count != fragment_count ||
+      !message.fragments[fragment].empty()) {
+    return;
+  }
+
+  // Only an empty message has an empty fragment, and it is complete once
+  // received.
+  message.fragments[fragment].assign(data, data + size);
+  if (++message.received_count < fragment_count) {
+    return;
+  }
+  message.complete = true;
+
+  if (channel.type != QB_CHANNEL_RELIABLE_ORDERED) {
+    Deliver(channel_id, &message);
+  }
+  if (!reliable) {
+    if (sequence_greater(id, channel.next_receive_id)) {
+      channel.next_receive_id = id;
+    }
+    return;
+  }
+
+  // Slide the window over the delivered messages, delivering ordered ones as
+  // they become contiguous.
+  for (;;) {
+    InMessage& next = channel.received[channel.next_receive_id % window];
+    if (!next.valid || next.id != channel.next_receive_id || !next.complete) {
+      break;
+    }
+    if (!next.delivered) {
+      Deliver(channel_id, &next);
+    }
+    next.valid = false;
+    ++channel.next_receive_id;
+  }
+}
+
+qbResult Connection::Receive(const uint8_t* packet, size_t size) {
+  if (size < kPacketHeaderSize) {
+    return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+  }
+
+  uint16_t sequence = read_u16(packet);
+  uint8_t flags = packet[2];
+  uint16_t ack = read_u16(packet + 3);
+  uint32_t ack_bits = read_u32(packet + 5);
+
+  // Drop duplicates and packets too old to be acked.
+  if (has_received_) {
+    if ((uint16_t)(remote_sequence_ - sequence) >= kPacketWindow &&
+        !sequence_greater(sequence, remote_sequence_)) {
+      return QB_OK;
+    }
+    ReceivedPacket& slot = received_[sequence % kPacketWindow];
+    if (slot.valid && slot.sequence == sequence) {
+      ack_owed_ = true;
+      return QB_OK;
+    }
+  }
+
+  // Check the fragments before acting on any of the packet.
+  const uint8_t* end = packet + size;
+  for (const uint8_t* p = packet + kPacketHeaderSize; p < end;) {
+    if ((size_t)(end - p) < kFragmentHeaderSize) {
+      return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+    }
+    uint8_t channel = p[0];
+    uint16_t fragment = read_u16(p + 3);
+    uint16_t fragment_count = read_u16(p + 5);
+    uint16_t fragment_size = read_u16(p + 7);
+    if (channel >= channels_.size() || fragment_count == 0 ||
+        fragment_count > kMaxFragments || fragment >= fragment_count ||
+        (size_t)(end - p) < kFragmentHeaderSize + fragment_size) {
+      return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+    }
+    p += kFragmentHeaderSize + fragment_size;
+  }
+
+  if (!has_received_ || sequence_greater(sequence, remote_sequence_)) {
+    // Forget the packets that slid out of the window.
+    for (uint16_t s = remote_sequence_ + 1; has_received_ && s != sequence; ++s) {
+      received_[s % kPacketWindow].valid = false;
+    }
+    remote_sequence_ = sequence;
+    has_received_ = true;
+  }
+  received_[sequence % kPacketWindow].valid = true;
+  received_[sequence % kPacketWindow].sequence = sequence;
+  ack_owed_ = true;
+  ++unacked_received_;
+  ++stats_.packets_received;
+
+  if (flags & kHasAck) {
+    acks_.push_back(ack);
+    for (uint16_t i = 0; i < 32; ++i) {
+      if (ack_bits & (1u << i)) {
+        acks_.push_back((uint16_t)(ack - i - 1));
+      }
+    }
+  }
+
+  for (const uint8_t* p = packet + kPacketHeaderSize; p < end;) {
+    uint16_t fragment_size = read_u16(p + 7);
+    OnFragment(p[0], read_u16(p + 1), read_u16(p + 3), read_u16(p + 5),
+               p + kFragmentHeaderSize, fragment_size);
+    p += kFragmentHeaderSize + fragment_size;
+  }
+
+  // The next packet could no longer ack the oldest of these, so ack them now
+  // rather than have the peer resend them. Leaves a packet's worth of slack
+  // for reordering.
+  if (unacked_received_ >= kAckedPackets - 1) {
+    BeginPacket();
+    return FlushPacket();
+  }
+  return QB_OK;
+}
+
+void Connection::BeginPacket() {
+  packet_.clear();
+  packet_fragments_.clear();
+  packet_fragment_count_ = 0;
+
+  uint32_t ack_bits = 0;
+  if (has_received_) {
+    for (uint16_t i = 0; i < 32; ++i) {
+      uint16_t s = (uint16_t)(remote_sequence_ - i - 1);
+      const ReceivedPacket& slot = received_[s % kPacketWindow];
+      if (slot.valid && slot.sequence == s) {
+        ack_bits |= 1u << i;
+      }
+    }
+  }
+
+  write_u16(&packet_, sequence_);
+  write_u8(&packet_, has_received_ ? kHasAck : 0);
+  write_u16(&packet_, remote_sequence_);
+  write_u32(&packet_, ack_bits);
+}
+
+qbResult Connection::FlushPacket() {
+  SentPacket& sent = sent_[sequence_ % kPacketWindow];
+  if (sent.valid && !sent.acked) {
+    ++stats_.packets_lost;
+  }
+  sent.valid = true;
+  sent.acked = false;
+  sent.sequence = sequence_;
+  sent.time = time_;
+  sent.fragments.swap(packet_fragments_);
+  ++sequence_;
+
+  ++stats_.packets_sent;
+  ack_owed_ = false;
+  unacked_received_ = 0;
+  packet_sent_ = true;
+
+  int32_t res;
+  if (attr_.send) {
+    res = attr_.send(packet_.data(), packet_.size(), attr_.state);
+  } else {
+    res = qb_socket_sendto(attr_.socket, (const char*)packet_.data(),
+                           packet_.size(), 0, &attr_.endpoint);
+  }
+
+  BeginPacket();
+  return res < 0 ? QB_ERROR_SOCKET : QB_OK;
+}
+
+void Connection::Write(uint8_t channel, OutMessage* message, uint16_t fragment) {
+  size_t fragment_size = FragmentSize();
+  size_t offset = fragment * fragment_size;
+  size_t size = std::min(fragment_size, message->data.size() - offset);
+
+  if (packet_.size() + kFragmentHeaderSize + size > attr_.mtu) {
+    FlushPacket();
+  }
+
+  write_u8(&packet_, channel);
+  write_u16(&packet_, message->id);
+  write_u16(&packet_, fragment);
+  write_u16(&packet_, message->fragment_count);
+  write_u16(&packet_, (uint16_t)size);
+  packet_.insert(packet_.end(), message->data.begin() + offset,
+                 message->data.begin() + offset + size);
+  ++packet_fragment_count_;
+
+  if (channels_[channel].type != QB_CHANNEL_UNRELIABLE) {
+    packet_fragments_.push_back({ channel, message->id, fragment });
+  }
+}
+
+qbResult Connection::Update(double time) {
+  time_ = time;
+  packet_sent_ = false;
+
+  for (uint16_t ack : acks_) {
+    OnAck(ack);
+  }
+  acks_.clear();
+  BeginPacket();
+
+  for (uint8_t c = 0; c < channels_.size(); ++c) {
+    Channel& channel = channels_[c];
+    if (channel.type == QB_CHANNEL_UNRELIABLE) {
+      while (!channel.queued.empty()) {
+        OutMessage& message = channel.queued.front();
+        for (uint16_t f = 0; f < message.fragment_count; ++f) {
+          Write(c, &message, f);
+        }
+        channel.queued.pop_front();
+      }
+      continue;
+    }
+
+    // Move waiting messages into the window.
+    while (!channel.backlog.empty() &&
+           (uint16_t)(channel.next_send_id - channel.oldest_unacked) < kMessageWindow) {
+      uint16_t id = channel.next_send_id++;
+      InitMessage(&channel.in_flight[id % kMessageWindow], id,
+                  std::move(channel.backlog.front()));
+      channel.backlog.pop_front();
+    }
+
+    for (uint16_t id = channel.oldest_unacked; id != channel.next_send_id; ++id) {
+      OutMessage& message = channel.in_flight[id % kMessageWindow];
+      if (!message.valid) {
+        continue;
+      }
+      for (uint16_t f = 0; f < message.fragment_count; ++f) {
+        if (message.acked[f]) {
+          continue;
+        }
+        if (message.sent[f] >= 0.0) {
+          if (time - message.sent[f] < rto_) {
+            continue;
+          }
+          ++stats_.fragments_resent;
+        }
+        message.sent[f] = time;
+        Write(c, &message, f);
+      }
+    }
+  }
+
+  if (packet_fragment_count_ > 0 || (ack_owed_ && !packet_sent_)) {
+    return FlushPacket();
+  }
+  return QB_OK;
+}
+
+bool Connection::Recv(qbMessage message) {
+  if (inbox_.empty()) {
+    return false;
+  }
+  Delivered& delivered = inbox_.front();
+  current_.swap(delivered.data);
+  message->channel = delivered.channel;
+  message->data = current_.data();
+  message->size = current_.size();
+  inbox_.pop_front();
+  return true;
+}
+
+struct qbConnection_ {
+  Connection connection;
+};
+
+qbResult qb_connection_create(qbConnection* connection, qbConnectionAttr attr) {
+  if (attr->channel_count > QB_CONNECTION_MAX_CHANNELS) {
+    return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+  }
+  if (attr->mtu != 0 && (attr->mtu < 64 || attr->mtu > kMaxMtu)) {
+    return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+  }
+  *connection = new qbConnection_{ Connection(attr) };
+  return QB_OK;
+}
+
+qbResult qb_connection_destroy(qbConnection* connection) {
+  delete *connection;
+  *connection = nullptr;
+  return QB_OK;
+}
+
+qbResult qb_connection_send(qbConnection connection, uint8_t channel,
+                            const void* data, size_t size) {
+  return connection->connection.Send(channel, data, size);
+}
+
+qbResult qb_connection_receive(qbConnection connection,
+                               const uint8_t* packet, size_t size) {
+  return connection->connection.Receive(packet, size);
+}
+
+qbResult qb_connection_update(qbConnection connection, double time) {
+  return connection->connection.Update(time);
+}
+
+bool qb_connection_recv(qbConnection connection, qbMessage message) {
+  return connection->connection.Recv(message);
+}
+
+void qb_connection_stats(qbConnection connection, qbConnectionStats stats) {
+  *stats = connection->connection.Stats();
+}
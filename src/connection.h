@@ -0,0 +1,178 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef CONNECTION__H
+#define CONNECTION__H
+
+#include <cubez/network.h>
+
+#include <deque>
+#include <vector>
+
+// Implements qbConnection.
+//
+// A packet is a header followed by fragments:
+//
+//   u16 sequence, u8 flags, u16 ack, u32 ack bits
+//   { u8 channel, u16 message id, u16 fragment, u16 fragment count,
+//     u16 size, size bytes }*
+//
+// Bit n of the ack bits acks the packet "ack - n - 1", so a packet acks at
+// most kAckedPackets packets. An ack is sent without waiting for the update
+// once nearly that many have been received since the last packet sent. Each
+// channel numbers its messages. Reliable channels keep at most kMessageWindow
+// messages in flight, the rest wait in a backlog. A fragment is resent once
+// the retransmission timeout passes without the packet that carried it being
+// acked.
+class Connection {
+public:
+  explicit Connection(qbConnectionAttr attr);
+
+  qbResult Send(uint8_t channel, const void* data, size_t size);
+  qbResult Receive(const uint8_t* packet, size_t size);
+  qbResult Update(double time);
+  bool Recv(qbMessage message);
+
+  const qbConnectionStats_& Stats() const {
+    return stats_;
+  }
+
+private:
+  static const uint16_t kPacketWindow = 1024;
+  static const uint16_t kMessageWindow = 1024;
+  static const uint16_t kUnreliableWindow = 256;
+  static const uint16_t kMaxFragments = 1024;
+  static const uint16_t kAckedPackets = 33;
+
+  struct FragmentRef {
+    uint8_t channel;
+    uint16_t id;
+    uint16_t fragment;
+  };
+
+  struct SentPacket {
+    bool valid = false;
+    bool acked = false;
+    uint16_t sequence;
+    double time;
+    std::vector<FragmentRef> fragments;
+  };
+
+  struct ReceivedPacket {
+    bool valid = false;
+    uint16_t sequence;
+  };
+
+  struct OutMessage {
+    bool valid = false;
+    uint16_t id;
+    std::vector<uint8_t> data;
+    uint16_t fragment_count;
+    uint16_t acked_count;
+    std::vector<bool> acked;
+
+    // When each fragment was last sent, negative if never.
+    std::vector<double> sent;
+  };
+
+  struct InMessage {
+    bool valid = false;
+    bool complete;
+    bool delivered;
+    uint16_t id;
+    uint16_t fragment_count;
+    uint16_t received_count;
+    std::vector<std::vector<uint8_t>> fragments;
+  };
+
+  struct Channel {
+    qbChannelType type;
+
+    uint16_t next_send_id = 0;
+
+    // Reliable: the oldest message not yet acked, the messages in flight
+    // indexed by id, and the messages waiting for the window to move.
+    uint16_t oldest_unacked = 0;
+    std::vector<OutMessage> in_flight;
+    std::deque<std::vector<uint8_t>> backlog;
+
+    // Unreliable: the messages to send on the next update.
+    std::deque<OutMessage> queued;
+
+    // Reliable: the oldest message not yet delivered. Unreliable: the newest
+    // message seen.
+    uint16_t next_receive_id = 0;
+    std::vector<InMessage> received;
+  };
+
+  struct Delivered {
+    uint8_t channel;
+    std::vector<uint8_t> data;
+  };
+
+  void InitMessage(OutMessage* message, uint16_t id, std::vector<uint8_t> data);
+  void OnAck(uint16_t sequence);
+  void OnFragment(uint8_t channel, uint16_t id, uint16_t fragment,
+                  uint16_t fragment_count, const uint8_t* data, size_t size);
+  void Deliver(uint8_t channel, InMessage* message);
+
+  // Appends a fragment to the packet being written, flushing it first if the
+  // fragment does not fit.
+  void Write(uint8_t channel, OutMessage* message, uint16_t fragment);
+  void BeginPacket();
+  qbResult FlushPacket();
+
+  size_t FragmentSize() const;
+
+  qbConnectionAttr_ attr_;
+  std::vector<Channel> channels_;
+
+  double time_ = 0.0;
+  uint16_t sequence_ = 0;
+  std::vector<SentPacket> sent_;
+
+  // Acks are applied on the next update, which times the round trip with the
+  // clock of the updates.
+  std::vector<uint16_t> acks_;
+
+  bool has_received_ = false;
+  bool ack_owed_ = false;
+
+  // Packets received since the last packet sent.
+  uint16_t unacked_received_ = 0;
+  uint16_t remote_sequence_ = 0;
+  std::vector<ReceivedPacket> received_;
+
+  // Retransmission timeout, see RFC 6298.
+  bool has_rtt_ = false;
+  double rttvar_ = 0.0;
+  double rto_ = 0.2;
+
+  std::vector<uint8_t> packet_;
+  std::vector<FragmentRef> packet_fragments_;
+  size_t packet_fragment_count_ = 0;
+  bool packet_sent_ = false;
+
+  std::deque<Delivered> inbox_;
+  std::vector<uint8_t> current_;
+
+  qbConnectionStats_ stats_;
+};
+
+#endif  // CONNECTION__H
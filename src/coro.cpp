@@ -26,7 +26,7 @@
 *
 * Notes:
 * * termination of a coroutine without explicit control transfer returns control
-*   to the coroutine which initialized the coro library.
+*   and the entry's return value to the coroutine that last called it.
 *
 * Todo:
 * 1. Co-routines must be integrated with any VProc/kernel-thread interface, since
@@ -50,9 +50,12 @@
 #include "coro.h"
 #include "tls.h"
 #include "ctxt.h"
+#include "coro_pool.h"
 #include <cubez/cubez.h>
 #include <cubez/common.h>
 
+#ifndef CORO_BACKEND_STACK_SWITCHING
+
 /*
 * These are thresholds used to grow and shrink the stack. They are scaled by
 * the size of various platform constants. STACK_TGROW is sized to allow
@@ -96,11 +99,13 @@ void _fix_frame_pointer(jmp_buf buf) {
 void _coro_save(Coro to, uintptr_t mark) {
   uintptr_t sp = (_stack_grows_up ? _sp_base : mark);
   size_t sz = (_stack_grows_up ? mark - _sp_base : _sp_base - mark);
-  if (to->stack_size < sz + STACK_TGROW || to->stack_size > sz - STACK_TSHRINK) {
-    size_t newsz = sz + STACK_ADJ;
-    free(to->stack_base);
-    to->stack_base = calloc(1, newsz);
-    to->stack_size = newsz;
+  if (to->stack_size < sz + STACK_TGROW || to->stack_size > sz + STACK_TSHRINK) {
+    size_t newsz = coro_pool_sizeclass(sz + STACK_ADJ);
+    if (newsz != to->stack_size) {
+      coro_pool_free(CORO_POOL_STACK, to->stack_base, to->stack_size);
+      to->stack_base = coro_pool_alloc(CORO_POOL_STACK, newsz);
+      to->stack_size = newsz;
+    }
   }
   to->stack_used = sz;
   memcpy(to->stack_base, (void *)sp, sz);
@@ -147,12 +152,10 @@ qbVar _coro_fastcall(Coro target, qbVar value) {
 */
 void _coro_enter(Coro c) {
   if (_save_and_resumed(c->ctxt)) {       /* start the coroutine; stack is empty at this point. */
-    qbVar _return;
-    _return.p = _cur;
-    _cur->start(*(qbVar*)(&_value));
+    qbVar _return = _cur->start(*(qbVar*)(&_value));
     _cur->is_done = 1;
-    /* return the exited coroutine to the exit handler */
-    _coro_fastcall(&_on_exit, _return);
+    /* hand the return value to the caller, or the exit handler if none */
+    _coro_fastcall(_cur->parent ? _cur->parent : &_on_exit, _return);
   } else {
     void* stack_top;
     _coro_save(c, (intptr_t)&stack_top);
@@ -160,8 +163,8 @@ void _coro_enter(Coro c) {
 }
 
 void _stack_init(Coro c, size_t init_size) {
-  c->stack_size = init_size;
-  c->stack_base = calloc(1, c->stack_size);
+  c->stack_size = coro_pool_sizeclass(init_size);
+  c->stack_base = coro_pool_alloc(CORO_POOL_STACK, c->stack_size);
 }
 
 #if defined(__clang__)
@@ -197,9 +200,10 @@ Coro coro_initialize(void* sp_base) {
 #endif
 
 Coro coro_new(_entry fn) {
-  Coro c = (Coro)malloc(sizeof(struct _Coro));
+  Coro c = (Coro)coro_pool_alloc(CORO_POOL_CONTEXT, sizeof(struct _Coro));
   _stack_init(c, STACK_DEFAULT);
 
+  c->parent = NULL;
   c->start = fn;
   c->is_done = 0;
   _coro_enter(c);
@@ -207,9 +211,10 @@ Coro coro_new(_entry fn) {
 }
 
 Coro coro_clone(Coro target) {
-  Coro c = (Coro)malloc(sizeof(struct _Coro));
+  Coro c = (Coro)coro_pool_alloc(CORO_POOL_CONTEXT, sizeof(struct _Coro));
   _stack_init(c, STACK_DEFAULT);
 
+  c->parent = NULL;
   c->start = target->start;
   c->is_done = 0;
   _coro_enter(c);
@@ -260,7 +265,9 @@ qbVar coro_yield(qbVar var) {
 
 void coro_free(Coro c) {
   if (c->stack_base != NULL) {
-    free((void *)c->stack_base);
+    coro_pool_free(CORO_POOL_STACK, c->stack_base, c->stack_size);
   }
-  free(c);
-}
\ No newline at end of file
+  coro_pool_free(CORO_POOL_CONTEXT, c, sizeof(struct _Coro));
+}
+
+#endif  /* CORO_BACKEND_STACK_SWITCHING */
@@ -34,6 +34,14 @@
 *
 * Refs:
 * http://www.yl.is.s.u-tokyo.ac.jp/sthreads/
+*
+* Backends:
+* The default backend copies the live stack segment in and out of a heap
+* buffer on every switch (coro.cpp). On 64-bit Linux, building with
+* -DQB_CORO_STACK_SWITCHING selects a backend that gives every coroutine its
+* own mmap'd stack with a guard page and only swaps the callee-saved registers
+* on a switch (coro_switch.cpp). With this backend, caveat 1 no longer applies
+* but a coroutine may not use more than CORO_STACK_SIZE bytes of stack.
 */
 
 #include "tls.h"
@@ -41,6 +49,23 @@
 #include <stdint.h>
 #include <cubez/cubez.h>
 
+#if defined(QB_CORO_STACK_SWITCHING) && defined(__COMPILE_AS_LINUX__) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+#define CORO_BACKEND_STACK_SWITCHING
+#endif
+
+/* true if a suspended coroutine may be resumed on a different thread */
+#ifdef CORO_BACKEND_STACK_SWITCHING
+#define CORO_MIGRATABLE 1
+#else
+#define CORO_MIGRATABLE 0
+#endif
+
+#ifndef CORO_STACK_SIZE
+/* size of the stack given to each coroutine by the stack-switching backend */
+#define CORO_STACK_SIZE (256 * 1024)
+#endif
+
 /* a coroutine handle */
 typedef struct _Coro *Coro;
 
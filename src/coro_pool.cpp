@@ -0,0 +1,177 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "coro_pool.h"
+#include "defs.h"
+#include "memory_stats.h"
+
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+namespace {
+
+// Size classes are the powers of two from 64B to 16MB. Larger blocks bypass
+// the free lists.
+const size_t kMinClassBits = 6;
+const size_t kMaxClassBits = 24;
+const size_t kClassCount = kMaxClassBits - kMinClassBits + 1;
+
+// Upper bound on the bytes a single thread keeps cached per size class. Small
+// classes may always keep at least kMinCachedBlocks.
+const size_t kMaxCachedBytes = 16 * 1024 * 1024;
+const size_t kMinCachedBlocks = 16;
+
+struct Allocator {
+  void*(*alloc)(size_t size);
+  void(*release)(void* block, size_t size);
+};
+
+void* system_alloc(size_t size) {
+  return malloc(size);
+}
+
+void system_release(void* block, size_t) {
+  free(block);
+}
+
+Allocator allocators_[CORO_POOL_TYPE_COUNT] = {
+  { system_alloc, system_release },
+  { system_alloc, system_release },
+  { system_alloc, system_release },
+};
+
+std::atomic<uint64_t> hits_[CORO_POOL_TYPE_COUNT];
+std::atomic<uint64_t> misses_[CORO_POOL_TYPE_COUNT];
+
+// Only stacks are large enough to be worth accounting for.
+void track(CoroPoolType type, int64_t reserved, int64_t used) {
+  if (type == CORO_POOL_STACK) {
+    memory_track(QB_MEMORY_TAG_CORO_STACK, reserved, used);
+  }
+}
+
+// Freed blocks are linked through their first word.
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+struct FreeList {
+  FreeBlock* head = nullptr;
+  size_t count = 0;
+};
+
+class ThreadCache {
+public:
+  ~ThreadCache() {
+    for (size_t type = 0; type < CORO_POOL_TYPE_COUNT; ++type) {
+      for (size_t c = 0; c < kClassCount; ++c) {
+        size_t size = (size_t)1 << (c + kMinClassBits);
+        FreeBlock* block = lists[type][c].head;
+        while (block) {
+          FreeBlock* next = block->next;
+          allocators_[type].release(block, size);
+          track((CoroPoolType)type, -(int64_t)size, 0);
+          block = next;
+        }
+      }
+    }
+  }
+
+  FreeList lists[CORO_POOL_TYPE_COUNT][kClassCount];
+};
+
+thread_local ThreadCache cache_;
+
+size_t class_index(size_t size) {
+  size_t bits = kMinClassBits;
+  while (((size_t)1 << bits) < size) {
+    ++bits;
+  }
+  return bits - kMinClassBits;
+}
+
+}  // namespace
+
+size_t coro_pool_sizeclass(size_t size) {
+  size_t index = class_index(size);
+  return index < kClassCount ? (size_t)1 << (index + kMinClassBits) : size;
+}
+
+void* coro_pool_alloc(CoroPoolType type, size_t size) {
+  size_t index = class_index(size);
+  if (index < kClassCount) {
+    FreeList& list = cache_.lists[type][index];
+    if (list.head) {
+      FreeBlock* block = list.head;
+      list.head = block->next;
+      --list.count;
+      hits_[type].fetch_add(1, std::memory_order_relaxed);
+      track(type, 0, (int64_t)coro_pool_sizeclass(size));
+      return block;
+    }
+  }
+
+  misses_[type].fetch_add(1, std::memory_order_relaxed);
+  size = coro_pool_sizeclass(size);
+  track(type, (int64_t)size, (int64_t)size);
+  return allocators_[type].alloc(size);
+}
+
+void coro_pool_free(CoroPoolType type, void* block, size_t size) {
+  size_t index = class_index(size);
+  size = coro_pool_sizeclass(size);
+  if (index < kClassCount) {
+    FreeList& list = cache_.lists[type][index];
+    if (list.count < kMinCachedBlocks || (list.count + 1) * size <= kMaxCachedBytes) {
+      FreeBlock* free_block = (FreeBlock*)block;
+      free_block->next = list.head;
+      list.head = free_block;
+      ++list.count;
+      track(type, 0, -(int64_t)size);
+      return;
+    }
+  }
+  track(type, -(int64_t)size, -(int64_t)size);
+  allocators_[type].release(block, size);
+}
+
+void coro_pool_setallocator(CoroPoolType type,
+                            void*(*alloc)(size_t size),
+                            void(*release)(void* block, size_t size)) {
+  allocators_[type] = { alloc, release };
+}
+
+qbCoro coro_pool_newcoro() {
+  return new (coro_pool_alloc(CORO_POOL_HANDLE, sizeof(qbCoro_))) qbCoro_();
+}
+
+void coro_pool_deletecoro(qbCoro coro) {
+  coro->~qbCoro_();
+  coro_pool_free(CORO_POOL_HANDLE, coro, sizeof(qbCoro_));
+}
+
+void coro_pool_stats(qbCoroPoolStats stats) {
+  qbPoolStats_* out[CORO_POOL_TYPE_COUNT] = {
+    &stats->handles, &stats->contexts, &stats->stacks
+  };
+  for (size_t type = 0; type < CORO_POOL_TYPE_COUNT; ++type) {
+    out[type]->hits = hits_[type].load(std::memory_order_relaxed);
+    out[type]->misses = misses_[type].load(std::memory_order_relaxed);
+  }
+}
@@ -0,0 +1,60 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef CORO_POOL__H
+#define CORO_POOL__H
+
+#include <cubez/cubez.h>
+
+// Recycles the memory behind coroutines: qbCoro handles, coroutine contexts
+// and stack buffers. Freed blocks are kept on free lists that are local to the
+// thread that freed them, bucketed into power-of-two size classes, so
+// allocating and freeing never takes a lock. A block may be freed on a
+// different thread than it was allocated on.
+
+enum CoroPoolType {
+  CORO_POOL_HANDLE,
+  CORO_POOL_CONTEXT,
+  CORO_POOL_STACK,
+  CORO_POOL_TYPE_COUNT,
+};
+
+// Returns the size of the size class that the given size falls into.
+size_t coro_pool_sizeclass(size_t size);
+
+// Returns a block of coro_pool_sizeclass(size) bytes. The contents are
+// undefined.
+void* coro_pool_alloc(CoroPoolType type, size_t size);
+
+// Returns the block to the calling thread's free list. The size must be the
+// same as the one the block was allocated with.
+void coro_pool_free(CoroPoolType type, void* block, size_t size);
+
+// Overrides how blocks of the given type are allocated from and released to
+// the system on a pool miss. Defaults to malloc and free.
+void coro_pool_setallocator(CoroPoolType type,
+                            void*(*alloc)(size_t size),
+                            void(*release)(void* block, size_t size));
+
+// Allocates and constructs a qbCoro from the pool.
+qbCoro coro_pool_newcoro();
+void coro_pool_deletecoro(qbCoro coro);
+
+void coro_pool_stats(qbCoroPoolStats stats);
+
+#endif  // CORO_POOL__H
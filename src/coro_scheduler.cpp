@@ -17,101 +17,87 @@
 */
 
 #include "coro_scheduler.h"
+#include "coro_pool.h"
 #include "defs.h"
 
+#include <cubez/utils.h>
+#include <chrono>
+#include <limits>
 #include <shared_mutex>
 
-// Potential optimizations:
-//  * make coroutines and stacks an object pool
-//  * if there are performance issues with copying large stacks, maybe put the
-//    sync_coro into its thread.
+// The scheduled coroutine running on this thread, if any.
+THREAD_LOCAL qbCoro current_coro = nullptr;
 
-CoroScheduler::CoroScheduler(size_t num_threads) {
-  thread_pool_.reset(new ThreadPool(num_threads));
-  coros_ = new SyncCoros();
-
-  sync_coro_ = qb_coro_create([](qbVar var) {
-    SyncCoros* coro_state = (SyncCoros*)var.p;
-
-    for (;;) {
-      for (qbCoro coro : coro_state->coros) {
-        qbVar ret = qb_coro_call(coro, coro->arg);
+// Index of the worker that owns this thread, or -1 if it is not a worker.
+THREAD_LOCAL int current_worker = -1;
 
-        if (coro_done(coro->main)) {
-          std::unique_lock<decltype(coro->ret_mu)> l;
-          coro->ret = ret;
-          coro_state->delete_coros.push_back(coro);
-        }
-      }
-
-      for (qbCoro coro : coro_state->delete_coros) {
-        coro_state->coros.erase(
-          std::find(coro_state->coros.begin(), coro_state->coros.end(), coro));
-      }
-      coro_state->delete_coros.resize(0);
+double now_seconds() {
+  return (double)qb_timer_query() / 1e9;
+}
 
-      {
-        std::lock_guard<decltype(coro_state->new_coros_mu)> l(coro_state->new_coros_mu);
-        for (SyncCoro& coro : coro_state->new_coros) {
-          coro.coro->main = coro_new(coro.entry);
-          coro_state->coros.push_back(coro.coro);
-        }
-        coro_state->new_coros.resize(0);
-      }
-      qb_coro_yield(qbNone);
-    }
+CoroScheduler::CoroScheduler(size_t num_threads) :
+  frame_(0), next_worker_(0), queued_(0), sleep_generation_(0), stop_(false) {
+  coros_ = new SyncCoros();
 
-    return qbNone;
-  });
+  for (size_t i = 0; i < num_threads; ++i) {
+    workers_.emplace_back(new Worker());
+    workers_.back()->pinned_count = 0;
+  }
+  for (size_t i = 0; i < num_threads; ++i) {
+    workers_[i]->thread = std::thread([this, i] { run_worker(i); });
+  }
 }
 
 CoroScheduler::~CoroScheduler() {
+  {
+    std::lock_guard<decltype(idle_mu_)> l(idle_mu_);
+    stop_ = true;
+  }
+  idle_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker->thread.join();
+  }
   delete coros_;
 }
 
 qbCoro CoroScheduler::schedule_sync(qbVar(*entry)(qbVar), qbVar var) {
-  SyncCoro coro;
-  coro.entry = entry;
-
-  qbCoro user_coro = new qbCoro_;
+  qbCoro user_coro = coro_pool_newcoro();
   user_coro->main = nullptr;
+  user_coro->entry = entry;
   user_coro->ret = qbFuture;
   user_coro->arg = var;
-  user_coro->is_async = true;
-
-  coro.coro = user_coro;
+  user_coro->is_scheduled = true;
+  user_coro->is_async = false;
+  user_coro->worker = -1;
 
   std::lock_guard<decltype(coros_->new_coros_mu)> l(coros_->new_coros_mu);
-  coros_->new_coros.push_back(coro);
+  coros_->new_coros.push_back(user_coro);
 
   return user_coro;
 }
 
 qbCoro CoroScheduler::schedule_async(qbVar(*entry)(qbVar), qbVar var) {
-  qbCoro user_coro = new qbCoro_;
+  qbCoro user_coro = coro_pool_newcoro();
+  user_coro->main = nullptr;
+  user_coro->entry = entry;
   user_coro->ret = qbFuture;
+  user_coro->arg = var;
+  user_coro->is_scheduled = true;
   user_coro->is_async = true;
+  user_coro->worker = -1;
 
-  thread_pool_->enqueue([user_coro, entry] (qbVar var) {
-    user_coro->main = coro_new(entry);
-    int is_done = false;
-    qbVar ret = qbFuture;
-    do {
-      ret = qb_coro_call(user_coro, var);
-      is_done = coro_done(user_coro->main);
-    } while (!is_done);
-
-    std::unique_lock<decltype(user_coro->ret_mu)> l;
-    user_coro->ret = ret;
-  }, var);
-
+  enqueue_async(user_coro);
   return user_coro;
 }
 
 qbVar CoroScheduler::await(qbCoro coro) {
+  if (coro->is_scheduled && suspend(park_await, coro)) {
+    return peek(coro);
+  }
+
   qbVar ret = qbFuture;
   while ((ret = peek(coro)).tag == QB_TAG_UNSET) {
-    if (coro->is_async) {
+    if (coro->is_scheduled) {
       qb_coro_yield(qbFuture);
     } else if (!coro_done(coro->main)) {
       // Calling coro_done is thread-safe with a synchronous coroutine because
@@ -128,6 +114,333 @@ qbVar CoroScheduler::peek(qbCoro coro) {
   return coro->ret;
 }
 
+bool CoroScheduler::sleep(double seconds) {
+  qbCoro self = running();
+  if (!self) {
+    return false;
+  }
+  self->wake_time = now_seconds() + seconds;
+  return suspend(park_sleep, this);
+}
+
+bool CoroScheduler::sleep_frames(uint32_t frames) {
+  qbCoro self = running();
+  if (!self) {
+    return false;
+  }
+  self->wake_frame = frame_ + frames;
+  return suspend(park_sleep_frames, this);
+}
+
+bool CoroScheduler::suspend(bool(*park)(qbCoro coro, void* arg), void* arg) {
+  qbCoro self = running();
+  if (!self) {
+    return false;
+  }
+  self->park = park;
+  self->park_arg = arg;
+  qb_coro_yield(qbFuture);
+  return true;
+}
+
+void CoroScheduler::wake(qbCoro coro) {
+  if (coro->is_async) {
+    enqueue_async(coro);
+    return;
+  }
+  std::lock_guard<decltype(coros_->new_coros_mu)> l(coros_->new_coros_mu);
+  coros_->woken.push_back(coro);
+}
+
+qbCoro CoroScheduler::create_pending() {
+  qbCoro coro = coro_pool_newcoro();
+  coro->main = nullptr;
+  coro->ret = qbFuture;
+  coro->is_scheduled = true;
+  coro->worker = -1;
+  return coro;
+}
+
+void CoroScheduler::complete(qbCoro coro, qbVar ret) {
+  finish(coro, ret);
+}
+
+qbCoro CoroScheduler::running() {
+  // A scheduled coroutine may call into an unscheduled one with qb_coro_call,
+  // which must not be suspended in its place.
+  return current_coro && coro_this() == current_coro->main ? current_coro : nullptr;
+}
+
 void CoroScheduler::run_sync() {
-  qb_coro_call(sync_coro_, qbVoid(coros_));
-}
\ No newline at end of file
+  SyncCoros* c = coros_;
+  uint64_t frame = ++frame_;
+  double now = now_seconds();
+
+  {
+    std::lock_guard<decltype(c->new_coros_mu)> l(c->new_coros_mu);
+    for (qbCoro coro : c->new_coros) {
+      coro->main = coro_new(coro->entry);
+      c->runnable.push_back(coro);
+    }
+    c->new_coros.resize(0);
+
+    c->runnable.insert(c->runnable.end(), c->woken.begin(), c->woken.end());
+    c->woken.resize(0);
+  }
+
+  while (!c->frame_sleepers.empty() && c->frame_sleepers.top().first <= frame) {
+    c->runnable.push_back(c->frame_sleepers.top().second);
+    c->frame_sleepers.pop();
+  }
+
+  while (!c->time_sleepers.empty() && c->time_sleepers.top().first <= now) {
+    c->runnable.push_back(c->time_sleepers.top().second);
+    c->time_sleepers.pop();
+  }
+
+  wake_async_sleepers(frame, now);
+
+  // Coroutines that yield while running are pushed back onto runnable for the
+  // next frame.
+  c->running.swap(c->runnable);
+  for (qbCoro coro : c->running) {
+    current_coro = coro;
+    qbVar ret = qb_coro_call(coro, coro->arg);
+    current_coro = nullptr;
+
+    after_run(coro, ret);
+  }
+  c->running.resize(0);
+}
+
+void CoroScheduler::run_worker(size_t index) {
+  Coro main = coro_initialize(&main);
+  current_worker = (int)index;
+  Worker* worker = workers_[index].get();
+
+  for (;;) {
+    qbCoro coro = next_async(index);
+    if (!coro) {
+      // The generation is read before the deadline. park_sleep pushes the
+      // sleeper before bumping the generation, so a sleeper that is missed by
+      // the deadline below is always seen as a new generation.
+      uint64_t generation;
+      {
+        std::lock_guard<decltype(idle_mu_)> l(idle_mu_);
+        generation = sleep_generation_;
+      }
+
+      double wake_time = std::numeric_limits<double>::infinity();
+      {
+        std::lock_guard<decltype(async_sleepers_.mu)> l(async_sleepers_.mu);
+        if (!async_sleepers_.time_sleepers.empty()) {
+          wake_time = async_sleepers_.time_sleepers.top().first;
+        }
+      }
+
+      {
+        std::unique_lock<decltype(idle_mu_)> l(idle_mu_);
+        auto ready = [this, worker, generation] {
+          return stop_ || queued_ > 0 || worker->pinned_count > 0 ||
+                 sleep_generation_ != generation;
+        };
+
+        if (wake_time == std::numeric_limits<double>::infinity()) {
+          idle_cv_.wait(l, ready);
+        } else {
+          idle_cv_.wait_for(l, std::chrono::duration<double>(wake_time - now_seconds()), ready);
+        }
+        if (stop_) {
+          return;
+        }
+      }
+
+      wake_async_sleepers(frame_, now_seconds());
+      continue;
+    }
+
+    if (!coro->main) {
+      coro->main = coro_new(coro->entry);
+#if !CORO_MIGRATABLE
+      coro->worker = (int)index;
+#endif
+    }
+
+    current_coro = coro;
+    qbVar ret = qb_coro_call(coro, coro->arg);
+    current_coro = nullptr;
+
+    after_run(coro, ret);
+  }
+}
+
+qbCoro CoroScheduler::next_async(size_t index) {
+  Worker* worker = workers_[index].get();
+  {
+    std::lock_guard<decltype(worker->mu)> l(worker->mu);
+    if (!worker->pinned.empty()) {
+      qbCoro coro = worker->pinned.front();
+      worker->pinned.pop_front();
+      --worker->pinned_count;
+      return coro;
+    }
+    if (!worker->queue.empty()) {
+      qbCoro coro = worker->queue.front();
+      worker->queue.pop_front();
+      --queued_;
+      return coro;
+    }
+  }
+
+  for (size_t i = 1; i < workers_.size(); ++i) {
+    Worker* victim = workers_[(index + i) % workers_.size()].get();
+    std::lock_guard<decltype(victim->mu)> l(victim->mu);
+    if (!victim->queue.empty()) {
+      qbCoro coro = victim->queue.back();
+      victim->queue.pop_back();
+      --queued_;
+      return coro;
+    }
+  }
+  return nullptr;
+}
+
+void CoroScheduler::enqueue_async(qbCoro coro) {
+  if (coro->worker >= 0) {
+    Worker* worker = workers_[coro->worker].get();
+    {
+      std::lock_guard<decltype(worker->mu)> l(worker->mu);
+      worker->pinned.push_back(coro);
+      ++worker->pinned_count;
+    }
+
+    // Only the owner can run it, so make sure the owner wakes up.
+    { std::lock_guard<decltype(idle_mu_)> l(idle_mu_); }
+    idle_cv_.notify_all();
+    return;
+  }
+
+  // Prefer the queue of the worker that is scheduling the coroutine, it is
+  // likely to have the coroutine's data in cache.
+  size_t index = current_worker >= 0
+    ? (size_t)current_worker
+    : next_worker_++ % workers_.size();
+  Worker* worker = workers_[index].get();
+  {
+    std::lock_guard<decltype(worker->mu)> l(worker->mu);
+    worker->queue.push_back(coro);
+    ++queued_;
+  }
+
+  { std::lock_guard<decltype(idle_mu_)> l(idle_mu_); }
+  idle_cv_.notify_one();
+}
+
+void CoroScheduler::wake_async_sleepers(uint64_t frame, double now) {
+  std::vector<qbCoro> woken;
+  {
+    std::lock_guard<decltype(async_sleepers_.mu)> l(async_sleepers_.mu);
+    auto& frame_sleepers = async_sleepers_.frame_sleepers;
+    while (!frame_sleepers.empty() && frame_sleepers.top().first <= frame) {
+      woken.push_back(frame_sleepers.top().second);
+      frame_sleepers.pop();
+    }
+
+    auto& time_sleepers = async_sleepers_.time_sleepers;
+    while (!time_sleepers.empty() && time_sleepers.top().first <= now) {
+      woken.push_back(time_sleepers.top().second);
+      time_sleepers.pop();
+    }
+  }
+
+  for (qbCoro coro : woken) {
+    enqueue_async(coro);
+  }
+}
+
+void CoroScheduler::after_run(qbCoro coro, qbVar ret) {
+  if (coro_done(coro->main)) {
+    finish(coro, ret);
+    return;
+  }
+
+  // The coroutine may be woken up and resumed on another thread as soon as it
+  // is parked, so it must not be touched afterwards.
+  if (coro->park) {
+    auto park = coro->park;
+    coro->park = nullptr;
+    if (park(coro, coro->park_arg)) {
+      return;
+    }
+  }
+
+  if (coro->is_async) {
+    enqueue_async(coro);
+  } else {
+    coros_->runnable.push_back(coro);
+  }
+}
+
+void CoroScheduler::finish(qbCoro coro, qbVar ret) {
+  // The stack is not needed once the coroutine returned, but the handle is
+  // kept for awaiters until qb_coro_destroy. This happens before the result
+  // is published because the handle may be destroyed as soon as it is.
+  if (coro->main) {
+    coro_free(coro->main);
+    coro->main = nullptr;
+  }
+
+  std::vector<qbCoro> waiters;
+  {
+    std::unique_lock<decltype(coro->ret_mu)> l(coro->ret_mu);
+    coro->ret = ret;
+    waiters.swap(coro->waiters);
+  }
+
+  for (qbCoro waiter : waiters) {
+    wake(waiter);
+  }
+}
+
+bool CoroScheduler::park_await(qbCoro coro, void* target) {
+  qbCoro awaited = (qbCoro)target;
+  std::unique_lock<decltype(awaited->ret_mu)> l(awaited->ret_mu);
+  if (awaited->ret.tag != QB_TAG_UNSET) {
+    return false;
+  }
+  awaited->waiters.push_back(coro);
+  return true;
+}
+
+bool CoroScheduler::park_sleep(qbCoro coro, void* scheduler) {
+  CoroScheduler* self = (CoroScheduler*)scheduler;
+  if (!coro->is_async) {
+    self->coros_->time_sleepers.push({ coro->wake_time, coro });
+    return true;
+  }
+
+  {
+    std::lock_guard<decltype(self->async_sleepers_.mu)> l(self->async_sleepers_.mu);
+    self->async_sleepers_.time_sleepers.push({ coro->wake_time, coro });
+  }
+
+  // Idle workers may be waiting for a later deadline.
+  {
+    std::lock_guard<decltype(self->idle_mu_)> l(self->idle_mu_);
+    ++self->sleep_generation_;
+  }
+  self->idle_cv_.notify_all();
+  return true;
+}
+
+bool CoroScheduler::park_sleep_frames(qbCoro coro, void* scheduler) {
+  CoroScheduler* self = (CoroScheduler*)scheduler;
+  if (!coro->is_async) {
+    self->coros_->frame_sleepers.push({ coro->wake_frame, coro });
+    return true;
+  }
+
+  std::lock_guard<decltype(self->async_sleepers_.mu)> l(self->async_sleepers_.mu);
+  self->async_sleepers_.frame_sleepers.push({ coro->wake_frame, coro });
+  return true;
+}
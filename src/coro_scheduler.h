@@ -21,13 +21,38 @@
 
 #include <cubez/cubez.h>
 
-#include "thread_pool.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <utility>
+#include <vector>
 
+// Runs the sync and async coroutines.
+//
+// Sync coroutines run on the main thread once per frame in run_sync(). Async
+// coroutines are multiplexed onto a fixed set of worker threads. Each worker
+// has its own run queue and steals from the back of the other workers' queues
+// when it runs dry.
+//
+// A coroutine only costs time when it is runnable: sleeping coroutines are
+// kept in min-heaps keyed by their wake frame or wake time, and coroutines
+// awaiting another coroutine are parked on its waiter list until it finishes.
+// A suspended coroutine is re-enqueued when it is woken up.
+//
+// With the stack-copying backend a coroutine's stack lives at a fixed address
+// of the thread that first ran it, so a started async coroutine is pinned to
+// its worker and only coroutines that have not started yet can be stolen.
 class CoroScheduler {
 public:
   CoroScheduler(size_t num_threads);
   ~CoroScheduler();
 
+  // Creates a coroutine and schedules the given function to be run on the
+  // main thread. Thread-safe.
   qbCoro schedule_sync(qbVar(*entry)(qbVar), qbVar var);
 
   // Creates a coroutine and schedules the given function to be run on a
@@ -38,25 +63,107 @@ public:
 
   qbVar peek(qbCoro coro);
 
+  // Suspends the running coroutine for at least the given time. Returns false
+  // without suspending if the caller is not a coroutine run by this scheduler.
+  bool sleep(double seconds);
+
+  // Suspends the running coroutine for the given number of frames. Returns
+  // false without suspending if the caller is not a coroutine run by this
+  // scheduler.
+  bool sleep_frames(uint32_t frames);
+
+  // Suspends the running coroutine until park(coro, arg) has run and the
+  // coroutine is woken up with wake(). The park function runs after the
+  // coroutine has yielded and may return false to resume the coroutine
+  // immediately. Returns false without suspending if the caller is not a
+  // coroutine run by this scheduler.
+  bool suspend(bool(*park)(qbCoro coro, void* arg), void* arg);
+
+  // Makes a suspended coroutine runnable again. Thread-safe.
+  void wake(qbCoro coro);
+
+  // Creates a coroutine without a body that represents an operation running
+  // outside of the scheduler. It can be awaited and peeked like any other
+  // scheduled coroutine and is done once complete() is called.
+  qbCoro create_pending();
+
+  // Sets the result of a pending coroutine and wakes up its awaiters.
+  // Thread-safe.
+  void complete(qbCoro coro, qbVar ret);
+
+  // Returns the scheduled coroutine that is running on this thread, if any.
+  qbCoro running();
+
   void run_sync();
 
 private:
-  struct SyncCoro {
-    qbVar(*entry)(qbVar);
-    qbCoro coro;
-  };
+  template<class Key_>
+  using SleepQueue = std::priority_queue<std::pair<Key_, qbCoro>,
+                                         std::vector<std::pair<Key_, qbCoro>>,
+                                         std::greater<std::pair<Key_, qbCoro>>>;
 
   struct SyncCoros {
-    std::vector<qbCoro> coros;
-    std::vector<qbCoro> delete_coros;
+    // Coroutines that run on the next call to run_sync.
+    std::vector<qbCoro> runnable;
+    std::vector<qbCoro> running;
+
+    SleepQueue<uint64_t> frame_sleepers;
+    SleepQueue<double> time_sleepers;
 
+    // Coroutines that were scheduled or woken up from any thread since the
+    // last call to run_sync. Guarded by new_coros_mu.
     std::mutex new_coros_mu;
-    std::vector<SyncCoro> new_coros;
+    std::vector<qbCoro> new_coros;
+    std::vector<qbCoro> woken;
   };
 
-  std::unique_ptr<ThreadPool> thread_pool_;
+  struct Worker {
+    std::mutex mu;
+
+    // Coroutines that any worker may run. The owner pops from the front and
+    // thieves steal from the back.
+    std::deque<qbCoro> queue;
+
+    // Coroutines that must be resumed on this worker.
+    std::deque<qbCoro> pinned;
+    std::atomic<size_t> pinned_count;
+
+    std::thread thread;
+  };
+
+  struct AsyncSleepers {
+    std::mutex mu;
+    SleepQueue<uint64_t> frame_sleepers;
+    SleepQueue<double> time_sleepers;
+  };
+
+  void run_worker(size_t index);
+  qbCoro next_async(size_t index);
+  void enqueue_async(qbCoro coro);
+  void wake_async_sleepers(uint64_t frame, double now);
+
+  // Called after a coroutine yields or returns.
+  void after_run(qbCoro coro, qbVar ret);
+  void finish(qbCoro coro, qbVar ret);
+
+  static bool park_await(qbCoro coro, void* target);
+  static bool park_sleep(qbCoro coro, void* scheduler);
+  static bool park_sleep_frames(qbCoro coro, void* scheduler);
+
   SyncCoros* coros_;
-  qbCoro sync_coro_;
+  std::atomic<uint64_t> frame_;
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<size_t> next_worker_;
+  std::atomic<size_t> queued_;
+  AsyncSleepers async_sleepers_;
+
+  // Idle workers wait on idle_cv_ until there is work, a sleeper is due or
+  // the scheduler is stopping.
+  std::mutex idle_mu_;
+  std::condition_variable idle_cv_;
+  uint64_t sleep_generation_;
+  bool stop_;
 };
 
 #endif  // CORO_SCHEDULER__H
@@ -0,0 +1,309 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+* Stack-switching coroutines for 64-bit Linux.
+*
+* Every coroutine owns a CORO_STACK_SIZE stack that is mmap'd with an
+* inaccessible guard page below it, so an overflow faults instead of silently
+* corrupting the neighbouring allocation. Pages are only committed when they
+* are touched, so idle coroutines cost little more than the pages they used.
+*
+* A switch pushes the callee-saved registers onto the current stack, stores
+* the stack pointer in the suspended coroutine, loads the stack pointer of
+* the target and pops its registers. Nothing on the stack is ever copied.
+*
+* The semantics match the stack-copying backend in coro.cpp: a coroutine that
+* returns from its entry function transfers control and its return value back
+* to the coroutine that last called it.
+*/
+
+#include "coro.h"
+
+#ifdef CORO_BACKEND_STACK_SWITCHING
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <iostream>
+#include <mutex>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "coro_pool.h"
+#include "tls.h"
+#include <cubez/cubez.h>
+#include <cubez/common.h>
+
+/* the coroutine structure */
+struct _Coro {
+  Coro parent;
+
+  /* saved stack pointer while the coroutine is suspended */
+  void* sp;
+
+  /* the value passed to the coroutine when it is resumed */
+  qbVar value;
+  _entry start;
+
+  /* lowest usable address of the stack, just above the guard page */
+  void* stack_base;
+  size_t stack_size;
+  int is_done;
+};
+
+/*
+* Saves the callee-saved registers of the running context on its stack, stores
+* the stack pointer into *from and resumes the context whose stack pointer is
+* "to".
+*/
+extern "C" void _coro_switch(void** from, void* to);
+
+#if defined(__x86_64__)
+
+/*
+* System V AMD64: rbx, rbp, r12-r15 and the control bits of MXCSR and the x87
+* control word are preserved across calls.
+*/
+__asm__(
+  ".text\n"
+  ".globl _coro_switch\n"
+  ".type _coro_switch,@function\n"
+  ".align 16\n"
+  "_coro_switch:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  subq $8, %rsp\n"
+  "  stmxcsr (%rsp)\n"
+  "  fnstcw 4(%rsp)\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq %rsi, %rsp\n"
+  "  ldmxcsr (%rsp)\n"
+  "  fldcw 4(%rsp)\n"
+  "  addq $8, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  ret\n"
+  ".size _coro_switch,.-_coro_switch\n"
+);
+
+/* number of words _coro_switch keeps on a suspended stack, excluding the
+   return address */
+#define SWITCH_FRAME_WORDS 7
+
+#elif defined(__aarch64__)
+
+/* AAPCS64: x19-x29, the link register and d8-d15 are preserved across calls. */
+__asm__(
+  ".text\n"
+  ".globl _coro_switch\n"
+  ".type _coro_switch,%function\n"
+  ".align 4\n"
+  "_coro_switch:\n"
+  "  sub sp, sp, #160\n"
+  "  stp x19, x20, [sp, #0]\n"
+  "  stp x21, x22, [sp, #16]\n"
+  "  stp x23, x24, [sp, #32]\n"
+  "  stp x25, x26, [sp, #48]\n"
+  "  stp x27, x28, [sp, #64]\n"
+  "  stp x29, x30, [sp, #80]\n"
+  "  stp d8, d9, [sp, #96]\n"
+  "  stp d10, d11, [sp, #112]\n"
+  "  stp d12, d13, [sp, #128]\n"
+  "  stp d14, d15, [sp, #144]\n"
+  "  mov x2, sp\n"
+  "  str x2, [x0]\n"
+  "  mov sp, x1\n"
+  "  ldp x19, x20, [sp, #0]\n"
+  "  ldp x21, x22, [sp, #16]\n"
+  "  ldp x23, x24, [sp, #32]\n"
+  "  ldp x25, x26, [sp, #48]\n"
+  "  ldp x27, x28, [sp, #64]\n"
+  "  ldp x29, x30, [sp, #80]\n"
+  "  ldp d8, d9, [sp, #96]\n"
+  "  ldp d10, d11, [sp, #112]\n"
+  "  ldp d12, d13, [sp, #128]\n"
+  "  ldp d14, d15, [sp, #144]\n"
+  "  add sp, sp, #160\n"
+  "  ret\n"
+  ".size _coro_switch,.-_coro_switch\n"
+);
+
+#endif
+
+/*
+* Each of these are local to the kernel thread. _on_exit is the context of the
+* thread that called coro_initialize and runs on the thread's own stack.
+*
+* A coroutine may be resumed on another thread than it was suspended on, so
+* no thread-local may be read after a switch without being reloaded.
+*/
+THREAD_LOCAL Coro _cur;
+THREAD_LOCAL struct _Coro _on_exit;
+
+static size_t _page_size() {
+  static size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+static qbVar _coro_transfer(Coro target, qbVar value) {
+  Coro self = _cur;
+  target->value = value;
+  _cur = target;
+  _coro_switch(&self->sp, target->sp);
+
+  /* when someone switched back to us, just return the value */
+  return self->value;
+}
+
+/*
+* The first frame of every coroutine. Runs the entry function and never
+* returns because there is nothing above it on the stack.
+*/
+static void _coro_main() {
+  Coro self = _cur;
+  qbVar ret = self->start(self->value);
+  self->is_done = 1;
+
+  /* hand the return value to the caller, or the exit handler if none */
+  _coro_transfer(self->parent ? self->parent : &_on_exit, ret);
+
+  /* a finished coroutine must never be resumed */
+  abort();
+}
+
+/*
+* Maps a stack of the given size with a guard page below it, into which the
+* stack grows on an overflow. Used as the system allocator of the stack pool.
+*/
+static void* _stack_map(size_t size) {
+  size_t guard = _page_size();
+  char* base = (char*)mmap(nullptr, size + guard, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                           -1, 0);
+  if (base == MAP_FAILED) {
+    FATAL("Could not map a coroutine stack of " << size << " bytes.");
+  }
+  mprotect(base, guard, PROT_NONE);
+  return base + guard;
+}
+
+static void _stack_unmap(void* stack, size_t size) {
+  size_t guard = _page_size();
+  munmap((char*)stack - guard, size + guard);
+}
+
+/*
+* Takes a stack from the pool and lays out a frame on it that _coro_switch will
+* "return" into _coro_main from.
+*/
+static void _stack_init(Coro c) {
+  c->stack_size = coro_pool_sizeclass(CORO_STACK_SIZE);
+  c->stack_base = coro_pool_alloc(CORO_POOL_STACK, c->stack_size);
+
+  uintptr_t* top = (uintptr_t*)((char*)c->stack_base + c->stack_size);
+#if defined(__x86_64__)
+  /* a null return address for _coro_main keeps backtraces from wandering off
+     the top of the stack and leaves rsp = 8 (mod 16) on entry, as if called */
+  *--top = 0;
+  *--top = (uintptr_t)&_coro_main;
+
+  /* default MXCSR and x87 control word, then zeroed callee-saved registers */
+  uintptr_t* sp = top - SWITCH_FRAME_WORDS;
+  for (int i = 0; i < SWITCH_FRAME_WORDS; ++i) {
+    sp[i] = 0;
+  }
+  sp[0] = (uintptr_t)0x037F << 32 | 0x1F80;
+#elif defined(__aarch64__)
+  uintptr_t* sp = top - 20;
+  for (int i = 0; i < 20; ++i) {
+    sp[i] = 0;
+  }
+  /* x30 */
+  sp[11] = (uintptr_t)&_coro_main;
+#endif
+  c->sp = sp;
+}
+
+Coro coro_initialize(void*) {
+  static std::once_flag stack_allocator;
+  std::call_once(stack_allocator, [] {
+    coro_pool_setallocator(CORO_POOL_STACK, _stack_map, _stack_unmap);
+  });
+
+  _on_exit.parent = nullptr;
+  _on_exit.sp = nullptr;
+  _on_exit.start = nullptr;
+  _on_exit.stack_base = nullptr;
+  _on_exit.stack_size = 0;
+  _on_exit.is_done = 0;
+
+  _cur = &_on_exit;
+  return _cur;
+}
+
+Coro coro_new(_entry fn) {
+  Coro c = (Coro)coro_pool_alloc(CORO_POOL_CONTEXT, sizeof(struct _Coro));
+  _stack_init(c);
+
+  c->parent = nullptr;
+  c->start = fn;
+  c->is_done = 0;
+  return c;
+}
+
+Coro coro_clone(Coro target) {
+  return coro_new(target->start);
+}
+
+Coro coro_this() {
+  return _cur == &_on_exit ? nullptr : _cur;
+}
+
+int coro_done(Coro c) {
+  return c == &_on_exit ? 0 : c->is_done;
+}
+
+qbVar coro_call(Coro target, qbVar value) {
+  assert(!target->is_done && "Cannot call a finished coroutine.");
+  target->parent = _cur;
+  return _coro_transfer(target, value);
+}
+
+qbVar coro_yield(qbVar var) {
+  if (_cur->parent) {
+    return _coro_transfer(_cur->parent, var);
+  }
+  return qbNone;
+}
+
+void coro_free(Coro c) {
+  if (c->stack_base != nullptr) {
+    coro_pool_free(CORO_POOL_STACK, c->stack_base, c->stack_size);
+  }
+  coro_pool_free(CORO_POOL_CONTEXT, c, sizeof(struct _Coro));
+}
+
+#endif  /* CORO_BACKEND_STACK_SWITCHING */
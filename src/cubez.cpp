@@ -22,17 +22,24 @@
 #include <cubez/audio.h>
 #include "defs.h"
 #include "private_universe.h"
+#include "bit_stream.h"
 #include "byte_vector.h"
 #include "component.h"
 #include "system_impl.h"
 #include "utils_internal.h"
 #include "coro_scheduler.h"
+#include "coro_pool.h"
 #include "input_internal.h"
 #include "log_internal.h"
 #include "render_internal.h"
+#include "rollback.h"
 #include "gui_internal.h"
 #include "audio_internal.h"
 #include "network_impl.h"
+#include "alarm_internal.h"
+#include "async_io_internal.h"
+#include "frame_allocator.h"
+#include "memory_stats.h"
 
 #define AS_PRIVATE(expr) ((PrivateUniverse*)(universe_->self))->expr
 
@@ -67,6 +74,7 @@ qbResult qb_init(qbUniverse* u, qbUniverseAttr attr) {
   
   universe_->self = new PrivateUniverse();
   coro_scheduler = new CoroScheduler(4);
+  async_io_initialize(2);
 
   qbResult ret = AS_PRIVATE(init());
 
@@ -106,6 +114,7 @@ qbResult qb_init(qbUniverse* u, qbUniverseAttr attr) {
   }
 
   network_initialize();
+  alarm_initialize(game_loop.dt);
 
   return ret;
 }
@@ -120,6 +129,9 @@ qbResult qb_start() {
 }
 
 qbResult qb_stop() {
+  alarm_shutdown();
+  async_io_shutdown();
+  memory_stats_shutdown();
   network_shutdown();
   render_shutdown();
   audio_shutdown();
@@ -151,8 +163,10 @@ qbResult loop(qbLoopCallbacks callbacks,
     if (callbacks && callbacks->on_update) {
       callbacks->on_update(universe_->frame, args->update);
     }
+    network_poll();
     qbResult result = AS_PRIVATE(loop());
     coro_scheduler->run_sync();
+    alarm_tick();
     qb_timer_add(update_timer);
 
     game_loop.accumulator -= game_loop.dt;
@@ -198,6 +212,9 @@ qbResult loop(qbLoopCallbacks callbacks,
   timing_info.total_fps = total_fps;
   timing_info.udpate_fps = update_fps;
 
+  network_nextframe();
+  frame_alloc_nextframe();
+
   return game_loop.is_running ? QB_OK : QB_DONE;
 }
 
@@ -210,17 +227,45 @@ qbResult qb_loop(qbLoopCallbacks callbacks,
   if (universe_->enabled & QB_FEATURE_GAME_LOOP) {
     return loop(callbacks, args);
   } else {
+    network_poll();
     qbResult result = AS_PRIVATE(loop());
     coro_scheduler->run_sync();
+    alarm_tick();
+    network_nextframe();
+    frame_alloc_nextframe();
     return result;
   }
 }
 
+qbResult qb_rollback_save(uint64_t frame) {
+  return AS_PRIVATE(rollback_save(frame));
+}
+
+qbResult qb_rollback_restore(uint64_t frame) {
+  return AS_PRIVATE(rollback_restore(frame));
+}
+
+qbResult qb_resimulate(uint64_t from, uint64_t to, qbRollbackInputs inputs) {
+  return AS_PRIVATE(resimulate(from, to, inputs));
+}
+
+bool qb_resimulating() {
+  return rollback_resimulating();
+}
+
 qbResult qb_timing(qbUniverse universe, qbTiming timing) {
   *timing = timing_info;
   return QB_OK;
 }
 
+qbResult qb_save(const char* file) {
+  return AS_PRIVATE(save(file));
+}
+
+qbResult qb_load(const char* file) {
+  return AS_PRIVATE(load(file));
+}
+
 qbId qb_create_program(const char* name) {
   return AS_PRIVATE(create_program(name));
 }
@@ -245,11 +290,20 @@ qbResult qb_system_disable(qbSystem system) {
   return AS_PRIVATE(disable_system(system));
 }
 
+qbResult qb_system_budgetstats(qbSystem system, qbSystemBudgetStats stats) {
+  SystemImpl::FromRaw(system)->BudgetStats(stats);
+  return QB_OK;
+}
+
 qbResult qb_componentattr_create(qbComponentAttr* attr) {
   *attr = (qbComponentAttr)calloc(1, sizeof(qbComponentAttr_));
   new (*attr) qbComponentAttr_;
   (*attr)->is_shared = false;
   (*attr)->type = qbComponentType::QB_COMPONENT_TYPE_RAW;
+  (*attr)->onserialize = nullptr;
+  (*attr)->ondeserialize = nullptr;
+  (*attr)->is_replicated = false;
+  (*attr)->field_count = 0;
 	return qbResult::QB_OK;
 }
 
@@ -274,6 +328,27 @@ qbResult qb_componentattr_setshared(qbComponentAttr attr) {
   return qbResult::QB_OK;
 }
 
+qbResult qb_componentattr_setreplicated(qbComponentAttr attr) {
+  attr->is_replicated = true;
+  return qbResult::QB_OK;
+}
+
+qbResult qb_componentattr_addfield(qbComponentAttr attr, qbFieldAttr field) {
+  return component_addfield(attr, *field);
+}
+
+qbResult qb_componentattr_onserialize(qbComponentAttr attr,
+                                      size_t(*fn)(void* read, uint8_t* write)) {
+  attr->onserialize = fn;
+  return qbResult::QB_OK;
+}
+
+qbResult qb_componentattr_ondeserialize(qbComponentAttr attr,
+                                        size_t(*fn)(uint8_t* read, uint8_t* write)) {
+  attr->ondeserialize = fn;
+  return qbResult::QB_OK;
+}
+
 qbResult qb_component_create(
     qbComponent* component, qbComponentAttr attr) {
   return AS_PRIVATE(component_create(component, attr));
@@ -287,6 +362,39 @@ size_t qb_component_getcount(qbComponent component) {
   return AS_PRIVATE(component_getcount(component));
 }
 
+void* qb_component_alloc(qbComponent component, size_t size) {
+  return AS_PRIVATE(component_alloc(component, size));
+}
+
+qbResult qb_component_shrink(qbComponent component) {
+  return AS_PRIVATE(component_shrink(component));
+}
+
+qbResult qb_component_pack(qbComponent component, const void* instances,
+                           size_t count, qbBitWriter writer) {
+  const qbComponentAttr_* attr = AS_PRIVATE(component_attr(component));
+  if (!attr) {
+    return QB_ERROR_NOT_FOUND;
+  }
+  component_pack(*attr, (const uint8_t*)instances, count, writer);
+  return writer->overflow ? QB_ERROR_MEMORY_OUT_OF_BOUNDS : QB_OK;
+}
+
+qbResult qb_component_unpack(qbComponent component, qbBitReader reader,
+                             void* instances, size_t count) {
+  const qbComponentAttr_* attr = AS_PRIVATE(component_attr(component));
+  if (!attr) {
+    return QB_ERROR_NOT_FOUND;
+  }
+  component_unpack(*attr, reader, (uint8_t*)instances, count);
+  return reader->overflow ? QB_ERROR_MEMORY_OUT_OF_BOUNDS : QB_OK;
+}
+
+size_t qb_component_packbound(qbComponent component, size_t count) {
+  const qbComponentAttr_* attr = AS_PRIVATE(component_attr(component));
+  return attr ? component_packbound(*attr, count) : 0;
+}
+
 qbResult qb_entityattr_create(qbEntityAttr* attr) {
   *attr = (qbEntityAttr)calloc(1, sizeof(qbEntityAttr_));
   new (*attr) qbEntityAttr_;
@@ -405,6 +513,11 @@ qbResult qb_systemattr_setuserstate(qbSystemAttr attr, void* state) {
 	return qbResult::QB_OK;
 }
 
+qbResult qb_systemattr_setbudget(qbSystemAttr attr, uint32_t budget_us) {
+  attr->budget_us = budget_us;
+  return qbResult::QB_OK;
+}
+
 qbResult qb_systemattr_addbarrier(qbSystemAttr attr,
                                   qbBarrier barrier) {
   qbTicket_* t = new qbTicket_;
@@ -524,22 +637,24 @@ qbResult qb_instance_find(qbComponent component, qbEntity entity, void* pbuffer)
 }
 
 qbCoro qb_coro_create(qbVar(*entry)(qbVar var)) {
-  qbCoro ret = new qbCoro_();
+  qbCoro ret = coro_pool_newcoro();
   ret->ret = qbFuture;
   ret->main = coro_new(entry);
   return ret;
 }
 
 qbCoro qb_coro_copy(qbCoro coro) {
-  qbCoro ret = new qbCoro_();
+  qbCoro ret = coro_pool_newcoro();
   ret->ret = qbFuture;
-  ret->main = coro_clone(coro->main);
+  ret->main = coro->main ? coro_clone(coro->main) : nullptr;
   return ret;
 }
 
 qbResult qb_coro_destroy(qbCoro* coro) {
-  coro_free((*coro)->main);
-  delete *coro;
+  if ((*coro)->main) {
+    coro_free((*coro)->main);
+  }
+  coro_pool_deletecoro(*coro);
   *coro = nullptr;
   return QB_OK;
 }
@@ -573,6 +688,10 @@ void qb_coro_wait(double seconds) {
   if (seconds == 0) {
     seconds = 1e-9;
   }
+  if (coro_scheduler->sleep(seconds)) {
+    return;
+  }
+
   double start = (double)qb_timer_query() / 1e9;
   double end = start + seconds;
   while ((double)qb_timer_query() / 1e9 < end) {
@@ -581,6 +700,10 @@ void qb_coro_wait(double seconds) {
 }
 
 void qb_coro_waitframes(uint32_t frames) {
+  if (frames == 0 || coro_scheduler->sleep_frames(frames)) {
+    return;
+  }
+
   volatile uint32_t frames_waited = 0;
   while (frames_waited < frames) {
     qb_coro_yield(qbFuture);
@@ -592,6 +715,24 @@ bool qb_coro_done(qbCoro coro) {
   return qb_coro_peek(coro).tag != QB_TAG_UNSET;
 }
 
+qbResult qb_frame_allocstats(qbFrameAllocStats stats) {
+  frame_alloc_stats(stats);
+  return QB_OK;
+}
+
+qbResult qb_coro_poolstats(qbCoroPoolStats stats) {
+  coro_pool_stats(stats);
+  return QB_OK;
+}
+
+const char* qb_coro_backend() {
+#ifdef CORO_BACKEND_STACK_SWITCHING
+  return "stack switching";
+#else
+  return "stack copying";
+#endif
+}
+
 qbVar qbVoid(void* p) {
   qbVar v;
   v.tag = QB_TAG_VOID;
@@ -647,11 +788,11 @@ qbScene qb_scene_global() {
 }
 
 qbResult qb_scene_save(qbScene* scene, const char* file) {
-  return QB_OK;
+  return AS_PRIVATE(scene_save(*scene, file));
 }
 
 qbResult qb_scene_load(qbScene* scene, const char* name, const char* file) {
-  return QB_OK;
+  return AS_PRIVATE(scene_load(scene, name, file));
 }
 
 qbResult qb_scene_set(qbScene scene) {
@@ -44,11 +44,34 @@ struct qbScene_ {
 
 struct qbCoro_ {
   Coro main;
+  qbVar(*entry)(qbVar);
 
+  // True if the coroutine is owned by the CoroScheduler.
+  bool is_scheduled;
   bool is_async;
   std::shared_mutex ret_mu;
   qbVar ret;
   qbVar arg;
+
+  // Set by a scheduled coroutine right before it suspends itself. The
+  // scheduler calls park(coro, park_arg) once the coroutine has yielded, so
+  // that it cannot be woken up while it is still running. Returns false if
+  // the coroutine should stay runnable.
+  bool(*park)(qbCoro coro, void* arg);
+  void* park_arg;
+
+  uint64_t wake_frame;
+  double wake_time;
+
+  // A value handed over while the coroutine was parked, e.g. by a channel.
+  qbVar transfer;
+
+  // The worker thread an async coroutine must be resumed on, or -1 if any
+  // worker may resume it.
+  int worker;
+
+  // Coroutines awaiting this one. Guarded by ret_mu.
+  std::vector<qbCoro> waiters;
 };
 
 struct qbInstanceOnCreateEvent_ {
@@ -68,6 +91,11 @@ struct qbComponentAttr_ {
   size_t data_size;
   bool is_shared;
   qbComponentType type;
+  size_t(*onserialize)(void* read, uint8_t* write);
+  size_t(*ondeserialize)(uint8_t* read, uint8_t* write);
+  bool is_replicated;
+  qbFieldAttr_ fields[QB_COMPONENT_MAX_FIELDS];
+  uint32_t field_count;
 };
 
 struct qbBarrier_ {
@@ -93,6 +121,9 @@ struct qbSystemAttr_ {
   void* state;
   qbComponentJoin join;
 
+  // Microseconds per frame, zero if unlimited.
+  uint32_t budget_us;
+
   std::vector<qbComponent> constants;
   std::vector<qbComponent> mutables;
   std::vector<qbComponent> components;
@@ -35,7 +35,7 @@ EntityRegistry* EntityRegistry::Clone() {
   EntityRegistry* ret = new EntityRegistry();
   long id = id_;
   ret->id_ = id;
-  ret->entities_ = entities_;
+  ret->entities_.share(entities_);
   ret->free_entity_ids_ = free_entity_ids_;
   return ret;
 }
@@ -93,6 +93,8 @@ class EntityRegistry {
   SparseSet entities_;
   std::vector<size_t> free_entity_ids_;
 
+  friend class SaveFile;
+  friend class StateDelta;
 };
 
 #endif  // ENTITY_REGISTRY__H
@@ -27,9 +27,11 @@ Event::Event(qbId program, qbId id, ByteQueue* message_queue,
     id_(id),
     message_queue_(message_queue),
     size_(size),
-    mem_buffer_(size) {
+    mem_buffer_(size),
+    memory_(QB_MEMORY_TAG_EVENT, id) {
   mem_buffer_.reserve(1000);
   free_mem_.reserve(1000);
+  UpdateMemory();
 }
 
 Event::Message Event::AllocMessage(void* initial_val) {
@@ -46,6 +48,7 @@ Event::Message Event::AllocMessage(void* initial_val) {
     void* val = mem_buffer_[ret_index];
     memmove(val, initial_val, size_);
   }
+  UpdateMemory();
   return{ id_, ret_index };
 }
 
@@ -79,6 +82,17 @@ void Event::Flush(size_t index, GameState* state) {
   FreeMessage(index);
 }
 
+size_t Event::MessageSize() const {
+  return size_;
+}
+
 void Event::FreeMessage(size_t index) {
   free_mem_.push_back(index);
+  UpdateMemory();
+}
+
+void Event::UpdateMemory() {
+  size_t live = mem_buffer_.size() - free_mem_.size();
+  memory_.Set(mem_buffer_.capacity() * size_ + free_mem_.capacity() * sizeof(size_t),
+              live * size_);
 }
@@ -24,6 +24,7 @@
 #include "byte_vector.h"
 #include "byte_queue.h"
 #include "memory_pool.h"
+#include "memory_stats.h"
 #include "game_state.h"
 
 #include <mutex>
@@ -54,6 +55,9 @@ class Event {
   // Not thread-safe.
   void Flush(size_t index, GameState* state);
 
+  // Returns the size in bytes of a single message.
+  size_t MessageSize() const;
+
  private:
   // Allocates a message to send. Moves the data pointed to by initial_val
   // to a new message. Returns pointer to the newly allocated message.
@@ -62,6 +66,8 @@ class Event {
   // Thread-safe.
   void FreeMessage(size_t index);
 
+  void UpdateMemory();
+
   std::vector<qbSystem> handlers_;
   qbId program_;
   qbId id_;
@@ -69,6 +75,7 @@ class Event {
   size_t size_;
   ByteVector mem_buffer_;
   std::vector<size_t> free_mem_;
+  MemoryAccount memory_;
 };
 
 #endif  // EVENT__H
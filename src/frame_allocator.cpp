@@ -0,0 +1,186 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "frame_allocator.h"
+#include "defs.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <stdlib.h>
+
+namespace {
+
+const size_t kMinChunkSize = 64 * 1024;
+
+struct Chunk {
+  Chunk* next;
+  size_t size;
+};
+
+char* chunk_begin(Chunk* chunk) {
+  return (char*)(chunk + 1);
+}
+
+// A chain of chunks owned by a single thread. Allocation bumps "top" through
+// the newest chunk and pushes a bigger one when it runs out. On a reset, a
+// chain is coalesced into one chunk large enough for the whole frame, so in a
+// steady state every allocation comes from a single block.
+struct Arena {
+  Chunk* chunks = nullptr;
+  char* top = nullptr;
+  char* end = nullptr;
+
+  // Read by frame_alloc_nextframe() from the main thread.
+  std::atomic<uint64_t> frame{ 0 };
+  std::atomic<size_t> used{ 0 };
+  std::atomic<size_t> capacity{ 0 };
+
+  Arena();
+  ~Arena();
+
+  void* Alloc(uint64_t now, size_t size, size_t align);
+  void Reset();
+  void Push(size_t size);
+  void Release();
+};
+
+std::mutex arenas_mu_;
+std::vector<Arena*> arenas_;
+
+std::atomic<uint64_t> frame_{ 1 };
+size_t frame_bytes_ = 0;
+size_t high_water_ = 0;
+
+// Even and odd frames alternate between two arenas, so what was allocated in
+// the previous frame is still intact while the current one runs. This keeps a
+// container that grows across a frame boundary, e.g. in a detached program,
+// from copying out of memory that was just rewound.
+thread_local Arena arenas_by_frame_[2];
+
+Arena::Arena() {
+  std::lock_guard<std::mutex> l(arenas_mu_);
+  arenas_.push_back(this);
+}
+
+Arena::~Arena() {
+  {
+    std::lock_guard<std::mutex> l(arenas_mu_);
+    arenas_.erase(std::find(arenas_.begin(), arenas_.end(), this));
+  }
+  Release();
+}
+
+void* Arena::Alloc(uint64_t now, size_t size, size_t align) {
+  if (frame.load(std::memory_order_relaxed) != now) {
+    Reset();
+    frame.store(now, std::memory_order_release);
+  }
+
+  uintptr_t p = ((uintptr_t)top + align - 1) & ~(uintptr_t)(align - 1);
+  if (!top || p + size > (uintptr_t)end) {
+    size_t last = chunks ? chunks->size : 0;
+    Push(std::max({ kMinChunkSize, last * 2, size + align }));
+    p = ((uintptr_t)top + align - 1) & ~(uintptr_t)(align - 1);
+  }
+
+  size_t consumed = p + size - (uintptr_t)top;
+  top = (char*)(p + size);
+  used.store(used.load(std::memory_order_relaxed) + consumed,
+             std::memory_order_relaxed);
+  return (void*)p;
+}
+
+void Arena::Reset() {
+  size_t size = capacity.load(std::memory_order_relaxed);
+
+  // Give back half of the memory after a frame that used less than a quarter
+  // of it, so that a single spike does not pin memory forever.
+  if (size > kMinChunkSize && used.load(std::memory_order_relaxed) * 4 < size) {
+    size /= 2;
+  }
+
+  if (chunks && !chunks->next && chunks->size == size) {
+    top = chunk_begin(chunks);
+  } else if (size > 0) {
+    Release();
+    Push(size);
+  }
+  used.store(0, std::memory_order_relaxed);
+}
+
+void Arena::Push(size_t size) {
+  Chunk* chunk = (Chunk*)malloc(sizeof(Chunk) + size);
+  if (!chunk) {
+    FATAL("Could not allocate a frame arena chunk of " << size << " bytes.");
+  }
+  chunk->next = chunks;
+  chunk->size = size;
+  chunks = chunk;
+  top = chunk_begin(chunk);
+  end = top + size;
+  capacity.store(capacity.load(std::memory_order_relaxed) + size,
+                 std::memory_order_relaxed);
+}
+
+void Arena::Release() {
+  while (chunks) {
+    Chunk* next = chunks->next;
+    free(chunks);
+    chunks = next;
+  }
+  top = end = nullptr;
+  capacity.store(0, std::memory_order_relaxed);
+}
+
+}  // namespace
+
+void frame_alloc_nextframe() {
+  std::lock_guard<std::mutex> l(arenas_mu_);
+  uint64_t now = frame_.load(std::memory_order_relaxed);
+
+  size_t bytes = 0;
+  for (Arena* arena : arenas_) {
+    if (arena->frame.load(std::memory_order_acquire) == now) {
+      bytes += arena->used.load(std::memory_order_relaxed);
+    }
+  }
+  frame_bytes_ = bytes;
+  high_water_ = std::max(high_water_, bytes);
+
+  frame_.store(now + 1, std::memory_order_release);
+}
+
+void frame_alloc_stats(qbFrameAllocStats stats) {
+  std::lock_guard<std::mutex> l(arenas_mu_);
+  stats->bytes = frame_bytes_;
+  stats->high_water = high_water_;
+  stats->capacity = 0;
+  for (Arena* arena : arenas_) {
+    stats->capacity += arena->capacity.load(std::memory_order_relaxed);
+  }
+}
+
+void* qb_frame_alloc(size_t size, size_t align) {
+  if (align == 0) {
+    align = alignof(std::max_align_t);
+  }
+  uint64_t frame = frame_.load(std::memory_order_acquire);
+  return arenas_by_frame_[frame & 1].Alloc(frame, size, align);
+}
@@ -0,0 +1,68 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef FRAME_ALLOCATOR__H
+#define FRAME_ALLOCATOR__H
+
+#include <cubez/cubez.h>
+
+#include <stddef.h>
+#include <vector>
+
+// Ends the current frame. Memory from qb_frame_alloc is reclaimed lazily: each
+// thread rewinds its own arenas when it first allocates in a later frame, so
+// no arena is ever touched by two threads at once.
+void frame_alloc_nextframe();
+
+void frame_alloc_stats(qbFrameAllocStats stats);
+
+// Standard allocator on top of qb_frame_alloc for containers that do not
+// outlive the frame. Only use it where the work is sure to finish inside the
+// frame, e.g. not on a loading thread, as the arena is rewound under it
+// otherwise. Deallocation is a no-op.
+template<class T>
+class FrameAllocator {
+ public:
+  typedef T value_type;
+
+  FrameAllocator() = default;
+
+  template<class U>
+  FrameAllocator(const FrameAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    return (T*)qb_frame_alloc(n * sizeof(T), alignof(T));
+  }
+
+  void deallocate(T*, size_t) {}
+
+  template<class U>
+  bool operator==(const FrameAllocator<U>&) const {
+    return true;
+  }
+
+  template<class U>
+  bool operator!=(const FrameAllocator<U>&) const {
+    return false;
+  }
+};
+
+template<class T>
+using FrameVector = std::vector<T, FrameAllocator<T>>;
+
+#endif  // FRAME_ALLOCATOR__H
@@ -115,6 +115,23 @@ void* GameState::ComponentGetEntityData(qbComponent component, qbEntity entity)
   return (*instances_)[component][entity];
 }
 
+void GameState::Compact(size_t max_blocks) {
+  instances_->Compact(max_blocks);
+}
+
+void GameState::Replace(std::unique_ptr<EntityRegistry> entities,
+                        std::unique_ptr<InstanceRegistry> instances) {
+  entities_ = std::move(entities);
+  instances_ = std::move(instances);
+
+  for (auto& destroyed_entities : destroyed_entities_) {
+    destroyed_entities.clear();
+  }
+  for (auto& removed_components : removed_components_) {
+    removed_components.clear();
+  }
+}
+
 size_t GameState::ComponentGetCount(qbComponent component) {
   return (*instances_)[component].Size();
 }
\ No newline at end of file
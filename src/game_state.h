@@ -34,6 +34,14 @@ public:
 
   void Flush();
 
+  // Frees at most max_blocks blocks of unused component storage.
+  void Compact(size_t max_blocks);
+
+  // Replaces all entities and component instances without sending events.
+  // Pending entity destroys and component removals are dropped.
+  void Replace(std::unique_ptr<EntityRegistry> entities,
+               std::unique_ptr<InstanceRegistry> instances);
+
   // Entity manipulation.
   qbResult EntityCreate(qbEntity* entity, const qbEntityAttr_& attr);
   qbResult EntityDestroy(qbEntity entity);
@@ -62,7 +70,11 @@ private:
   TypedBlockVector<std::vector<qbEntity>> destroyed_entities_;
   TypedBlockVector<std::vector<std::pair<qbEntity, qbComponent>>> removed_components_;
 
+  friend class SaveFile;
+  friend class Snapshot;
   friend class StateDelta;
+  friend struct qbReplicator_;
+  friend struct qbReplica_;
 };
 
 #endif  // GAME_STATE__H
\ No newline at end of file
@@ -0,0 +1,201 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "gpu_heap.h"
+
+GpuHeap::GpuHeap(uint64_t page_size, uint64_t alignment)
+  : page_size_(page_size), alignment_(alignment) {}
+
+GpuHeap::Handle GpuHeap::Alloc(uint64_t size) {
+  if (size == 0) {
+    return kInvalidHandle;
+  }
+
+  uint64_t units = (size + alignment_ - 1) / alignment_;
+  Location location;
+  if (!AllocInPages(units, kInvalidHandle, &location)) {
+    uint32_t page = AddPage(std::max(units, page_size_ / alignment_));
+    location.page = page;
+    location.offset = pages_[page].buddies->alloc(units) * alignment_;
+    ++pages_[page].count;
+  }
+  location.size = size;
+
+  Handle handle;
+  if (free_handles_.empty()) {
+    handle = (Handle)entries_.size();
+    entries_.push_back({});
+  } else {
+    handle = free_handles_.back();
+    free_handles_.pop_back();
+  }
+  entries_[handle].location = location;
+  entries_[handle].live = true;
+  return handle;
+}
+
+void GpuHeap::Free(Handle handle) {
+  if (handle >= entries_.size() || !entries_[handle].live) {
+    return;
+  }
+
+  Entry& entry = entries_[handle];
+  Page& page = pages_[entry.location.page];
+  page.buddies->release(entry.location.offset / alignment_);
+  --page.count;
+  entry.live = false;
+  free_handles_.push_back(handle);
+}
+
+const GpuHeap::Location* GpuHeap::Find(Handle handle) const {
+  if (handle >= entries_.size() || !entries_[handle].live) {
+    return nullptr;
+  }
+  return &entries_[handle].location;
+}
+
+std::vector<GpuHeap::Move> GpuHeap::Defragment(uint64_t max_bytes) {
+  std::vector<Move> moves;
+
+  // Keep one page around so that a heap that momentarily empties out does not
+  // recreate its buffer.
+  uint32_t pages = 0;
+  for (uint32_t i = 0; i < pages_.size(); ++i) {
+    if (pages_[i].buddies) {
+      ++pages;
+    }
+  }
+  for (uint32_t i = 0; i < pages_.size() && pages > 1; ++i) {
+    if (pages_[i].buddies && pages_[i].count == 0) {
+      ReleasePage(i);
+      --pages;
+    }
+  }
+
+  // Evacuate the least used page if it is less than half full.
+  uint32_t source = kInvalidHandle;
+  double min_usage = 0.5;
+  for (uint32_t i = 0; i < pages_.size(); ++i) {
+    const Page& page = pages_[i];
+    if (!page.buddies || page.count == 0) {
+      continue;
+    }
+    double usage = (double)page.buddies->used() / page.buddies->capacity();
+    if (usage < min_usage) {
+      min_usage = usage;
+      source = i;
+    }
+  }
+  if (source == kInvalidHandle || pages < 2) {
+    return moves;
+  }
+
+  uint64_t moved = 0;
+  for (Handle handle = 0; handle < entries_.size() && moved < max_bytes; ++handle) {
+    Entry& entry = entries_[handle];
+    if (!entry.live || entry.location.page != source) {
+      continue;
+    }
+
+    uint64_t units = (entry.location.size + alignment_ - 1) / alignment_;
+    Location to;
+    if (!AllocInPages(units, source, &to)) {
+      break;
+    }
+    to.size = entry.location.size;
+
+    // The source range is not reused before the copy happens because nothing
+    // is allocated in the source page until this returns.
+    Page& from_page = pages_[source];
+    from_page.buddies->release(entry.location.offset / alignment_);
+    --from_page.count;
+
+    moves.push_back({ handle, entry.location, to });
+    entry.location = to;
+    moved += to.size;
+  }
+
+  return moves;
+}
+
+uint32_t GpuHeap::PageCount() const {
+  return (uint32_t)pages_.size();
+}
+
+uint64_t GpuHeap::PageSize(uint32_t page) const {
+  return page < pages_.size() ? pages_[page].size : 0;
+}
+
+uint64_t GpuHeap::UsedBytes() const {
+  uint64_t used = 0;
+  for (const Page& page : pages_) {
+    if (page.buddies) {
+      used += page.buddies->used() * alignment_;
+    }
+  }
+  return used;
+}
+
+uint64_t GpuHeap::ReservedBytes() const {
+  uint64_t reserved = 0;
+  for (const Page& page : pages_) {
+    reserved += page.size;
+  }
+  return reserved;
+}
+
+bool GpuHeap::AllocInPages(uint64_t units, uint32_t exclude, Location* location) {
+  // First fit, so that allocations pack into the lowest pages and the higher
+  // ones drain out for Defragment() to release.
+  for (uint32_t i = 0; i < pages_.size(); ++i) {
+    Page& page = pages_[i];
+    if (i == exclude || !page.buddies) {
+      continue;
+    }
+    uint64_t offset = page.buddies->alloc(units);
+    if (offset != BuddySystem::kInvalid) {
+      ++page.count;
+      location->page = i;
+      location->offset = offset * alignment_;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint32_t GpuHeap::AddPage(uint64_t units) {
+  uint32_t index = 0;
+  while (index < pages_.size() && pages_[index].buddies) {
+    ++index;
+  }
+  if (index == pages_.size()) {
+    pages_.emplace_back();
+  }
+
+  Page& page = pages_[index];
+  page.buddies.reset(new BuddySystem(units));
+  page.size = page.buddies->capacity() * alignment_;
+  page.count = 0;
+  return index;
+}
+
+void GpuHeap::ReleasePage(uint32_t page) {
+  pages_[page].buddies.reset();
+  pages_[page].size = 0;
+  pages_[page].count = 0;
+}
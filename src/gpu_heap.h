@@ -0,0 +1,102 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef GPU_HEAP__H
+#define GPU_HEAP__H
+
+#include "buddy_system_allocator.h"
+
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+// Bookkeeping for sub-allocating ranges of a few large GPU buffers, called
+// pages. It does not touch the graphics API: the owner keeps one buffer per
+// page, reconciling with PageSize() after every call that may add or remove
+// pages, and performs the copies returned by Defragment().
+class GpuHeap {
+public:
+  typedef uint32_t Handle;
+  static const Handle kInvalidHandle = 0xFFFFFFFF;
+
+  struct Location {
+    uint32_t page;
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  struct Move {
+    Handle handle;
+    Location from;
+    Location to;
+  };
+
+  // Allocations are rounded up to a power of two multiple of alignment, which
+  // must itself be a power of two. Allocations bigger than page_size get a
+  // page of their own.
+  GpuHeap(uint64_t page_size, uint64_t alignment);
+
+  // Returns kInvalidHandle if size is 0.
+  Handle Alloc(uint64_t size);
+  void Free(Handle handle);
+
+  // The location of an allocation, or null if the handle is invalid or was
+  // freed. Only changes in Defragment().
+  const Location* Find(Handle handle) const;
+
+  // Releases empty pages, then moves allocations out of the least used page
+  // into the others until at most max_bytes were moved. The returned moves
+  // must be copied in order before the next use of their destinations.
+  std::vector<Move> Defragment(uint64_t max_bytes);
+
+  // Number of page slots. Slots of released pages are reused.
+  uint32_t PageCount() const;
+
+  // Size of the page in bytes, or 0 if the slot is empty.
+  uint64_t PageSize(uint32_t page) const;
+
+  uint64_t UsedBytes() const;
+  uint64_t ReservedBytes() const;
+
+private:
+  struct Page {
+    std::unique_ptr<BuddySystem> buddies;
+    uint64_t size;
+    size_t count;
+  };
+
+  struct Entry {
+    Location location;
+    bool live;
+  };
+
+  // Allocates units in an existing page other than "exclude", or returns
+  // false.
+  bool AllocInPages(uint64_t units, uint32_t exclude, Location* location);
+  uint32_t AddPage(uint64_t units);
+  void ReleasePage(uint32_t page);
+
+  const uint64_t page_size_;
+  const uint64_t alignment_;
+
+  std::vector<Page> pages_;
+  std::vector<Entry> entries_;
+  std::vector<Handle> free_handles_;
+};
+
+#endif  // GPU_HEAP__H
@@ -0,0 +1,155 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef INDEX_VECTOR__H
+#define INDEX_VECTOR__H
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// A vector of index entries kept in fixed-size chunks. Copies share chunks,
+// and a shared chunk is only duplicated when either copy first writes to it,
+// so copying costs a reference count increment per chunk and a write after a
+// copy costs at most one chunk.
+//
+// Reads go through the const operator[]. Writes go through set() or the
+// other mutators.
+template<class Ty_>
+class IndexVector {
+public:
+  static const size_t kChunkBits = 10;
+  static const size_t kChunkSize = (size_t)1 << kChunkBits;
+  static const size_t kChunkMask = kChunkSize - 1;
+
+  IndexVector() : size_(0) {}
+
+  const Ty_& operator[](size_t i) const {
+    return chunks_[i >> kChunkBits]->data[i & kChunkMask];
+  }
+
+  void set(size_t i, Ty_ value) {
+    mutable_chunk(i >> kChunkBits)[i & kChunkMask] = value;
+  }
+
+  const Ty_& back() const {
+    return (*this)[size_ - 1];
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  size_t capacity() const {
+    return chunks_.size() * kChunkSize;
+  }
+
+  void reserve(size_t size) {
+    chunks_.reserve((size + kChunkMask) >> kChunkBits);
+  }
+
+  void push_back(Ty_ value) {
+    if (size_ == capacity()) {
+      chunks_.push_back(std::make_shared<Chunk>());
+    }
+    set(size_++, value);
+  }
+
+  void pop_back() {
+    --size_;
+  }
+
+  // Entries past the old size are set to value.
+  void resize(size_t size, Ty_ value = Ty_()) {
+    while (capacity() < size) {
+      chunks_.push_back(std::make_shared<Chunk>());
+    }
+    for (size_t i = size_; i < size;) {
+      size_t chunk = i >> kChunkBits;
+      size_t end = std::min(size, (chunk + 1) << kChunkBits);
+      Ty_* data = mutable_chunk(chunk);
+      std::fill(data + (i & kChunkMask), data + (end - (chunk << kChunkBits)), value);
+      i = end;
+    }
+    size_ = size;
+  }
+
+  // Frees the chunks past size().
+  void shrink_to_fit() {
+    chunks_.resize((size_ + kChunkMask) >> kChunkBits);
+    chunks_.shrink_to_fit();
+  }
+
+  void assign(const Ty_* data, size_t size) {
+    chunks_.clear();
+    reserve(size);
+    for (size_t i = 0; i < size; i += kChunkSize) {
+      std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>();
+      std::copy(data + i, data + std::min(size, i + kChunkSize), chunk->data);
+      chunks_.push_back(std::move(chunk));
+    }
+    size_ = size;
+  }
+
+  // Number of chunks allocated.
+  size_t chunks() const {
+    return chunks_.size();
+  }
+
+  // The entries of the i-th chunk. Two vectors with the same chunk pointer
+  // share it, so hold the same entries in it.
+  const Ty_* chunk(size_t i) const {
+    return chunks_[i]->data;
+  }
+
+  // Number of entries of the i-th chunk that are below size().
+  size_t chunk_size(size_t i) const {
+    return std::min(kChunkSize, size_ - (i << kChunkBits));
+  }
+
+  // True if the i-th entry is in a chunk shared with other.
+  bool shares(const IndexVector& other, size_t i) const {
+    size_t chunk = i >> kChunkBits;
+    return i < size_ && i < other.size_ &&
+           chunks_[chunk] == other.chunks_[chunk];
+  }
+
+private:
+  struct Chunk {
+    Ty_ data[kChunkSize];
+  };
+
+  // Returns the chunk for writing, copying it first if it is shared.
+  Ty_* mutable_chunk(size_t i) {
+    std::shared_ptr<Chunk>& chunk = chunks_[i];
+    if (chunk.use_count() > 1) {
+      chunk = std::make_shared<Chunk>(*chunk);
+    }
+    return chunk->data;
+  }
+
+  std::vector<std::shared_ptr<Chunk>> chunks_;
+  size_t size_;
+};
+
+#endif  // INDEX_VECTOR__H
@@ -103,6 +103,17 @@ int InstanceRegistry::DestroyInstanceFor(qbEntity entity,
   return 0;
 }
 
+void InstanceRegistry::Compact(size_t max_blocks) {
+  size_t count = components_.size();
+  for (size_t i = 0; i < count && max_blocks > 0; ++i) {
+    compact_cursor_ = (compact_cursor_ + 1) % count;
+    Component* component = (*(components_.begin() + compact_cursor_)).second;
+    if (component->ShouldShrink()) {
+      max_blocks -= component->Shrink(max_blocks);
+    }
+  }
+}
+
 qbResult InstanceRegistry::SendInstanceCreateNotification(qbEntity entity, Component* component, GameState* state) const {
   return component_registry_.SendInstanceCreateNotification(entity, component, state);
 }
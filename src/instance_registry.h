@@ -54,14 +54,23 @@ public:
   int DestroyInstanceFor(qbEntity entity, qbComponent component,
                          GameState* state);
 
+  // Frees at most max_blocks blocks of unused component storage. Picks up
+  // where the last call left off so that every component gets its turn.
+  void Compact(size_t max_blocks);
+
   qbResult SendInstanceCreateNotification(qbEntity entity, Component* component, GameState* state) const;
   qbResult SendInstanceDestroyNotification(qbEntity entity, Component* component, GameState* state) const;
 
 private:
   void Create(qbComponent component);
 
+  friend class SaveFile;
+  friend class StateDelta;
+  friend struct qbReplicator_;
+
   const ComponentRegistry& component_registry_;
   SparseMap<Component*, TypedBlockVector<Component*>> components_;
+  size_t compact_cursor_ = 0;
 };
 
 #endif  // INSTANCE_REGISTRY__H
@@ -0,0 +1,253 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include <cubez/network.h>
+
+#include <algorithm>
+#include <array>
+#include <map>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// An endpoint as bytes that can be compared: the family, the port and the
+// address, with an IPv4 address zero padded.
+typedef std::array<uint8_t, 19> Address;
+
+Address address_of(const qbEndpoint_& endpoint) {
+  Address address = {};
+  address[0] = (uint8_t)endpoint.af;
+  memcpy(&address[1], &endpoint.port, sizeof(endpoint.port));
+  if (endpoint.af == QB_IPV6) {
+    memcpy(&address[3], endpoint.in6_addr, sizeof(endpoint.in6_addr));
+  } else {
+    memcpy(&address[3], &endpoint.in_addr, sizeof(endpoint.in_addr));
+  }
+  return address;
+}
+
+struct Datagram {
+  std::vector<uint8_t> data;
+  qbEndpoint_ from;
+};
+
+// The datagrams in flight to one end by arrival time. Datagrams that arrive
+// at the same time stay in the order they were sent.
+typedef std::multimap<double, Datagram> Inbox;
+
+// One direction between two ends.
+struct Lane {
+  // When the last datagram queued for the bandwidth goes out.
+  double busy_until = 0.0;
+};
+
+// SplitMix64, so that a seed gives the same draws on every platform.
+uint64_t next_random(uint64_t* state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+double next_uniform(uint64_t* state) {
+  return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+}  // namespace
+
+struct qbLink_ {
+  qbLinkAttr_ attr;
+  uint64_t random;
+  qbLinkStats_ stats;
+
+  // By the side they go to.
+  Inbox sides[2];
+  Lane side_lanes[2];
+
+  std::map<Address, Inbox> bound;
+  std::map<std::pair<Address, Address>, Lane> lanes;
+
+  // Puts a datagram in flight to "to", or drops it. A null "to" is an
+  // endpoint that is not bound.
+  void Transmit(Lane* lane, Inbox* to, const uint8_t* data, size_t size,
+                const qbEndpoint_& from, double time);
+
+  int32_t Receive(Inbox* inbox, uint8_t* data, size_t size, qbEndpoint from,
+                  double time);
+};
+
+void qbLink_::Transmit(Lane* lane, Inbox* to, const uint8_t* data, size_t size,
+                       const qbEndpoint_& from, double time) {
+  ++stats.sent;
+
+  // Every datagram makes the same draws, for both copies of a duplicate,
+  // whether or not the conditions are enabled and whether or not it is
+  // dropped. Enabling one condition then does not change what the others
+  // draw.
+  bool lost = next_uniform(&random) < attr.loss;
+  bool duplicated = next_uniform(&random) < attr.duplicate;
+  double jitter[2];
+  bool reordered[2];
+  for (int i = 0; i < 2; ++i) {
+    jitter[i] = next_uniform(&random) * attr.jitter;
+    reordered[i] = next_uniform(&random) < attr.reorder;
+  }
+  if (lost || !to) {
+    ++stats.lost;
+    return;
+  }
+
+  double sent = time;
+  if (attr.bandwidth > 0.0) {
+    double start = std::max(time, lane->busy_until);
+    if (attr.queue_size > 0 &&
+        (start - time) * attr.bandwidth + size > (double)attr.queue_size) {
+      ++stats.overflowed;
+      return;
+    }
+    sent = start + size / attr.bandwidth;
+    lane->busy_until = sent;
+  }
+
+  int copies = 1;
+  if (duplicated) {
+    copies = 2;
+    ++stats.duplicated;
+  }
+  for (int i = 0; i < copies; ++i) {
+    double arrival = sent + attr.latency + jitter[i];
+    if (reordered[i]) {
+      arrival += attr.reorder_delay;
+      ++stats.reordered;
+    }
+    Datagram datagram;
+    datagram.data.assign(data, data + size);
+    datagram.from = from;
+    to->emplace(arrival, std::move(datagram));
+  }
+}
+
+int32_t qbLink_::Receive(Inbox* inbox, uint8_t* data, size_t size,
+                         qbEndpoint from, double time) {
+  if (inbox->empty() || inbox->begin()->first > time) {
+    return -1;
+  }
+
+  const Datagram& datagram = inbox->begin()->second;
+  size_t received = std::min(size, datagram.data.size());
+  if (received > 0) {
+    memcpy(data, datagram.data.data(), received);
+  }
+  if (from) {
+    *from = datagram.from;
+  }
+  inbox->erase(inbox->begin());
+  ++stats.delivered;
+  return (int32_t)received;
+}
+
+qbResult qb_link_create(qbLink* link, qbLinkAttr attr) {
+  *link = new qbLink_{};
+  (*link)->attr = *attr;
+  (*link)->random = attr->seed;
+  return QB_OK;
+}
+
+qbResult qb_link_destroy(qbLink* link) {
+  delete *link;
+  *link = nullptr;
+  return QB_OK;
+}
+
+qbResult qb_link_send(qbLink link, int side, const uint8_t* data,
+                      size_t size, double time) {
+  if (side != 0 && side != 1) {
+    return QB_ERROR_NOT_FOUND;
+  }
+  link->Transmit(&link->side_lanes[1 - side], &link->sides[1 - side], data,
+                 size, qbEndpoint_{}, time);
+  return QB_OK;
+}
+
+int32_t qb_link_recv(qbLink link, int side, uint8_t* data, size_t size,
+                     double time) {
+  if (side != 0 && side != 1) {
+    return -1;
+  }
+  return link->Receive(&link->sides[side], data, size, nullptr, time);
+}
+
+qbResult qb_link_bind(qbLink link, qbEndpoint endpoint) {
+  link->bound[address_of(*endpoint)];
+  return QB_OK;
+}
+
+int32_t qb_link_sendto(qbLink link, qbEndpoint from, const char* buf,
+                       size_t len, qbEndpoint to, double time) {
+  Address source = address_of(*from);
+  Address destination = address_of(*to);
+  auto found = link->bound.find(destination);
+  link->Transmit(&link->lanes[{ source, destination }],
+                 found == link->bound.end() ? nullptr : &found->second,
+                 (const uint8_t*)buf, len, *from, time);
+  return (int32_t)len;
+}
+
+int32_t qb_link_recvfrom(qbLink link, qbEndpoint at, char* buf, size_t len,
+                         qbEndpoint from, double time) {
+  auto found = link->bound.find(address_of(*at));
+  if (found == link->bound.end()) {
+    return -1;
+  }
+  return link->Receive(&found->second, (uint8_t*)buf, len, from, time);
+}
+
+int32_t qb_link_sendbatch(qbLink link, qbEndpoint from, qbPacket packets,
+                          size_t count, double time) {
+  for (size_t i = 0; i < count; ++i) {
+    qb_link_sendto(link, from, packets[i].buf, packets[i].len,
+                   &packets[i].endpoint, time);
+  }
+  return (int32_t)count;
+}
+
+int32_t qb_link_recvbatch(qbLink link, qbEndpoint at, qbPacket packets,
+                          size_t count, double time) {
+  auto found = link->bound.find(address_of(*at));
+  if (found == link->bound.end()) {
+    return 0;
+  }
+  size_t filled = 0;
+  for (; filled < count; ++filled) {
+    qbPacket packet = &packets[filled];
+    int32_t received = link->Receive(&found->second, (uint8_t*)packet->buf,
+                                     packet->cap, &packet->endpoint, time);
+    if (received < 0) {
+      break;
+    }
+    packet->len = (size_t)received;
+  }
+  return (int32_t)filled;
+}
+
+void qb_link_stats(qbLink link, qbLinkStats stats) {
+  *stats = link->stats;
+}
@@ -0,0 +1,191 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "lz.h"
+
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+namespace {
+
+const int kHashBits = 14;
+const size_t kMinMatch = 4;
+const size_t kMaxOffset = 65535;
+
+// The last bytes are always literals, so that matching never reads past the
+// end of the input.
+const size_t kLastLiterals = 12;
+
+uint32_t read32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+uint32_t hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - kHashBits);
+}
+
+uint8_t* write_length(uint8_t* op, size_t length) {
+  while (length >= 255) {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = (uint8_t)length;
+  return op;
+}
+
+// Reads the rest of a length that did not fit in the token.
+bool read_length(const uint8_t** ip, const uint8_t* end, size_t* length) {
+  uint8_t b;
+  do {
+    if (*ip >= end) {
+      return false;
+    }
+    b = *(*ip)++;
+    *length += b;
+  } while (b == 255);
+  return true;
+}
+
+uint8_t* write_sequence(uint8_t* op, const uint8_t* literals, size_t literal_count,
+                        size_t offset, size_t match_length) {
+  uint8_t* token = op++;
+  *token = (uint8_t)(std::min(literal_count, (size_t)15) << 4);
+  if (literal_count >= 15) {
+    op = write_length(op, literal_count - 15);
+  }
+  if (literal_count > 0) {
+    memcpy(op, literals, literal_count);
+    op += literal_count;
+  }
+
+  if (match_length == 0) {
+    return op;
+  }
+  *op++ = (uint8_t)(offset & 0xFF);
+  *op++ = (uint8_t)(offset >> 8);
+  match_length -= kMinMatch;
+  *token |= (uint8_t)std::min(match_length, (size_t)15);
+  if (match_length >= 15) {
+    op = write_length(op, match_length - 15);
+  }
+  return op;
+}
+
+}  // namespace
+
+size_t lz_compress_bound(size_t size) {
+  return size + size / 255 + 16;
+}
+
+size_t lz_decompress_bound(size_t size) {
+  return size > SIZE_MAX / 255 ? SIZE_MAX : size * 255;
+}
+
+size_t lz_compress(const uint8_t* src, size_t size, uint8_t* dst) {
+  thread_local std::vector<uint32_t> table;
+  table.assign(1 << kHashBits, 0);
+
+  const uint8_t* ip = src;
+  const uint8_t* anchor = src;
+  const uint8_t* end = src + size;
+  const uint8_t* match_limit = size > kLastLiterals ? end - kLastLiterals : src;
+  uint8_t* op = dst;
+
+  while (ip < match_limit) {
+    uint32_t sequence = read32(ip);
+    uint32_t h = hash(sequence);
+    const uint8_t* ref = src + table[h];
+    table[h] = (uint32_t)(ip - src);
+
+    if (ref >= ip || (size_t)(ip - ref) > kMaxOffset || read32(ref) != sequence) {
+      ++ip;
+      continue;
+    }
+
+    const uint8_t* match_end = ip + kMinMatch;
+    ref += kMinMatch;
+    while (match_end < end - kLastLiterals / 2 && *match_end == *ref) {
+      ++match_end;
+      ++ref;
+    }
+    op = write_sequence(op, anchor, ip - anchor, match_end - ref,
+                        match_end - ip);
+    ip = anchor = match_end;
+  }
+  return write_sequence(op, anchor, end - anchor, 0, 0) - dst;
+}
+
+bool lz_decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t dst_size) {
+  const uint8_t* ip = src;
+  const uint8_t* end = src + size;
+  uint8_t* op = dst;
+  uint8_t* out_end = dst + dst_size;
+
+  while (ip < end) {
+    uint8_t token = *ip++;
+    size_t literal_count = token >> 4;
+    if (literal_count == 15 && !read_length(&ip, end, &literal_count)) {
+      return false;
+    }
+    if (literal_count > (size_t)(end - ip) || literal_count > (size_t)(out_end - op)) {
+      return false;
+    }
+    if (literal_count > 0) {
+      memcpy(op, ip, literal_count);
+      ip += literal_count;
+      op += literal_count;
+    }
+    if (ip == end) {
+      break;
+    }
+
+    if (end - ip < 2) {
+      return false;
+    }
+    size_t offset = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - dst)) {
+      return false;
+    }
+    size_t match_length = token & 15;
+    if (match_length == 15 && !read_length(&ip, end, &match_length)) {
+      return false;
+    }
+    match_length += kMinMatch;
+    if (match_length > (size_t)(out_end - op)) {
+      return false;
+    }
+
+    // A match that overlaps what it is copying repeats the last offset bytes,
+    // so it is copied byte by byte.
+    const uint8_t* ref = op - offset;
+    if (offset >= match_length) {
+      memcpy(op, ref, match_length);
+    } else {
+      for (size_t i = 0; i < match_length; ++i) {
+        op[i] = ref[i];
+      }
+    }
+    op += match_length;
+  }
+  return op == out_end;
+}
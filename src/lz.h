@@ -0,0 +1,46 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef LZ__H
+#define LZ__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A byte-oriented LZ77 codec in the spirit of LZ4: a stream of sequences,
+// each a token, a run of literals and a back-reference of at least 4 bytes
+// into the last 64KB. Trades ratio for speed, which suits data that is
+// compressed every frame.
+
+// Returns the largest size lz_compress can produce for size bytes.
+size_t lz_compress_bound(size_t size);
+
+// Compresses size bytes of src into dst, which must hold
+// lz_compress_bound(size) bytes. Returns the compressed size.
+size_t lz_compress(const uint8_t* src, size_t size, uint8_t* dst);
+
+// Returns the largest size size bytes of lz_compress output can decompress
+// to. Every byte of a sequence adds at most 255 bytes to the output.
+size_t lz_decompress_bound(size_t size);
+
+// Decompresses into dst, which must be exactly the uncompressed size. Returns
+// false if src is malformed.
+bool lz_decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t dst_size);
+
+#endif  // LZ__H
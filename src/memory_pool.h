@@ -25,6 +25,9 @@
 
 #include <climits>
 #include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
 
 template <typename T, size_t BlockSize = 4096>
 class MemoryPool {
@@ -205,7 +208,7 @@ MemoryPool<T, BlockSize>::allocateBlock() {
 
 template <typename T, size_t BlockSize>
 inline typename MemoryPool<T, BlockSize>::pointer
-MemoryPool<T, BlockSize>::allocate(size_type n, const_pointer hint) {
+MemoryPool<T, BlockSize>::allocate(size_type, const_pointer) {
   if (freeSlots_ != nullptr) {
     pointer result = reinterpret_cast<pointer>(freeSlots_);
     freeSlots_ = freeSlots_->next;
@@ -221,7 +224,7 @@ MemoryPool<T, BlockSize>::allocate(size_type n, const_pointer hint) {
 
 template <typename T, size_t BlockSize>
 inline void
-MemoryPool<T, BlockSize>::deallocate(pointer p, size_type n) {
+MemoryPool<T, BlockSize>::deallocate(pointer p, size_type) {
   if (p != nullptr) {
     reinterpret_cast<slot_pointer_>(p)->next = freeSlots_;
     freeSlots_ = reinterpret_cast<slot_pointer_>(p);
@@ -0,0 +1,195 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "memory_stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const char* kTagNames[QB_MEMORY_TAG_COUNT] = {
+  "component", "event", "coro_stack", "program", "render"
+};
+
+std::atomic<int64_t> reserved_[QB_MEMORY_TAG_COUNT];
+std::atomic<int64_t> used_[QB_MEMORY_TAG_COUNT];
+
+std::mutex accounts_mu_;
+std::vector<MemoryAccount*> accounts_;
+
+// Writes a row of totals to the timeline every interval until stopped.
+class Sampler {
+ public:
+  Sampler(const char* file, double interval)
+      : out_(file), interval_(interval), stop_(false) {}
+
+  ~Sampler() {
+    {
+      std::lock_guard<std::mutex> l(mu_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  bool Start() {
+    if (!out_.is_open()) {
+      return false;
+    }
+
+    out_ << "seconds";
+    for (size_t tag = 0; tag < QB_MEMORY_TAG_COUNT; ++tag) {
+      out_ << "," << kTagNames[tag] << "_reserved," << kTagNames[tag] << "_used";
+    }
+    out_ << "\n";
+
+    thread_ = std::thread([this] { Run(); });
+    return true;
+  }
+
+ private:
+  void Run() {
+    auto start = std::chrono::steady_clock::now();
+    auto interval = std::chrono::duration<double>(interval_);
+
+    std::unique_lock<std::mutex> l(mu_);
+    while (!stop_) {
+      qbMemoryStats_ stats;
+      qb_memory_stats(&stats);
+
+      out_ << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      for (size_t tag = 0; tag < QB_MEMORY_TAG_COUNT; ++tag) {
+        out_ << "," << stats.tags[tag].reserved << "," << stats.tags[tag].used;
+      }
+      out_ << "\n";
+
+      cv_.wait_for(l, interval, [this] { return stop_; });
+    }
+    out_.flush();
+  }
+
+  std::ofstream out_;
+  const double interval_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool stop_;
+  std::thread thread_;
+};
+
+std::mutex sampler_mu_;
+Sampler* sampler_ = nullptr;
+
+}  // namespace
+
+void memory_track(qbMemoryTag tag, int64_t reserved, int64_t used) {
+  reserved_[tag].fetch_add(reserved, std::memory_order_relaxed);
+  used_[tag].fetch_add(used, std::memory_order_relaxed);
+}
+
+void memory_stats_shutdown() {
+  qb_memory_stopsampling();
+}
+
+MemoryAccount::MemoryAccount(qbMemoryTag tag, qbId id)
+    : tag_(tag), id_(id), reserved_(0), used_(0) {
+  std::lock_guard<std::mutex> l(accounts_mu_);
+  accounts_.push_back(this);
+}
+
+MemoryAccount::~MemoryAccount() {
+  Set(0, 0);
+  std::lock_guard<std::mutex> l(accounts_mu_);
+  accounts_.erase(std::find(accounts_.begin(), accounts_.end(), this));
+}
+
+void MemoryAccount::Set(size_t reserved, size_t used) {
+  size_t old_reserved = reserved_.exchange(reserved, std::memory_order_relaxed);
+  size_t old_used = used_.exchange(used, std::memory_order_relaxed);
+  memory_track(tag_, (int64_t)reserved - (int64_t)old_reserved,
+               (int64_t)used - (int64_t)old_used);
+}
+
+void MemoryAccount::Add(int64_t reserved, int64_t used) {
+  reserved_.fetch_add(reserved, std::memory_order_relaxed);
+  used_.fetch_add(used, std::memory_order_relaxed);
+  memory_track(tag_, reserved, used);
+}
+
+qbMemoryTag MemoryAccount::Tag() const {
+  return tag_;
+}
+
+qbId MemoryAccount::Id() const {
+  return id_;
+}
+
+qbMemoryUsage_ MemoryAccount::Usage() const {
+  return{ reserved_.load(std::memory_order_relaxed),
+          used_.load(std::memory_order_relaxed) };
+}
+
+qbResult qb_memory_stats(qbMemoryStats stats) {
+  stats->total = {};
+  for (size_t tag = 0; tag < QB_MEMORY_TAG_COUNT; ++tag) {
+    stats->tags[tag].reserved =
+      (size_t)std::max(reserved_[tag].load(std::memory_order_relaxed), (int64_t)0);
+    stats->tags[tag].used =
+      (size_t)std::max(used_[tag].load(std::memory_order_relaxed), (int64_t)0);
+    stats->total.reserved += stats->tags[tag].reserved;
+    stats->total.used += stats->tags[tag].used;
+  }
+  return QB_OK;
+}
+
+qbResult qb_memory_foreach(void(*fn)(qbMemoryTag tag, qbId id,
+                                     qbMemoryUsage_ usage, void* arg),
+                           void* arg) {
+  std::lock_guard<std::mutex> l(accounts_mu_);
+  for (MemoryAccount* account : accounts_) {
+    fn(account->Tag(), account->Id(), account->Usage(), arg);
+  }
+  return QB_OK;
+}
+
+qbResult qb_memory_startsampling(const char* file, double interval) {
+  std::lock_guard<std::mutex> l(sampler_mu_);
+  delete sampler_;
+  sampler_ = new Sampler(file, interval);
+  if (!sampler_->Start()) {
+    delete sampler_;
+    sampler_ = nullptr;
+    return QB_ERROR_FAILED_INITIALIZATION;
+  }
+  return QB_OK;
+}
+
+qbResult qb_memory_stopsampling() {
+  std::lock_guard<std::mutex> l(sampler_mu_);
+  delete sampler_;
+  sampler_ = nullptr;
+  return QB_OK;
+}
@@ -0,0 +1,62 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef MEMORY_STATS__H
+#define MEMORY_STATS__H
+
+#include <cubez/cubez.h>
+
+#include <atomic>
+#include <stdint.h>
+
+// Adds the given number of bytes to the totals of a tag. Used for memory that
+// is not owned by an object with its own MemoryAccount.
+void memory_track(qbMemoryTag tag, int64_t reserved, int64_t used);
+
+// Stops sampling, if running.
+void memory_stats_shutdown();
+
+// The memory owned by a single object, e.g. a component or an event. Accounts
+// are listed by qb_memory_foreach and roll up into the totals of their tag.
+// Thread-safe.
+class MemoryAccount {
+ public:
+  MemoryAccount(qbMemoryTag tag, qbId id);
+  ~MemoryAccount();
+
+  MemoryAccount(const MemoryAccount&) = delete;
+  MemoryAccount& operator=(const MemoryAccount&) = delete;
+
+  // Replaces the current usage of the account.
+  void Set(size_t reserved, size_t used);
+
+  // Adds to the current usage of the account.
+  void Add(int64_t reserved, int64_t used);
+
+  qbMemoryTag Tag() const;
+  qbId Id() const;
+  qbMemoryUsage_ Usage() const;
+
+ private:
+  const qbMemoryTag tag_;
+  const qbId id_;
+  std::atomic<size_t> reserved_;
+  std::atomic<size_t> used_;
+};
+
+#endif  // MEMORY_STATS__H
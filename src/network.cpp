@@ -16,8 +16,11 @@
 * limitations under the License.
 */
 
+
 #include "network_impl.h"
+#include "frame_allocator.h"
 #include <cubez/common.h>
+#include <cubez/network.h>
 
 #ifdef __COMPILE_AS_WINDOWS__
 #define WIN32_LEAN_AND_MEAN
@@ -25,10 +28,220 @@
 #include <Ws2tcpip.h>
 
 WSADATA wsa_data;
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __COMPILE_AS_LINUX__
+#include <sys/epoll.h>
+#elif !defined(__COMPILE_AS_WINDOWS__)
+#include <poll.h>
 #endif
 
+#include <algorithm>
+#include <errno.h>
 #include <iostream>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// Bounds the datagrams received from one socket per poll, so that a flooded
+// socket cannot starve the others. The rest are received on the next poll.
+const size_t kMaxDatagramsPerPoll = 256;
+
+// Datagrams received per system call.
+const size_t kRecvBatch = 32;
+
+// Waits for readiness with epoll on Linux and with poll elsewhere. Sockets are
+// level-triggered, so one that is not drained is reported again.
+class Reactor {
+public:
+  Reactor() {
+#ifdef __COMPILE_AS_LINUX__
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0) {
+      FATAL("Could not create the socket reactor: " << strerror(errno));
+    }
+#endif
+  }
+
+  ~Reactor() {
+#ifdef __COMPILE_AS_LINUX__
+    close(epoll_fd_);
+#endif
+  }
+
+  bool Watch(qbSocket socket, int interest, bool is_new) {
+#ifdef __COMPILE_AS_LINUX__
+    epoll_event e = {};
+    e.events = ToEpoll(interest);
+    e.data.fd = socket;
+    return epoll_ctl(epoll_fd_, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                     socket, &e) == 0;
+#else
+    short events = ToPoll(interest);
+    if (is_new) {
+      PollFd fd = {};
+      fd.fd = socket;
+      fd.events = events;
+      fds_.push_back(fd);
+    } else {
+      Find(socket)->events = events;
+    }
+    return true;
+#endif
+  }
+
+  void Unwatch(qbSocket socket) {
+#ifdef __COMPILE_AS_LINUX__
+    epoll_event e = {};
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, socket, &e);
+#else
+    fds_.erase(Find(socket));
+#endif
+  }
+
+  // Appends every ready socket and its QB_SOCKET_* flags.
+  void Poll(std::vector<std::pair<qbSocket, int>>* ready) {
+#ifdef __COMPILE_AS_LINUX__
+    int count;
+    do {
+      count = epoll_wait(epoll_fd_, events_, kMaxEvents, 0);
+      for (int i = 0; i < count; ++i) {
+        qbSocket socket = events_[i].data.fd;
+        ready->push_back({ socket, FromEpoll(events_[i].events) });
+      }
+    } while (count == kMaxEvents);
+#else
+    if (fds_.empty()) {
+      return;
+    }
+#ifdef __COMPILE_AS_WINDOWS__
+    int count = WSAPoll(fds_.data(), (ULONG)fds_.size(), 0);
+#else
+    int count = poll(fds_.data(), fds_.size(), 0);
+#endif
+    for (size_t i = 0; i < fds_.size() && count > 0; ++i) {
+      if (fds_[i].revents) {
+        ready->push_back({ (qbSocket)fds_[i].fd, FromPoll(fds_[i].revents) });
+        --count;
+      }
+    }
+#endif
+  }
+
+private:
+#ifdef __COMPILE_AS_LINUX__
+  static uint32_t ToEpoll(int interest) {
+    return ((interest & QB_SOCKET_READABLE) ? (uint32_t)EPOLLIN : 0) |
+           ((interest & QB_SOCKET_WRITABLE) ? (uint32_t)EPOLLOUT : 0);
+  }
+
+  static int FromEpoll(uint32_t events) {
+    return ((events & EPOLLIN) ? QB_SOCKET_READABLE : 0) |
+           ((events & EPOLLOUT) ? QB_SOCKET_WRITABLE : 0) |
+           ((events & (EPOLLHUP | EPOLLERR)) ? QB_SOCKET_CLOSED : 0);
+  }
+
+  static const int kMaxEvents = 256;
+  int epoll_fd_;
+  epoll_event events_[kMaxEvents];
+#else
+#ifdef __COMPILE_AS_WINDOWS__
+  typedef WSAPOLLFD PollFd;
+#else
+  typedef pollfd PollFd;
+#endif
+
+  static short ToPoll(int interest) {
+    return ((interest & QB_SOCKET_READABLE) ? POLLIN : 0) |
+           ((interest & QB_SOCKET_WRITABLE) ? POLLOUT : 0);
+  }
+
+  static int FromPoll(short events) {
+    return ((events & POLLIN) ? QB_SOCKET_READABLE : 0) |
+           ((events & POLLOUT) ? QB_SOCKET_WRITABLE : 0) |
+           ((events & (POLLHUP | POLLERR | POLLNVAL)) ? QB_SOCKET_CLOSED : 0);
+  }
+
+  std::vector<PollFd>::iterator Find(qbSocket socket) {
+    return std::find_if(fds_.begin(), fds_.end(), [socket](const PollFd& fd) {
+      return (qbSocket)fd.fd == socket;
+    });
+  }
+
+  std::vector<PollFd> fds_;
+#endif
+};
+
+Reactor* reactor_ = nullptr;
+std::unordered_map<qbSocket, qbSocketWatchAttr_> watches_;
+std::vector<std::pair<qbSocket, int>> ready_;
+std::vector<qbPacketBuffer> held_[2];
+size_t generation_ = 0;
 
+bool set_nonblocking(qbSocket socket) {
+#ifdef __COMPILE_AS_WINDOWS__
+  u_long mode = 1;
+  return ioctlsocket(socket, FIONBIO, &mode) == 0;
+#else
+  int flags = fcntl(socket, F_GETFL, 0);
+  return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+// Receives up to kMaxDatagramsPerPoll datagrams into packet buffers. The
+// reactor holds a reference to each until the frame after next, so that
+// handlers on other program threads see them too.
+template<class Container_>
+void recv_datagrams(qbSocket socket, const qbSocketWatchAttr_& watch,
+                    Container_* events) {
+  qbPacketBuffer buffers[kRecvBatch];
+  qbEndpoint_ endpoints[kRecvBatch];
+
+  for (size_t total = 0; total < kMaxDatagramsPerPoll;) {
+    int32_t res = qb_socket_recvbuffers(socket, buffers, endpoints, kRecvBatch, 0);
+    if (res < 0) {
+      if (errno != QB_SOCKET_EWOULDBLOCK) {
+        qbSocketEvent_ e = {};
+        e.socket = socket;
+        e.events = QB_SOCKET_CLOSED;
+        e.user = watch.user;
+        events->push_back(e);
+      }
+      return;
+    }
+
+    for (int32_t i = 0; i < res; ++i) {
+      qbSocketEvent_ e = {};
+      e.socket = socket;
+      e.events = QB_SOCKET_READABLE;
+      e.user = watch.user;
+      e.buffer = buffers[i];
+      e.data = buffers[i]->data;
+      e.size = buffers[i]->size;
+      e.from = endpoints[i];
+      events->push_back(e);
+      held_[generation_].push_back(buffers[i]);
+    }
+    total += res;
+    if ((size_t)res < kRecvBatch) {
+      return;
+    }
+  }
+}
+
+void release_held(std::vector<qbPacketBuffer>* held) {
+  for (qbPacketBuffer buffer : *held) {
+    qb_packetbuffer_release(buffer);
+  }
+  held->clear();
+}
+
+}  // namespace
 
 void network_initialize() {
 #ifdef __COMPILE_AS_WINDOWS__
@@ -38,10 +251,104 @@ void network_initialize() {
     return;
   }
 #endif
+  reactor_ = new Reactor();
 }
 
 void network_shutdown() {
+  delete reactor_;
+  reactor_ = nullptr;
+  watches_.clear();
+  release_held(&held_[0]);
+  release_held(&held_[1]);
 #ifdef __COMPILE_AS_WINDOWS__
   WSACleanup();
 #endif
-}
\ No newline at end of file
+}
+
+void network_nextframe() {
+  generation_ ^= 1;
+  release_held(&held_[generation_]);
+}
+
+void network_poll() {
+  if (!reactor_) {
+    return;
+  }
+
+  if (watches_.empty()) {
+    return;
+  }
+
+  ready_.clear();
+  reactor_->Poll(&ready_);
+  if (ready_.empty()) {
+    return;
+  }
+
+  // Few events are shared by many sockets, so batches are found linearly.
+  FrameVector<std::pair<qbEvent, FrameVector<qbSocketEvent_>>> batches;
+  for (const auto& ready : ready_) {
+    auto found = watches_.find(ready.first);
+    if (found == watches_.end()) {
+      continue;
+    }
+    const qbSocketWatchAttr_& watch = found->second;
+
+    auto batch = std::find_if(batches.begin(), batches.end(),
+                              [&watch](const auto& batch) {
+      return batch.first == watch.event;
+    });
+    if (batch == batches.end()) {
+      batches.push_back({ watch.event, {} });
+      batch = batches.end() - 1;
+    }
+
+    int flags = ready.second;
+    if (watch.recv_datagrams && (flags & QB_SOCKET_READABLE)) {
+      recv_datagrams(ready.first, watch, &batch->second);
+      flags &= ~QB_SOCKET_READABLE;
+    }
+    if (flags) {
+      qbSocketEvent_ e = {};
+      e.socket = ready.first;
+      e.events = flags;
+      e.user = watch.user;
+      batch->second.push_back(e);
+    }
+  }
+
+  for (auto& batch : batches) {
+    if (batch.second.empty()) {
+      continue;
+    }
+    qbSocketEventBatch_ message;
+    message.count = batch.second.size();
+    message.events = batch.second.data();
+    qb_event_send(batch.first, &message);
+  }
+}
+
+qbResult qb_socket_watch(qbSocket socket, qbSocketWatchAttr attr) {
+  if (!reactor_) {
+    return QB_ERROR_BAD_RUN_STATE;
+  }
+  bool is_new = watches_.find(socket) == watches_.end();
+  if (is_new && !set_nonblocking(socket)) {
+    return QB_ERROR_SOCKET;
+  }
+  if (!reactor_->Watch(socket, attr->interest, is_new)) {
+    return QB_ERROR_SOCKET;
+  }
+  watches_[socket] = *attr;
+  return QB_OK;
+}
+
+qbResult qb_socket_unwatch(qbSocket socket) {
+  auto found = watches_.find(socket);
+  if (!reactor_ || found == watches_.end()) {
+    return QB_ERROR_NOT_FOUND;
+  }
+  reactor_->Unwatch(socket);
+  watches_.erase(found);
+  return QB_OK;
+}
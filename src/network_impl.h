@@ -22,4 +22,12 @@
 void network_initialize();
 void network_shutdown();
 
+// Polls the sockets watched by the reactor without blocking and sends the
+// batches of socket events. Called once per fixed update.
+void network_poll();
+
+// Releases the packet buffers received the frame before last. Called once per
+// frame, next to frame_alloc_nextframe().
+void network_nextframe();
+
 #endif  // NETWORK__H
\ No newline at end of file
@@ -0,0 +1,205 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include <cubez/socket.h>
+#include <cubez/common.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace {
+
+// A buffer and its bookkeeping share the first cache line, the data starts on
+// the next one.
+struct alignas(64) Slot {
+  // Must be first, a qbPacketBuffer is a pointer to the slot.
+  qbPacketBuffer_ buffer;
+  std::atomic<int32_t> refs;
+  Slot* next;
+
+  alignas(64) uint8_t data[QB_PACKET_BUFFER_CAPACITY];
+};
+static_assert(sizeof(Slot) == 2048, "A slot should be 2KB.");
+
+const size_t kSlotsPerSlab = 256;
+
+const size_t kMaxBatch = 64;
+
+class PacketPool {
+public:
+  ~PacketPool() {
+    for (Slot* slab : slabs_) {
+      ALIGNED_FREE(slab);
+    }
+  }
+
+  // Takes count buffers under one lock.
+  void Alloc(qbPacketBuffer* buffers, size_t count) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      for (size_t i = 0; i < count; ++i) {
+        if (!free_) {
+          Grow();
+        }
+        buffers[i] = &free_->buffer;
+        free_ = free_->next;
+      }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+      Slot* slot = (Slot*)buffers[i];
+      slot->next = nullptr;
+      slot->buffer.size = 0;
+      slot->refs.store(1, std::memory_order_relaxed);
+    }
+  }
+
+  void Free(Slot* slot) {
+    std::lock_guard<std::mutex> lock(mu_);
+    slot->next = free_;
+    free_ = slot;
+  }
+
+  // Returns count buffers that were never shared, under one lock.
+  void Free(qbPacketBuffer* buffers, size_t count) {
+    if (count == 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mu_);
+    for (size_t i = 0; i < count; ++i) {
+      Slot* slot = (Slot*)buffers[i];
+      slot->next = free_;
+      free_ = slot;
+    }
+  }
+
+private:
+  void Grow() {
+    Slot* slab = (Slot*)ALIGNED_ALLOC(sizeof(Slot) * kSlotsPerSlab, alignof(Slot));
+    if (!slab) {
+      FATAL("Could not allocate packet buffers.");
+    }
+    slabs_.push_back(slab);
+
+    for (size_t i = 0; i < kSlotsPerSlab; ++i) {
+      Slot* slot = new (slab + i) Slot;
+      slot->buffer.data = slot->data;
+      slot->buffer.size = 0;
+      slot->buffer.capacity = QB_PACKET_BUFFER_CAPACITY;
+      slot->refs.store(0, std::memory_order_relaxed);
+      slot->next = free_;
+      free_ = slot;
+    }
+  }
+
+  std::mutex mu_;
+  Slot* free_ = nullptr;
+  std::vector<Slot*> slabs_;
+};
+
+PacketPool& pool() {
+  static PacketPool pool;
+  return pool;
+}
+
+}  // namespace
+
+qbPacketBuffer qb_packetbuffer_alloc() {
+  qbPacketBuffer buffer;
+  pool().Alloc(&buffer, 1);
+  return buffer;
+}
+
+void qb_packetbuffer_ref(qbPacketBuffer buffer) {
+  ((Slot*)buffer)->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void qb_packetbuffer_release(qbPacketBuffer buffer) {
+  Slot* slot = (Slot*)buffer;
+  if (slot->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    pool().Free(slot);
+  }
+}
+
+int32_t qb_socket_sendbuffers(qbSocket socket, const qbPacketBuffer* buffers,
+                              const qbEndpoint_* endpoints, size_t count, int flags) {
+  qbPacket_ packets[kMaxBatch];
+
+  size_t sent = 0;
+  while (sent < count) {
+    size_t n = std::min(count - sent, kMaxBatch);
+    for (size_t i = 0; i < n; ++i) {
+      packets[i].buf = (char*)buffers[sent + i]->data;
+      packets[i].len = buffers[sent + i]->size;
+      packets[i].endpoint = endpoints[sent + i];
+    }
+
+    int32_t res = qb_socket_sendbatch(socket, packets, n, flags);
+    if (res < 0 && sent == 0) {
+      for (size_t i = 0; i < count; ++i) {
+        qb_packetbuffer_release(buffers[i]);
+      }
+      return -1;
+    }
+    // An error after the first batch ends the send with what went out.
+    if (res < 0) {
+      break;
+    }
+    sent += (size_t)res;
+    if ((size_t)res < n) {
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    qb_packetbuffer_release(buffers[i]);
+  }
+  return (int32_t)sent;
+}
+
+int32_t qb_socket_recvbuffers(qbSocket socket, qbPacketBuffer* buffers,
+                              qbEndpoint_* endpoints, size_t count, int flags) {
+  // One call, so that only the first datagram can block.
+  thread_local std::vector<qbPacket_> packets;
+  packets.resize(count);
+  pool().Alloc(buffers, count);
+  for (size_t i = 0; i < count; ++i) {
+    packets[i].buf = (char*)buffers[i]->data;
+    packets[i].cap = buffers[i]->capacity;
+  }
+
+  int32_t res = qb_socket_recvbatch(socket, packets.data(), count, flags);
+  size_t received = res > 0 ? (size_t)res : 0;
+  for (size_t i = 0; i < received; ++i) {
+    buffers[i]->size = std::min(packets[i].len, buffers[i]->capacity);
+    endpoints[i] = packets[i].endpoint;
+  }
+
+  // The unused buffers go back in one batch, so a poll that finds a single
+  // datagram takes the lock twice.
+  pool().Free(buffers + received, count - received);
+  for (size_t i = received; i < count; ++i) {
+    buffers[i] = nullptr;
+  }
+  return res;
+}
@@ -0,0 +1,122 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "pointer_pool.h"
+#include "defs.h"
+
+#include <cstdlib>
+
+namespace {
+
+const size_t kLargeClass = 7;
+
+const uint32_t kMagic = 0x9B0C7E11;
+
+}  // namespace
+
+PointerPool::~PointerPool() {
+  while (large_) {
+    Large* next = large_->next;
+    free(large_);
+    large_ = next;
+  }
+}
+
+void* PointerPool::Alloc(size_t size) {
+  size_t total = size + sizeof(Header);
+  size_t size_class = 0;
+  while (size_class < kLargeClass && ((size_t)32 << size_class) < total) {
+    ++size_class;
+  }
+
+  Header* header;
+  {
+    std::lock_guard<std::mutex> l(mu_);
+    switch (size_class) {
+      case 0: header = (Header*)pool_32_.allocate(); break;
+      case 1: header = (Header*)pool_64_.allocate(); break;
+      case 2: header = (Header*)pool_128_.allocate(); break;
+      case 3: header = (Header*)pool_256_.allocate(); break;
+      case 4: header = (Header*)pool_512_.allocate(); break;
+      case 5: header = (Header*)pool_1024_.allocate(); break;
+      case 6: header = (Header*)pool_2048_.allocate(); break;
+      default: {
+        Large* large = (Large*)malloc(sizeof(Large) + total);
+        if (!large) {
+          FATAL("Could not allocate a component payload of " << size << " bytes.");
+        }
+        large->prev = nullptr;
+        large->next = large_;
+        if (large_) {
+          large_->prev = large;
+        }
+        large_ = large;
+        header = (Header*)(large + 1);
+      }
+    }
+  }
+
+  header->pool = this;
+  header->size_class = (uint32_t)size_class;
+  header->magic = kMagic;
+  return header + 1;
+}
+
+void PointerPool::Free(void* payload) {
+  if (!payload) {
+    return;
+  }
+
+  Header* header = (Header*)payload - 1;
+  header->magic = 0;
+  std::lock_guard<std::mutex> l(mu_);
+  switch (header->size_class) {
+    case 0: pool_32_.deallocate((Slot<32>*)header); break;
+    case 1: pool_64_.deallocate((Slot<64>*)header); break;
+    case 2: pool_128_.deallocate((Slot<128>*)header); break;
+    case 3: pool_256_.deallocate((Slot<256>*)header); break;
+    case 4: pool_512_.deallocate((Slot<512>*)header); break;
+    case 5: pool_1024_.deallocate((Slot<1024>*)header); break;
+    case 6: pool_2048_.deallocate((Slot<2048>*)header); break;
+    default: {
+      Large* large = (Large*)header - 1;
+      if (large->prev) {
+        large->prev->next = large->next;
+      } else {
+        large_ = large->next;
+      }
+      if (large->next) {
+        large->next->prev = large->prev;
+      }
+      free(large);
+    }
+  }
+}
+
+void PointerPool::Release(void* payload) {
+  if (!payload) {
+    return;
+  }
+
+  Header* header = (Header*)payload - 1;
+  if (header->magic == kMagic) {
+    header->pool->Free(payload);
+  } else {
+    free(payload);
+  }
+}
@@ -0,0 +1,87 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef POINTER_POOL__H
+#define POINTER_POOL__H
+
+#include "memory_pool.h"
+
+#include <cstdint>
+#include <mutex>
+
+// Allocates the payloads of a QB_COMPONENT_TYPE_POINTER component. Requests
+// are rounded up to a power-of-two size class between 32B and 2KB and served
+// from a MemoryPool per class; anything larger goes to malloc. Every payload
+// is preceded by a small header with its pool, its size class and a magic
+// value, so it can be freed without knowing its size and told apart from a
+// payload the user allocated with malloc.
+//
+// Destroying the pool releases all of its blocks at once, whether or not the
+// payloads were freed.
+class PointerPool {
+ public:
+  PointerPool() = default;
+  PointerPool(const PointerPool&) = delete;
+  PointerPool& operator=(const PointerPool&) = delete;
+  ~PointerPool();
+
+  void* Alloc(size_t size);
+  void Free(void* payload);
+
+  // Returns a payload to the pool that allocated it, or to free() if it was
+  // not allocated by a pool.
+  static void Release(void* payload);
+
+ private:
+  template<size_t N>
+  struct alignas(16) Slot {
+    uint8_t bytes[N];
+  };
+
+  // Keeps payloads aligned to 16 bytes. The magic is last so that it is read
+  // from the allocator's own bookkeeping in front of a malloc'd payload, which
+  // never holds it.
+  struct alignas(16) Header {
+    PointerPool* pool;
+    uint32_t size_class;
+    uint32_t magic;
+  };
+
+  // Each block holds 64 slots.
+  template<size_t N>
+  using Pool = MemoryPool<Slot<N>, N * 64>;
+
+  std::mutex mu_;
+  Pool<32> pool_32_;
+  Pool<64> pool_64_;
+  Pool<128> pool_128_;
+  Pool<256> pool_256_;
+  Pool<512> pool_512_;
+  Pool<1024> pool_1024_;
+  Pool<2048> pool_2048_;
+
+  // Payloads too large for any size class are kept in a list so they can be
+  // freed on destruction.
+  struct alignas(16) Large {
+    Large* prev;
+    Large* next;
+  };
+  Large* large_ = nullptr;
+};
+
+#endif  // POINTER_POOL__H
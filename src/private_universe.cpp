@@ -18,8 +18,15 @@
 
 #include "private_universe.h"
 #include "system_impl.h"
+#include "replay_internal.h"
+#include "replication_internal.h"
+#include "save_file.h"
 #include "snapshot.h"
 
+// Bounds the number of component blocks freed per frame, so that releasing the
+// storage of a large wave of destroyed entities is spread across frames.
+const size_t kCompactBlocksPerFrame = 64;
+
 #ifdef __COMPILE_AS_WINDOWS__
 #undef CreateEvent
 #undef SendMessage
@@ -115,6 +122,7 @@ qbResult Runner::assert_in_state(std::vector<State>&& allowed) {
 PrivateUniverse::PrivateUniverse() {  
   programs_ = std::make_unique<ProgramRegistry>();
   components_ = std::make_unique<ComponentRegistry>();
+  rollback_ = std::make_unique<Rollback>();
 
   scene_create(&baseline_, "");
   working_ = active_ = baseline_;
@@ -139,11 +147,61 @@ qbResult PrivateUniverse::loop() {
   runner_.transition({RunState::RUNNING, RunState::STARTED}, RunState::LOOPING);
 
   WorkingScene()->Flush();
+  WorkingScene()->Compact(kCompactBlocksPerFrame);
+  replay_capture(WorkingScene());
+  replication_capture(WorkingScene());
   programs_->Run(WorkingScene());
 
   return runner_.transition(RunState::LOOPING, RunState::RUNNING);
 }
 
+qbResult PrivateUniverse::rollback_save(uint64_t frame) {
+  if (runner_.assert_in_state({ RunState::RUNNING, RunState::STARTED }) != QB_OK) {
+    return QB_ERROR_BAD_RUN_STATE;
+  }
+  GameState* state = active_->state;
+  state->Flush();
+  rollback_->Save(frame, state);
+  return QB_OK;
+}
+
+qbResult PrivateUniverse::rollback_restore(uint64_t frame) {
+  if (runner_.assert_in_state({ RunState::RUNNING, RunState::STARTED }) != QB_OK) {
+    return QB_ERROR_BAD_RUN_STATE;
+  }
+  return rollback_->Restore(frame, active_->state);
+}
+
+qbResult PrivateUniverse::resimulate(uint64_t from, uint64_t to,
+                                     qbRollbackInputs inputs) {
+  if (from > to) {
+    return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+  }
+  qbResult result = rollback_restore(from);
+  if (result != QB_OK) {
+    return result;
+  }
+
+  // Runs the systems the same way as loop(), without the captures.
+  scene_reset();
+  GameState* state = WorkingScene();
+  rollback_setresimulating(true);
+  for (uint64_t frame = from; frame < to; ++frame) {
+    if (inputs && inputs->on_frame) {
+      inputs->on_frame(frame, inputs->arg);
+    }
+    runner_.transition({ RunState::RUNNING, RunState::STARTED }, RunState::LOOPING);
+    state->Flush();
+    programs_->Run(state);
+    runner_.transition(RunState::LOOPING, RunState::RUNNING);
+
+    state->Flush();
+    rollback_->Save(frame + 1, state);
+  }
+  rollback_setresimulating(false);
+  return QB_OK;
+}
+
 qbResult PrivateUniverse::stop() {
   return runner_.transition({RunState::RUNNING, RunState::UNKNOWN}, RunState::STOPPED);
 }
@@ -289,6 +347,23 @@ size_t PrivateUniverse::component_getcount(qbComponent component) {
   return WorkingScene()->ComponentGetCount(component);
 }
 
+void* PrivateUniverse::component_alloc(qbComponent component, size_t size) {
+  Component* loading = Component::Deserializing();
+  if (loading && loading->Id() == component) {
+    return loading->Alloc(size);
+  }
+  return WorkingScene()->ComponentGet(component)->Alloc(size);
+}
+
+qbResult PrivateUniverse::component_shrink(qbComponent component) {
+  WorkingScene()->ComponentGet(component)->Shrink(SIZE_MAX);
+  return QB_OK;
+}
+
+const qbComponentAttr_* PrivateUniverse::component_attr(qbComponent component) {
+  return components_->Find(component);
+}
+
 qbResult PrivateUniverse::instance_oncreate(qbComponent component,
                                             qbInstanceOnCreate on_create) {
   qbSystemAttr attr;
@@ -401,7 +476,7 @@ qbResult PrivateUniverse::scene_create(qbScene* scene, const char* name) {
     
     ret->name = new_name;
   } else {
-    ret->name = new char('\0');
+    ret->name = new char[1]();
   }
   *scene = ret;
   return QB_OK;
@@ -422,7 +497,8 @@ qbResult PrivateUniverse::scene_destroy(qbScene* scene) {
   }
 
   // Delete the game state to destroy all entities.
-  delete (*scene)->name;
+  rollback_->Forget((*scene)->state);
+  delete[] (*scene)->name;
   delete (*scene)->state;
   delete *scene;
   *scene = nullptr;
@@ -456,6 +532,34 @@ qbResult PrivateUniverse::scene_attach(qbScene scene, const char* key, void* val
   return QB_OK;
 }
 
+qbResult PrivateUniverse::scene_save(qbScene scene, const char* file) {
+  return SaveFile::Write(scene->state, file);
+}
+
+qbResult PrivateUniverse::scene_load(qbScene* scene, const char* name,
+                                     const char* file) {
+  qbScene ret = nullptr;
+  scene_create(&ret, name);
+  qbResult result = SaveFile::Read(ret->state, file);
+  if (result != QB_OK) {
+    // Not destroyed through scene_destroy() since it was never seen by users.
+    delete[] ret->name;
+    delete ret->state;
+    delete ret;
+    return result;
+  }
+  *scene = ret;
+  return QB_OK;
+}
+
+qbResult PrivateUniverse::save(const char* file) {
+  return SaveFile::Write(WorkingScene(), file);
+}
+
+qbResult PrivateUniverse::load(const char* file) {
+  return SaveFile::Read(WorkingScene(), file);
+}
+
 qbResult PrivateUniverse::scene_activate(qbScene scene) {
   if (active_ == scene) {
     return QB_OK;
@@ -24,6 +24,7 @@
 #include "component_registry.h"
 #include "entity_registry.h"
 #include "program_registry.h"
+#include "rollback.h"
 
 #include <mutex>
 
@@ -145,6 +146,12 @@ class PrivateUniverse {
   // Component manipulation.
   qbResult component_create(qbComponent* component, qbComponentAttr attr);
   size_t component_getcount(qbComponent component);
+  void* component_alloc(qbComponent component, size_t size);
+  qbResult component_shrink(qbComponent component);
+
+  // Returns the attributes the component was created with or nullptr if it
+  // does not exist.
+  const qbComponentAttr_* component_attr(qbComponent component);
 
   // Synchronization methods.
   qbBarrier barrier_create();
@@ -158,6 +165,16 @@ class PrivateUniverse {
   qbResult scene_reset();
   qbResult scene_activate(qbScene scene);
   qbResult scene_attach(qbScene scene, const char* key, void* value);
+  qbResult scene_save(qbScene scene, const char* file);
+  qbResult scene_load(qbScene* scene, const char* name, const char* file);
+
+  // Saves or loads the working scene.
+  qbResult save(const char* file);
+  qbResult load(const char* file);
+  qbResult rollback_save(uint64_t frame);
+  qbResult rollback_restore(uint64_t frame);
+  qbResult resimulate(uint64_t from, uint64_t to, qbRollbackInputs inputs);
+
   qbResult scene_ondestroy(qbScene scene, void(*fn)(qbScene scene,
                                                     size_t count,
                                                     const char* keys[],
@@ -193,6 +210,8 @@ class PrivateUniverse {
   qbScene working_;
 
   std::vector<qbBarrier> barriers_;
+
+  std::unique_ptr<Rollback> rollback_;
 };
 
 #endif  // PRIVATE_UNIVERSE__H
@@ -21,7 +21,8 @@
 
 ProgramImpl::ProgramImpl(qbProgram* program)
     : program_(program),
-      events_(program->id) {}
+      events_(program->id),
+      memory_(QB_MEMORY_TAG_PROGRAM, program->id) {}
 
 ProgramImpl* ProgramImpl::FromRaw(qbProgram* program) {
   return (ProgramImpl*)program->self;
@@ -121,6 +122,8 @@ qbSystem ProgramImpl::AllocSystem(qbId id, const qbSystemAttr_& attr) {
   SystemImpl* impl = SystemImpl::FromRaw(p);
 
   new (impl) SystemImpl(attr, p, attr.components);
+  memory_.Add(sizeof(qbSystem_) + sizeof(SystemImpl),
+              sizeof(qbSystem_) + sizeof(SystemImpl));
 
   return p;
 }
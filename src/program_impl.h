@@ -23,6 +23,7 @@
 #include "component_registry.h"
 #include "event_registry.h"
 #include "game_state.h"
+#include "memory_stats.h"
 
 class ProgramImpl {
  public:
@@ -64,6 +65,8 @@ class ProgramImpl {
   std::vector<qbSystem> systems_;
   std::vector<qbSystem> loop_systems_;
   std::set<qbSystem> event_systems_;
+
+  MemoryAccount memory_;
 };
 
 #endif  // PROGRAM_IMPL__H
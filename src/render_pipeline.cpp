@@ -33,6 +33,8 @@
 #include <stdlib.h>
 #include <cubez/render.h>
 #include "shader.h"
+#include "memory_stats.h"
+#include "gpu_heap.h"
 #include <cubez/utils.h>
 #include <vector>
 #include <assert.h>
@@ -102,6 +104,14 @@ typedef struct qbGpuBuffer_ {
   int sharing_type;
 } qbGpuBuffer_;
 
+typedef struct qbGpuHeap_ {
+  const char* name;
+  qbGpuBufferType buffer_type;
+
+  GpuHeap* heap;
+  std::vector<qbGpuBuffer> pages;
+} qbGpuHeap_;
+
 typedef struct qbMeshBuffer_ {
   const char* name;
   qbRenderExt ext;
@@ -669,9 +679,11 @@ void qb_gpubuffer_create(qbGpuBuffer* buffer_ref, qbGpuBufferAttr attr) {
   glBindBuffer(target, buffer->id);
   glBufferData(target, buffer->size, buffer->data, GL_DYNAMIC_DRAW);
   CHECK_GL();
+  memory_track(QB_MEMORY_TAG_RENDER, buffer->size, buffer->size);
 }
 
 void qb_gpubuffer_destroy(qbGpuBuffer* buffer) {
+  memory_track(QB_MEMORY_TAG_RENDER, -(int64_t)(*buffer)->size, -(int64_t)(*buffer)->size);
   free((void*)(*buffer)->name);
   glDeleteBuffers(1, &(*buffer)->id);
   delete[] (*buffer)->data;
@@ -706,6 +718,102 @@ void qb_gpubuffer_swap(qbGpuBuffer a, qbGpuBuffer b) {
   std::swap(*a, *b);
 }
 
+namespace {
+
+// Creates and destroys buffers to match the pages of the heap.
+void gpuheap_sync(qbGpuHeap heap) {
+  heap->pages.resize(heap->heap->PageCount(), nullptr);
+  for (uint32_t i = 0; i < heap->pages.size(); ++i) {
+    uint64_t size = heap->heap->PageSize(i);
+    qbGpuBuffer& page = heap->pages[i];
+    if (page && page->size != size) {
+      qb_gpubuffer_destroy(&page);
+    }
+    if (!page && size > 0) {
+      qbGpuBufferAttr_ attr = {};
+      attr.name = heap->name;
+      attr.size = size;
+      attr.elem_size = 1;
+      attr.buffer_type = heap->buffer_type;
+      qb_gpubuffer_create(&page, &attr);
+    }
+  }
+}
+
+}  // namespace
+
+void qb_gpuheap_create(qbGpuHeap* heap_ref, qbGpuHeapAttr attr) {
+  *heap_ref = new qbGpuHeap_;
+  qbGpuHeap heap = *heap_ref;
+  heap->name = STRDUP(attr->name ? attr->name : "");
+  heap->buffer_type = attr->buffer_type;
+  heap->heap = new GpuHeap(attr->page_size, attr->alignment ? attr->alignment : 256);
+}
+
+void qb_gpuheap_destroy(qbGpuHeap* heap) {
+  for (qbGpuBuffer& page : (*heap)->pages) {
+    if (page) {
+      qb_gpubuffer_destroy(&page);
+    }
+  }
+  delete (*heap)->heap;
+  free((void*)(*heap)->name);
+  delete *heap;
+  *heap = nullptr;
+}
+
+qbId qb_gpuheap_alloc(qbGpuHeap heap, size_t size, void* data) {
+  GpuHeap::Handle handle = heap->heap->Alloc(size);
+  if (handle == GpuHeap::kInvalidHandle) {
+    return -1;
+  }
+  gpuheap_sync(heap);
+
+  if (data) {
+    qb_gpuheap_update(heap, handle, 0, size, data);
+  }
+  return handle;
+}
+
+void qb_gpuheap_free(qbGpuHeap heap, qbId allocation) {
+  heap->heap->Free((GpuHeap::Handle)allocation);
+}
+
+void qb_gpuheap_update(qbGpuHeap heap, qbId allocation, intptr_t offset, size_t size, void* data) {
+  const GpuHeap::Location* location = heap->heap->Find((GpuHeap::Handle)allocation);
+  if (!location) {
+    return;
+  }
+  qb_gpubuffer_update(heap->pages[location->page], location->offset + offset, size, data);
+}
+
+qbGpuBuffer qb_gpuheap_buffer(qbGpuHeap heap, qbId allocation, intptr_t* offset) {
+  const GpuHeap::Location* location = heap->heap->Find((GpuHeap::Handle)allocation);
+  if (!location) {
+    return nullptr;
+  }
+  if (offset) {
+    *offset = (intptr_t)location->offset;
+  }
+  return heap->pages[location->page];
+}
+
+size_t qb_gpuheap_defragment(qbGpuHeap heap, size_t max_bytes) {
+  std::vector<GpuHeap::Move> moves = heap->heap->Defragment(max_bytes);
+
+  size_t moved = 0;
+  for (const GpuHeap::Move& move : moves) {
+    qb_gpubuffer_copy(heap->pages[move.to.page], heap->pages[move.from.page],
+                      move.to.offset, move.from.offset, move.to.size);
+    moved += move.to.size;
+  }
+
+  // Buffers of released pages are destroyed only after their contents were
+  // copied out.
+  gpuheap_sync(heap);
+  return moved;
+}
+
 void qb_meshbuffer_create(qbMeshBuffer* buffer_ref, qbMeshBufferAttr attr) {
   *buffer_ref = new qbMeshBuffer_;
   qbMeshBuffer buffer = *buffer_ref;
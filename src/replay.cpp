@@ -0,0 +1,302 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "replay_internal.h"
+#include "defs.h"
+#include "game_state.h"
+#include "lz.h"
+#include "snapshot.h"
+#include "state_delta.h"
+
+#include <cubez/cubez.h>
+#include <cubez/utils.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// A replay file is a header followed by one record per frame. Records are
+// only ever appended, so a file cut short by a crash is still readable up to
+// its last whole frame.
+namespace {
+
+const char kMagic[8] = { 'Q', 'B', 'R', 'E', 'P', 'L', 'A', 'Y' };
+const uint32_t kVersion = 2;
+const uint32_t kDefaultKeyframeInterval = 300;
+
+enum FrameKind : uint32_t {
+  // The whole world.
+  FRAME_KEY = 0,
+
+  // The changes since the previous frame.
+  FRAME_DELTA = 1,
+};
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t keyframe_interval;
+};
+
+struct FrameHeader {
+  uint32_t kind;
+  uint32_t reserved;
+  uint64_t frame;
+  uint64_t raw_size;
+  uint64_t compressed_size;
+};
+
+}  // namespace
+
+struct qbRecorder_ {
+  FILE* file;
+  uint32_t keyframe_interval;
+  uint64_t frame;
+
+  // The state as of the last frame and which state it was taken of. Diffing
+  // against it only visits the blocks written to since.
+  std::unique_ptr<Snapshot> prev;
+  GameState* prev_state;
+
+  std::vector<uint8_t> raw;
+  std::vector<uint8_t> compressed;
+
+  void Capture(GameState* state) {
+    bool keyframe = !prev || prev_state != state ||
+                    frame % keyframe_interval == 0;
+    raw.clear();
+    StateDelta::Encode(keyframe ? nullptr : prev.get(), state, &raw);
+
+    compressed.resize(lz_compress_bound(raw.size()));
+    compressed.resize(lz_compress(raw.data(), raw.size(), compressed.data()));
+
+    FrameHeader header;
+    header.kind = keyframe ? FRAME_KEY : FRAME_DELTA;
+    header.reserved = 0;
+    header.frame = frame;
+    header.raw_size = raw.size();
+    header.compressed_size = compressed.size();
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(compressed.data(), 1, compressed.size(), file);
+    fflush(file);
+
+    // Replacing the snapshot releases the blocks the state has since copied.
+    prev.reset();
+    prev.reset(new Snapshot(qb_timer_query() / 1000, state));
+    prev_state = state;
+    ++frame;
+  }
+};
+
+struct qbReplay_ {
+  struct Entry {
+    uint64_t offset;
+    FrameHeader header;
+  };
+
+  FILE* file;
+  std::vector<Entry> frames;
+
+  StateDelta::World world;
+
+  // The frame that world holds, or -1 if none.
+  int64_t current;
+
+  std::vector<uint8_t> compressed;
+  std::vector<uint8_t> raw;
+
+  bool Index() {
+    FileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+        header.version != kVersion) {
+      return false;
+    }
+
+    for (;;) {
+      Entry entry;
+      entry.offset = (uint64_t)ftell(file);
+      if (fread(&entry.header, sizeof(entry.header), 1, file) != 1 ||
+          entry.header.frame != frames.size() ||
+          (frames.empty() && entry.header.kind != FRAME_KEY) ||
+          fseek(file, (long)entry.header.compressed_size, SEEK_CUR) != 0) {
+        break;
+      }
+      // Apply allocates raw_size bytes, so it must be one the compressed
+      // bytes can produce.
+      if (entry.header.compressed_size > SIZE_MAX ||
+          entry.header.raw_size >
+            lz_decompress_bound((size_t)entry.header.compressed_size)) {
+        return false;
+      }
+      frames.push_back(entry);
+    }
+
+    // Drop a last frame that was not completely written.
+    if (!frames.empty()) {
+      fseek(file, 0, SEEK_END);
+      const Entry& last = frames.back();
+      if ((uint64_t)ftell(file) <
+          last.offset + sizeof(FrameHeader) + last.header.compressed_size) {
+        frames.pop_back();
+      }
+    }
+    return true;
+  }
+
+  bool Apply(const Entry& entry, GameState* state) {
+    compressed.resize(entry.header.compressed_size);
+    raw.resize(entry.header.raw_size);
+    if (fseek(file, (long)(entry.offset + sizeof(FrameHeader)), SEEK_SET) != 0 ||
+        fread(compressed.data(), 1, compressed.size(), file) != compressed.size() ||
+        !lz_decompress(compressed.data(), compressed.size(), raw.data(), raw.size())) {
+      return false;
+    }
+    if (entry.header.kind == FRAME_KEY) {
+      world = StateDelta::World();
+    }
+    return StateDelta::Apply(raw.data(), raw.size(), state, &world);
+  }
+
+  qbResult Seek(uint64_t frame, GameState* state) {
+    if (frame >= frames.size()) {
+      return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+    }
+
+    // Play forward from the current frame if no keyframe is in between,
+    // otherwise from the closest keyframe.
+    uint64_t keyframe = frame;
+    while (frames[keyframe].header.kind != FRAME_KEY) {
+      --keyframe;
+    }
+    uint64_t start = keyframe;
+    if (current >= (int64_t)keyframe && current <= (int64_t)frame) {
+      start = (uint64_t)current + 1;
+    }
+
+    for (uint64_t i = start; i <= frame; ++i) {
+      if (!Apply(frames[i], state)) {
+        current = -1;
+        return QB_ERROR_INCOMPATIBLE_DATA_TYPES;
+      }
+      current = (int64_t)i;
+    }
+    return StateDelta::Load(world, state);
+  }
+};
+
+namespace {
+
+std::mutex recorders_mu_;
+std::vector<qbRecorder> recorders_;
+
+}  // namespace
+
+void replay_capture(GameState* state) {
+  std::lock_guard<std::mutex> l(recorders_mu_);
+  for (qbRecorder recorder : recorders_) {
+    recorder->Capture(state);
+  }
+}
+
+qbResult qb_recorder_create(qbRecorder* recorder, const char* file,
+                            qbRecorderAttr attr) {
+  FILE* f = fopen(file, "wb");
+  if (!f) {
+    *recorder = nullptr;
+    return QB_ERROR_NOT_FOUND;
+  }
+
+  qbRecorder ret = new qbRecorder_();
+  ret->file = f;
+  ret->keyframe_interval = attr && attr->keyframe_interval > 0
+    ? attr->keyframe_interval : kDefaultKeyframeInterval;
+  ret->frame = 0;
+  ret->prev_state = nullptr;
+
+  FileHeader header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.keyframe_interval = ret->keyframe_interval;
+  fwrite(&header, sizeof(header), 1, f);
+
+  std::lock_guard<std::mutex> l(recorders_mu_);
+  recorders_.push_back(ret);
+  *recorder = ret;
+  return QB_OK;
+}
+
+qbResult qb_recorder_destroy(qbRecorder* recorder) {
+  if (!*recorder) {
+    return QB_ERROR_NULL_POINTER;
+  }
+  {
+    std::lock_guard<std::mutex> l(recorders_mu_);
+    recorders_.erase(std::find(recorders_.begin(), recorders_.end(), *recorder));
+  }
+  fclose((*recorder)->file);
+  delete *recorder;
+  *recorder = nullptr;
+  return QB_OK;
+}
+
+uint64_t qb_recorder_framecount(qbRecorder recorder) {
+  std::lock_guard<std::mutex> l(recorders_mu_);
+  return recorder->frame;
+}
+
+qbResult qb_replay_open(qbReplay* replay, const char* file) {
+  *replay = nullptr;
+  FILE* f = fopen(file, "rb");
+  if (!f) {
+    return QB_ERROR_NOT_FOUND;
+  }
+
+  qbReplay ret = new qbReplay_();
+  ret->file = f;
+  ret->current = -1;
+  if (!ret->Index()) {
+    fclose(f);
+    delete ret;
+    return QB_ERROR_INCOMPATIBLE_DATA_TYPES;
+  }
+  *replay = ret;
+  return QB_OK;
+}
+
+qbResult qb_replay_close(qbReplay* replay) {
+  if (!*replay) {
+    return QB_ERROR_NULL_POINTER;
+  }
+  fclose((*replay)->file);
+  delete *replay;
+  *replay = nullptr;
+  return QB_OK;
+}
+
+uint64_t qb_replay_framecount(qbReplay replay) {
+  return replay->frames.size();
+}
+
+qbResult qb_replay_seek(qbReplay replay, uint64_t frame, qbScene scene) {
+  return replay->Seek(frame, scene->state);
+}
@@ -0,0 +1,754 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "replication_internal.h"
+#include "component.h"
+#include "bit_stream.h"
+#include "component_registry.h"
+#include "defs.h"
+#include "game_state.h"
+#include "snapshot.h"
+
+#include <cubez/network.h>
+
+#include <algorithm>
+#include <math.h>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+// A message is:
+//
+//   u32 tick, u32 baseline tick or kNoBaseline
+//   varint removed count, { varint entity delta }*
+//   u32 entity count,
+//   { varint entity delta, varint record count,
+//     { varint component << 1 | removed, [varint size, size bytes] }* }*
+//
+// Entity ids are sorted and written as the difference to the previous one.
+// Instances are packed with the fields of their component.
+namespace {
+
+const uint32_t kNoBaseline = 0xFFFFFFFF;
+const uint32_t kDefaultHistory = 32;
+const uint32_t kReplicaHistory = 64;
+
+void put_u32(std::vector<uint8_t>* out, uint32_t v) {
+  for (int i = 0; i < 4; ++i) {
+    out->push_back((uint8_t)(v >> (8 * i)));
+  }
+}
+
+void put_varint(std::vector<uint8_t>* out, uint64_t v) {
+  while (v >= 0x80) {
+    out->push_back((uint8_t)(v | 0x80));
+    v >>= 7;
+  }
+  out->push_back((uint8_t)v);
+}
+
+class Reader {
+public:
+  Reader(const uint8_t* data, size_t size) : p_(data), end_(data + size) {}
+
+  uint32_t u32() {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) {
+      v |= (uint32_t)byte() << (8 * i);
+    }
+    return v;
+  }
+
+  uint64_t varint() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      uint8_t b = byte();
+      v |= (uint64_t)(b & 0x7F) << shift;
+      if (!(b & 0x80)) {
+        break;
+      }
+    }
+    return v;
+  }
+
+  const uint8_t* bytes(uint64_t size) {
+    if ((uint64_t)(end_ - p_) < size) {
+      ok_ = false;
+      return nullptr;
+    }
+    const uint8_t* ret = p_;
+    p_ += size;
+    return ret;
+  }
+
+  bool ok() const {
+    return ok_;
+  }
+
+private:
+  uint8_t byte() {
+    if (p_ == end_) {
+      ok_ = false;
+      return 0;
+    }
+    return *p_++;
+  }
+
+  const uint8_t* p_;
+  const uint8_t* end_;
+  bool ok_ = true;
+};
+
+bool tick_newer(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) > 0;
+}
+
+}  // namespace
+
+struct qbReplicator_ {
+  struct Tick {
+    uint32_t tick;
+    std::unique_ptr<Snapshot> snapshot;
+  };
+
+  struct Client {
+    bool active = false;
+    float viewpoint[3] = {};
+
+    bool has_ack = false;
+    uint32_t acked = 0;
+
+    // The entities sent in each tick by tick % history. Sorted.
+    std::vector<uint32_t> sent_ticks;
+    std::vector<std::vector<qbEntity>> sent;
+
+    std::vector<uint8_t> message;
+  };
+
+  struct Positioned {
+    qbEntity entity;
+    float p[3];
+  };
+
+  qbReplicatorAttr_ attr;
+  std::mutex mu;
+
+  // The position is checked against its component on the first capture that
+  // finds the component. Writes fail if it does not fit.
+  bool position_checked = false;
+  qbResult error = QB_OK;
+
+  uint32_t next_tick = 0;
+  std::vector<Tick> ticks;
+  std::vector<qbComponent> replicated;
+  std::vector<qbComponentAttr_> replicated_attrs;
+
+  // Of the latest tick, the entities bucketed by grid cell and the entities
+  // every client receives.
+  std::unordered_map<uint64_t, std::vector<Positioned>> grid;
+  std::vector<qbEntity> everywhere;
+
+  std::vector<Client> clients;
+  std::vector<qbEntity> visible;
+
+  // The records of the latest tick's entities by the baseline they were
+  // encoded against, kNoBaseline if whole. Clients that acked the same tick
+  // share them. A range of size zero means the entity is unchanged.
+  struct Encoded {
+    std::unordered_map<qbEntity, std::pair<uint32_t, uint32_t>> ranges;
+    std::vector<uint8_t> bytes;
+  };
+  std::unordered_map<uint32_t, Encoded> encoded;
+
+  // Appends the record count and records of the entity to out and returns
+  // their range. Null components in "base" are treated as empty.
+  std::pair<uint32_t, uint32_t> EncodeRecords(
+    qbEntity entity, const std::vector<const Component*>& cur,
+    const std::vector<const Component*>& base, std::vector<uint8_t>* out);
+
+  void Capture(GameState* state);
+  qbResult Write(Client* client, const uint8_t** data, size_t* size);
+
+  int64_t Cell(float x) const {
+    return (int64_t)floorf(x / attr.cell_size);
+  }
+
+  static uint64_t CellKey(int64_t x, int64_t y, int64_t z) {
+    return ((uint64_t)(x & 0x1FFFFF) << 42) | ((uint64_t)(y & 0x1FFFFF) << 21) |
+           (uint64_t)(z & 0x1FFFFF);
+  }
+
+  void FindVisible(const Client& client);
+
+  // Returns the component of a captured tick, or null if it has no instances.
+  static const Component* Find(const Snapshot& snapshot, qbComponent component) {
+    auto& components = snapshot.instances_->components_;
+    return components.has(component) ? components[component] : nullptr;
+  }
+
+  // True if the instance is the same in both ticks. An instance is unchanged
+  // if both ticks still share the chunk of the index and the block it is in.
+  static bool Unchanged(const Component& cur, const Component& base, qbEntity entity) {
+    const auto& ci = cur.instances_;
+    const auto& bi = base.instances_;
+    if (ci.sparse().shares(bi.sparse(), (size_t)entity)) {
+      size_t block = ci.values().block_of(ci.sparse()[entity]);
+      if (ci.values().block(block) == bi.values().block(block)) {
+        return true;
+      }
+    }
+    return memcmp(cur.at(entity), base.at(entity), cur.ElementSize()) == 0;
+  }
+};
+
+void qbReplicator_::Capture(GameState* state) {
+  uint32_t tick = next_tick++;
+  Tick& slot = ticks[tick % ticks.size()];
+  slot.tick = tick;
+  slot.snapshot.reset(new Snapshot(0, state));
+  const Snapshot& snapshot = *slot.snapshot;
+
+  replicated.clear();
+  for (auto pair : snapshot.instances_->components_) {
+    const qbComponentAttr_* component_attr = state->components_->Find(pair.first);
+    if (component_attr && component_attr->is_replicated &&
+        component_attr->type == QB_COMPONENT_TYPE_RAW) {
+      replicated.push_back(pair.first);
+    }
+  }
+  std::sort(replicated.begin(), replicated.end());
+  replicated_attrs.clear();
+  for (qbComponent id : replicated) {
+    replicated_attrs.push_back(*state->components_->Find(id));
+  }
+  encoded.clear();
+
+  everywhere.clear();
+  for (qbComponent id : replicated) {
+    for (auto instance : *Find(snapshot, id)) {
+      everywhere.push_back(instance.first);
+    }
+  }
+  std::sort(everywhere.begin(), everywhere.end());
+  everywhere.erase(std::unique(everywhere.begin(), everywhere.end()), everywhere.end());
+
+  for (auto& cell : grid) {
+    cell.second.clear();
+  }
+  if (attr.interest && !position_checked) {
+    const qbComponentAttr_* position_attr = state->components_->Find(attr.position);
+    if (position_attr) {
+      position_checked = true;
+      if (attr.position_offset > position_attr->data_size ||
+          position_attr->data_size - attr.position_offset < 3 * sizeof(float)) {
+        error = QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+      }
+    }
+  }
+
+  const Component* position = attr.interest ? Find(snapshot, attr.position) : nullptr;
+  if (!position || error != QB_OK) {
+    return;
+  }
+
+  size_t unpositioned = 0;
+  for (qbEntity entity : everywhere) {
+    if (!position->Has(entity)) {
+      everywhere[unpositioned++] = entity;
+      continue;
+    }
+    Positioned positioned;
+    positioned.entity = entity;
+    memcpy(positioned.p, (const uint8_t*)position->at(entity) + attr.position_offset,
+           sizeof(positioned.p));
+    grid[CellKey(Cell(positioned.p[0]), Cell(positioned.p[1]), Cell(positioned.p[2]))]
+      .push_back(positioned);
+  }
+  everywhere.resize(unpositioned);
+}
+
+void qbReplicator_::FindVisible(const Client& client) {
+  visible.assign(everywhere.begin(), everywhere.end());
+
+  const float* v = client.viewpoint;
+  float r2 = attr.radius * attr.radius;
+  int64_t lo[3], hi[3];
+  for (int i = 0; i < 3; ++i) {
+    lo[i] = Cell(v[i] - attr.radius);
+    hi[i] = Cell(v[i] + attr.radius);
+  }
+  for (int64_t x = lo[0]; x <= hi[0]; ++x) {
+    for (int64_t y = lo[1]; y <= hi[1]; ++y) {
+      for (int64_t z = lo[2]; z <= hi[2]; ++z) {
+        auto found = grid.find(CellKey(x, y, z));
+        if (found == grid.end()) {
+          continue;
+        }
+        for (const Positioned& positioned : found->second) {
+          float dx = positioned.p[0] - v[0];
+          float dy = positioned.p[1] - v[1];
+          float dz = positioned.p[2] - v[2];
+          if (dx * dx + dy * dy + dz * dz <= r2) {
+            visible.push_back(positioned.entity);
+          }
+        }
+      }
+    }
+  }
+  std::sort(visible.begin(), visible.end());
+}
+
+std::pair<uint32_t, uint32_t> qbReplicator_::EncodeRecords(
+    qbEntity entity, const std::vector<const Component*>& cur,
+    const std::vector<const Component*>& base, std::vector<uint8_t>* out) {
+  thread_local std::vector<uint8_t> records;
+  thread_local std::vector<uint8_t> packed;
+  records.clear();
+  uint64_t record_count = 0;
+  for (size_t i = 0; i < replicated.size(); ++i) {
+    const Component* c = cur[i];
+    const Component* b = base[i];
+    bool has = c && c->Has(entity);
+    bool had = b && b->Has(entity);
+    if (has && (!had || !Unchanged(*c, *b, entity))) {
+      const qbComponentAttr_& component_attr = replicated_attrs[i];
+      packed.resize(component_packbound(component_attr, 1));
+      qbBitWriter_ writer;
+      qb_bitwriter_init(&writer, packed.data(), packed.size());
+      component_pack(component_attr, (const uint8_t*)c->at(entity), 1, &writer);
+      size_t packed_size;
+      qb_bitwriter_flush(&writer, &packed_size);
+
+      put_varint(&records, (uint64_t)replicated[i] << 1);
+      put_varint(&records, packed_size);
+      records.insert(records.end(), packed.begin(), packed.begin() + packed_size);
+      ++record_count;
+    } else if (!has && had) {
+      put_varint(&records, ((uint64_t)replicated[i] << 1) | 1);
+      ++record_count;
+    }
+  }
+  if (record_count == 0) {
+    return { 0, 0 };
+  }
+
+  size_t offset = out->size();
+  put_varint(out, record_count);
+  out->insert(out->end(), records.begin(), records.end());
+  return { (uint32_t)offset, (uint32_t)(out->size() - offset) };
+}
+
+qbResult qbReplicator_::Write(Client* client, const uint8_t** data, size_t* size) {
+  if (next_tick == 0) {
+    return QB_ERROR_BAD_RUN_STATE;
+  }
+  uint32_t tick = next_tick - 1;
+  uint32_t history = (uint32_t)ticks.size();
+  const Snapshot& cur = *ticks[tick % history].snapshot;
+
+  const Snapshot* base = nullptr;
+  const std::vector<qbEntity>* base_entities = nullptr;
+  if (client->has_ack && tick - client->acked < history &&
+      ticks[client->acked % history].tick == client->acked &&
+      client->sent_ticks[client->acked % history] == client->acked) {
+    base = ticks[client->acked % history].snapshot.get();
+    base_entities = &client->sent[client->acked % history];
+  }
+
+  FindVisible(*client);
+
+  std::vector<uint8_t>& out = client->message;
+  out.clear();
+  put_u32(&out, tick);
+  put_u32(&out, base ? client->acked : kNoBaseline);
+
+  // Entities that left the client's view or were destroyed.
+  std::vector<qbEntity> removed;
+  if (base_entities) {
+    std::set_difference(base_entities->begin(), base_entities->end(),
+                        visible.begin(), visible.end(), std::back_inserter(removed));
+  }
+  put_varint(&out, removed.size());
+  qbEntity prev = 0;
+  for (qbEntity entity : removed) {
+    put_varint(&out, entity - prev);
+    prev = entity;
+  }
+
+  std::vector<const Component*> cur_components(replicated.size());
+  std::vector<const Component*> base_components(replicated.size());
+  std::vector<const Component*> no_components(replicated.size());
+  for (size_t i = 0; i < replicated.size(); ++i) {
+    cur_components[i] = Find(cur, replicated[i]);
+    base_components[i] = base ? Find(*base, replicated[i]) : nullptr;
+  }
+
+  size_t count_at = out.size();
+  put_u32(&out, 0);
+  uint32_t count = 0;
+  prev = 0;
+
+  auto base_it = base_entities ? base_entities->begin() : std::vector<qbEntity>::const_iterator();
+  for (qbEntity entity : visible) {
+    bool in_base = false;
+    if (base_entities) {
+      base_it = std::lower_bound(base_it, base_entities->end(), entity);
+      in_base = base_it != base_entities->end() && *base_it == entity;
+    }
+
+    // Entities new to the client are sent whole.
+    Encoded& records = in_base ? encoded[client->acked] : encoded[kNoBaseline];
+    auto found = records.ranges.find(entity);
+    if (found == records.ranges.end()) {
+      found = records.ranges.emplace(
+        entity, EncodeRecords(entity, cur_components,
+                              in_base ? base_components : no_components,
+                              &records.bytes)).first;
+    }
+    if (found->second.second == 0) {
+      continue;
+    }
+
+    put_varint(&out, entity - prev);
+    prev = entity;
+    const uint8_t* bytes = records.bytes.data() + found->second.first;
+    out.insert(out.end(), bytes, bytes + found->second.second);
+    ++count;
+  }
+  for (int i = 0; i < 4; ++i) {
+    out[count_at + i] = (uint8_t)(count >> (8 * i));
+  }
+
+  client->sent_ticks[tick % history] = tick;
+  client->sent[tick % history] = visible;
+
+  *data = out.data();
+  *size = out.size();
+  return QB_OK;
+}
+
+namespace {
+
+std::mutex replicators_mu_;
+std::vector<qbReplicator> replicators_;
+
+}  // namespace
+
+void replication_capture(GameState* state) {
+  std::lock_guard<std::mutex> l(replicators_mu_);
+  for (qbReplicator replicator : replicators_) {
+    std::lock_guard<std::mutex> rl(replicator->mu);
+    replicator->Capture(state);
+  }
+}
+
+qbResult qb_replicator_create(qbReplicator* replicator, qbReplicatorAttr attr) {
+  qbReplicator ret = new qbReplicator_;
+  ret->attr = *attr;
+  if (ret->attr.cell_size <= 0.0f) {
+    ret->attr.cell_size = ret->attr.radius;
+  }
+  if (ret->attr.interest && ret->attr.cell_size <= 0.0f) {
+    delete ret;
+    return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+  }
+  if (ret->attr.history == 0) {
+    ret->attr.history = kDefaultHistory;
+  }
+  ret->ticks.resize(ret->attr.history);
+
+  std::lock_guard<std::mutex> l(replicators_mu_);
+  replicators_.push_back(ret);
+  *replicator = ret;
+  return QB_OK;
+}
+
+qbResult qb_replicator_destroy(qbReplicator* replicator) {
+  {
+    std::lock_guard<std::mutex> l(replicators_mu_);
+    replicators_.erase(std::find(replicators_.begin(), replicators_.end(), *replicator));
+  }
+  delete *replicator;
+  *replicator = nullptr;
+  return QB_OK;
+}
+
+qbResult qb_replicator_addclient(qbReplicator replicator, uint32_t* client) {
+  std::lock_guard<std::mutex> l(replicator->mu);
+  auto& clients = replicator->clients;
+  auto found = std::find_if(clients.begin(), clients.end(),
+                            [](const qbReplicator_::Client& c) { return !c.active; });
+  if (found == clients.end()) {
+    found = clients.insert(clients.end(), qbReplicator_::Client{});
+  }
+  *found = qbReplicator_::Client{};
+  found->active = true;
+  found->sent_ticks.assign(replicator->attr.history, kNoBaseline);
+  found->sent.resize(replicator->attr.history);
+  *client = (uint32_t)(found - clients.begin());
+  return QB_OK;
+}
+
+qbResult qb_replicator_removeclient(qbReplicator replicator, uint32_t client) {
+  std::lock_guard<std::mutex> l(replicator->mu);
+  if (client >= replicator->clients.size() || !replicator->clients[client].active) {
+    return QB_ERROR_NOT_FOUND;
+  }
+  replicator->clients[client] = qbReplicator_::Client{};
+  return QB_OK;
+}
+
+qbResult qb_replicator_setviewpoint(qbReplicator replicator, uint32_t client,
+                                    float x, float y, float z) {
+  std::lock_guard<std::mutex> l(replicator->mu);
+  if (client >= replicator->clients.size() || !replicator->clients[client].active) {
+    return QB_ERROR_NOT_FOUND;
+  }
+  float* viewpoint = replicator->clients[client].viewpoint;
+  viewpoint[0] = x;
+  viewpoint[1] = y;
+  viewpoint[2] = z;
+  return QB_OK;
+}
+
+qbResult qb_replicator_ack(qbReplicator replicator, uint32_t client, uint32_t tick) {
+  std::lock_guard<std::mutex> l(replicator->mu);
+  if (client >= replicator->clients.size() || !replicator->clients[client].active) {
+    return QB_ERROR_NOT_FOUND;
+  }
+  qbReplicator_::Client& c = replicator->clients[client];
+  if (!c.has_ack || tick_newer(tick, c.acked)) {
+    c.has_ack = true;
+    c.acked = tick;
+  }
+  return QB_OK;
+}
+
+qbResult qb_replicator_write(qbReplicator replicator, uint32_t client,
+                             const uint8_t** data, size_t* size) {
+  std::lock_guard<std::mutex> l(replicator->mu);
+  if (client >= replicator->clients.size() || !replicator->clients[client].active) {
+    return QB_ERROR_NOT_FOUND;
+  }
+  if (replicator->error != QB_OK) {
+    return replicator->error;
+  }
+  return replicator->Write(&replicator->clients[client], data, size);
+}
+
+struct qbReplica_ {
+  // A replicated entity's instances by component.
+  typedef std::vector<std::pair<qbComponent, std::vector<uint8_t>>> Instances;
+  typedef std::unordered_map<qbEntity, Instances> World;
+
+  struct Tick {
+    uint32_t tick = kNoBaseline;
+    World world;
+  };
+
+  std::vector<Tick> ticks;
+
+  bool has_applied = false;
+  uint32_t applied = 0;
+
+  // What is in the scene, and the local entity of each server entity.
+  World current;
+  std::unordered_map<qbEntity, qbEntity> local;
+
+  qbResult Apply(GameState* state, const uint8_t* data, size_t size, uint32_t* tick);
+  void Sync(GameState* state, const World& world);
+};
+
+qbResult qbReplica_::Apply(GameState* state, const uint8_t* data, size_t size,
+                           uint32_t* tick_out) {
+  Reader in(data, size);
+  uint32_t tick = in.u32();
+  uint32_t baseline = in.u32();
+  if (!in.ok()) {
+    return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+  }
+  if (has_applied && applied - tick >= kReplicaHistory && !tick_newer(tick, applied)) {
+    return QB_ERROR_NOT_FOUND;
+  }
+
+  World world;
+  if (baseline != kNoBaseline) {
+    const Tick& base = ticks[baseline % kReplicaHistory];
+    if (base.tick != baseline) {
+      return QB_ERROR_NOT_FOUND;
+    }
+    world = base.world;
+  }
+
+  uint64_t removed = in.varint();
+  qbEntity entity = 0;
+  for (uint64_t i = 0; i < removed && in.ok(); ++i) {
+    entity += (qbEntity)in.varint();
+    world.erase(entity);
+  }
+
+  uint32_t count = in.u32();
+  entity = 0;
+  for (uint32_t i = 0; i < count && in.ok(); ++i) {
+    entity += (qbEntity)in.varint();
+    Instances& instances = world[entity];
+    uint64_t records = in.varint();
+    for (uint64_t r = 0; r < records && in.ok(); ++r) {
+      uint64_t header = in.varint();
+      qbComponent component = (qbComponent)(header >> 1);
+      auto it = std::find_if(instances.begin(), instances.end(),
+                             [component](const auto& i) { return i.first == component; });
+      if (header & 1) {
+        if (it != instances.end()) {
+          instances.erase(it);
+        }
+        continue;
+      }
+      uint64_t packed_size = in.varint();
+      const uint8_t* packed = in.bytes(packed_size);
+      if (!packed) {
+        break;
+      }
+
+      // Instances of components that do not exist locally, or were packed
+      // with other fields, are skipped.
+      const qbComponentAttr_* attr = state->components_->Find(component);
+      if (!attr) {
+        continue;
+      }
+      std::vector<uint8_t> value(attr->data_size);
+      qbBitReader_ reader;
+      qb_bitreader_init(&reader, packed, (size_t)packed_size);
+      component_unpack(*attr, &reader, value.data(), 1);
+      if (reader.overflow) {
+        continue;
+      }
+      if (it == instances.end()) {
+        it = instances.insert(instances.end(), { component, {} });
+      }
+      it->second = std::move(value);
+    }
+  }
+  if (!in.ok()) {
+    return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+  }
+
+  bool is_newest = !has_applied || tick_newer(tick, applied);
+  if (is_newest) {
+    Sync(state, world);
+    has_applied = true;
+    applied = tick;
+  }
+
+  Tick& slot = ticks[tick % kReplicaHistory];
+  slot.tick = tick;
+  slot.world = std::move(world);
+
+  *tick_out = tick;
+  return QB_OK;
+}
+
+void qbReplica_::Sync(GameState* state, const World& world) {
+  for (auto it = current.begin(); it != current.end(); ++it) {
+    if (world.find(it->first) == world.end()) {
+      state->EntityDestroy(local[it->first]);
+      local.erase(it->first);
+    }
+  }
+
+  // Instances of components that do not exist locally or differ in size are
+  // skipped.
+  auto matches = [state](qbComponent component, const std::vector<uint8_t>& value) {
+    const qbComponentAttr_* attr = state->components_->Find(component);
+    return attr && attr->data_size == value.size();
+  };
+
+  for (const auto& pair : world) {
+    const Instances& instances = pair.second;
+    auto found = local.find(pair.first);
+    if (found == local.end()) {
+      qbEntityAttr_ attr;
+      for (const auto& instance : instances) {
+        if (matches(instance.first, instance.second)) {
+          attr.component_list.push_back({ instance.first, (void*)instance.second.data() });
+        }
+      }
+      qbEntity created;
+      state->EntityCreate(&created, attr);
+      local[pair.first] = created;
+      continue;
+    }
+
+    qbEntity entity = found->second;
+    const Instances* prev = nullptr;
+    auto prev_it = current.find(pair.first);
+    if (prev_it != current.end()) {
+      prev = &prev_it->second;
+    }
+
+    for (const auto& instance : instances) {
+      if (!matches(instance.first, instance.second)) {
+        continue;
+      }
+      if (prev) {
+        auto p = std::find_if(prev->begin(), prev->end(),
+                              [&instance](const auto& i) { return i.first == instance.first; });
+        if (p != prev->end() && p->second == instance.second) {
+          continue;
+        }
+      }
+      if (state->EntityHasComponent(entity, instance.first)) {
+        memcpy(state->ComponentGetEntityData(instance.first, entity),
+               instance.second.data(), instance.second.size());
+      } else {
+        state->EntityAddComponent(entity, instance.first, (void*)instance.second.data());
+      }
+    }
+
+    if (prev) {
+      for (const auto& instance : *prev) {
+        auto n = std::find_if(instances.begin(), instances.end(),
+                              [&instance](const auto& i) { return i.first == instance.first; });
+        if (n == instances.end()) {
+          state->EntityRemoveComponent(entity, instance.first);
+        }
+      }
+    }
+  }
+  current = world;
+}
+
+qbResult qb_replica_create(qbReplica* replica) {
+  *replica = new qbReplica_;
+  (*replica)->ticks.resize(kReplicaHistory);
+  return QB_OK;
+}
+
+qbResult qb_replica_destroy(qbReplica* replica) {
+  delete *replica;
+  *replica = nullptr;
+  return QB_OK;
+}
+
+qbResult qb_replica_apply(qbReplica replica, qbScene scene,
+                          const uint8_t* data, size_t size, uint32_t* tick) {
+  return replica->Apply(scene->state, data, size, tick);
+}
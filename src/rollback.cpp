@@ -0,0 +1,75 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "rollback.h"
+#include "game_state.h"
+#include "snapshot.h"
+
+#include <atomic>
+#include <iterator>
+
+namespace {
+
+std::atomic_bool resimulating_{ false };
+
+}  // namespace
+
+Rollback::Rollback() : state_(nullptr) {}
+
+Rollback::~Rollback() {}
+
+void Rollback::Save(uint64_t frame, GameState* state) {
+  if (state != state_) {
+    frames_.clear();
+    state_ = state;
+  }
+
+  // Drop the old snapshot first so that its blocks are no longer shared and
+  // the new one does not keep them alive.
+  frames_.erase(frame);
+  frames_[frame].reset(new Snapshot(0, state));
+  while (frames_.size() > QB_ROLLBACK_MAX_FRAMES) {
+    frames_.erase(frames_.begin());
+  }
+}
+
+qbResult Rollback::Restore(uint64_t frame, GameState* state) {
+  auto found = frames_.find(frame);
+  if (state != state_ || found == frames_.end()) {
+    return QB_ERROR_NOT_FOUND;
+  }
+  found->second->Restore(state);
+  frames_.erase(std::next(found), frames_.end());
+  return QB_OK;
+}
+
+void Rollback::Forget(GameState* state) {
+  if (state == state_) {
+    frames_.clear();
+    state_ = nullptr;
+  }
+}
+
+bool rollback_resimulating() {
+  return resimulating_.load(std::memory_order_relaxed);
+}
+
+void rollback_setresimulating(bool resimulating) {
+  resimulating_.store(resimulating, std::memory_order_relaxed);
+}
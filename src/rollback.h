@@ -0,0 +1,58 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef ROLLBACK__H
+#define ROLLBACK__H
+
+#include <cubez/cubez.h>
+
+#include <map>
+#include <memory>
+
+class GameState;
+class Snapshot;
+
+// The frames of a scene saved for rollback. Each is a Snapshot, so the frames
+// share every block of instances that did not change between them.
+class Rollback {
+public:
+  Rollback();
+  ~Rollback();
+
+  // Saves the state as the frame. Frames saved from another state are
+  // dropped, as is the oldest frame once there are QB_ROLLBACK_MAX_FRAMES.
+  void Save(uint64_t frame, GameState* state);
+
+  // Rewinds the state to the frame and drops the frames after it. Returns
+  // QB_ERROR_NOT_FOUND if the frame was not saved from this state.
+  qbResult Restore(uint64_t frame, GameState* state);
+
+  // Drops the frames if they were saved from the state.
+  void Forget(GameState* state);
+
+private:
+  GameState* state_;
+  std::map<uint64_t, std::unique_ptr<Snapshot>> frames_;
+};
+
+// True while qb_resimulate runs systems.
+bool rollback_resimulating();
+void rollback_setresimulating(bool resimulating);
+
+#endif  // ROLLBACK__H
@@ -0,0 +1,467 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "save_file.h"
+#include "component.h"
+#include "component_registry.h"
+#include "game_state.h"
+
+#include <algorithm>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#ifdef __COMPILE_AS_LINUX__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char kMagic[8] = { 'Q', 'B', 'S', 'A', 'V', 'E', '\r', '\n' };
+const uint32_t kVersion = 1;
+const uint64_t kPageSize = 4096;
+const uint64_t kArrayAlignment = 64;
+
+enum SectionKind : uint32_t {
+  // Index of alive entities followed by the ids free for reuse.
+  SECTION_ENTITIES = 0,
+
+  // Index of a component followed by the blocks of its instances.
+  SECTION_BLOCKS = 1,
+
+  // Dense keys of a component followed by one record per instance, each a
+  // uint64_t size and the bytes written by onserialize.
+  SECTION_SERIALIZED = 2,
+};
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t section_count;
+  uint64_t file_size;
+  uint64_t next_entity;
+};
+
+// All offsets are from the start of the file.
+struct SectionHeader {
+  uint32_t kind;
+  uint32_t component_type;
+  int64_t component;
+  uint64_t element_size;
+  uint64_t sparse_offset;
+  uint64_t sparse_count;
+  uint64_t dense_offset;
+  uint64_t dense_count;
+  uint64_t data_offset;
+  uint64_t data_size;
+  uint64_t block_stride;
+  uint64_t block_count;
+};
+
+class Writer {
+public:
+  Writer(FILE* file) : file_(file), offset_(0), ok_(true) {}
+
+  uint64_t Append(const void* data, size_t size) {
+    uint64_t at = offset_;
+    if (size > 0 && fwrite(data, 1, size, file_) != size) {
+      ok_ = false;
+    }
+    offset_ += size;
+    return at;
+  }
+
+  // Pads the file up to the alignment and returns the new offset.
+  uint64_t Align(uint64_t alignment) {
+    static const uint8_t zeros[kPageSize] = {};
+    Append(zeros, (alignment - offset_ % alignment) % alignment);
+    return offset_;
+  }
+
+  void Rewrite(uint64_t offset, const void* data, size_t size) {
+    if (fseek(file_, (long)offset, SEEK_SET) != 0 ||
+        fwrite(data, 1, size, file_) != size) {
+      ok_ = false;
+    }
+  }
+
+  uint64_t Offset() const {
+    return offset_;
+  }
+
+  bool Ok() const {
+    return ok_;
+  }
+
+private:
+  FILE* file_;
+  uint64_t offset_;
+  bool ok_;
+};
+
+template<class Ty_>
+uint64_t append_array(Writer* writer, const std::vector<Ty_>& array) {
+  uint64_t offset = writer->Align(kArrayAlignment);
+  writer->Append(array.data(), array.size() * sizeof(Ty_));
+  return offset;
+}
+
+template<class Ty_>
+uint64_t append_array(Writer* writer, const IndexVector<Ty_>& array) {
+  uint64_t offset = writer->Align(kArrayAlignment);
+  for (size_t i = 0; i < array.size(); i += array.kChunkSize) {
+    size_t chunk = i >> array.kChunkBits;
+    writer->Append(array.chunk(chunk), array.chunk_size(chunk) * sizeof(Ty_));
+  }
+  return offset;
+}
+
+// Maps the whole file copy-on-write, so that the blocks pointing into it can
+// be written to without touching the file.
+std::shared_ptr<uint8_t> map_file(const char* file, size_t* size) {
+#ifdef __COMPILE_AS_LINUX__
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+  size_t length = (size_t)st.st_size;
+  void* data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+  *size = length;
+  return std::shared_ptr<uint8_t>((uint8_t*)data, [length](uint8_t* data) {
+    munmap(data, length);
+  });
+#else
+  FILE* f = fopen(file, "rb");
+  if (!f) {
+    return nullptr;
+  }
+  fseek(f, 0, SEEK_END);
+  long length = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (length <= 0) {
+    fclose(f);
+    return nullptr;
+  }
+  size_t capacity = ((size_t)length + kPageSize - 1) & ~(size_t)(kPageSize - 1);
+  std::shared_ptr<uint8_t> data((uint8_t*)ALIGNED_ALLOC(capacity, kPageSize),
+                                [](uint8_t* data) { ALIGNED_FREE(data); });
+  size_t read = fread(data.get(), 1, (size_t)length, f);
+  fclose(f);
+  if (read != (size_t)length) {
+    return nullptr;
+  }
+  *size = (size_t)length;
+  return data;
+#endif
+}
+
+// Returns true if count elements of the given size at offset are inside the
+// file and aligned for reading in place.
+bool in_file(uint64_t offset, uint64_t count, uint64_t element_size,
+             uint64_t alignment, size_t file_size) {
+  if (offset > file_size || offset % alignment != 0) {
+    return false;
+  }
+  return element_size == 0 || count <= (file_size - offset) / element_size;
+}
+
+// Returns true if the sparse and dense arrays are the inverse of each other:
+// every dense key is inside the sparse array and maps back to its position,
+// and every other sparse entry is empty. This also rules out duplicate keys.
+bool valid_index(const qbId* sparse, uint64_t sparse_count,
+                 const uint64_t* dense, uint64_t dense_count) {
+  for (uint64_t i = 0; i < dense_count; ++i) {
+    if (dense[i] >= sparse_count || sparse[dense[i]] != (qbId)i) {
+      return false;
+    }
+  }
+  uint64_t used = 0;
+  for (uint64_t key = 0; key < sparse_count; ++key) {
+    if (sparse[key] != -1) {
+      ++used;
+    }
+  }
+  return used == dense_count;
+}
+
+}  // namespace
+
+qbResult SaveFile::Write(GameState* state, const char* file) {
+  // Decide up front which components are saved to know the size of the
+  // section table.
+  std::vector<std::pair<Component*, const qbComponentAttr_*>> saved;
+  for (auto pair : state->instances_->components_) {
+    Component* component = pair.second;
+    const qbComponentAttr_* attr = state->components_->Find(component->Id());
+    if (!attr) {
+      continue;
+    }
+    if (component->type_ == qbComponentType::QB_COMPONENT_TYPE_POINTER &&
+        !attr->onserialize) {
+      continue;
+    }
+    saved.push_back({ component, attr });
+  }
+
+  FILE* f = fopen(file, "wb");
+  if (!f) {
+    return QB_ERROR_NOT_FOUND;
+  }
+
+  FileHeader header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.section_count = (uint32_t)(saved.size() + 1);
+  header.next_entity = (uint64_t)state->entities_->id_.load();
+
+  std::vector<SectionHeader> sections(header.section_count);
+  memset(sections.data(), 0, sections.size() * sizeof(SectionHeader));
+
+  Writer writer(f);
+  writer.Append(&header, sizeof(header));
+  writer.Append(sections.data(), sections.size() * sizeof(SectionHeader));
+
+  {
+    SectionHeader& section = sections[0];
+    section.kind = SECTION_ENTITIES;
+    section.component = -1;
+
+    const SparseSet& index = state->entities_->entities_;
+    section.sparse_offset = append_array(&writer, index.sparse());
+    section.sparse_count = index.sparse().size();
+    section.dense_offset = append_array(&writer, index.dense());
+    section.dense_count = index.dense().size();
+
+    const std::vector<size_t>& free_ids = state->entities_->free_entity_ids_;
+    section.data_offset = append_array(
+      &writer, std::vector<uint64_t>(free_ids.begin(), free_ids.end()));
+    section.data_size = free_ids.size() * sizeof(uint64_t);
+  }
+
+  std::vector<uint8_t> buffer;
+  for (size_t i = 0; i < saved.size(); ++i) {
+    const Component* component = saved[i].first;
+    const qbComponentAttr_* attr = saved[i].second;
+    SectionHeader& section = sections[i + 1];
+    const auto& instances = component->instances_;
+
+    section.component = component->Id();
+    section.component_type = (uint32_t)component->type_;
+    section.element_size = instances.element_size();
+    section.dense_offset = append_array(&writer, instances.dense());
+    section.dense_count = instances.dense().size();
+
+    if (component->type_ == qbComponentType::QB_COMPONENT_TYPE_RAW ||
+        !attr->onserialize) {
+      section.kind = SECTION_BLOCKS;
+      section.sparse_offset = append_array(&writer, instances.sparse());
+      section.sparse_count = instances.sparse().size();
+
+      const BlockVector& values = instances.values();
+      section.block_stride = values.block_stride();
+      section.block_count = values.element_size() == 0
+        ? 0 : std::min(values.blocks(), values.blocks_needed());
+      section.data_offset = writer.Align(kPageSize);
+
+      buffer.resize(section.block_stride);
+      for (size_t block = 0; block < section.block_count; ++block) {
+        values.export_block(block, buffer.data());
+        writer.Append(buffer.data(), buffer.size());
+      }
+    } else {
+      section.kind = SECTION_SERIALIZED;
+      section.data_offset = writer.Align(kPageSize);
+
+      // The serializer is called once to size the record and once to fill it.
+      for (auto instance : *component) {
+        void* data = (void*)instance.second;
+        uint64_t size = attr->onserialize(data, nullptr);
+        buffer.resize(size);
+        attr->onserialize(data, buffer.data());
+        writer.Append(&size, sizeof(size));
+        writer.Append(buffer.data(), buffer.size());
+      }
+    }
+    section.data_size = writer.Offset() - section.data_offset;
+  }
+
+  header.file_size = writer.Offset();
+  writer.Rewrite(0, &header, sizeof(header));
+  writer.Rewrite(sizeof(header), sections.data(),
+                 sections.size() * sizeof(SectionHeader));
+
+  bool ok = writer.Ok();
+  ok &= fclose(f) == 0;
+  return ok ? QB_OK : QB_ERROR_FILE;
+}
+
+qbResult SaveFile::Read(GameState* state, const char* file) {
+  size_t size = 0;
+  std::shared_ptr<uint8_t> data = map_file(file, &size);
+  if (!data) {
+    return QB_ERROR_NOT_FOUND;
+  }
+  uint8_t* base = data.get();
+
+  FileHeader header;
+  if (size < sizeof(header)) {
+    return QB_ERROR_INCOMPATIBLE_DATA_TYPES;
+  }
+  memcpy(&header, base, sizeof(header));
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kVersion || header.file_size != size ||
+      !in_file(sizeof(header), header.section_count, sizeof(SectionHeader),
+               alignof(SectionHeader), size)) {
+    return QB_ERROR_INCOMPATIBLE_DATA_TYPES;
+  }
+  const SectionHeader* sections = (const SectionHeader*)(base + sizeof(header));
+
+  std::unique_ptr<EntityRegistry> entities;
+  std::unique_ptr<InstanceRegistry> instances(
+    new InstanceRegistry(*state->components_));
+
+  for (uint32_t i = 0; i < header.section_count; ++i) {
+    const SectionHeader& section = sections[i];
+    if (!in_file(section.dense_offset, section.dense_count, sizeof(uint64_t),
+                 kArrayAlignment, size) ||
+        !in_file(section.sparse_offset, section.sparse_count, sizeof(qbId),
+                 kArrayAlignment, size) ||
+        !in_file(section.data_offset, section.data_size, 1, 1, size)) {
+      return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+    }
+    const uint64_t* dense = (const uint64_t*)(base + section.dense_offset);
+    const qbId* sparse = (const qbId*)(base + section.sparse_offset);
+    uint8_t* payload = base + section.data_offset;
+
+    if (section.kind == SECTION_ENTITIES) {
+      if (entities) {
+        return QB_ERROR_ALREADY_EXISTS;
+      }
+      if (!valid_index(sparse, section.sparse_count, dense, section.dense_count)) {
+        return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+      }
+      entities.reset(new EntityRegistry());
+      entities->id_ = (long)header.next_entity;
+      entities->entities_.assign(sparse, section.sparse_count,
+                                 dense, section.dense_count);
+      const uint64_t* free_ids = (const uint64_t*)payload;
+      entities->free_entity_ids_.assign(
+        free_ids, free_ids + section.data_size / sizeof(uint64_t));
+      continue;
+    }
+
+    const qbComponentAttr_* attr = state->components_->Find(section.component);
+    if (!attr) {
+      return QB_ERROR_NOT_FOUND;
+    }
+    if (attr->data_size != section.element_size ||
+        (uint32_t)attr->type != section.component_type) {
+      return QB_ERROR_INCOMPATIBLE_DATA_TYPES;
+    }
+    Component& component = (*instances)[section.component];
+    auto& component_instances = component.instances_;
+
+    if (section.kind == SECTION_BLOCKS) {
+      BlockVector& values = component_instances.values();
+      if (section.block_count > 0 &&
+          (section.block_stride != values.block_stride() ||
+           section.data_offset % kPageSize != 0 ||
+           section.block_count * section.block_stride > section.data_size)) {
+        return QB_ERROR_INCOMPATIBLE_DATA_TYPES;
+      }
+      if (!valid_index(sparse, section.sparse_count, dense, section.dense_count)) {
+        return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+      }
+
+      std::vector<void*> blocks(section.block_count);
+      for (size_t block = 0; block < blocks.size(); ++block) {
+        blocks[block] = payload + block * section.block_stride;
+      }
+      component_instances.assign(sparse, section.sparse_count,
+                                 dense, section.dense_count);
+      values.adopt(blocks, section.dense_count, data);
+      if (values.element_size() > 0 && values.blocks_needed() > values.blocks()) {
+        return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+      }
+    } else if (section.kind == SECTION_SERIALIZED) {
+      if (!attr->ondeserialize) {
+        return QB_ERROR_INCOMPATIBLE_DATA_TYPES;
+      }
+
+      // The section has no sparse index to check its keys against, so each
+      // key must be a loaded entity that appears once and has no instance
+      // yet. Writers put the entities first.
+      if (!entities) {
+        return QB_ERROR_NOT_FOUND;
+      }
+      std::vector<bool> seen(entities->entities_.sparse().size());
+      for (uint64_t j = 0; j < section.dense_count; ++j) {
+        if (!entities->entities_.has(dense[j]) || seen[dense[j]] ||
+            component.Has(dense[j])) {
+          return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+        }
+        seen[dense[j]] = true;
+      }
+
+      component.Reserve(section.dense_count);
+      std::vector<uint8_t> value(section.element_size);
+      uint8_t* record = payload;
+      uint8_t* end = payload + section.data_size;
+      for (uint64_t j = 0; j < section.dense_count; ++j) {
+        uint64_t record_size;
+        if ((size_t)(end - record) < sizeof(record_size)) {
+          return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+        }
+        memcpy(&record_size, record, sizeof(record_size));
+        record += sizeof(record_size);
+        if ((uint64_t)(end - record) < record_size) {
+          return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+        }
+        Component::SetDeserializing(&component);
+        attr->ondeserialize(record, value.data());
+        Component::SetDeserializing(nullptr);
+        component.Create(dense[j], value.data());
+        record += record_size;
+      }
+    } else {
+      return QB_ERROR_INCOMPATIBLE_DATA_TYPES;
+    }
+    component.UpdateMemory();
+  }
+
+  if (!entities) {
+    return QB_ERROR_NOT_FOUND;
+  }
+
+  state->Replace(std::move(entities), std::move(instances));
+  return QB_OK;
+}
@@ -0,0 +1,46 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef SAVE_FILE__H
+#define SAVE_FILE__H
+
+#include <cubez/cubez.h>
+
+class GameState;
+
+// Reads and writes the entities and component instances of a GameState.
+//
+// A file starts with a header and a table of sections, one for the entities
+// and one per component. Every section is aligned to a page. RAW components
+// are written as the blocks of their BlockVector, so that loading maps the
+// file and points the blocks at it instead of parsing instances. A block is
+// only copied to the heap once it is written to. POINTER and COMPOSITE
+// components with an onserialize function are written instance by instance
+// and read back with their ondeserialize function. POINTER components without
+// one are not saved.
+class SaveFile {
+public:
+  static qbResult Write(GameState* state, const char* file);
+
+  // Replaces the contents of state with the file. Does not send any create or
+  // destroy events. Leaves state untouched if the file cannot be read.
+  static qbResult Read(GameState* state, const char* file);
+};
+
+#endif  // SAVE_FILE__H
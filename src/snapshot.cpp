@@ -17,10 +17,15 @@
 */
 
 #include "snapshot.h"
+#include "game_state.h"
 
-Snapshot::Snapshot(int64_t timestamp_us, EntityRegistry* entities,
-                   ComponentRegistry* components)
+Snapshot::Snapshot(int64_t timestamp_us, GameState* state)
     : timestamp_us(timestamp_us) {
-  this->entities.reset(entities->Clone());
-  this->components.reset(components->Clone());
-}
\ No newline at end of file
+  entities_.reset(state->entities_->Clone());
+  instances_.reset(state->instances_->Clone());
+}
+
+void Snapshot::Restore(GameState* state) {
+  state->Replace(std::unique_ptr<EntityRegistry>(entities_->Clone()),
+                 std::unique_ptr<InstanceRegistry>(instances_->Clone()));
+}
@@ -1,17 +1,50 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
 #ifndef SNAPSHOT__H
 #define SNAPSHOT__H
 
-#include "component_registry.h"
 #include "entity_registry.h"
+#include "instance_registry.h"
 #include <memory>
 
+class GameState;
+
+// A copy-on-write copy of a GameState. Taking one shares every block of
+// component instances with the state; a block is only duplicated when either
+// side first mutates it, so a snapshot costs little more than the blocks that
+// change until it is dropped.
 class Snapshot {
 public:
-  Snapshot(int64_t timestamp_us, EntityRegistry* entities, ComponentRegistry* components);
+  Snapshot(int64_t timestamp_us, GameState* state);
+
+  // Rewinds the state to this snapshot. The snapshot stays valid and can be
+  // restored again.
+  void Restore(GameState* state);
 
-  std::unique_ptr<EntityRegistry> entities;
-  std::unique_ptr<ComponentRegistry> components;
   const int64_t timestamp_us;
+
+private:
+  std::unique_ptr<EntityRegistry> entities_;
+  std::unique_ptr<InstanceRegistry> instances_;
+
+  friend class StateDelta;
+  friend struct qbReplicator_;
 };
 
 #endif  // SNAPSHOT__H
\ No newline at end of file
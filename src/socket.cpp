@@ -30,9 +30,21 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <unistd.h>
 #endif
 
+#ifdef __COMPILE_AS_LINUX__
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#elif !defined(__COMPILE_AS_WINDOWS__)
+#include <poll.h>
+#endif
+
+#include <algorithm>
 #include <iostream>
+#include <string.h>
 
 // https://docs.microsoft.com/en-us/windows/win32/winsock/porting-socket-applications-to-winsock
 // https://www.geeksforgeeks.org/socket-programming-cc/
@@ -190,7 +202,9 @@ qbSocketError translate_qb_socket_error(int err) {
     case EPROTOTYPE: return QB_SOCKET_EPROTOTYPE;
     case ESOCKTNOSUPPORT: return QB_SOCKET_ESOCKTNOSUPPORT;
     case ETIMEDOUT: return QB_SOCKET_ETIMEDOUT;
+#if EAGAIN != EWOULDBLOCK
     case EAGAIN:  // Fall-through intended.
+#endif
     case EWOULDBLOCK: return QB_SOCKET_EWOULDBLOCK;
     case ESHUTDOWN: return QB_SOCKET_ESHUTDOWN;
     case EHOSTDOWN: return  QB_SOCKET_EHOSTDOWN;
@@ -225,7 +239,7 @@ qbResult qb_socket_close(qbSocket socket) {
     QB_RETURN_SOCKET_ERROR;
   }
 #else
-  if (close(socket->socket_) < 0) {
+  if (close(socket) < 0) {
     QB_RETURN_SOCKET_ERROR;
   }
 #endif
@@ -253,13 +267,13 @@ qbResult qb_socket_bind(qbSocket socket, qbEndpoint endpoint) {
     receiver.sin_family = AF_INET;
     receiver.sin_port = endpoint->port;
     receiver.sin_addr.s_addr = endpoint->in_addr;
-    res = bind(socket, (SOCKADDR*)&receiver, sizeof(receiver));
+    res = bind(socket, (sockaddr*)&receiver, sizeof(receiver));
   } else {
     sockaddr_in6 receiver = {};
     receiver.sin6_family = AF_INET6;
     receiver.sin6_port = endpoint->port;
     memcpy(receiver.sin6_addr.s6_addr, endpoint->in6_addr, 16);
-    res = bind(socket, (SOCKADDR*)&receiver, sizeof(receiver));
+    res = bind(socket, (sockaddr*)&receiver, sizeof(receiver));
   }
 
 #ifdef __COMPILE_AS_WINDOWS__
@@ -290,10 +304,10 @@ qbResult qb_socket_listen(qbSocket socket, int backlog) {
 }
 
 qbResult qb_socket_accept(qbSocket socket, qbSocket* peer, qbEndpoint endpoint) {
-  sockaddr addr;
-  int addr_len;
+  sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
 
-  qbSocket res = accept(socket, &addr, &addr_len) < 0;
+  qbSocket res = accept(socket, (sockaddr*)&addr, &addr_len);
 #ifdef __COMPILE_AS_WINDOWS__
   if (res == INVALID_SOCKET) {
     QB_RETURN_SOCKET_ERROR;
@@ -326,13 +340,13 @@ qbResult qb_socket_connect(qbSocket socket, qbEndpoint endpoint) {
     peer.sin_family = AF_INET;
     peer.sin_port = endpoint->port;
     peer.sin_addr.s_addr = endpoint->in_addr;
-    res = connect(socket, (SOCKADDR*)&peer, sizeof(peer));
+    res = connect(socket, (sockaddr*)&peer, sizeof(peer));
   } else {
     sockaddr_in6 peer = {};
     peer.sin6_family = AF_INET6;
     peer.sin6_port = endpoint->port;
     memcpy(peer.sin6_addr.s6_addr, endpoint->in6_addr, 16);
-    res = connect(socket, (SOCKADDR*)&peer, sizeof(peer));
+    res = connect(socket, (sockaddr*)&peer, sizeof(peer));
   }
 
 #ifdef __COMPILE_AS_WINDOWS__
@@ -368,13 +382,13 @@ int32_t qb_socket_sendto(qbSocket socket, const char* buf, size_t len, int flags
     peer.sin_family = AF_INET;
     peer.sin_port = endpoint->port;
     peer.sin_addr.s_addr = endpoint->in_addr;
-    res = sendto(socket, buf, (int)len, flags, (SOCKADDR*)&peer, sizeof(peer));
+    res = sendto(socket, buf, (int)len, flags, (sockaddr*)&peer, sizeof(peer));
   } else {
     sockaddr_in6 peer = {};
     peer.sin6_family = AF_INET6;
     peer.sin6_port = endpoint->port;
     memcpy(peer.sin6_addr.s6_addr, endpoint->in6_addr, 16);
-    res = sendto(socket, buf, (int)len, flags, (SOCKADDR*)&peer, sizeof(peer));
+    res = sendto(socket, buf, (int)len, flags, (sockaddr*)&peer, sizeof(peer));
   }
 #ifdef __COMPILE_AS_WINDOWS__  
   if (res == SOCKET_ERROR) {
@@ -404,7 +418,7 @@ int32_t qb_socket_recv(qbSocket socket, char* buf, size_t len, int flags) {
 
 int32_t qb_socket_recvfrom(qbSocket socket, char* buf, size_t len, int flags, qbEndpoint endpoint) {
   char addr[sizeof(sockaddr_in6)] = { 0 };
-  int addr_len;
+  socklen_t addr_len = sizeof(addr);
 
   int res = recvfrom(socket, buf, (int)len, flags, (sockaddr*)addr, &addr_len);
 #ifdef __COMPILE_AS_WINDOWS__  
@@ -434,6 +448,247 @@ int32_t qb_socket_recvfrom(qbSocket socket, char* buf, size_t len, int flags, qb
   return res;
 }
 
+namespace {
+
+socklen_t to_sockaddr(qbEndpoint endpoint, sockaddr_storage* addr) {
+  if (endpoint->af == QB_IPV4) {
+    sockaddr_in* peer = (sockaddr_in*)addr;
+    memset(peer, 0, sizeof(sockaddr_in));
+    peer->sin_family = AF_INET;
+    peer->sin_port = endpoint->port;
+    peer->sin_addr.s_addr = endpoint->in_addr;
+    return sizeof(sockaddr_in);
+  }
+  sockaddr_in6* peer = (sockaddr_in6*)addr;
+  memset(peer, 0, sizeof(sockaddr_in6));
+  peer->sin6_family = AF_INET6;
+  peer->sin6_port = endpoint->port;
+  memcpy(peer->sin6_addr.s6_addr, endpoint->in6_addr, 16);
+  return sizeof(sockaddr_in6);
+}
+
+void to_endpoint(const sockaddr_storage& addr, qbEndpoint endpoint) {
+  if (addr.ss_family == AF_INET) {
+    const sockaddr_in* addr_in = (const sockaddr_in*)&addr;
+    endpoint->af = QB_IPV4;
+    endpoint->port = addr_in->sin_port;
+    endpoint->in_addr = addr_in->sin_addr.s_addr;
+  } else if (addr.ss_family == AF_INET6) {
+    const sockaddr_in6* addr_in = (const sockaddr_in6*)&addr;
+    endpoint->af = QB_IPV6;
+    endpoint->port = addr_in->sin6_port;
+    memcpy(endpoint->in6_addr, addr_in->sin6_addr.s6_addr, 16);
+  }
+}
+
+#ifdef __COMPILE_AS_LINUX__
+// Number of messages handed to one sendmmsg or recvmmsg call.
+const size_t kMaxBatch = 64;
+
+// Kernel limits for a single UDP GSO send.
+const size_t kMaxGsoSegments = 64;
+const size_t kMaxGsoBytes = 65000;
+
+// Cleared the first time the kernel rejects a UDP_SEGMENT send.
+bool gso_enabled = true;
+
+bool same_endpoint(const qbEndpoint_& a, const qbEndpoint_& b) {
+  if (a.af != b.af || a.port != b.port) {
+    return false;
+  }
+  return a.af == QB_IPV4 ? a.in_addr == b.in_addr
+                         : memcmp(a.in6_addr, b.in6_addr, 16) == 0;
+}
+
+// Returns how many packets from "packets" can go out as one GSO send. Every
+// segment but the last must have the same size.
+size_t gso_run(qbPacket packets, size_t count) {
+  if (!gso_enabled || packets[0].len == 0) {
+    return 1;
+  }
+  size_t segment = packets[0].len;
+  size_t bytes = segment;
+  size_t run = 1;
+  while (run < count && run < kMaxGsoSegments) {
+    const qbPacket_& next = packets[run];
+    if (next.len == 0 || next.len > segment ||
+        bytes + next.len > kMaxGsoBytes ||
+        !same_endpoint(packets[0].endpoint, next.endpoint)) {
+      break;
+    }
+    bytes += next.len;
+    ++run;
+    if (next.len < segment) {
+      break;
+    }
+  }
+  return run;
+}
+#endif
+
+}  // namespace
+
+int32_t qb_socket_sendbatch(qbSocket socket, qbPacket packets, size_t count, int flags) {
+#ifdef __COMPILE_AS_LINUX__
+  mmsghdr msgs[kMaxBatch];
+  iovec iovs[kMaxBatch];
+  sockaddr_storage addrs[kMaxBatch];
+  size_t spans[kMaxBatch];
+  alignas(cmsghdr) char control[kMaxBatch][CMSG_SPACE(sizeof(uint16_t))];
+
+  size_t sent = 0;
+  while (sent < count) {
+    // Each message holds one packet, or a run of packets for GSO with one
+    // iovec per packet.
+    size_t msg_count = 0;
+    size_t iov_count = 0;
+    size_t next = sent;
+    while (next < count && msg_count < kMaxBatch && iov_count < kMaxBatch) {
+      size_t span = gso_run(packets + next, std::min(count - next, kMaxBatch - iov_count));
+
+      mmsghdr& msg = msgs[msg_count];
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_hdr.msg_name = &addrs[msg_count];
+      msg.msg_hdr.msg_namelen = to_sockaddr(&packets[next].endpoint, &addrs[msg_count]);
+      msg.msg_hdr.msg_iov = &iovs[iov_count];
+      msg.msg_hdr.msg_iovlen = span;
+      for (size_t i = 0; i < span; ++i) {
+        iovs[iov_count + i].iov_base = packets[next + i].buf;
+        iovs[iov_count + i].iov_len = packets[next + i].len;
+      }
+
+      if (span > 1) {
+        msg.msg_hdr.msg_control = control[msg_count];
+        msg.msg_hdr.msg_controllen = sizeof(control[msg_count]);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg.msg_hdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t segment = (uint16_t)packets[next].len;
+        memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+      }
+
+      spans[msg_count] = span;
+      iov_count += span;
+      next += span;
+      ++msg_count;
+    }
+
+    int res = sendmmsg(socket, msgs, (unsigned int)msg_count, flags);
+    if (res < 0) {
+      // Older kernels and devices without checksum offload reject GSO. Retry
+      // the same packets one datagram at a time.
+      if (spans[0] > 1 && (errno == EINVAL || errno == EIO)) {
+        gso_enabled = false;
+        continue;
+      }
+      if (sent > 0) {
+        break;
+      }
+      QB_RETURN_SOCKET_MSG_ERROR;
+    }
+
+    for (int i = 0; i < res; ++i) {
+      sent += spans[i];
+    }
+    if ((size_t)res < msg_count) {
+      break;
+    }
+  }
+  return (int32_t)sent;
+#else
+  size_t sent = 0;
+  for (; sent < count; ++sent) {
+    qbPacket_& packet = packets[sent];
+    if (qb_socket_sendto(socket, packet.buf, packet.len, flags, &packet.endpoint) < 0) {
+      if (sent > 0) {
+        break;
+      }
+      return -1;
+    }
+  }
+  return (int32_t)sent;
+#endif
+}
+
+int32_t qb_socket_recvbatch(qbSocket socket, qbPacket packets, size_t count, int flags) {
+#ifdef __COMPILE_AS_LINUX__
+  mmsghdr msgs[kMaxBatch];
+  iovec iovs[kMaxBatch];
+  sockaddr_storage addrs[kMaxBatch];
+
+  size_t received = 0;
+  while (received < count) {
+    size_t n = std::min(count - received, kMaxBatch);
+    for (size_t i = 0; i < n; ++i) {
+      qbPacket_& packet = packets[received + i];
+      iovs[i].iov_base = packet.buf;
+      iovs[i].iov_len = packet.cap;
+
+      memset(&msgs[i], 0, sizeof(msgs[i]));
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // Only the first datagram may block, after that take what is queued.
+    int wait = received == 0 ? MSG_WAITFORONE : MSG_DONTWAIT;
+    int res = recvmmsg(socket, msgs, (unsigned int)n, flags | wait, nullptr);
+    if (res < 0) {
+      if (received > 0) {
+        break;
+      }
+      QB_RETURN_SOCKET_MSG_ERROR;
+    }
+
+    for (int i = 0; i < res; ++i) {
+      qbPacket_& packet = packets[received + i];
+      packet.len = msgs[i].msg_len;
+      to_endpoint(addrs[i], &packet.endpoint);
+    }
+    received += res;
+    if ((size_t)res < n) {
+      break;
+    }
+  }
+  return (int32_t)received;
+#else
+  size_t received = 0;
+  for (; received < count; ++received) {
+    // Only the first datagram may block, after that take what is queued.
+    if (received > 0) {
+#ifdef __COMPILE_AS_WINDOWS__
+      WSAPOLLFD fd = {};
+      fd.fd = socket;
+      fd.events = POLLRDNORM;
+      if (WSAPoll(&fd, 1, 0) <= 0) {
+        break;
+      }
+#else
+      pollfd fd = {};
+      fd.fd = socket;
+      fd.events = POLLIN;
+      if (poll(&fd, 1, 0) <= 0) {
+        break;
+      }
+#endif
+    }
+
+    qbPacket_& packet = packets[received];
+    int32_t res = qb_socket_recvfrom(socket, packet.buf, packet.cap, flags, &packet.endpoint);
+    if (res < 0) {
+      if (received > 0) {
+        break;
+      }
+      return -1;
+    }
+    packet.len = (size_t)res;
+  }
+  return (int32_t)received;
+#endif
+}
+
 qbResult qb_socket_setopt(qbSocket socket, int level, int name, const char* val, int len) {
   int res = setsockopt(socket, level, name, val, len);
 #ifdef __COMPILE_AS_WINDOWS__  
@@ -449,7 +704,7 @@ qbResult qb_socket_setopt(qbSocket socket, int level, int name, const char* val,
 }
 
 qbResult qb_socket_getopt(qbSocket socket, int level, int name, char* val, int* len) {
-  int res = getsockopt(socket, level, name, val, len);
+  int res = getsockopt(socket, level, name, val, (socklen_t*)len);
 #ifdef __COMPILE_AS_WINDOWS__  
   if (res == SOCKET_ERROR) {
     QB_RETURN_SOCKET_ERROR;
@@ -20,9 +20,11 @@
 #define SPARSE_MAP__H
 
 #include <cubez/cubez.h>
+#include <memory>
 #include <vector>
 #include "block_vector.h"
 #include "byte_vector.h"
+#include "index_vector.h"
 
 template<class Value_, class Container_>
 class SparseMap {
@@ -260,8 +262,15 @@ public:
       return !(*this == other);
     }
 
+    // The value is for reading. Writing through it would bypass copy-on-write
+    // of blocks shared with a snapshot, use mutable_value() instead.
     std::pair<qbId, void*> operator*() {
-      return{ map_->dense_[index_], map_->dense_values_[index_] };
+      const Container_& values = map_->dense_values_;
+      return{ map_->dense_[index_], (void*)values[index_] };
+    }
+
+    void* mutable_value() {
+      return map_->dense_values_[index_];
     }
 
   private:
@@ -311,14 +320,17 @@ public:
   };
 
   SparseMap(size_t element_size)
-    : element_size_(element_size), sparse_(16, -1),
-    dense_values_(element_size) {}
+    : element_size_(element_size), dense_values_(element_size) {
+    sparse_.resize(16, -1);
+  }
 
-  SparseMap(const SparseMap& other) : dense_values_(other.element_size_) {
+  SparseMap(const SparseMap& other)
+    : element_size_(other.element_size_), dense_values_(other.element_size_) {
     copy(other);
   }
 
-  SparseMap(SparseMap&& other) : dense_values_(other.element_size_) {
+  SparseMap(SparseMap&& other)
+    : element_size_(other.element_size_), dense_values_(other.element_size_) {
     move(other);
   }
 
@@ -373,21 +385,25 @@ public:
     if (key >= sparse_.size()) {
       sparse_.resize(key + 1, -1);
     }
-    sparse_[key] = dense_.size();
+    sparse_.set(key, dense_.size());
     dense_.push_back(key);
     dense_values_.push_back(value);
   }
 
   void erase(uint64_t key) {
+    qbId position = sparse_[key];
+
     // Erase the old value.
-    memmove(dense_values_[sparse_[key]], dense_values_.back(), element_size_);
+    const Container_& values = dense_values_;
+    memmove(dense_values_[position], values.back(), element_size_);
     dense_values_.pop_back();
 
     // Erase from the sparse set.
-    dense_[sparse_[key]] = dense_.back();
-    sparse_[dense_.back()] = sparse_[key];
+    uint64_t last = dense_.back();
+    dense_.set(position, last);
+    sparse_.set(last, position);
     dense_.pop_back();
-    sparse_[key] = -1;
+    sparse_.set(key, -1);
   }
 
   void clear() {
@@ -416,6 +432,83 @@ public:
     return element_size_;
   }
 
+  // Returns true if there are blocks of values past the ones needed for
+  // size(), keeping slack so that a map that oscillates around a block
+  // boundary is not shrunk and regrown every frame.
+  bool should_shrink() const {
+    size_t needed = dense_values_.blocks_needed();
+    return dense_values_.blocks() > needed + needed / 4 + 1;
+  }
+
+  // Frees at most max_blocks blocks of values that are no longer needed. Once
+  // all of them are freed, trims the unused tail of the index. Returns the
+  // number of blocks freed.
+  size_t shrink(size_t max_blocks) {
+    size_t freed = dense_values_.shrink(max_blocks);
+    if (dense_values_.blocks() > dense_values_.blocks_needed()) {
+      return freed;
+    }
+
+    size_t end = sparse_.size();
+    while (end > 0 && sparse_[end - 1] == -1) {
+      --end;
+    }
+    if (end < sparse_.capacity() / 2) {
+      sparse_.resize(end);
+      sparse_.shrink_to_fit();
+    }
+    if (dense_.size() < dense_.capacity() / 2) {
+      dense_.shrink_to_fit();
+    }
+    return freed;
+  }
+
+  // Bytes allocated for the values and the index.
+  size_t reserved_bytes() const {
+    return dense_values_.reserved_bytes() +
+           sparse_.capacity() * sizeof(qbId) +
+           dense_.capacity() * sizeof(uint64_t);
+  }
+
+  // Bytes holding values and index entries.
+  size_t used_bytes() const {
+    return dense_.size() * element_size_ +
+           sparse_.size() * sizeof(qbId) +
+           dense_.size() * sizeof(uint64_t);
+  }
+
+  const IndexVector<qbId>& sparse() const {
+    return sparse_;
+  }
+
+  const IndexVector<uint64_t>& dense() const {
+    return dense_;
+  }
+
+  const Container_& values() const {
+    return dense_values_;
+  }
+
+  // Replaces the index. The caller is responsible for filling values() with
+  // a value for each of the dense keys.
+  void assign(const qbId* sparse, size_t sparse_size,
+              const uint64_t* dense, size_t dense_size) {
+    sparse_.assign(sparse, sparse_size);
+    dense_.assign(dense, dense_size);
+  }
+
+  Container_& values() {
+    return dense_values_;
+  }
+
+  // Makes this map a copy of other that shares its index and blocks of
+  // values until either map is mutated. See BlockVector::share().
+  void share(SparseMap& other) {
+    sparse_ = other.sparse_;
+    dense_ = other.dense_;
+    dense_values_.share(other.dense_values_);
+  }
+
 private:
   void copy(const SparseMap& other) {
     dense_values_ = other.dense_values_;
@@ -425,14 +518,14 @@ private:
 
   void move(const SparseMap& other) {
     dense_values_ = std::move(other.dense_values_);
-    sparse_ = std::move(other.sparse_);
-    dense_ = std::move(other.dense_);
+    sparse_ = other.sparse_;
+    dense_ = other.dense_;
   }
 
   size_t element_size_;
-  std::vector<qbId> sparse_;
+  IndexVector<qbId> sparse_;
+  IndexVector<uint64_t> dense_;
   Container_ dense_values_;
-  std::vector<uint64_t> dense_;
 };
 
 #endif  // SPARSE_MAP__H
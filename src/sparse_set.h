@@ -19,10 +19,10 @@
 #ifndef SPARSE_SET__H
 #define SPARSE_SET__H
 
-#include <vector>
-
 #include <cubez/cubez.h>
 
+#include "index_vector.h"
+
 class SparseSet {
 public:
   class iterator {
@@ -49,7 +49,7 @@ public:
       return !(*this == other);
     }
 
-    uint64_t& operator*() {
+    uint64_t operator*() const {
       return set_->dense_[index_];
     }
 
@@ -85,7 +85,7 @@ public:
       return !(*this == other);
     }
 
-    uint64_t operator*() {
+    uint64_t operator*() const {
       return set_->dense_[index_];
     }
 
@@ -98,7 +98,8 @@ public:
     friend class SparseSet;
   };
 
-  SparseSet() : sparse_(16, -1) {
+  SparseSet() {
+    sparse_.resize(16, -1);
     dense_.reserve(16);
   }
 
@@ -111,15 +112,17 @@ public:
     if (value >= sparse_.size()) {
       sparse_.resize(value + 1, -1);
     }
-    sparse_[value] = dense_.size();
+    sparse_.set(value, dense_.size());
     dense_.push_back(value);
   }
 
   void erase(uint64_t value) {
-    dense_[sparse_[value]] = dense_.back();
-    sparse_[dense_.back()] = sparse_[value];
+    qbHandle position = sparse_[value];
+    uint64_t last = dense_.back();
+    dense_.set(position, last);
+    sparse_.set(last, position);
     dense_.pop_back();
-    sparse_[value] = -1;
+    sparse_.set(value, -1);
   }
 
   void clear() {
@@ -127,7 +130,7 @@ public:
     dense_.resize(0);
   }
 
-  bool has(uint64_t value) {
+  bool has(uint64_t value) const {
     if (value >= sparse_.size()) {
       return false;
     }
@@ -138,6 +141,27 @@ public:
     return dense_.size();
   }
 
+  const IndexVector<qbHandle>& sparse() const {
+    return sparse_;
+  }
+
+  const IndexVector<uint64_t>& dense() const {
+    return dense_;
+  }
+
+  void assign(const qbHandle* sparse, size_t sparse_size,
+              const uint64_t* dense, size_t dense_size) {
+    sparse_.assign(sparse, sparse_size);
+    dense_.assign(dense, dense_size);
+  }
+
+  // Makes this set a copy of other that shares its storage. Either set only
+  // copies the chunks of the index it writes to.
+  void share(const SparseSet& other) {
+    sparse_ = other.sparse_;
+    dense_ = other.dense_;
+  }
+
   iterator begin() {
     return iterator(this, 0);
   }
@@ -155,8 +179,8 @@ public:
   }
 
 private:
-  std::vector<qbHandle> sparse_;
-  std::vector<uint64_t> dense_;
+  IndexVector<qbHandle> sparse_;
+  IndexVector<uint64_t> dense_;
 };
 
 #endif  // SPARSE_SET__H
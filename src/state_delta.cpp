@@ -0,0 +1,486 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#include "state_delta.h"
+#include "bit_stream.h"
+#include "component.h"
+#include "component_registry.h"
+#include "game_state.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <memory>
+#include <string.h>
+
+namespace {
+
+// Changed bytes closer than this are written as a single range.
+const uint64_t kRangeGap = 16;
+
+// Entity ids are handed out densely, so a larger key only comes from a corrupt
+// replay. Bounds the sparse arrays built from the keys.
+const uint64_t kMaxKey = (uint64_t)1 << 26;
+
+template<class Ty_>
+void put(std::vector<uint8_t>* out, Ty_ value) {
+  size_t at = out->size();
+  out->resize(at + sizeof(Ty_));
+  memcpy(out->data() + at, &value, sizeof(Ty_));
+}
+
+template<class Ty_>
+void patch(std::vector<uint8_t>* out, size_t at, Ty_ value) {
+  memcpy(out->data() + at, &value, sizeof(Ty_));
+}
+
+class Reader {
+public:
+  Reader(const uint8_t* data, size_t size)
+    : p_(data), end_(data + size), ok_(true) {}
+
+  template<class Ty_>
+  Ty_ get() {
+    Ty_ value{};
+    if ((size_t)(end_ - p_) < sizeof(Ty_)) {
+      ok_ = false;
+      return value;
+    }
+    memcpy(&value, p_, sizeof(Ty_));
+    p_ += sizeof(Ty_);
+    return value;
+  }
+
+  const uint8_t* bytes(uint64_t size) {
+    if ((uint64_t)(end_ - p_) < size) {
+      ok_ = false;
+      return nullptr;
+    }
+    const uint8_t* ret = p_;
+    p_ += size;
+    return ret;
+  }
+
+  size_t remaining() const {
+    return end_ - p_;
+  }
+
+  bool ok() const {
+    return ok_;
+  }
+
+private:
+  const uint8_t* p_;
+  const uint8_t* end_;
+  bool ok_;
+};
+
+// Collects the changed bytes of a BlockVector as ranges of the array of its
+// elements laid end to end. Bytes must be touched in increasing order.
+class RangeEncoder {
+public:
+  RangeEncoder(const BlockVector& values, std::vector<uint8_t>* out)
+    : values_(values), out_(out), count_at_(out->size()), count_(0),
+      open_(false), start_(0), end_(0), length_at_(0) {
+    put<uint64_t>(out_, 0);
+  }
+
+  void Touch(uint64_t offset, uint64_t size) {
+    if (!open_ || offset > end_ + kRangeGap) {
+      Close();
+      put<uint64_t>(out_, offset);
+      length_at_ = out_->size();
+      put<uint64_t>(out_, 0);
+      start_ = end_ = offset;
+      open_ = true;
+    }
+    Append(offset + size);
+  }
+
+  // Returns the number of ranges.
+  uint64_t Finish() {
+    Close();
+    patch(out_, count_at_, count_);
+    return count_;
+  }
+
+private:
+  void Append(uint64_t to) {
+    size_t element_size = values_.element_size();
+    while (end_ < to) {
+      uint64_t offset = end_ % element_size;
+      uint64_t size = std::min(element_size - offset, to - end_);
+      const uint8_t* data = (const uint8_t*)values_[end_ / element_size] + offset;
+      out_->insert(out_->end(), data, data + size);
+      end_ += size;
+    }
+  }
+
+  void Close() {
+    if (open_) {
+      patch(out_, length_at_, end_ - start_);
+      ++count_;
+      open_ = false;
+    }
+  }
+
+  const BlockVector& values_;
+  std::vector<uint8_t>* out_;
+  size_t count_at_;
+  uint64_t count_;
+
+  bool open_;
+  uint64_t start_;
+  uint64_t end_;
+  size_t length_at_;
+};
+
+// Writes the positions of a dense index that differ from prev, where a null
+// prev is empty. Returns true if any did or the size changed.
+bool encode_index(const IndexVector<uint64_t>* prev,
+                  const IndexVector<uint64_t>& cur, std::vector<uint8_t>* out) {
+  size_t prev_size = prev ? prev->size() : 0;
+
+  // Indices are copied on write by chunk, so a chunk that is still shared is
+  // unchanged.
+  bool shared = prev && prev_size == cur.size();
+  for (size_t i = 0; shared && i < cur.size(); i += cur.kChunkSize) {
+    shared = cur.shares(*prev, i);
+  }
+  if (shared) {
+    put<uint8_t>(out, 0);
+    return false;
+  }
+  put<uint8_t>(out, 1);
+  put<uint64_t>(out, cur.size());
+  size_t count_at = out->size();
+  put<uint64_t>(out, 0);
+
+  uint64_t count = 0;
+  for (size_t i = 0; i < cur.size(); ++i) {
+    if (prev && (i & cur.kChunkMask) == 0 && cur.shares(*prev, i)) {
+      i = std::min(std::min(prev_size, cur.size()), i + cur.kChunkSize) - 1;
+      continue;
+    }
+    if (i >= prev_size || (*prev)[i] != cur[i]) {
+      put<uint64_t>(out, i);
+      put<uint64_t>(out, cur[i]);
+      ++count;
+    }
+  }
+  patch(out, count_at, count);
+  return count > 0 || cur.size() != prev_size;
+}
+
+// Returns the number of ranges written.
+uint64_t encode_values(const BlockVector* prev, const BlockVector& cur,
+                       std::vector<uint8_t>* out) {
+  RangeEncoder ranges(cur, out);
+  size_t element_size = cur.element_size();
+  uint64_t count = element_size > 0 ? cur.size() : 0;
+  uint64_t prev_count = prev ? prev->size() : 0;
+
+  for (uint64_t i = 0; i < count;) {
+    size_t block = cur.block_of(i);
+    uint64_t block_end = std::min(cur.block_end(block), count);
+
+    // A block still shared with the snapshot was not written to.
+    if (prev && block < prev->blocks() && cur.block(block) == prev->block(block)) {
+      i = std::max(i, std::min(block_end, prev_count));
+    }
+
+    for (; i < block_end; ++i) {
+      if (i >= prev_count) {
+        ranges.Touch(i * element_size, element_size);
+        continue;
+      }
+      const uint8_t* c = (const uint8_t*)cur[i];
+      const uint8_t* p = (const uint8_t*)(*prev)[i];
+      if (memcmp(c, p, element_size) == 0) {
+        continue;
+      }
+      for (size_t k = 0; k < element_size;) {
+        if (c[k] == p[k]) {
+          ++k;
+          continue;
+        }
+        size_t run = k;
+        while (run < element_size && c[run] != p[run]) {
+          ++run;
+        }
+        ranges.Touch(i * element_size + k, run - k);
+        k = run;
+      }
+    }
+  }
+  return ranges.Finish();
+}
+
+// Writes the instances that differ from prev as runs of consecutive instances
+// packed with the fields of the component. Runs do not cross blocks, so each
+// is packed in one pass. Returns the number of runs written.
+uint64_t encode_packed(const qbComponentAttr_& attr, const BlockVector* prev,
+                       const BlockVector& cur, std::vector<uint8_t>* out) {
+  size_t count_at = out->size();
+  put<uint64_t>(out, 0);
+  uint64_t runs = 0;
+
+  auto pack = [&](uint64_t first, uint64_t end) {
+    put<uint64_t>(out, first);
+    put<uint64_t>(out, end - first);
+    size_t size_at = out->size();
+    put<uint64_t>(out, 0);
+
+    size_t at = out->size();
+    size_t bound = component_packbound(attr, end - first);
+    out->resize(at + bound);
+    qbBitWriter_ writer;
+    qb_bitwriter_init(&writer, out->data() + at, bound);
+    component_pack(attr, (const uint8_t*)cur[first], end - first, &writer);
+    size_t size;
+    qb_bitwriter_flush(&writer, &size);
+    out->resize(at + size);
+    patch<uint64_t>(out, size_at, size);
+    ++runs;
+  };
+
+  size_t element_size = cur.element_size();
+  uint64_t count = element_size > 0 ? cur.size() : 0;
+  uint64_t prev_count = prev ? prev->size() : 0;
+  for (uint64_t i = 0; i < count;) {
+    size_t block = cur.block_of(i);
+    uint64_t block_end = std::min(cur.block_end(block), count);
+    if (prev && block < prev->blocks() && cur.block(block) == prev->block(block)) {
+      i = std::max(i, std::min(block_end, prev_count));
+    }
+
+    uint64_t first = i;
+    for (; i < block_end; ++i) {
+      if (i < prev_count && memcmp(cur[i], (*prev)[i], element_size) == 0) {
+        if (first < i) {
+          pack(first, i);
+        }
+        first = i + 1;
+      }
+    }
+    if (first < i) {
+      pack(first, i);
+    }
+  }
+  patch(out, count_at, runs);
+  return runs;
+}
+
+bool apply_index(Reader* reader, std::vector<uint64_t>* index) {
+  if (reader->get<uint8_t>() == 0) {
+    return reader->ok();
+  }
+  uint64_t size = reader->get<uint64_t>();
+  uint64_t count = reader->get<uint64_t>();
+
+  // Every position past the old size must have been written.
+  if (!reader->ok() || size > index->size() + count ||
+      count > reader->remaining() / (2 * sizeof(uint64_t))) {
+    return false;
+  }
+  index->resize(size);
+  for (uint64_t i = 0; i < count; ++i) {
+    uint64_t position = reader->get<uint64_t>();
+    uint64_t key = reader->get<uint64_t>();
+    if (position >= size || key >= kMaxKey) {
+      return false;
+    }
+    (*index)[position] = key;
+  }
+  return reader->ok();
+}
+
+// Builds the sparse array of the dense keys. Returns false if a key is out of
+// range or repeated.
+template<class Ty_>
+bool sparse_of(const std::vector<uint64_t>& dense, std::vector<Ty_>* sparse) {
+  uint64_t size = 0;
+  for (uint64_t key : dense) {
+    if (key >= kMaxKey) {
+      return false;
+    }
+    size = std::max(size, key + 1);
+  }
+  sparse->assign(size, -1);
+  for (size_t i = 0; i < dense.size(); ++i) {
+    if ((*sparse)[dense[i]] != -1) {
+      return false;
+    }
+    (*sparse)[dense[i]] = (Ty_)i;
+  }
+  return true;
+}
+
+}  // namespace
+
+void StateDelta::Encode(Snapshot* from, GameState* to, std::vector<uint8_t>* out) {
+  encode_index(from ? &from->entities_->entities_.dense() : nullptr,
+               to->entities_->entities_.dense(), out);
+
+  size_t count_at = out->size();
+  uint32_t count = 0;
+  put<uint32_t>(out, 0);
+
+  for (auto pair : to->instances_->components_) {
+    Component* component = pair.second;
+    if (component->type_ == qbComponentType::QB_COMPONENT_TYPE_POINTER) {
+      continue;
+    }
+
+    const Component* prev = nullptr;
+    if (from && from->instances_->components_.has(component->Id())) {
+      prev = from->instances_->components_[component->Id()];
+    }
+
+    // Components with fields are written packed, others as changed bytes.
+    const qbComponentAttr_* attr = to->components_->Find(component->Id());
+    bool packed = attr && attr->field_count > 0;
+
+    const auto& instances = component->instances_;
+    size_t mark = out->size();
+    put<int64_t>(out, component->Id());
+    put<uint64_t>(out, instances.element_size());
+    put<uint8_t>(out, packed ? 1 : 0);
+    bool changed = encode_index(prev ? &prev->instances_.dense() : nullptr,
+                                instances.dense(), out);
+    if (packed) {
+      changed |= encode_packed(*attr, prev ? &prev->instances_.values() : nullptr,
+                               instances.values(), out) > 0;
+    } else {
+      changed |= encode_values(prev ? &prev->instances_.values() : nullptr,
+                               instances.values(), out) > 0;
+    }
+    if (changed) {
+      ++count;
+    } else {
+      out->resize(mark);
+    }
+  }
+  patch(out, count_at, count);
+}
+
+bool StateDelta::Apply(const uint8_t* delta, size_t size, GameState* state,
+                       World* world) {
+  Reader reader(delta, size);
+  if (!apply_index(&reader, &world->entities)) {
+    return false;
+  }
+
+  uint32_t count = reader.get<uint32_t>();
+  for (uint32_t i = 0; i < count && reader.ok(); ++i) {
+    qbComponent id = reader.get<int64_t>();
+    uint64_t element_size = reader.get<uint64_t>();
+    bool packed = reader.get<uint8_t>() != 0;
+    Instances& instances = world->components[id];
+    if (!instances.keys.empty() && instances.element_size != element_size) {
+      return false;
+    }
+    instances.element_size = element_size;
+
+    if (!apply_index(&reader, &instances.keys)) {
+      return false;
+    }
+    instances.values.resize(instances.keys.size() * element_size);
+
+    if (packed) {
+      const qbComponentAttr_* attr = state->components_->Find(id);
+      if (!attr || attr->data_size != element_size) {
+        return false;
+      }
+      uint64_t run_count = reader.get<uint64_t>();
+      for (uint64_t j = 0; j < run_count && reader.ok(); ++j) {
+        uint64_t first = reader.get<uint64_t>();
+        uint64_t run = reader.get<uint64_t>();
+        uint64_t length = reader.get<uint64_t>();
+        const uint8_t* bytes = reader.bytes(length);
+        if (!bytes || first > instances.keys.size() ||
+            run > instances.keys.size() - first) {
+          return false;
+        }
+        qbBitReader_ bits;
+        qb_bitreader_init(&bits, bytes, (size_t)length);
+        component_unpack(*attr, &bits,
+                         instances.values.data() + first * element_size, (size_t)run);
+        if (bits.overflow) {
+          return false;
+        }
+      }
+      continue;
+    }
+
+    uint64_t range_count = reader.get<uint64_t>();
+    for (uint64_t j = 0; j < range_count && reader.ok(); ++j) {
+      uint64_t offset = reader.get<uint64_t>();
+      uint64_t length = reader.get<uint64_t>();
+      const uint8_t* bytes = reader.bytes(length);
+      if (!bytes || offset > instances.values.size() ||
+          length > instances.values.size() - offset) {
+        return false;
+      }
+      memcpy(instances.values.data() + offset, bytes, length);
+    }
+  }
+  return reader.ok() && reader.remaining() == 0;
+}
+
+qbResult StateDelta::Load(const World& world, GameState* state) {
+  std::vector<qbHandle> entity_sparse;
+  if (!sparse_of(world.entities, &entity_sparse)) {
+    return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+  }
+  std::unique_ptr<EntityRegistry> entities(new EntityRegistry());
+  entities->entities_.assign(entity_sparse.data(), entity_sparse.size(),
+                             world.entities.data(), world.entities.size());
+  entities->id_ = (long)entity_sparse.size();
+
+  std::unique_ptr<InstanceRegistry> instances(
+    new InstanceRegistry(*state->components_));
+  for (const auto& pair : world.components) {
+    const Instances& from = pair.second;
+    const qbComponentAttr_* attr = state->components_->Find(pair.first);
+    if (!attr || attr->data_size != from.element_size) {
+      continue;
+    }
+
+    Component& component = (*instances)[pair.first];
+    auto& map = component.instances_;
+    std::vector<qbId> sparse;
+    if (!sparse_of(from.keys, &sparse)) {
+      return QB_ERROR_MEMORY_OUT_OF_BOUNDS;
+    }
+    map.assign(sparse.data(), sparse.size(), from.keys.data(), from.keys.size());
+
+    BlockVector& values = map.values();
+    values.resize(from.keys.size());
+    if (from.element_size > 0) {
+      for (size_t i = 0; i < from.keys.size(); ++i) {
+        memcpy(values[i], from.values.data() + i * from.element_size,
+               from.element_size);
+      }
+    }
+    component.UpdateMemory();
+  }
+
+  state->Replace(std::move(entities), std::move(instances));
+  return QB_OK;
+}
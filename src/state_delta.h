@@ -0,0 +1,70 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef STATE_DELTA__H
+#define STATE_DELTA__H
+
+#include <cubez/cubez.h>
+
+#include <map>
+#include <vector>
+
+class GameState;
+class Snapshot;
+
+// Encodes the difference between a Snapshot and the GameState it was taken
+// of, and applies it to a plain copy of the world.
+//
+// A delta holds the positions of the dense entity and instance indices that
+// changed, and the byte ranges of instances that changed. Only blocks of
+// instances that are no longer shared with the snapshot are compared, so the
+// cost follows what was written rather than the size of the world. Components
+// with fields write their changed instances whole, packed with their fields.
+// POINTER components are not encoded since their payloads live outside of the
+// state.
+class StateDelta {
+public:
+  struct Instances {
+    size_t element_size = 0;
+    std::vector<uint64_t> keys;
+    std::vector<uint8_t> values;
+  };
+
+  // The entities and component instances of a GameState, laid out in the
+  // same order.
+  struct World {
+    std::vector<uint64_t> entities;
+    std::map<qbComponent, Instances> components;
+  };
+
+  // Appends the changes from "from" to "to" to out. A null "from" encodes the
+  // whole state.
+  static void Encode(Snapshot* from, GameState* to, std::vector<uint8_t>* out);
+
+  // Applies an encoded delta. Packed instances are unpacked with the fields of
+  // the components of state. Returns false if it is malformed.
+  static bool Apply(const uint8_t* delta, size_t size, GameState* state,
+                    World* world);
+
+  // Replaces the contents of state with the world. Components that do not
+  // exist or do not match in size are skipped.
+  static qbResult Load(const World& world, GameState* state);
+};
+
+#endif  // STATE_DELTA__H
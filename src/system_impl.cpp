@@ -17,6 +17,7 @@
 */
 
 #include "system_impl.h"
+#include <cubez/utils.h>
 #include <omp.h>
 
 SystemImpl::SystemImpl(const qbSystemAttr_& attr, qbSystem system, std::vector<qbComponent> components) :
@@ -26,7 +27,17 @@ SystemImpl::SystemImpl(const qbSystemAttr_& attr, qbSystem system, std::vector<q
   tickets_(attr.tickets),
   transform_(attr.transform),
   callback_(attr.callback),
-  condition_(attr.condition) {
+  condition_(attr.condition),
+  budget_ns_((int64_t)attr.budget_us * 1000),
+  deadline_(0),
+  cursor_(0),
+  source_(0),
+  progress_(0.0),
+  sweep_start_(0),
+  sweep_frame_count_(0),
+  sweep_latency_(0.0),
+  sweep_frames_(0),
+  sweeps_(0) {
 
   for(auto component : components_) {
     qbInstance_ instance;
@@ -61,20 +72,39 @@ void SystemImpl::Run(GameState* game_state, void* event) {
     return;
   }
 
+  bool swept = true;
   if (transform_) {
+    // Instances removed since the last frame may have shrunk the source
+    // below the cursor.
+    if (cursor_ > 0 && source_size > 0) {
+      Component* source =
+        game_state->ComponentGet(components_[source_size == 1 ? 0 : source_]);
+      if (cursor_ >= source->Size()) {
+        cursor_ = 0;
+      }
+    }
+
+    int64_t now = qb_timer_query();
+    if (cursor_ == 0) {
+      sweep_start_ = now;
+      sweep_frame_count_ = 0;
+    }
+    ++sweep_frame_count_;
+    deadline_ = now + budget_ns_;
+
     for (auto& t: tickets_) {
       t->lock();
     }
     if (source_size == 0) {
-      Run_0(&frame);
+      swept = Run_0(&frame);
     } else if (source_size == 1) {
       Component* c = game_state->ComponentGet(components_[0]);
       c->Lock(instances_[0].is_mutable);
-      Run_1(c, &frame, game_state);
+      swept = Run_1(c, &frame, game_state);
       c->Unlock(instances_[0].is_mutable);
     } else if (source_size > 1) {
-      thread_local static std::vector<Component*> components;
-      components.resize(0);
+      FrameVector<Component*> components;
+      components.reserve(source_size);
       size_t index = 0;
       for (auto component : components_) {
         Component* c = game_state->ComponentGet(component);
@@ -83,14 +113,22 @@ void SystemImpl::Run(GameState* game_state, void* event) {
         c->Unlock(instances_[index].is_mutable);
         ++index;
       }
-      Run_N(components, &frame, game_state);
+      swept = Run_N(components, &frame, game_state);
     }
     for (auto& t : tickets_) {
       t->unlock();
     }
+
+    if (swept) {
+      cursor_ = 0;
+      progress_ = 1.0;
+      sweep_latency_ = (qb_timer_query() - sweep_start_) * 0.000000001;
+      sweep_frames_ = sweep_frame_count_;
+      ++sweeps_;
+    }
   }
 
-  if (callback_) {
+  if (callback_ && swept) {
     callback_(&frame);
   }
 }
@@ -98,12 +136,16 @@ void SystemImpl::Run(GameState* game_state, void* event) {
 qbInstance_ SystemImpl::FindInstance(qbEntity entity, Component* component, GameState* state) {
   qbInstance_ instance;
   instance.system = system_;
-  CopyToInstance(component, entity, &instance, state);
+  CopyToInstance(component, entity, (*component)[entity], &instance, state);
   return instance;
 }
 
 void SystemImpl::CopyToInstance(Component* component, qbEntity entity, qbInstance instance, GameState* state) {
-  CopyToInstance(component, entity, (*component)[entity], instance, state);
+  // Reading through the const accessor keeps blocks shared with a snapshot.
+  void* data = instance->is_mutable
+    ? (*component)[entity]
+    : (void*)((const Component*)component)->at(entity);
+  CopyToInstance(component, entity, data, instance, state);
 }
 
 void SystemImpl::CopyToInstance(Component* component, qbEntity entity, void* instance_data, qbInstance instance, GameState* state) {
@@ -113,44 +155,67 @@ void SystemImpl::CopyToInstance(Component* component, qbEntity entity, void* ins
   instance->state = state;
 }
 
+void SystemImpl::BudgetStats(qbSystemBudgetStats stats) const {
+  stats->progress = progress_;
+  stats->sweep_latency = sweep_latency_;
+  stats->sweep_frames = sweep_frames_;
+  stats->sweeps = sweeps_;
+}
+
 void SystemImpl::RunTransform(qbInstance* instances, qbFrame* frame) {
   transform_(instances, frame);
 }
 
-void SystemImpl::Run_0(qbFrame* f) {
+bool SystemImpl::OutOfBudget() {
+  return budget_ns_ && qb_timer_query() >= deadline_;
+}
+
+bool SystemImpl::Run_0(qbFrame* f) {
   RunTransform(nullptr, f);
+  return true;
 }
 
-void SystemImpl::Run_1(Component* component, qbFrame* f, GameState* state) {
-  for (auto id_component : *component) {
-    CopyToInstance(component, id_component.first, id_component.second, &instances_[0], state);
+bool SystemImpl::Run_1(Component* component, qbFrame* f, GameState* state) {
+  for (auto it = component->begin() + cursor_; it != component->end(); ++it) {
+    auto id_component = *it;
+    void* data = instances_[0].is_mutable ? it.mutable_value() : id_component.second;
+    CopyToInstance(component, id_component.first, data, &instances_[0], state);
     RunTransform(instance_data_.data(), f);
+
+    ++cursor_;
+    if (OutOfBudget() && cursor_ < component->Size()) {
+      progress_ = (double)cursor_ / component->Size();
+      return false;
+    }
   }
+  return true;
 }
 
-void SystemImpl::Run_N(const std::vector<Component*>& components, qbFrame* f, GameState* state) {
-  Component* source = components[0];
+bool SystemImpl::Run_N(const FrameVector<Component*>& components, qbFrame* f, GameState* state) {
   switch(join_) {
     case qbComponentJoin::QB_JOIN_INNER: {
+      if (cursor_ > 0) {
+        break;
+      }
       uint64_t min = 0xFFFFFFFFFFFFFFFF;
       for (size_t i = 0; i < components_.size(); ++i) {
         Component* src = components[i];
         uint64_t maybe_min = src->Size();
         if (maybe_min < min) {
           min = maybe_min;
-          source = src;
+          source_ = i;
         }
       }
     } break;
     case qbComponentJoin::QB_JOIN_LEFT:
-      source = components[0];
+      source_ = 0;
     break;
     case qbComponentJoin::QB_JOIN_CROSS: {
       static std::vector<size_t> indices(components_.size(), 0);
 
       for (Component* component : components) {
         if (component->Size() == 0) {
-          return;
+          return true;
         }
       }
 
@@ -182,24 +247,32 @@ void SystemImpl::Run_N(const std::vector<Component*>& components, qbFrame* f, Ga
   switch(join_) {
     case qbComponentJoin::QB_JOIN_LEFT:
     case qbComponentJoin::QB_JOIN_INNER: {
-      for (auto id_component : *source) {
-        qbId entity_id = id_component.first;
-        bool should_continue = false;
+      Component* source = components[source_];
+      for (auto it = source->begin() + cursor_; it != source->end(); ++it) {
+        qbId entity_id = (*it).first;
+        bool should_run = true;
         for (size_t j = 0; j < components_.size(); ++j) {
           Component* c = components[j];
           if (!c->Has(entity_id)) {
-            should_continue = true;
+            should_run = false;
             break;
           }
           CopyToInstance(c, entity_id, &instances_[j], state);
         }
-        if (should_continue) continue;
+        if (should_run) {
+          RunTransform(instance_data_.data(), f);
+        }
 
-        RunTransform(instance_data_.data(), f);
+        ++cursor_;
+        if (OutOfBudget() && cursor_ < source->Size()) {
+          progress_ = (double)cursor_ / source->Size();
+          return false;
+        }
       }
     } break;
     default:
       break;
   }
+  return true;
 }
 
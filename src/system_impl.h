@@ -22,6 +22,7 @@
 #include "defs.h"
 #include "game_state.h"
 #include "barrier.h"
+#include "frame_allocator.h"
 
 #include <algorithm>
 #include <cstring>
@@ -36,16 +37,23 @@ class SystemImpl {
 
   qbInstance_ FindInstance(qbEntity entity, Component* component, GameState* state);
 
+  void BudgetStats(qbSystemBudgetStats stats) const;
+
  private:
   void CopyToInstance(Component* component, qbEntity entity, qbInstance instance, GameState* state);
   void CopyToInstance(Component* component, qbEntity entity, void* instance_data, qbInstance instance, GameState* state);
 
-  void Run_0(qbFrame* f);
-  void Run_1(Component* component, qbFrame* f, GameState* state);
-  void Run_N(const std::vector<Component*>& components, qbFrame* f, GameState* state);
+  // Each returns true once the transform has run over every instance.
+  bool Run_0(qbFrame* f);
+  bool Run_1(Component* component, qbFrame* f, GameState* state);
+  bool Run_N(const FrameVector<Component*>& components, qbFrame* f, GameState* state);
 
   void RunTransform(qbInstance* instances, qbFrame* frame);
 
+  // Called after every instance. Returns true if the budget for this frame is
+  // spent.
+  bool OutOfBudget();
+
   qbSystem system_;
   std::vector<qbComponent> components_;
 
@@ -59,6 +67,23 @@ class SystemImpl {
   qbTransformFn transform_;
   qbCallbackFn callback_;
   qbConditionFn condition_;
+
+  // Zero if the system is not budgeted.
+  int64_t budget_ns_;
+  int64_t deadline_;
+
+  // Index of the next instance to visit in the source component. The source
+  // of an inner join is chosen at the start of a sweep and kept until it ends
+  // so that the cursor stays meaningful.
+  size_t cursor_;
+  size_t source_;
+  double progress_;
+
+  int64_t sweep_start_;
+  uint64_t sweep_frame_count_;
+  double sweep_latency_;
+  uint64_t sweep_frames_;
+  uint64_t sweeps_;
 };
 
 
@@ -0,0 +1,187 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef TIMER_WHEEL__H
+#define TIMER_WHEEL__H
+
+#include <cubez/common.h>
+
+// A hierarchical timer wheel (Varghese & Lauck). Timers are kept in
+// intrusive lists bucketed by their deadline, so scheduling and cancelling are
+// O(1) and advancing one tick only touches the timers that are due. Timers
+// that are far in the future live in coarser levels and are cascaded down as
+// the wheel turns. Each timer is cascaded at most kLevels - 1 times.
+//
+// Not thread-safe.
+class TimerWheel {
+ public:
+  struct Timer {
+    Timer* prev = nullptr;
+    Timer* next = nullptr;
+
+    // Absolute tick this timer expires on.
+    uint64_t deadline = 0;
+  };
+
+  static const uint64_t kSlotBits = 8;
+  static const uint64_t kSlots = (uint64_t)1 << kSlotBits;
+  static const uint64_t kSlotMask = kSlots - 1;
+  static const uint64_t kLevels = 4;
+
+  // The furthest a timer can be scheduled into the future. Timers scheduled
+  // further than this are clamped.
+  static const uint64_t kMaxDelay = ((uint64_t)1 << (kSlotBits * kLevels)) - 1;
+
+  TimerWheel() : now_(0), size_(0) {
+    for (uint64_t level = 0; level < kLevels; ++level) {
+      for (uint64_t slot = 0; slot < kSlots; ++slot) {
+        Timer* sentinel = &slots_[level][slot];
+        sentinel->prev = sentinel->next = sentinel;
+      }
+    }
+  }
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  // Schedules the timer to expire after the given number of ticks. A delay of
+  // zero expires on the next tick.
+  void Schedule(Timer* timer, uint64_t delay) {
+    delay = delay == 0 ? 1 : delay;
+    delay = delay > kMaxDelay ? kMaxDelay : delay;
+    timer->deadline = now_ + delay;
+    Insert(timer);
+    ++size_;
+  }
+
+  // Removes a scheduled timer. Does nothing if the timer is not scheduled.
+  void Cancel(Timer* timer) {
+    if (!IsScheduled(timer)) {
+      return;
+    }
+    Unlink(timer);
+    --size_;
+  }
+
+  bool IsScheduled(const Timer* timer) const {
+    return timer->next != nullptr;
+  }
+
+  // Advances the wheel by the given number of ticks. Calls on_expire(Timer*)
+  // for every timer that is due. The timer is unlinked before the callback
+  // runs, so the callback is free to re-schedule or free it.
+  template<class OnExpire_>
+  void Advance(uint64_t ticks, OnExpire_&& on_expire) {
+    for (uint64_t t = 0; t < ticks; ++t) {
+      ++now_;
+
+      // Cascade the coarser levels whenever the finer level wraps around.
+      for (uint64_t level = 1; level < kLevels; ++level) {
+        uint64_t shift = kSlotBits * level;
+        if ((now_ & (((uint64_t)1 << shift) - 1)) != 0) {
+          break;
+        }
+        Cascade(&slots_[level][(now_ >> shift) & kSlotMask]);
+      }
+
+      Timer* sentinel = &slots_[0][now_ & kSlotMask];
+      while (sentinel->next != sentinel) {
+        Timer* timer = sentinel->next;
+        Unlink(timer);
+        --size_;
+        on_expire(timer);
+      }
+    }
+  }
+
+  // Unschedules every timer and calls on_clear(Timer*) on each, in no
+  // particular order. Like Advance, the callback is free to free the timer.
+  template<class OnClear_>
+  void Clear(OnClear_&& on_clear) {
+    for (uint64_t level = 0; level < kLevels; ++level) {
+      for (uint64_t slot = 0; slot < kSlots; ++slot) {
+        Timer* sentinel = &slots_[level][slot];
+        while (sentinel->next != sentinel) {
+          Timer* timer = sentinel->next;
+          Unlink(timer);
+          --size_;
+          on_clear(timer);
+        }
+      }
+    }
+  }
+
+  // Returns the number of ticks until the timer expires.
+  uint64_t Remaining(const Timer* timer) const {
+    return timer->deadline > now_ ? timer->deadline - now_ : 0;
+  }
+
+  uint64_t Now() const {
+    return now_;
+  }
+
+  size_t Size() const {
+    return size_;
+  }
+
+ private:
+  void Insert(Timer* timer) {
+    uint64_t delta = timer->deadline - now_;
+    uint64_t level = 0;
+    while (level + 1 < kLevels && delta >= ((uint64_t)1 << (kSlotBits * (level + 1)))) {
+      ++level;
+    }
+    uint64_t slot = (timer->deadline >> (kSlotBits * level)) & kSlotMask;
+    Link(&slots_[level][slot], timer);
+  }
+
+  void Cascade(Timer* sentinel) {
+    // Detach the whole list first because re-inserted timers may land back in
+    // this slot's level.
+    Timer* timer = sentinel->next;
+    sentinel->prev->next = nullptr;
+    sentinel->prev = sentinel->next = sentinel;
+
+    while (timer && timer != sentinel) {
+      Timer* next = timer->next;
+      timer->prev = timer->next = nullptr;
+      Insert(timer);
+      timer = next;
+    }
+  }
+
+  static void Link(Timer* sentinel, Timer* timer) {
+    timer->prev = sentinel->prev;
+    timer->next = sentinel;
+    sentinel->prev->next = timer;
+    sentinel->prev = timer;
+  }
+
+  static void Unlink(Timer* timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = nullptr;
+  }
+
+  // Each slot is the sentinel of a circular doubly-linked list.
+  Timer slots_[kLevels][kSlots];
+  uint64_t now_;
+  size_t size_;
+};
+
+#endif  // TIMER_WHEEL__H
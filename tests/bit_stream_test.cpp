@@ -0,0 +1,310 @@
+#include "bit_stream.h"
+#undef INFO
+#include "catch.h"
+
+#include <cmath>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+namespace {
+
+qbComponentAttr_ make_attr(size_t data_size) {
+  qbComponentAttr_ attr = {};
+  attr.data_size = data_size;
+  attr.type = QB_COMPONENT_TYPE_RAW;
+  return attr;
+}
+
+qbFieldAttr_ make_field(qbFieldType type, size_t offset, size_t size) {
+  qbFieldAttr_ field = {};
+  field.type = type;
+  field.offset = offset;
+  field.size = size;
+  return field;
+}
+
+// Packs the instances and unpacks them into "out".
+void round_trip(const qbComponentAttr_& attr, const void* instances,
+                size_t count, void* out) {
+  std::vector<uint8_t> buf(component_packbound(attr, count));
+  qbBitWriter_ writer;
+  qb_bitwriter_init(&writer, buf.data(), buf.size());
+  component_pack(attr, (const uint8_t*)instances, count, &writer);
+  size_t size;
+  REQUIRE(qb_bitwriter_flush(&writer, &size) == QB_OK);
+
+  qbBitReader_ reader;
+  qb_bitreader_init(&reader, buf.data(), size);
+  component_unpack(attr, &reader, (uint8_t*)out, count);
+  REQUIRE_FALSE(reader.overflow);
+}
+
+}  // namespace
+
+TEST_CASE("Bits of every width round trip", "[bit_stream]") {
+  uint8_t buf[1024];
+  qbBitWriter_ writer;
+  qb_bitwriter_init(&writer, buf, sizeof(buf));
+  for (uint32_t bits = 1; bits <= 32; ++bits) {
+    qb_bitwriter_bits(&writer, 0xFFFFFFFFu, bits);
+    qb_bitwriter_bits(&writer, 0x5A5A5A5Au, bits);
+  }
+  qb_bitwriter_varint(&writer, 0);
+  qb_bitwriter_varint(&writer, 127);
+  qb_bitwriter_varint(&writer, 128);
+  qb_bitwriter_varint(&writer, UINT64_MAX);
+  size_t size;
+  REQUIRE(qb_bitwriter_flush(&writer, &size) == QB_OK);
+
+  qbBitReader_ reader;
+  qb_bitreader_init(&reader, buf, size);
+  for (uint32_t bits = 1; bits <= 32; ++bits) {
+    uint32_t mask = bits == 32 ? 0xFFFFFFFFu : (1u << bits) - 1;
+    REQUIRE(qb_bitreader_bits(&reader, bits) == mask);
+    REQUIRE(qb_bitreader_bits(&reader, bits) == (0x5A5A5A5Au & mask));
+  }
+  REQUIRE(qb_bitreader_varint(&reader) == 0);
+  REQUIRE(qb_bitreader_varint(&reader) == 127);
+  REQUIRE(qb_bitreader_varint(&reader) == 128);
+  REQUIRE(qb_bitreader_varint(&reader) == UINT64_MAX);
+  REQUIRE_FALSE(reader.overflow);
+}
+
+TEST_CASE("Floats are quantized within their bounds", "[bit_stream]") {
+  const float min = -100.0f;
+  const float max = 50.0f;
+  for (uint32_t bits : { 1u, 8u, 16u, 24u, 25u, 32u }) {
+    float step = (max - min) / (float)(bits == 32 ? 0xFFFFFFFFu : (1u << bits) - 1);
+    const float values[] = { min, max, -1000.0f, 1000.0f, 0.0f, 12.34f, NAN };
+    const float expected[] = { min, max, min, max, 0.0f, 12.34f, min };
+
+    uint8_t buf[64];
+    qbBitWriter_ writer;
+    qb_bitwriter_init(&writer, buf, sizeof(buf));
+    for (float v : values) {
+      qb_bitwriter_float(&writer, v, min, max, bits);
+    }
+    size_t size;
+    REQUIRE(qb_bitwriter_flush(&writer, &size) == QB_OK);
+
+    qbBitReader_ reader;
+    qb_bitreader_init(&reader, buf, size);
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+      float v = qb_bitreader_float(&reader, min, max, bits);
+      REQUIRE(v >= min);
+      REQUIRE(v <= max);
+      if (i < 2) {
+        // The bounds are exact at any precision.
+        REQUIRE(v == expected[i]);
+      } else {
+        REQUIRE(std::fabs(v - expected[i]) <= step / 2 + 1e-4f);
+      }
+    }
+    REQUIRE_FALSE(reader.overflow);
+  }
+}
+
+TEST_CASE("A quaternion with a negative largest component round trips",
+          "[bit_stream]") {
+  const float quats[][4] = {
+    { 0.1f, 0.2f, 0.3f, -0.927362f },
+    { -0.9f, 0.3f, -0.2f, 0.245f },
+    { 0.0f, 0.0f, 0.0f, 1.0f },
+    { 0.5f, -0.5f, 0.5f, -0.5f },
+  };
+  for (const auto& quat : quats) {
+    float q[4];
+    float norm = 0.0f;
+    for (int i = 0; i < 4; ++i) {
+      norm += quat[i] * quat[i];
+    }
+    for (int i = 0; i < 4; ++i) {
+      q[i] = quat[i] / std::sqrt(norm);
+    }
+
+    uint8_t buf[32];
+    qbBitWriter_ writer;
+    qb_bitwriter_init(&writer, buf, sizeof(buf));
+    qb_bitwriter_quat(&writer, q, 16);
+    size_t size;
+    REQUIRE(qb_bitwriter_flush(&writer, &size) == QB_OK);
+
+    float out[4];
+    qbBitReader_ reader;
+    qb_bitreader_init(&reader, buf, size);
+    qb_bitreader_quat(&reader, out, 16);
+    REQUIRE_FALSE(reader.overflow);
+
+    // q and -q are the same rotation.
+    float dot = 0.0f;
+    for (int i = 0; i < 4; ++i) {
+      dot += q[i] * out[i];
+    }
+    REQUIRE(std::fabs(dot) > 0.9999f);
+  }
+}
+
+TEST_CASE("Signed integers of every size round trip", "[bit_stream]") {
+  struct Ints {
+    int8_t i8;
+    int16_t i16;
+    int32_t i32;
+    int64_t i64;
+  };
+  qbComponentAttr_ attr = make_attr(sizeof(Ints));
+  REQUIRE(component_addfield(&attr, make_field(QB_FIELD_INT, offsetof(Ints, i8), 1)) == QB_OK);
+  REQUIRE(component_addfield(&attr, make_field(QB_FIELD_INT, offsetof(Ints, i16), 2)) == QB_OK);
+  REQUIRE(component_addfield(&attr, make_field(QB_FIELD_INT, offsetof(Ints, i32), 4)) == QB_OK);
+  REQUIRE(component_addfield(&attr, make_field(QB_FIELD_INT, offsetof(Ints, i64), 8)) == QB_OK);
+
+  const Ints ints[] = {
+    { 0, 0, 0, 0 },
+    { -1, -1, -1, -1 },
+    { 1, 1, 1, 1 },
+    { INT8_MIN, INT16_MIN, INT32_MIN, INT64_MIN },
+    { INT8_MAX, INT16_MAX, INT32_MAX, INT64_MAX },
+  };
+  const size_t count = sizeof(ints) / sizeof(ints[0]);
+  Ints out[count];
+  round_trip(attr, ints, count, out);
+  for (size_t i = 0; i < count; ++i) {
+    REQUIRE(out[i].i8 == ints[i].i8);
+    REQUIRE(out[i].i16 == ints[i].i16);
+    REQUIRE(out[i].i32 == ints[i].i32);
+    REQUIRE(out[i].i64 == ints[i].i64);
+  }
+
+  // Small negatives take a single byte.
+  uint8_t buf[8];
+  qbBitWriter_ writer;
+  qb_bitwriter_init(&writer, buf, sizeof(buf));
+  component_pack(attr, (const uint8_t*)&ints[1], 1, &writer);
+  size_t size;
+  REQUIRE(qb_bitwriter_flush(&writer, &size) == QB_OK);
+  REQUIRE(size == 4);
+}
+
+TEST_CASE("Components pack field by field", "[bit_stream]") {
+  struct Body {
+    float position[3];
+    float rotation[4];
+    uint32_t flags;
+    uint64_t id;
+    uint8_t name[5];
+    uint8_t unpacked[3];
+  };
+  qbComponentAttr_ attr = make_attr(sizeof(Body));
+  for (int i = 0; i < 3; ++i) {
+    qbFieldAttr_ field = make_field(QB_FIELD_FLOAT, offsetof(Body, position) + 4 * i, 0);
+    field.min = -1000.0f;
+    field.max = 1000.0f;
+    field.bits = 32;
+    REQUIRE(component_addfield(&attr, field) == QB_OK);
+  }
+  qbFieldAttr_ rotation = make_field(QB_FIELD_QUAT, offsetof(Body, rotation), 0);
+  rotation.bits = 12;
+  REQUIRE(component_addfield(&attr, rotation) == QB_OK);
+  REQUIRE(component_addfield(&attr, make_field(QB_FIELD_UINT, offsetof(Body, flags), 4)) == QB_OK);
+  REQUIRE(component_addfield(&attr, make_field(QB_FIELD_UINT, offsetof(Body, id), 8)) == QB_OK);
+  REQUIRE(component_addfield(&attr, make_field(QB_FIELD_BYTES, offsetof(Body, name), 5)) == QB_OK);
+
+  std::vector<Body> bodies(100);
+  for (size_t i = 0; i < bodies.size(); ++i) {
+    Body& body = bodies[i];
+    body.position[0] = -1000.0f + 20.0f * i;
+    body.position[1] = 0.5f * i;
+    body.position[2] = 1000.0f;
+    body.rotation[0] = 0.0f;
+    body.rotation[1] = 0.0f;
+    body.rotation[2] = 0.0f;
+    body.rotation[3] = i % 2 ? 1.0f : -1.0f;
+    body.flags = 0xFFFFFFFFu - (uint32_t)i;
+    body.id = UINT64_MAX - i;
+    memcpy(body.name, "abcde", 5);
+    memset(body.unpacked, 0xFF, sizeof(body.unpacked));
+  }
+
+  std::vector<Body> out(bodies.size());
+  round_trip(attr, bodies.data(), bodies.size(), out.data());
+  for (size_t i = 0; i < bodies.size(); ++i) {
+    for (int k = 0; k < 3; ++k) {
+      REQUIRE(std::fabs(out[i].position[k] - bodies[i].position[k]) < 1e-3f);
+    }
+    REQUIRE(std::fabs(std::fabs(out[i].rotation[3]) - 1.0f) < 1e-3f);
+    REQUIRE(out[i].flags == bodies[i].flags);
+    REQUIRE(out[i].id == bodies[i].id);
+    REQUIRE(memcmp(out[i].name, "abcde", 5) == 0);
+
+    // Bytes outside of the fields read back as zero.
+    for (uint8_t b : out[i].unpacked) {
+      REQUIRE(b == 0);
+    }
+  }
+}
+
+TEST_CASE("Fields that do not fit are rejected", "[bit_stream]") {
+  qbComponentAttr_ attr = make_attr(8);
+  REQUIRE(component_addfield(&attr, make_field(QB_FIELD_UINT, 4, 8)) == QB_ERROR_MEMORY_OUT_OF_BOUNDS);
+  REQUIRE(component_addfield(&attr, make_field(QB_FIELD_UINT, 0, 3)) == QB_ERROR_INCOMPATIBLE_DATA_TYPES);
+  REQUIRE(component_addfield(&attr, make_field(QB_FIELD_QUAT, 0, 0)) == QB_ERROR_INCOMPATIBLE_DATA_TYPES);
+
+  qbFieldAttr_ field = make_field(QB_FIELD_FLOAT, 0, 0);
+  field.bits = 33;
+  field.min = 0.0f;
+  field.max = 1.0f;
+  REQUIRE(component_addfield(&attr, field) == QB_ERROR_INCOMPATIBLE_DATA_TYPES);
+  field.bits = 8;
+  field.max = 0.0f;
+  REQUIRE(component_addfield(&attr, field) == QB_ERROR_INCOMPATIBLE_DATA_TYPES);
+  REQUIRE(attr.field_count == 0);
+}
+
+TEST_CASE("Reading past the end overflows", "[bit_stream]") {
+  uint8_t buf[8];
+  qbBitWriter_ writer;
+  qb_bitwriter_init(&writer, buf, sizeof(buf));
+  qb_bitwriter_bits(&writer, 0xABCDEF, 24);
+  size_t size;
+  REQUIRE(qb_bitwriter_flush(&writer, &size) == QB_OK);
+  REQUIRE(size == 3);
+
+  qbBitReader_ reader;
+  qb_bitreader_init(&reader, buf, size);
+  REQUIRE(qb_bitreader_bits(&reader, 16) == 0xCDEF);
+  REQUIRE_FALSE(reader.overflow);
+  REQUIRE(qb_bitreader_bits(&reader, 16) == 0);
+  REQUIRE(reader.overflow);
+  REQUIRE(qb_bitreader_bits(&reader, 1) == 0);
+
+  // A varint whose continuation bit runs off the end.
+  uint8_t varint[] = { 0x80, 0x80 };
+  qb_bitreader_init(&reader, varint, sizeof(varint));
+  REQUIRE(qb_bitreader_varint(&reader) == 0);
+  REQUIRE(reader.overflow);
+
+  // Instances unpacked from a truncated stream.
+  struct Pair {
+    uint32_t a;
+    uint32_t b;
+  };
+  qbComponentAttr_ attr = make_attr(sizeof(Pair));
+  REQUIRE(component_addfield(&attr, make_field(QB_FIELD_UINT, 0, 4)) == QB_OK);
+  REQUIRE(component_addfield(&attr, make_field(QB_FIELD_UINT, 4, 4)) == QB_OK);
+  Pair out[4];
+  qb_bitreader_init(&reader, buf, 2);
+  component_unpack(attr, &reader, (uint8_t*)out, 4);
+  REQUIRE(reader.overflow);
+}
+
+TEST_CASE("Writing past the capacity overflows", "[bit_stream]") {
+  uint8_t buf[5];
+  qbBitWriter_ writer;
+  qb_bitwriter_init(&writer, buf, sizeof(buf));
+  qb_bitwriter_bits(&writer, 0xFFFFFFFFu, 32);
+  qb_bitwriter_bits(&writer, 0xFFFFFFFFu, 32);
+  size_t size;
+  REQUIRE(qb_bitwriter_flush(&writer, &size) == QB_ERROR_MEMORY_OUT_OF_BOUNDS);
+  REQUIRE(size <= sizeof(buf));
+}
@@ -0,0 +1,73 @@
+#include "block_vector.h"
+#include "sparse_map.h"
+#include "sparse_set.h"
+#undef INFO
+#include "catch.h"
+
+TEST_CASE("Shared blocks are accounted to each vector", "[block_vector]") {
+  // Enough blocks for the tail to be carved from an arena.
+  const size_t count = 10000;
+  BlockVector vector(64);
+  for (size_t i = 0; i < count; ++i) {
+    vector.push_back((void*)nullptr);
+    *(uint8_t*)vector[i] = 0;
+  }
+  size_t reserved = vector.reserved_bytes();
+
+  {
+    BlockVector snapshot;
+    snapshot.share(vector);
+    REQUIRE(snapshot.reserved_bytes() == reserved);
+
+    // Gives every block of the vector a private copy. The copies are carved
+    // from the arena, where blocks are padded to a cache line.
+    for (size_t i = 0; i < count; ++i) {
+      *(uint8_t*)vector[i] = 1;
+    }
+    REQUIRE(vector.reserved_bytes() >= reserved);
+    REQUIRE(vector.reserved_bytes() <= reserved + vector.blocks() * 64);
+    REQUIRE(snapshot.reserved_bytes() == reserved);
+    REQUIRE(*(const uint8_t*)((const BlockVector&)snapshot)[0] == 0);
+    reserved = vector.reserved_bytes();
+  }
+  REQUIRE(vector.reserved_bytes() == reserved);
+}
+
+TEST_CASE("Reading a shared sparse set does not copy it", "[sparse_set]") {
+  SparseSet set;
+  for (uint64_t i = 0; i < 5000; ++i) {
+    set.insert(i);
+  }
+  SparseSet snapshot;
+  snapshot.share(set);
+
+  uint64_t sum = 0;
+  for (auto it = set.begin(); it != set.end(); ++it) {
+    sum += *it;
+  }
+  REQUIRE(sum == 5000 * 4999 / 2);
+  for (size_t i = 0; i < set.dense().chunks(); ++i) {
+    REQUIRE(set.dense().chunk(i) == snapshot.dense().chunk(i));
+  }
+}
+
+TEST_CASE("Writing to a shared sparse map copies one chunk", "[sparse_map]") {
+  SparseMap<void, BlockVector> map(sizeof(uint32_t));
+  for (uint64_t i = 0; i < 5000; ++i) {
+    map.insert(i, nullptr);
+  }
+  SparseMap<void, BlockVector> snapshot(sizeof(uint32_t));
+  snapshot.share(map);
+
+  // Swaps the last key into the erased key's place and puts it back at the
+  // end, which writes to the first and last chunks of the index.
+  map.erase(1);
+  map.insert(1, nullptr);
+
+  REQUIRE(map.size() == snapshot.size());
+  REQUIRE(!map.sparse().shares(snapshot.sparse(), 0));
+  REQUIRE(map.sparse().shares(snapshot.sparse(), 2000));
+  REQUIRE(map.dense().shares(snapshot.dense(), 2000));
+  REQUIRE(snapshot.dense()[1] == 1);
+  REQUIRE(map.dense()[1] == 4999);
+}
@@ -0,0 +1,217 @@
+#include <cubez/network.h>
+#undef INFO
+#include "catch.h"
+
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+namespace {
+
+// One end of two connections talking over a qbLink.
+struct Peer {
+  qbLink link;
+  int side;
+  double* time;
+  qbConnection connection;
+};
+
+int32_t link_send(const uint8_t* packet, size_t size, void* state) {
+  Peer* peer = (Peer*)state;
+  qb_link_send(peer->link, peer->side, packet, size, *peer->time);
+  return (int32_t)size;
+}
+
+const qbChannelType kChannels[] = {
+  QB_CHANNEL_UNRELIABLE,
+  QB_CHANNEL_RELIABLE_UNORDERED,
+  QB_CHANNEL_RELIABLE_ORDERED,
+};
+
+void create_peer(Peer* peer, qbLink link, int side, double* time) {
+  peer->link = link;
+  peer->side = side;
+  peer->time = time;
+
+  qbConnectionAttr_ attr = {};
+  attr.channels = kChannels;
+  attr.channel_count = sizeof(kChannels) / sizeof(kChannels[0]);
+  attr.send = link_send;
+  attr.state = peer;
+  REQUIRE(qb_connection_create(&peer->connection, &attr) == QB_OK);
+}
+
+// Hands the connection every datagram that has arrived by now.
+void drain(Peer* peer) {
+  uint8_t buf[2048];
+  int32_t size;
+  while ((size = qb_link_recv(peer->link, peer->side, buf, sizeof(buf),
+                              *peer->time)) >= 0) {
+    qb_connection_receive(peer->connection, buf, (size_t)size);
+  }
+}
+
+// A message is its index followed by "size" bytes derived from it.
+std::vector<uint8_t> make_message(uint32_t index, size_t size) {
+  std::vector<uint8_t> message(sizeof(index) + size);
+  memcpy(message.data(), &index, sizeof(index));
+  for (size_t i = 0; i < size; ++i) {
+    message[sizeof(index) + i] = (uint8_t)(index + i);
+  }
+  return message;
+}
+
+}  // namespace
+
+TEST_CASE("Reliable messages are delivered exactly once over a lossy link",
+          "[connection]") {
+  qbLinkAttr_ link_attr = {};
+  link_attr.latency = 0.05;
+  link_attr.loss = 0.2;
+  link_attr.jitter = 0.02;
+  link_attr.duplicate = 0.05;
+  link_attr.reorder = 0.05;
+  link_attr.reorder_delay = 0.03;
+  link_attr.seed = 1234;
+  qbLink link;
+  REQUIRE(qb_link_create(&link, &link_attr) == QB_OK);
+
+  double time = 0.0;
+  Peer a, b;
+  create_peer(&a, link, 0, &time);
+  create_peer(&b, link, 1, &time);
+
+  // Every 10th message is split into fragments.
+  const uint32_t count = 400;
+  std::vector<int> unordered(count, 0);
+  uint32_t ordered = 0;
+  uint32_t sent = 0;
+  for (int step = 0; step < 60 * 60; ++step) {
+    time = step / 60.0;
+    for (int i = 0; i < 4 && sent < count; ++i, ++sent) {
+      size_t size = sent % 10 == 0 ? 3000 : 16;
+      std::vector<uint8_t> message = make_message(sent, size);
+      REQUIRE(qb_connection_send(a.connection, 1, message.data(),
+                                 message.size()) == QB_OK);
+      REQUIRE(qb_connection_send(a.connection, 2, message.data(),
+                                 message.size()) == QB_OK);
+    }
+
+    drain(&a);
+    drain(&b);
+    qb_connection_update(a.connection, time);
+    qb_connection_update(b.connection, time);
+
+    qbMessage_ message;
+    while (qb_connection_recv(b.connection, &message)) {
+      uint32_t index;
+      REQUIRE(message.size >= sizeof(index));
+      memcpy(&index, message.data, sizeof(index));
+      REQUIRE(index < count);
+
+      size_t size = index % 10 == 0 ? 3000 : 16;
+      std::vector<uint8_t> expected = make_message(index, size);
+      REQUIRE(message.size == expected.size());
+      REQUIRE(memcmp(message.data, expected.data(), expected.size()) == 0);
+
+      if (message.channel == 1) {
+        ++unordered[index];
+      } else {
+        REQUIRE(message.channel == 2);
+        REQUIRE(index == ordered);
+        ++ordered;
+      }
+    }
+
+    if (ordered == count &&
+        std::count(unordered.begin(), unordered.end(), 1) == (int)count) {
+      break;
+    }
+  }
+
+  REQUIRE(ordered == count);
+  for (uint32_t i = 0; i < count; ++i) {
+    REQUIRE(unordered[i] == 1);
+  }
+
+  qbLinkStats_ link_stats;
+  qb_link_stats(link, &link_stats);
+  REQUIRE(link_stats.lost > 0);
+
+  qbConnectionStats_ stats;
+  qb_connection_stats(a.connection, &stats);
+  REQUIRE(stats.fragments_resent > 0);
+
+  qb_connection_destroy(&a.connection);
+  qb_connection_destroy(&b.connection);
+  qb_link_destroy(&link);
+}
+
+TEST_CASE("A burst longer than the ack window is not resent",
+          "[connection]") {
+  qbLinkAttr_ link_attr = {};
+  link_attr.latency = 0.05;
+  qbLink link;
+  REQUIRE(qb_link_create(&link, &link_attr) == QB_OK);
+
+  double time = 0.0;
+  Peer a, b;
+  create_peer(&a, link, 0, &time);
+  create_peer(&b, link, 1, &time);
+
+  // One packet per message, all sent by a single update.
+  const uint32_t count = 200;
+  for (uint32_t i = 0; i < count; ++i) {
+    std::vector<uint8_t> message = make_message(i, 1000);
+    REQUIRE(qb_connection_send(a.connection, 2, message.data(),
+                               message.size()) == QB_OK);
+  }
+  qb_connection_update(a.connection, time);
+
+  // The whole burst arrives before the receiver's next update, whose packet
+  // could only ack the last 33 of it.
+  uint32_t received = 0;
+  for (int step = 1; step <= 100; ++step) {
+    time = step / 100.0;
+    drain(&a);
+    drain(&b);
+    qb_connection_update(a.connection, time);
+    if (step % 5 == 0) {
+      qb_connection_update(b.connection, time);
+    }
+
+    qbMessage_ message;
+    while (qb_connection_recv(b.connection, &message)) {
+      ++received;
+    }
+  }
+
+  REQUIRE(received == count);
+
+  qbConnectionStats_ stats;
+  qb_connection_stats(a.connection, &stats);
+  REQUIRE(stats.fragments_resent == 0);
+  REQUIRE(stats.packets_lost == 0);
+
+  qb_connection_destroy(&a.connection);
+  qb_connection_destroy(&b.connection);
+  qb_link_destroy(&link);
+}
+
+TEST_CASE("An MTU larger than a datagram is rejected", "[connection]") {
+  qbConnectionAttr_ attr = {};
+  attr.channels = kChannels;
+  attr.channel_count = 1;
+  attr.send = link_send;
+
+  qbConnection connection;
+  attr.mtu = 100000;
+  REQUIRE(qb_connection_create(&connection, &attr) != QB_OK);
+
+  attr.mtu = 16;
+  REQUIRE(qb_connection_create(&connection, &attr) != QB_OK);
+
+  attr.mtu = 1500;
+  REQUIRE(qb_connection_create(&connection, &attr) == QB_OK);
+  qb_connection_destroy(&connection);
+}
@@ -0,0 +1,224 @@
+#include "buddy_system_allocator.h"
+#include "fast_math.h"
+#include "gpu_heap.h"
+#undef INFO
+#include "catch.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace {
+
+// Copies, so that REQUIRE does not need a definition of the class constants.
+const uint64_t kInvalid = BuddySystem::kInvalid;
+const GpuHeap::Handle kInvalidHandle = GpuHeap::kInvalidHandle;
+
+// Checks that the live allocations of every page do not overlap.
+void require_disjoint(const GpuHeap& heap, const std::vector<GpuHeap::Handle>& handles) {
+  std::vector<GpuHeap::Location> locations;
+  for (GpuHeap::Handle handle : handles) {
+    const GpuHeap::Location* location = heap.Find(handle);
+    REQUIRE(location != nullptr);
+    REQUIRE(location->offset + location->size <= heap.PageSize(location->page));
+    locations.push_back(*location);
+  }
+  std::sort(locations.begin(), locations.end(),
+            [](const GpuHeap::Location& a, const GpuHeap::Location& b) {
+    return a.page != b.page ? a.page < b.page : a.offset < b.offset;
+  });
+  for (size_t i = 1; i < locations.size(); ++i) {
+    if (locations[i].page == locations[i - 1].page) {
+      REQUIRE(locations[i - 1].offset + locations[i - 1].size <= locations[i].offset);
+    }
+  }
+}
+
+}  // namespace
+
+TEST_CASE("log_2 looks at every byte", "[buddy_system]") {
+  REQUIRE(log_2(1) == 0);
+  REQUIRE(log_2(255) == 7);
+  REQUIRE(log_2(256) == 8);
+  REQUIRE(log_2(300) == 8);
+  REQUIRE(log_2(65535) == 15);
+  REQUIRE(log_2(65536) == 16);
+  REQUIRE(log_2((uint64_t)1 << 40) == 40);
+  REQUIRE(log_2(~(uint64_t)0) == 63);
+
+  REQUIRE(BuddySystem::order_of(256) == 8);
+  REQUIRE(BuddySystem::order_of(257) == 9);
+  REQUIRE(BuddySystem(1000).capacity() == 1024);
+}
+
+TEST_CASE("Buddies split on alloc and merge on release", "[buddy_system]") {
+  BuddySystem buddies(16);
+  REQUIRE(buddies.capacity() == 16);
+
+  // Splitting 16 leaves free blocks of 1, 2, 4 and 8.
+  uint64_t a = buddies.alloc(1);
+  REQUIRE(a == 0);
+  REQUIRE(buddies.alloc(8) == 8);
+  REQUIRE(buddies.alloc(4) == 4);
+  REQUIRE(buddies.alloc(2) == 2);
+  REQUIRE(buddies.alloc(1) == 1);
+  REQUIRE(buddies.used() == 16);
+  REQUIRE(buddies.alloc(1) == kInvalid);
+
+  // Nothing merges while a buddy is taken.
+  buddies.release(8);
+  buddies.release(2);
+  REQUIRE(buddies.alloc(16) == kInvalid);
+  REQUIRE(buddies.size_of(4) == 4);
+
+  // Releasing the last two units merges all the way up.
+  buddies.release(1);
+  buddies.release(4);
+  buddies.release(a);
+  REQUIRE(buddies.used() == 0);
+  REQUIRE(buddies.alloc(16) == 0);
+
+  // Releasing twice or out of range is ignored.
+  buddies.release(0);
+  buddies.release(0);
+  buddies.release(100);
+  REQUIRE(buddies.used() == 0);
+  REQUIRE(buddies.alloc(16) == 0);
+}
+
+TEST_CASE("Random allocs never overlap and merge back to one block",
+          "[buddy_system]") {
+  BuddySystem buddies(1 << 12);
+  std::mt19937 rng(42);
+  std::vector<uint64_t> live;
+  std::vector<uint8_t> owner(buddies.capacity(), 0);
+
+  for (int i = 0; i < 20000; ++i) {
+    if (live.empty() || rng() % 3 != 0) {
+      uint64_t count = 1 + rng() % 300;
+      uint64_t offset = buddies.alloc(count);
+      if (offset == kInvalid) {
+        continue;
+      }
+      REQUIRE(buddies.size_of(offset) >= count);
+      for (uint64_t u = offset; u < offset + buddies.size_of(offset); ++u) {
+        REQUIRE(owner[u] == 0);
+        owner[u] = 1;
+      }
+      live.push_back(offset);
+    } else {
+      size_t index = rng() % live.size();
+      uint64_t offset = live[index];
+      std::fill(owner.begin() + offset, owner.begin() + offset + buddies.size_of(offset), 0);
+      buddies.release(offset);
+      live[index] = live.back();
+      live.pop_back();
+    }
+  }
+
+  for (uint64_t offset : live) {
+    buddies.release(offset);
+  }
+  REQUIRE(buddies.used() == 0);
+  REQUIRE(buddies.alloc(buddies.capacity()) == 0);
+}
+
+TEST_CASE("Invalid and freed GPU heap handles are not found", "[gpu_heap]") {
+  GpuHeap heap(1024, 16);
+  REQUIRE(heap.Alloc(0) == kInvalidHandle);
+  REQUIRE(heap.Find(kInvalidHandle) == nullptr);
+  REQUIRE(heap.Find(0) == nullptr);
+
+  GpuHeap::Handle handle = heap.Alloc(100);
+  REQUIRE(heap.Find(handle) != nullptr);
+  REQUIRE(heap.Find(handle)->size == 100);
+  heap.Free(handle);
+  REQUIRE(heap.Find(handle) == nullptr);
+  heap.Free(handle);
+  heap.Free(kInvalidHandle);
+  REQUIRE(heap.UsedBytes() == 0);
+}
+
+TEST_CASE("Defragment evacuates the least used page and releases it",
+          "[gpu_heap]") {
+  // 64 allocations fill a page.
+  GpuHeap heap(1024, 16);
+  std::vector<GpuHeap::Handle> first, second;
+  for (int i = 0; i < 64; ++i) {
+    first.push_back(heap.Alloc(16));
+  }
+  for (int i = 0; i < 64; ++i) {
+    second.push_back(heap.Alloc(16));
+  }
+  REQUIRE(heap.PageCount() == 2);
+  REQUIRE(heap.Find(first[0])->page == 0);
+  REQUIRE(heap.Find(second[0])->page == 1);
+
+  // Page 0 is left a quarter full, page 1 three quarters full.
+  std::vector<GpuHeap::Handle> live;
+  for (int i = 0; i < 64; ++i) {
+    if (i % 4 == 0) {
+      live.push_back(first[i]);
+    } else {
+      heap.Free(first[i]);
+    }
+    if (i % 4 != 0) {
+      live.push_back(second[i]);
+    } else {
+      heap.Free(second[i]);
+    }
+  }
+
+  // The byte budget stops the evacuation early.
+  std::vector<GpuHeap::Move> moves = heap.Defragment(32);
+  REQUIRE(moves.size() == 2);
+  for (const GpuHeap::Move& move : moves) {
+    REQUIRE(move.from.page == 0);
+    REQUIRE(move.to.page == 1);
+    REQUIRE(move.to.size == 16);
+    REQUIRE(heap.Find(move.handle)->page == 1);
+    REQUIRE(heap.Find(move.handle)->offset == move.to.offset);
+  }
+  require_disjoint(heap, live);
+
+  moves = heap.Defragment(1024);
+  REQUIRE(moves.size() == 14);
+  require_disjoint(heap, live);
+  for (GpuHeap::Handle handle : live) {
+    REQUIRE(heap.Find(handle)->page == 1);
+  }
+  REQUIRE(heap.PageSize(0) == 1024);
+
+  // The emptied page is released by the next pass.
+  moves = heap.Defragment(1024);
+  REQUIRE(moves.empty());
+  REQUIRE(heap.PageSize(0) == 0);
+  REQUIRE(heap.PageSize(1) == 1024);
+  REQUIRE(heap.ReservedBytes() == 1024);
+  REQUIRE(heap.UsedBytes() == 1024);
+
+  // A new page reuses the released slot.
+  GpuHeap::Handle handle = heap.Alloc(16);
+  REQUIRE(heap.Find(handle)->page == 0);
+  REQUIRE(heap.PageCount() == 2);
+
+  // The last page is kept when the heap empties out.
+  heap.Free(handle);
+  for (GpuHeap::Handle h : live) {
+    heap.Free(h);
+  }
+  heap.Defragment(1024);
+  REQUIRE(heap.ReservedBytes() == 1024);
+  REQUIRE(heap.UsedBytes() == 0);
+}
+
+TEST_CASE("Allocations bigger than a page get a page of their own",
+          "[gpu_heap]") {
+  GpuHeap heap(1024, 16);
+  GpuHeap::Handle small = heap.Alloc(16);
+  GpuHeap::Handle big = heap.Alloc(3000);
+  REQUIRE(heap.Find(small)->page == 0);
+  REQUIRE(heap.Find(big)->page == 1);
+  REQUIRE(heap.Find(big)->offset == 0);
+  REQUIRE(heap.PageSize(1) == 4096);
+}
@@ -0,0 +1,95 @@
+#include "lz.h"
+#undef INFO
+#include "catch.h"
+
+#include <random>
+#include <string.h>
+#include <vector>
+
+namespace {
+
+std::vector<uint8_t> compress(const std::vector<uint8_t>& data) {
+  std::vector<uint8_t> out(lz_compress_bound(data.size()));
+  size_t size = lz_compress(data.data(), data.size(), out.data());
+  REQUIRE(size <= out.size());
+  out.resize(size);
+  return out;
+}
+
+std::vector<uint8_t> random_bytes(size_t size, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::vector<uint8_t> data(size);
+  for (uint8_t& b : data) {
+    b = (uint8_t)rng();
+  }
+  return data;
+}
+
+}  // namespace
+
+TEST_CASE("Incompressible data round trips within the bound", "[lz]") {
+  for (size_t size : { 0, 1, 4, 13, 255, 256, 4096, 100000 }) {
+    std::vector<uint8_t> data = random_bytes(size, (uint32_t)size);
+    std::vector<uint8_t> compressed = compress(data);
+
+    std::vector<uint8_t> out(size);
+    REQUIRE(lz_decompress(compressed.data(), compressed.size(), out.data(), out.size()));
+    REQUIRE(out == data);
+  }
+}
+
+TEST_CASE("Repetitive data compresses and round trips", "[lz]") {
+  std::vector<uint8_t> data(100000);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = (uint8_t)(i % 7 == 0 ? i : i % 3);
+  }
+  // A long run, which is copied with an overlapping match.
+  memset(data.data() + 50000, 'a', 10000);
+  std::vector<uint8_t> compressed = compress(data);
+  REQUIRE(compressed.size() < data.size() / 4);
+  REQUIRE(data.size() <= lz_decompress_bound(compressed.size()));
+
+  std::vector<uint8_t> out(data.size());
+  REQUIRE(lz_decompress(compressed.data(), compressed.size(), out.data(), out.size()));
+  REQUIRE(out == data);
+
+  // The output size must match exactly.
+  out.resize(data.size() + 1);
+  REQUIRE_FALSE(lz_decompress(compressed.data(), compressed.size(), out.data(), out.size()));
+  out.resize(data.size() - 1);
+  REQUIRE_FALSE(lz_decompress(compressed.data(), compressed.size(), out.data(), out.size()));
+}
+
+TEST_CASE("Truncated and corrupt input is rejected", "[lz]") {
+  std::vector<uint8_t> data = random_bytes(3000, 1);
+  for (size_t i = 1000; i < 2000; ++i) {
+    data[i] = data[i - 500];
+  }
+  std::vector<uint8_t> compressed = compress(data);
+  std::vector<uint8_t> out(data.size());
+
+  for (size_t size = 0; size < compressed.size(); ++size) {
+    // Copied so that reading past the prefix is caught by sanitizers.
+    std::vector<uint8_t> prefix(compressed.begin(), compressed.begin() + size);
+    REQUIRE_FALSE(lz_decompress(prefix.data(), prefix.size(), out.data(), out.size()));
+  }
+
+  // An offset that reaches before the start of the output.
+  const uint8_t bad_offset[] = { 0x10, 'x', 0x02, 0x00 };
+  REQUIRE_FALSE(lz_decompress(bad_offset, sizeof(bad_offset), out.data(), out.size()));
+
+  // A literal length that runs past the input.
+  const uint8_t bad_length[] = { 0xF0, 0xFF, 0xFF };
+  REQUIRE_FALSE(lz_decompress(bad_length, sizeof(bad_length), out.data(), out.size()));
+}
+
+TEST_CASE("A run decompresses to at most the bound", "[lz]") {
+  // The best ratio the codec reaches.
+  std::vector<uint8_t> data(1 << 22, 0);
+  std::vector<uint8_t> compressed = compress(data);
+  REQUIRE(data.size() <= lz_decompress_bound(compressed.size()));
+
+  std::vector<uint8_t> out(data.size());
+  REQUIRE(lz_decompress(compressed.data(), compressed.size(), out.data(), out.size()));
+  REQUIRE(out == data);
+}
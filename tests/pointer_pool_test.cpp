@@ -0,0 +1,32 @@
+#include "pointer_pool.h"
+#undef INFO
+#include "catch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+TEST_CASE("Pooled and malloc'd payloads are released to their allocator",
+          "[pointer_pool]") {
+  PointerPool pool;
+  PointerPool other;
+  std::vector<void*> payloads;
+  for (size_t size : { 1, 16, 100, 1000, 2032, 5000 }) {
+    payloads.push_back(pool.Alloc(size));
+    payloads.push_back(other.Alloc(size));
+    payloads.push_back(malloc(size));
+    for (size_t i = payloads.size() - 3; i < payloads.size(); ++i) {
+      REQUIRE(payloads[i] != nullptr);
+      memset(payloads[i], 0xFF, size);
+    }
+  }
+  for (void* payload : payloads) {
+    PointerPool::Release(payload);
+  }
+  PointerPool::Release(nullptr);
+
+  // Freed slots are reused.
+  void* payload = pool.Alloc(16);
+  REQUIRE(payload != nullptr);
+  PointerPool::Release(payload);
+}